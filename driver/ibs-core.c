@@ -10,7 +10,8 @@
  * This file contains the core of the code for an IBS driver. User programs
  * interface with this driver using device file system nodes at
  * /dev/cpu/<cpuid>/ibs/op and /dev/cpu/<cpuid>/ibs/fetch, where <cpuid>
- * represents an integer ID of a core in the system. For details about the user
+ * represents an integer ID of a core in the system, and through /dev/ibs/all,
+ * which reads the samples of every core at once. For details about the user
  * interface, see the code in this file, ibs-structs.h, and ibs-uapi.h.
  */
 #include <asm/nmi.h>
@@ -18,6 +19,7 @@
 /* Older versions of Linux need device.h, so keep this */
 #include <linux/device.h>
 #include <linux/fs.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/sched.h>
 #include <linux/version.h>
@@ -105,6 +107,7 @@ static struct notifier_block handle_ibs_nmi_notifier =
 #endif
 
 static const struct file_operations ibs_fops = {
+	.mmap =			ibs_mmap,
 	.open =			ibs_open,
 	.owner =		THIS_MODULE,
 	.poll =			ibs_poll,
@@ -113,6 +116,27 @@ static const struct file_operations ibs_fops = {
 	.unlocked_ioctl =	ibs_ioctl,
 };
 
+static const struct file_operations ibs_all_fops = {
+	.open =			ibs_all_open,
+	.owner =		THIS_MODULE,
+	.poll =			ibs_all_poll,
+	.read =			ibs_all_read,
+	.release =		ibs_all_release,
+};
+
+/* /dev/ibs/all, which reads every CPU's buffers through one fd */
+static struct miscdevice ibs_all_miscdev = {
+	.minor =		MISC_DYNAMIC_MINOR,
+	.name =			"ibs_all",
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,31)
+	.nodename =		"ibs/all",
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+	.mode =			0666,
+#endif
+	.fops =			&ibs_all_fops,
+};
+
 static void init_ibs_dev(struct ibs_dev *dev, int cpu)
 {
 	mutex_init(&dev->read_lock);
@@ -120,6 +144,11 @@ static void init_ibs_dev(struct ibs_dev *dev, int cpu)
 	init_waitqueue_head(&dev->pollq);
 	dev->cpu = cpu;
 	atomic_set(&dev->in_use, 0);
+	atomic_set(&dev->mmapped, 0);
+	dev->all_held = 0;
+	atomic_set(&dev->frozen, 0);
+	atomic_set(&dev->enabled, 0);
+	dev->combined = NULL;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,11,0)
 	dev->bottom_half = IRQ_WORK_INIT_LAZY(&handle_ibs_work);
@@ -150,7 +179,9 @@ static void init_ibs_op_dev(struct ibs_dev *dev, int cpu)
 {
 	init_ibs_dev(dev, cpu);
 	dev->flavor = IBS_OP;
+	dev->sample_fields = IBS_OP_FIELDS_ALL;
 	dev->entry_size = sizeof(struct ibs_op);
+	dev->sample_size = dev->entry_size;
 	mutex_init(&dev->ctl_lock);
 }
 
@@ -158,7 +189,9 @@ static void init_ibs_fetch_dev(struct ibs_dev *dev, int cpu)
 {
 	init_ibs_dev(dev, cpu);
 	dev->flavor = IBS_FETCH;
+	dev->sample_fields = IBS_FETCH_FIELDS_ALL;
 	dev->entry_size = sizeof(struct ibs_fetch);
+	dev->sample_size = dev->entry_size;
 	mutex_init(&dev->ctl_lock);
 }
 
@@ -500,6 +533,7 @@ static void destroy_ibs_cpu_structs(void)
 	for_each_possible_cpu(cpu) {
 		free_ibs_buffer(per_cpu_ptr(pcpu_fetch_dev, cpu));
 		free_ibs_buffer(per_cpu_ptr(pcpu_op_dev, cpu));
+		setup_ibs_hist(per_cpu_ptr(pcpu_op_dev, cpu), 0, 0);
 		if (workaround_fam17h_zn)
 			stop_fam17h_zn_static_workaround(cpu);
 	}
@@ -539,12 +573,12 @@ err_metadata:
 	for_each_possible_cpu(cpu) {
 		init_ibs_op_dev(per_cpu_ptr(pcpu_op_dev, cpu), cpu);
 		err = setup_ibs_buffer(per_cpu_ptr(pcpu_op_dev, cpu),
-					IBS_OP_BUFFER_SIZE);
+					IBS_OP_BUFFER_SIZE, 0);
 		if (err)
 			goto err_buffers;
 		init_ibs_fetch_dev(per_cpu_ptr(pcpu_fetch_dev, cpu), cpu);
 		err = setup_ibs_buffer(per_cpu_ptr(pcpu_fetch_dev, cpu),
-					IBS_FETCH_BUFFER_SIZE);
+					IBS_FETCH_BUFFER_SIZE, 0);
 		if (err) {
 err_buffers:
 			pr_err("CPU %d failed to allocate IBS device buffer; "
@@ -641,6 +675,12 @@ err_buffers:
 #endif // >= 3.15.0
 #endif // >= 4.10
 
+	err = misc_register(&ibs_all_miscdev);
+	if (err) {
+		pr_err("Failed to create the IBS all-CPU device; exiting\n");
+		goto out_device;
+	}
+
 /* Now set up the NMI handler */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0)
 	err = register_nmi_handler(NMI_LOCAL, handle_ibs_nmi,
@@ -650,11 +690,13 @@ err_buffers:
 #endif
 	if (err) {
 		pr_err("Failed to register NMI handler; exiting\n");
-		goto out_device;
+		goto out_misc;
 	}
 
 	goto out;
 
+out_misc:
+	misc_deregister(&ibs_all_miscdev);
 out_device:
 	destroy_ibs_devices();
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
@@ -676,6 +718,7 @@ static __exit void ibs_exit(void)
 #else
 	unregister_die_notifier(&handle_ibs_nmi_notifier);
 #endif
+	misc_deregister(&ibs_all_miscdev);
 
 #if LINUX_VERSION_CODE <= KERNEL_VERSION(4,10,0)
 	/* We only need to do this on older kernels -- the CPU hotplug destroyer
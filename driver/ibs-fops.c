@@ -10,13 +10,16 @@
  * ioctl() commands sent to the device.
  * The ioctl() options are described in the comments of ibs-uapi.h
  */
+#include <linux/cpumask.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/mutex.h>
 #include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/version.h>
 #include <linux/wait.h>
 #include <linux/delay.h>
+#include <linux/vmalloc.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
 #include <linux/atomic.h>
@@ -47,6 +50,7 @@
 
 #include "ibs-fops.h"
 #include "ibs-msr-index.h"
+#include "ibs-sched.h"
 #include "ibs-structs.h"
 #include "ibs-uapi.h"
 #include "ibs-utils.h"
@@ -57,16 +61,32 @@
 extern void *pcpu_op_dev;
 extern void *pcpu_fetch_dev;
 
+/* Readers and pollers of /dev/ibs/all, which any CPU's samples may wake */
+DECLARE_WAIT_QUEUE_HEAD(ibs_all_waitq);
+
+/* /dev/ibs/all may only be open once, so its state is kept here */
+static atomic_t ibs_all_in_use = ATOMIC_INIT(0);
+static DEFINE_MUTEX(ibs_all_lock);	/* serializes reads */
+static unsigned int ibs_all_next;	/* ring the next read starts at */
+
+/* The rings behind /dev/ibs/all are numbered like the per-CPU minors */
+#define IBS_ALL_NR_RINGS	(2 * nr_cpu_ids)
+
 static inline void enable_ibs_op_on_cpu(struct ibs_dev *dev,
 		const int cpu, const u64 op_ctl)
 {
 	if (dev->workaround_fam17h_zn)
 		start_fam17h_zn_dyn_workaround(cpu);
+	/* A gated device is armed by the sched_switch probe instead */
+	if (dev->gated)
+		ibs_sched_gate_start_on_cpu(dev);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
-	wrmsrl_on_cpu(cpu, MSR_IBS_OP_CTL, op_ctl);
+	else
+		wrmsrl_on_cpu(cpu, MSR_IBS_OP_CTL, op_ctl);
 #else
-	wrmsr_on_cpu(cpu, MSR_IBS_OP_CTL, (u32)((u64)(op_ctl)),
-			(u32)((u64)(op_ctl) >> 32));
+	else
+		wrmsr_on_cpu(cpu, MSR_IBS_OP_CTL, (u32)((u64)(op_ctl)),
+				(u32)((u64)(op_ctl) >> 32));
 #endif
 }
 
@@ -100,6 +120,9 @@ static void disable_ibs_op(void *info)
 
 void disable_ibs_op_on_cpu(struct ibs_dev *dev, const int cpu)
 {
+	/* Keep the sched_switch probe from re-arming it afterwards */
+	if (dev->gated)
+		ibs_sched_gate_stop_on_cpu(dev);
 	if (dev->workaround_fam10h_err_420)
 		do_fam10h_workaround_420(cpu);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
@@ -116,16 +139,22 @@ static inline void enable_ibs_fetch_on_cpu(struct ibs_dev *dev,
 {
 	if (dev->workaround_fam17h_zn)
 		start_fam17h_zn_dyn_workaround(cpu);
+	if (dev->gated)
+		ibs_sched_gate_start_on_cpu(dev);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
-	wrmsrl_on_cpu(cpu, MSR_IBS_FETCH_CTL, fetch_ctl);
+	else
+		wrmsrl_on_cpu(cpu, MSR_IBS_FETCH_CTL, fetch_ctl);
 #else
-	wrmsr_on_cpu(cpu, MSR_IBS_FETCH_CTL, (u32)((u64)(fetch_ctl)),
-			(u32)((u64)(fetch_ctl) >> 32));
+	else
+		wrmsr_on_cpu(cpu, MSR_IBS_FETCH_CTL, (u32)((u64)(fetch_ctl)),
+				(u32)((u64)(fetch_ctl) >> 32));
 #endif
 }
 
 void disable_ibs_fetch_on_cpu(struct ibs_dev *dev, const int cpu)
 {
+	if (dev->gated)
+		ibs_sched_gate_stop_on_cpu(dev);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,13,0)
 	wrmsrl_on_cpu(cpu, MSR_IBS_FETCH_CTL, 0ULL);
 #else
@@ -138,8 +167,22 @@ void disable_ibs_fetch_on_cpu(struct ibs_dev *dev, const int cpu)
 static void set_ibs_defaults(struct ibs_dev *dev)
 {
 	atomic_long_set(&dev->poll_threshold, 1);
+	dev->ring_mode = IBS_RING_MODE_DROP;
+	atomic_set(&dev->frozen, 0);
+	atomic_set(&dev->enabled, 0);
+	atomic_set(&dev->filter_num_tgids, 0);
+	atomic_long_set(&dev->filter_cr3, 0);
+	atomic_set(&dev->filter_mode, IBS_FILTER_MODE_ALL);
+	atomic_long_set(&dev->filtered, 0);
+	ibs_set_filter_cgroup(dev, -1);
+	ibs_sched_gate_set(dev, 0);
+	setup_ibs_hist(dev, 0, 0);
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	/* The entry size of a buffer held by /dev/ibs/all must not change */
 	if (dev->flavor == IBS_OP)
 	{
+		if (!atomic_read(&dev->mmapped))
+			set_ibs_sample_fields(dev, IBS_OP_FIELDS_ALL);
 		if (dev->ibs_op_cnt_ext_supported)
 		{
 			dev->ctl = (scatter_bits(0, IBS_OP_CUR_CNT_23) |
@@ -154,9 +197,79 @@ static void set_ibs_defaults(struct ibs_dev *dev)
 		}
 	}
 	else	/* dev->flavor == IBS_FETCH */
+	{
+		if (!atomic_read(&dev->mmapped))
+			set_ibs_sample_fields(dev, IBS_FETCH_FIELDS_ALL);
 		dev->ctl = (IBS_RAND_EN |
 				scatter_bits(0, IBS_FETCH_CNT) |
 				scatter_bits(0x1000, IBS_FETCH_MAX_CNT));
+	}
+}
+
+/**
+ * split_ibs_ring - give the fetch half of a combined ring its buffer back
+ * @dev:	op device of the combined ring
+ *
+ * The fetch device is disabled, and once no interrupt handler can still be
+ * writing into the op device's buffer, it is returned to its defaults and
+ * closed. The caller holds the op device's ctl_lock and empties its buffer.
+ */
+static void split_ibs_ring(struct ibs_dev *dev)
+{
+	struct ibs_dev *fetch = dev->combined;
+
+	mutex_lock(&fetch->ctl_lock);
+	disable_ibs_fetch_on_cpu(fetch, fetch->cpu);
+	sync_ibs_nmi(fetch->cpu);
+	fetch->combined = NULL;
+	dev->combined = NULL;
+	set_ibs_defaults(fetch);
+	reset_ibs_buffer(fetch);
+	atomic_set(&fetch->in_use, 0);
+	mutex_unlock(&fetch->ctl_lock);
+
+	/* Readers may have been waiting on the fetch half alone */
+	wake_up(&dev->readq);
+	wake_up(&dev->pollq);
+}
+
+/* SET_COMBINED; called with the op device's ctl_lock held while IBS is
+ * disabled */
+static long set_ibs_combined(struct ibs_dev *dev, int on)
+{
+	struct ibs_dev *fetch = per_cpu_ptr(pcpu_fetch_dev, dev->cpu);
+
+	if (on == (dev->combined != NULL))
+		return 0;
+	/* A mapping consumer would keep using the old entry size */
+	if (atomic_read(&dev->mmapped))
+		return -EBUSY;
+	if (!on) {
+		split_ibs_ring(dev);
+	} else {
+		if (!dev->ibs_fetch_supported)
+			return -ENODEV;
+		if (dev->hist_slots)
+			return -EBUSY;
+		if (atomic_cmpxchg(&fetch->in_use, 0, 1) != 0)
+			return -EBUSY;
+
+		mutex_lock(&fetch->ctl_lock);
+		fetch->owner = dev->owner;
+		set_ibs_defaults(fetch);
+		reset_ibs_buffer(fetch);
+		fetch->combined = dev;
+		dev->combined = fetch;
+		mutex_unlock(&fetch->ctl_lock);
+	}
+
+	/* Switch between entries and IBS_RECORD_ALIGN units */
+	set_ibs_sample_fields(dev, dev->sample_fields);
+	if (atomic_long_read(&dev->poll_threshold) >= dev->capacity)
+		atomic_long_set(&dev->poll_threshold,
+				max(dev->capacity, 2ULL) - 1);
+	reset_ibs_buffer(dev);
+	return 0;
 }
 
 int ibs_open(struct inode *inode, struct file *file)
@@ -173,6 +286,7 @@ int ibs_open(struct inode *inode, struct file *file)
 		return -EBUSY;
 
 	file->private_data = dev;
+	dev->owner = current->tgid;
 
 	mutex_lock(&dev->ctl_lock);
 	set_ibs_defaults(dev);
@@ -192,6 +306,13 @@ int ibs_release(struct inode *inode, struct file *file)
 		disable_ibs_op_on_cpu(dev, dev->cpu);
 	else /* dev->flavor == IBS_FETCH */
 		disable_ibs_fetch_on_cpu(dev, dev->cpu);
+	if (dev->combined)
+		split_ibs_ring(dev);
+	/* Let go of /dev/ibs/all's hold, so the next owner starts clean */
+	if (dev->all_held) {
+		dev->all_held = 0;
+		atomic_dec(&dev->mmapped);
+	}
 
 	set_ibs_defaults(dev);
 	reset_ibs_buffer(dev);
@@ -205,17 +326,25 @@ int ibs_release(struct inode *inode, struct file *file)
 
 static ssize_t do_ibs_read(struct ibs_dev *dev, char __user *buf, size_t count)
 {
-	long rd = atomic_long_read(&dev->rd);
+	long rd = atomic_long_read(&dev->ring->rd);
 	long wr = atomic_long_read(&dev->wr);
-	long entries = atomic_long_read(&dev->entries);
-	void *rd_ptr = dev->buf + rd * dev->entry_size;
+	long entries = ibs_buffer_entries(dev);
+	void *rd_ptr;
 	long entries_read = 0;
 
+	/* A mapping consumer may have left garbage in the read index */
+	if ((unsigned long)rd >= dev->capacity)
+		return -EIO;
+	rd_ptr = dev->buf + rd * dev->entry_size;
+
 	/* Read this much: */
 	count = min(count, (size_t)(entries * dev->entry_size));
 	if (count == 0)
 		return 0;
 
+	/* Pairs with the smp_wmb() before the NMI handler publishes wr */
+	smp_rmb();
+
 	if (rd < wr) {	/* Buffer has not wrapped */
 		if (copy_to_user(buf, rd_ptr, count))
 			return -EFAULT;
@@ -239,19 +368,137 @@ static ssize_t do_ibs_read(struct ibs_dev *dev, char __user *buf, size_t count)
 	}
 	entries_read = count / dev->entry_size;
 	rd = (rd + entries_read) % dev->capacity;
-	atomic_long_set(&dev->rd, rd);
-	atomic_long_sub(entries_read, &dev->entries);
+	/* Finish copying the entries out before handing their slots back */
+	smp_mb();
+	atomic_long_set(&dev->ring->rd, rd);
+	dev->stats.read_bytes += count;
 	return count;
 }
 
+/**
+ * do_ibs_read_records - copy whole records out of a combined ring
+ * @dev:	op device that owns the ring
+ * @buf:	user buffer to copy the records into
+ * @count:	size of buf in bytes
+ *
+ * Records run back to back up to the end of the buffer or a pad, so each
+ * such run goes out with one copy. A record size that cannot be right means
+ * a mapping consumer has scribbled on the ring.
+ */
+static ssize_t do_ibs_read_records(struct ibs_dev *dev, char __user *buf,
+		size_t count)
+{
+	u64 cap = dev->capacity;
+	u64 rd = atomic_long_read(&dev->ring->rd);
+	u64 wr = atomic_long_read(&dev->wr);
+	u64 run = rd;		/* start of the run not yet copied out */
+	size_t run_len = 0, copied = 0;
+	ssize_t retval = 0;
+
+	if (rd >= cap)
+		return -EIO;
+
+	/* Pairs with the smp_wmb() before the NMI handler publishes wr */
+	smp_rmb();
+
+	while (rd != wr) {
+		struct ibs_record_header *rec = (struct ibs_record_header *)
+			(dev->buf + rd * IBS_RECORD_ALIGN);
+		u32 size = rec->size;
+
+		if (size < sizeof(*rec) || size % IBS_RECORD_ALIGN ||
+				rd + size / IBS_RECORD_ALIGN > cap) {
+			retval = -EIO;
+			break;
+		}
+		if (rec->type != IBS_RECORD_PAD) {
+			if (copied + run_len + size > count) {
+				if (copied + run_len == 0)
+					retval = -EINVAL;
+				break;
+			}
+			run_len += size;
+		}
+		rd += size / IBS_RECORD_ALIGN;
+		if (rec->type == IBS_RECORD_PAD || rd == cap) {
+			if (run_len && copy_to_user(buf + copied,
+						dev->buf + run * IBS_RECORD_ALIGN,
+						run_len))
+				return -EFAULT;
+			copied += run_len;
+			run_len = 0;
+			rd %= cap;
+			run = rd;
+		}
+	}
+	if (run_len && copy_to_user(buf + copied,
+				dev->buf + run * IBS_RECORD_ALIGN, run_len))
+		return -EFAULT;
+	copied += run_len;
+	if (copied == 0)
+		return retval;
+
+	/* Finish copying the records out before handing their room back */
+	smp_mb();
+	atomic_long_set(&dev->ring->rd, rd);
+	dev->stats.read_bytes += copied;
+	return copied;
+}
+
+/**
+ * do_ibs_read_hist - hand the filling histogram table over to the reader
+ * @dev:	op device in histogram mode
+ * @buf:	user buffer to copy the slots into
+ * @count:	size of buf in bytes
+ *
+ * The NMI handler moves to the other (empty) table, and once it can no longer
+ * be touching the old one, that table's used slots are packed at its start,
+ * copied out and cleared. Called with read_lock held and hist_slots set.
+ */
+static ssize_t do_ibs_read_hist(struct ibs_dev *dev, char __user *buf,
+		size_t count)
+{
+	struct ibs_hist_entry *table;
+	u64 i, used = 0;
+	ssize_t retval;
+
+	if (count < dev->hist_slots * sizeof(*table))
+		return -EINVAL;
+
+	table = dev->hist[dev->hist_active];
+	dev->hist_active = !dev->hist_active;
+	sync_ibs_nmi(dev->cpu);
+
+	for (i = 0; i < dev->hist_slots; i++)
+		if (table[i].count)
+			table[used++] = table[i];
+	retval = used * sizeof(*table);
+	if (used && copy_to_user(buf, table, retval))
+		retval = -EFAULT;
+	else
+		dev->stats.read_bytes += retval;
+	memset(table, 0, dev->hist_slots * sizeof(*table));
+	return retval;
+}
+
 ssize_t ibs_read(struct file *file, char __user *buf, size_t count,
 			loff_t *fpos)
 {
 	struct ibs_dev *dev = file->private_data;
 	ssize_t retval;
 
+	if (dev->hist_slots) {
+		/* setup_ibs_hist() swaps the tables under read_lock */
+		mutex_lock(&dev->read_lock);
+		retval = dev->hist_slots ? do_ibs_read_hist(dev, buf, count) :
+			0;
+		mutex_unlock(&dev->read_lock);
+		return retval;
+	}
 	if (count < dev->entry_size || count > dev->size)
 		return -EINVAL;
+	if (!ibs_ring_readable(dev))
+		return -EBUSY;
 	/* Make count a multiple of the entry size */
 	count -= count % dev->entry_size;
 
@@ -259,27 +506,30 @@ ssize_t ibs_read(struct file *file, char __user *buf, size_t count,
 	 * Assuming we are the sole reader, we will rarely spin on this lock.
 	 */
 	mutex_lock(&dev->read_lock);
-	while (!atomic_long_read(&dev->entries)) {	/* No data */
+	while (!ibs_buffer_entries(dev)) {	/* No data */
 		mutex_unlock(&dev->read_lock);
 
+		/* The frozen window has been read out */
+		if (atomic_read(&dev->frozen))
+			return 0;
+
 		/* If IBS is disabled, return nothing */
-		mutex_lock(&dev->ctl_lock);
-		if ((dev->flavor == IBS_OP && !(dev->ctl & IBS_OP_EN)) ||
-		(dev->flavor == IBS_FETCH && !(dev->ctl & IBS_FETCH_EN))) {
-			mutex_unlock(&dev->ctl_lock);
+		if (!ibs_ring_enabled(dev))
 			return 0;
-		}
-		mutex_unlock(&dev->ctl_lock);
-	
+
 		if (file->f_flags & O_NONBLOCK)
 			return -EAGAIN;
+		/* IBS_DISABLE wakes us up too */
 		if (wait_event_interruptible(dev->readq,
-					(atomic_long_read(&dev->rd) !=
-					atomic_long_read(&dev->wr))))
+					ibs_buffer_entries(dev) ||
+					!ibs_ring_enabled(dev)))
 			return -ERESTARTSYS;
 		mutex_lock(&dev->read_lock);
 	}
-	retval = do_ibs_read(dev, buf, count);
+	if (ibs_ring_combined(dev))
+		retval = do_ibs_read_records(dev, buf, count);
+	else
+		retval = do_ibs_read(dev, buf, count);
 	mutex_unlock(&dev->read_lock);
 	return retval;
 }
@@ -291,68 +541,116 @@ unsigned int ibs_poll(struct file *file, poll_table *wait)
 	/* Update the poll table in case nobody has data */
 	poll_wait(file, &dev->pollq, wait);
 
-	mutex_lock(&dev->read_lock);
-	if (atomic_long_read(&dev->entries) >=
-		atomic_long_read(&dev->poll_threshold)) {
-		mutex_unlock(&dev->read_lock);
+	/* The NMI handler only wakes pollers it can see on the queue. Pairs
+	 * with the smp_mb() in ibs_wake_up(). */
+	smp_mb();
+
+	if (ibs_ring_readable(dev) && ibs_buffer_entries(dev) >=
+		atomic_long_read(&dev->poll_threshold))
 		return POLLIN | POLLRDNORM;	/* There is enough data */
-	}
-	mutex_unlock(&dev->read_lock);
 
 	/* Check whether IBS is disabled */
-	mutex_lock(&dev->ctl_lock);
-	if ((dev->flavor == IBS_OP && !(dev->ctl & IBS_OP_EN)) ||
-	(dev->flavor == IBS_FETCH && !(dev->ctl & IBS_FETCH_EN))) {
-		mutex_unlock(&dev->ctl_lock);
+	if (!ibs_ring_enabled(dev))
 		return POLLHUP;
-	}
-	mutex_unlock(&dev->ctl_lock);
 	return 0;
 }
 
-long ibs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static void ibs_vma_open(struct vm_area_struct *vma)
+{
+	struct ibs_dev *dev = vma->vm_private_data;
+	atomic_inc(&dev->mmapped);
+}
+
+static void ibs_vma_close(struct vm_area_struct *vma)
+{
+	struct ibs_dev *dev = vma->vm_private_data;
+	atomic_dec(&dev->mmapped);
+}
+
+static const struct vm_operations_struct ibs_vm_ops = {
+	.open =		ibs_vma_open,
+	.close =	ibs_vma_close,
+};
+
+int ibs_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	long retval = 0;
 	struct ibs_dev *dev = file->private_data;
-	int cpu = dev->cpu;
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long addr;
+	int retval = 0;
 
-	/* Lock-free commands */
-	switch (cmd) {
-	case DEBUG_BUFFER:
-		pr_info("cpu %d buffer: { wr = %lu; rd = %lu; entries = %lu; "
-			"lost = %lu; capacity = %llu; entry_size = %llu; "
-			"size = %llu; }\n",
-			cpu,
-			atomic_long_read(&dev->wr),
-			atomic_long_read(&dev->rd),
-			atomic_long_read(&dev->entries),
-			atomic_long_read(&dev->lost),
-			dev->capacity,
-			dev->entry_size,
-			dev->size);
-		return 0;
-	case GET_LOST:
-		return atomic_long_xchg(&dev->lost, 0);
-	case FIONREAD:
-		return atomic_long_read(&dev->entries);
-	}
+	/* The consumer hands slots back by writing rd into the control page,
+	 * so a private (copy-on-write) mapping would never work. */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
 
-	/* Commands that require the ctl_lock */
+	/* Hold off SET_BUFFER_SIZE while the mapping is set up */
 	mutex_lock(&dev->ctl_lock);
+	if (off > dev->ring_len || len > dev->ring_len - off)
+		retval = -EINVAL;
+	/* Mapped consumers expect fixed-size entries, not records */
+	else if (ibs_ring_combined(dev))
+		retval = -EBUSY;
+
+	/* The ring is either node-local vmalloc memory, which is not marked
+	 * VM_USERMAP and so cannot go through remap_vmalloc_range(), or one
+	 * contiguous block of pages. Insert it one page at a time. */
+	for (addr = vma->vm_start; !retval && addr < vma->vm_end;
+			addr += PAGE_SIZE, off += PAGE_SIZE) {
+		char *kaddr = (char *)dev->ring + off;
+		struct page *page = dev->ring_huge ? virt_to_page(kaddr) :
+			vmalloc_to_page(kaddr);
+		retval = vm_insert_page(vma, addr, page);
+	}
+	if (!retval) {
+		vma->vm_private_data = dev;
+		vma->vm_ops = &ibs_vm_ops;
+		ibs_vma_open(vma);
+	}
+	mutex_unlock(&dev->ctl_lock);
+	return retval;
+}
+
+/* The commands that run under ctl_lock, which the caller holds */
+static long ibs_ctl_locked(struct ibs_dev *dev, unsigned int cmd,
+		unsigned long arg)
+{
+	struct ibs_dev *fetch = NULL;
+	long retval = 0;
+	int cpu = dev->cpu;
+
 	/* For SET* commands, ensure IBS is disabled */
 	if (cmd == SET_CUR_CNT || cmd == SET_CNT ||
-		cmd == SET_MAX_CNT ||
 		cmd == SET_CNT_CTL ||
 		cmd == SET_RAND_EN ||
 		cmd == SET_POLL_SIZE ||
 		cmd == SET_BUFFER_SIZE ||
+		cmd == SET_SAMPLE_FIELDS ||
+		cmd == SET_RING_MODE ||
+		cmd == SET_HISTOGRAM ||
+		cmd == SET_SCHED_GATE ||
+		cmd == SET_COMBINED ||
 		cmd == RESET_BUFFER) {
 			if ((dev->flavor == IBS_OP && dev->ctl & IBS_OP_EN) ||
 			(dev->flavor == IBS_FETCH && dev->ctl & IBS_FETCH_EN)) {
-				mutex_unlock(&dev->ctl_lock);
 				return -EBUSY;
 		}
 	}
+	/* The fetch half of a combined ring writes into this buffer too, so
+	 * hold it disabled while the buffer changes. Lock order is op, then
+	 * fetch. */
+	if (ibs_ring_combined(dev) && (cmd == SET_BUFFER_SIZE ||
+		cmd == SET_SAMPLE_FIELDS ||
+		cmd == SET_RING_MODE ||
+		cmd == RESET_BUFFER)) {
+		fetch = dev->combined;
+		mutex_lock(&fetch->ctl_lock);
+		if (fetch->ctl & IBS_FETCH_EN) {
+			mutex_unlock(&fetch->ctl_lock);
+			return -EBUSY;
+		}
+	}
 	switch (cmd) {
 	case IBS_ENABLE:
 		if (dev->flavor == IBS_OP) {
@@ -362,6 +660,7 @@ long ibs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			dev->ctl |= IBS_FETCH_EN;
 			enable_ibs_fetch_on_cpu(dev, cpu, dev->ctl);
 		}
+		atomic_set(&dev->enabled, 1);
 		break;
 	case IBS_DISABLE:
 		if (dev->flavor == IBS_OP) {
@@ -371,6 +670,12 @@ long ibs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			disable_ibs_fetch_on_cpu(dev, cpu);
 			dev->ctl &= ~IBS_FETCH_EN;
 		}
+		atomic_set(&dev->enabled, 0);
+		/* Blocked readers and pollers may be waiting for samples that
+		 * will never come now */
+		wake_up(&ibs_ring_dev(dev)->readq);
+		wake_up(&ibs_ring_dev(dev)->pollq);
+		wake_up(&ibs_all_waitq);
 		break;
 	case SET_CUR_CNT:
 	case SET_CNT:
@@ -401,22 +706,31 @@ long ibs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			retval = gather_bits(dev->ctl, IBS_FETCH_CNT);
 		break;
 	case SET_MAX_CNT:
+	{
+		/* This may run while IBS is enabled. The NMI handler re-arms
+		 * the counter from dev->ctl after every sample, so build the
+		 * new value first and publish it with a single store; the
+		 * handler then never sees a half-updated max count. The other
+		 * ctl writers need IBS disabled. */
+		u64 ctl = dev->ctl;
 		if (dev->flavor == IBS_OP) {
 			if (dev->ibs_op_cnt_ext_supported)
 			{
-				dev->ctl &= ~IBS_OP_MAX_CNT;
-				dev->ctl |= scatter_bits(arg, IBS_OP_MAX_CNT);
+				ctl &= ~IBS_OP_MAX_CNT;
+				ctl |= scatter_bits(arg, IBS_OP_MAX_CNT);
 			}
 			else
 			{
-				dev->ctl &= ~IBS_OP_MAX_CNT_OLD;
-				dev->ctl |= scatter_bits(arg, IBS_OP_MAX_CNT_OLD);
+				ctl &= ~IBS_OP_MAX_CNT_OLD;
+				ctl |= scatter_bits(arg, IBS_OP_MAX_CNT_OLD);
 			}
 		} else {	/* dev->flavor == IBS_FETCH */
-			dev->ctl &= ~IBS_FETCH_MAX_CNT;
-			dev->ctl |= scatter_bits(arg, IBS_FETCH_MAX_CNT);
+			ctl &= ~IBS_FETCH_MAX_CNT;
+			ctl |= scatter_bits(arg, IBS_FETCH_MAX_CNT);
 		}
+		WRITE_ONCE(dev->ctl, ctl);
 		break;
+	}
 	case GET_MAX_CNT:
 		if (dev->flavor == IBS_OP)
 			if (dev->ibs_op_cnt_ext_supported)
@@ -467,36 +781,743 @@ long ibs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case GET_POLL_SIZE:
 		retval = atomic_long_read(&dev->poll_threshold);
 		break;
-	case SET_BUFFER_SIZE:
-		/* Ensure requested buffer can hold at least one entry */
-		if (arg < dev->entry_size) {
+	case SET_BUFFER_SIZE: {
+		u64 size = arg & IBS_BUFFER_SIZE_MASK;
+		int huge = !!(arg & IBS_BUFFER_HUGE);
+
+		/* Ensure requested buffer can hold at least one entry, even
+		 * after the field mask goes back to all fields */
+		if (size < ibs_entry_size(dev->flavor == IBS_OP ?
+					IBS_OP_FIELDS_ALL : IBS_FETCH_FIELDS_ALL)) {
 			retval = -EINVAL;
 			break;
 		}
 		/* Do not re-allocate if there is no change */
-		if (arg == dev->size) {
+		if (size == dev->size && huge == dev->ring_huge) {
 			reset_ibs_buffer(dev);
 			break;
 		}
+		/* Someone is still looking at the old buffer */
+		if (atomic_read(&dev->mmapped)) {
+			retval = -EBUSY;
+			break;
+		}
 
-		free_ibs_buffer(dev);
-		retval = setup_ibs_buffer(dev, arg);
+		retval = setup_ibs_buffer(dev, size, huge);
 		if (retval)
-			pr_warn("Failed to set IBS %s cpu %d buffer size to %ld; "
+			pr_warn("Failed to set IBS %s cpu %d buffer size to %llu%s; "
 				"leaving buffer unchanged\n",
 				dev->flavor == IBS_OP ? "op" : "fetch",
-				dev->cpu, arg);
+				dev->cpu, size, huge ? " (huge)" : "");
 		break;
+	}
 	case GET_BUFFER_SIZE:
 		retval = dev->size;
 		break;
 	case RESET_BUFFER:
 		reset_ibs_buffer(dev);
 		break;
+	case SET_SAMPLE_FIELDS:
+		if (arg == 0 || (arg & ~(dev->flavor == IBS_OP ?
+					IBS_OP_FIELDS_ALL : IBS_FETCH_FIELDS_ALL))) {
+			retval = -EINVAL;
+			break;
+		}
+		/* A mapping consumer would keep using the old entry size */
+		if (atomic_read(&dev->mmapped)) {
+			retval = -EBUSY;
+			break;
+		}
+		set_ibs_sample_fields(dev, arg);
+		if (atomic_long_read(&dev->poll_threshold) >= dev->capacity)
+			atomic_long_set(&dev->poll_threshold,
+					max(dev->capacity, 2ULL) - 1);
+		reset_ibs_buffer(dev);
+		break;
+	case GET_SAMPLE_FIELDS:
+		retval = dev->sample_fields;
+		break;
+	case ADD_FILTER_TGID: {
+		int i, num_tgids = atomic_read(&dev->filter_num_tgids);
+
+		if ((long)arg <= 0 || arg > PID_MAX_LIMIT) {
+			retval = -EINVAL;
+			break;
+		}
+		for (i = 0; i < num_tgids; i++)
+			if (dev->filter_tgids[i] == (pid_t)arg)
+				break;
+		if (i < num_tgids)	/* Already in the set */
+			break;
+		if (num_tgids == IBS_FILTER_MAX_TGIDS) {
+			retval = -ENOSPC;
+			break;
+		}
+		dev->filter_tgids[num_tgids] = arg;
+		/* The NMI handler must see the new entry before the count */
+		smp_wmb();
+		atomic_set(&dev->filter_num_tgids, num_tgids + 1);
+		break;
+	}
+	case CLEAR_FILTER_TGIDS:
+		atomic_set(&dev->filter_num_tgids, 0);
+		break;
+	case SET_FILTER_CR3:
+		atomic_long_set(&dev->filter_cr3, arg);
+		break;
+	case GET_FILTER_CR3:
+		retval = atomic_long_read(&dev->filter_cr3);
+		break;
+	case SET_FILTER_MODE:
+		if (arg == IBS_FILTER_MODE_ALL || arg == IBS_FILTER_MODE_USER ||
+				arg == IBS_FILTER_MODE_KERNEL)
+			atomic_set(&dev->filter_mode, arg);
+		else
+			retval = -EINVAL;
+		break;
+	case GET_FILTER_MODE:
+		retval = atomic_read(&dev->filter_mode);
+		break;
+	case SET_RING_MODE:
+		if (arg != IBS_RING_MODE_DROP && arg != IBS_RING_MODE_OVERWRITE) {
+			retval = -EINVAL;
+			break;
+		}
+		dev->ring_mode = arg;
+		reset_ibs_buffer(dev);
+		break;
+	case GET_RING_MODE:
+		retval = dev->ring_mode;
+		break;
+	case SNAPSHOT:
+		if (arg == IBS_SNAPSHOT_FREEZE) {
+			atomic_set(&dev->frozen, 1);
+			sync_ibs_nmi(cpu);
+		} else if (arg == IBS_SNAPSHOT_THAW) {
+			atomic_set(&dev->frozen, 0);
+		} else {
+			retval = -EINVAL;
+		}
+		break;
+	case SET_HISTOGRAM:
+	{
+		u64 slots = arg & IBS_HIST_SLOTS_MASK;
+		if (dev->flavor != IBS_OP || slots > IBS_HIST_MAX_SLOTS ||
+				(slots & (slots - 1))) {
+			retval = -EINVAL;
+			break;
+		}
+		if (slots && dev->combined) {
+			retval = -EBUSY;
+			break;
+		}
+		retval = setup_ibs_hist(dev, slots,
+				!!(arg & IBS_HIST_KEY_PAGE));
+		break;
+	}
+	case GET_HISTOGRAM:
+		retval = dev->hist_slots;
+		break;
+	case SET_FILTER_CGROUP:
+		retval = ibs_set_filter_cgroup(dev, (int)arg);
+		break;
+	case SET_SCHED_GATE:
+		if (arg == 0 || arg == 1)
+			retval = ibs_sched_gate_set(dev, arg);
+		else
+			retval = -EINVAL;
+		break;
+	case GET_SCHED_GATE:
+		retval = dev->gated;
+		break;
+	case SET_COMBINED:
+		if (dev->flavor != IBS_OP || arg > 1)
+			retval = -EINVAL;
+		else
+			retval = set_ibs_combined(dev, arg);
+		break;
+	case GET_COMBINED:
+		retval = ibs_ring_combined(dev);
+		break;
 	default:	/* Command not recognized */
 		retval = -ENOTTY;
 		break;
 	}
+	if (fetch)
+		mutex_unlock(&fetch->ctl_lock);
+	return retval;
+}
+
+/**
+ * ibs_fetch_ioctl - run a command for the fetch half of a combined ring
+ * @dev:	fetch device of the combined ring
+ * @cmd:	ioctl command
+ * @arg:	ioctl argument
+ *
+ * Commands about the buffer belong to the op device, which owns it. The op
+ * device's ctl_lock keeps the ring combined throughout.
+ */
+static long ibs_fetch_ioctl(struct ibs_dev *dev, unsigned int cmd,
+		unsigned long arg)
+{
+	struct ibs_dev *fetch;
+	long retval;
+
+	switch (cmd) {
+	case SET_POLL_SIZE:
+	case GET_POLL_SIZE:
+	case SET_BUFFER_SIZE:
+	case GET_BUFFER_SIZE:
+	case RESET_BUFFER:
+	case SET_RING_MODE:
+	case GET_RING_MODE:
+	case SNAPSHOT:
+	case SET_COMBINED:
+	case GET_COMBINED:
+	case SESSION_CONFIG:
+	case SESSION_DISABLE:
+	case GET_LOST:
+	case DEBUG_BUFFER:
+		return -EINVAL;
+	}
+
+	mutex_lock(&dev->ctl_lock);
+	if (!ibs_ring_combined(dev)) {
+		mutex_unlock(&dev->ctl_lock);
+		return -EINVAL;
+	}
+	fetch = dev->combined;
+	mutex_lock(&fetch->ctl_lock);
+	switch (cmd) {
+	case GET_FILTERED:
+		retval = atomic_long_xchg(&fetch->filtered, 0);
+		break;
+	case GET_STATS:
+		retval = 0;
+		if (copy_to_user((void __user *)arg, &fetch->stats,
+					sizeof(fetch->stats)))
+			retval = -EFAULT;
+		break;
+	case SET_SAMPLE_FIELDS:
+		/* The records already buffered would no longer decode */
+		if ((dev->ctl & IBS_OP_EN) || atomic_read(&dev->mmapped)) {
+			retval = -EBUSY;
+			break;
+		}
+		retval = ibs_ctl_locked(fetch, cmd, arg);
+		if (!retval)
+			reset_ibs_buffer(dev);
+		break;
+	default:
+		retval = ibs_ctl_locked(fetch, cmd, arg);
+		break;
+	}
+	mutex_unlock(&fetch->ctl_lock);
 	mutex_unlock(&dev->ctl_lock);
 	return retval;
 }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+/* Serializes sessions, so that two of them never interleave their passes
+ * over the devices. Taken before any ctl_lock. */
+static DEFINE_MUTEX(ibs_session_lock);
+
+static struct ibs_dev *ibs_session_dev(int cpu, int flavor)
+{
+	if (flavor == IBS_OP)
+		return per_cpu_ptr(pcpu_op_dev, cpu);
+	return per_cpu_ptr(pcpu_fetch_dev, cpu);
+}
+
+/* IBS_SESSION_OP and IBS_SESSION_FETCH are 1 << IBS_OP and 1 << IBS_FETCH */
+#define for_each_session_dev(dev, cpu, flavor, mask, flavors) \
+	for_each_cpu((cpu), (mask)) \
+		for ((flavor) = IBS_OP; (flavor) <= IBS_FETCH; (flavor)++) \
+			if (((flavors) & (1 << (flavor))) && \
+				((dev) = ibs_session_dev((cpu), (flavor))))
+
+/* These two run on every CPU of the session at the same time */
+static void ibs_session_enable_local(void *info)
+{
+	int flavors = *(int *)info;
+	int cpu = smp_processor_id();
+	int flavor;
+
+	for (flavor = IBS_OP; flavor <= IBS_FETCH; flavor++) {
+		struct ibs_dev *dev = ibs_session_dev(cpu, flavor);
+
+		if (!(flavors & (1 << flavor)))
+			continue;
+		if (dev->gated)
+			ibs_sched_gate_start(dev);
+		else
+			wrmsrl((flavor == IBS_OP) ? MSR_IBS_OP_CTL :
+					MSR_IBS_FETCH_CTL, dev->ctl);
+	}
+}
+
+static void ibs_session_disable_local(void *info)
+{
+	int flavors = *(int *)info;
+	int cpu = smp_processor_id();
+	struct ibs_dev *dev;
+
+	if (flavors & IBS_SESSION_OP) {
+		dev = ibs_session_dev(cpu, IBS_OP);
+		if (dev->gated)
+			ibs_sched_gate_stop(dev);
+		if (dev->workaround_fam10h_err_420) {
+			/* do_fam10h_workaround_420(), minus the IPI */
+			u64 op_ctl;
+			rdmsrl(MSR_IBS_OP_CTL, op_ctl);
+			wrmsrl(MSR_IBS_OP_CTL,
+				(op_ctl | IBS_OP_VAL) & ~IBS_OP_MAX_CNT_OLD);
+		}
+		disable_ibs_op(NULL);
+	}
+	if (flavors & IBS_SESSION_FETCH) {
+		dev = ibs_session_dev(cpu, IBS_FETCH);
+		if (dev->gated)
+			ibs_sched_gate_stop(dev);
+		wrmsrl(MSR_IBS_FETCH_CTL, 0ULL);
+	}
+}
+
+static void ibs_session_broadcast(const struct cpumask *mask,
+		void (*fn)(void *), int *flavors)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+	preempt_disable();
+	on_each_cpu_mask(mask, fn, flavors, 1);
+	preempt_enable();
+#else
+	int cpu;
+	for_each_cpu(cpu, mask)
+		smp_call_function_single(cpu, fn, flavors, 1);
+#endif
+}
+
+/* Read the session's CPU bitmap, and check that the caller owns all of its
+ * devices */
+static int ibs_session_cpus(const struct ibs_session *s, struct cpumask *mask,
+		int flavors)
+{
+	size_t len = min_t(size_t, s->cpus_len, cpumask_size());
+	struct ibs_dev *dev;
+	int cpu, flavor;
+
+	cpumask_clear(mask);
+	if (copy_from_user(cpumask_bits(mask),
+				(void __user *)(unsigned long)s->cpus, len))
+		return -EFAULT;
+	cpumask_and(mask, mask, cpu_online_mask);
+	if (cpumask_empty(mask))
+		return -EINVAL;
+
+	for_each_session_dev(dev, cpu, flavor, mask, flavors)
+		if (!atomic_read(&dev->in_use) || dev->owner != current->tgid)
+			return -EPERM;
+	return 0;
+}
+
+static long ibs_session_apply(struct ibs_dev *dev, const struct ibs_session *s)
+{
+	long err = 0;
+
+	if (s->max_cnt != IBS_SESSION_KEEP)
+		err = ibs_ctl_locked(dev, SET_MAX_CNT, s->max_cnt);
+	if (!err && s->buffer_size != IBS_SESSION_KEEP)
+		err = ibs_ctl_locked(dev, SET_BUFFER_SIZE, s->buffer_size);
+	if (!err && s->poll_size != IBS_SESSION_KEEP)
+		err = ibs_ctl_locked(dev, SET_POLL_SIZE, s->poll_size);
+	if (!err && dev->flavor == IBS_OP && s->cnt_ctl != IBS_SESSION_KEEP)
+		err = ibs_ctl_locked(dev, SET_CNT_CTL, s->cnt_ctl);
+	if (!err && dev->flavor == IBS_FETCH && s->rand_en != IBS_SESSION_KEEP)
+		err = ibs_ctl_locked(dev, SET_RAND_EN, s->rand_en);
+	return err;
+}
+
+static int ibs_session_copy(unsigned long arg, struct ibs_session *s,
+		int *flavors)
+{
+	if (copy_from_user(s, (void __user *)arg, sizeof(*s)))
+		return -EFAULT;
+	*flavors = s->flags & (IBS_SESSION_OP | IBS_SESSION_FETCH);
+	if (!*flavors || (s->flags & ~IBS_SESSION_FLAGS))
+		return -EINVAL;
+	return 0;
+}
+
+static long ibs_session_config(unsigned long arg)
+{
+	struct ibs_session s;
+	struct ibs_dev *dev;
+	cpumask_var_t mask;
+	int cpu, flavor, flavors;
+	long err;
+
+	err = ibs_session_copy(arg, &s, &flavors);
+	if (err)
+		return err;
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	mutex_lock(&ibs_session_lock);
+	err = ibs_session_cpus(&s, mask, flavors);
+	if (err)
+		goto out;
+
+	/* Set up every device before enabling any of them */
+	for_each_session_dev(dev, cpu, flavor, mask, flavors) {
+		mutex_lock(&dev->ctl_lock);
+		err = ibs_session_apply(dev, &s);
+		mutex_unlock(&dev->ctl_lock);
+		if (err)
+			goto out;
+	}
+	if (!(s.flags & IBS_SESSION_ENABLE))
+		goto out;
+
+	/* The workaround needs IPIs of its own, so it cannot go in the
+	 * broadcast */
+	for_each_session_dev(dev, cpu, flavor, mask, flavors) {
+		mutex_lock(&dev->ctl_lock);
+		if (dev->workaround_fam17h_zn)
+			start_fam17h_zn_dyn_workaround(cpu);
+		dev->ctl |= (flavor == IBS_OP) ? IBS_OP_EN : IBS_FETCH_EN;
+		mutex_unlock(&dev->ctl_lock);
+	}
+	ibs_session_broadcast(mask, ibs_session_enable_local, &flavors);
+	for_each_session_dev(dev, cpu, flavor, mask, flavors)
+		atomic_set(&dev->enabled, 1);
+out:
+	mutex_unlock(&ibs_session_lock);
+	free_cpumask_var(mask);
+	return err;
+}
+
+static long ibs_session_disable(unsigned long arg)
+{
+	struct ibs_session s;
+	struct ibs_dev *dev;
+	cpumask_var_t mask;
+	int cpu, flavor, flavors;
+	long err;
+
+	err = ibs_session_copy(arg, &s, &flavors);
+	if (err)
+		return err;
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	mutex_lock(&ibs_session_lock);
+	err = ibs_session_cpus(&s, mask, flavors);
+	if (err)
+		goto out;
+
+	ibs_session_broadcast(mask, ibs_session_disable_local, &flavors);
+	for_each_session_dev(dev, cpu, flavor, mask, flavors) {
+		mutex_lock(&dev->ctl_lock);
+		dev->ctl &= (flavor == IBS_OP) ? ~IBS_OP_EN : ~IBS_FETCH_EN;
+		if (dev->workaround_fam17h_zn)
+			stop_fam17h_zn_dyn_workaround(cpu);
+		atomic_set(&dev->enabled, 0);
+		wake_up(&ibs_ring_dev(dev)->readq);
+		wake_up(&ibs_ring_dev(dev)->pollq);
+		mutex_unlock(&dev->ctl_lock);
+	}
+	wake_up(&ibs_all_waitq);
+out:
+	mutex_unlock(&ibs_session_lock);
+	free_cpumask_var(mask);
+	return err;
+}
+#else
+static long ibs_session_config(unsigned long arg)
+{
+	return -ENOTTY;
+}
+
+static long ibs_session_disable(unsigned long arg)
+{
+	return -ENOTTY;
+}
+#endif
+
+long ibs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	long retval = 0;
+	struct ibs_dev *dev = file->private_data;
+	int cpu = dev->cpu;
+
+	if ((cmd & ~0xFFU) == IBS_CMD_FETCH)
+		return ibs_fetch_ioctl(dev, cmd & 0xFFU, arg);
+
+	/* Lock-free commands */
+	switch (cmd) {
+	case DEBUG_BUFFER:
+		pr_info("cpu %d buffer: { wr = %lu; rd = %lu; entries = %lu; "
+			"lost = %lu; capacity = %llu; entry_size = %llu; "
+			"size = %llu; mmapped = %d; filtered = %lu; "
+			"huge = %d; node = %d; ring_mode = %d; "
+			"frozen = %d; }\n",
+			cpu,
+			atomic_long_read(&dev->wr),
+			atomic_long_read(&dev->ring->rd),
+			ibs_buffer_entries(dev),
+			atomic_long_read(&dev->ring->lost),
+			dev->capacity,
+			dev->entry_size,
+			dev->size,
+			atomic_read(&dev->mmapped),
+			atomic_long_read(&dev->filtered),
+			dev->ring_huge,
+			cpu_to_node(cpu),
+			dev->ring_mode,
+			atomic_read(&dev->frozen));
+		return 0;
+	case GET_LOST:
+		return atomic_long_xchg(&dev->ring->lost, 0);
+	case GET_FILTERED:
+		return atomic_long_xchg(&dev->filtered, 0);
+	case GET_STATS:
+		/* The NMI handler may bump counters mid-copy; each one is
+		 * still a consistent 64-bit value */
+		if (copy_to_user((void __user *)arg, &dev->stats,
+					sizeof(dev->stats)))
+			return -EFAULT;
+		return 0;
+	case FIONREAD:
+		return ibs_buffer_entries(dev);
+	/* These take the ctl_lock of every device they touch */
+	case SESSION_CONFIG:
+		return ibs_session_config(arg);
+	case SESSION_DISABLE:
+		return ibs_session_disable(arg);
+	}
+
+	/* Commands that require the ctl_lock */
+	mutex_lock(&dev->ctl_lock);
+	retval = ibs_ctl_locked(dev, cmd, arg);
+	mutex_unlock(&dev->ctl_lock);
+	return retval;
+}
+
+static struct ibs_dev *ibs_all_dev(unsigned int ring)
+{
+	unsigned int cpu = IBS_CPU(ring);
+
+	if (!cpu_possible(cpu))
+		return NULL;
+	if (IBS_FLAVOR(ring) == IBS_OP)
+		return per_cpu_ptr(pcpu_op_dev, cpu);
+	return per_cpu_ptr(pcpu_fetch_dev, cpu);
+}
+
+/**
+ * ibs_all_ready - check whether any buffer has enough samples to read
+ * @any:	count any sample as enough, instead of the poll threshold
+ * @enabled:	(output) nonzero if any device is enabled
+ */
+static int ibs_all_ready(int any, int *enabled)
+{
+	unsigned int ring;
+	int ready = 0;
+
+	*enabled = 0;
+	for (ring = 0; ring < IBS_ALL_NR_RINGS && !(ready && *enabled);
+			ring++) {
+		struct ibs_dev *dev = ibs_all_dev(ring);
+
+		if (dev == NULL || !dev->all_held)
+			continue;
+		if (atomic_read(&dev->enabled))
+			*enabled = 1;
+		if (ibs_ring_readable(dev) && ibs_buffer_entries(dev) >=
+				(any ? 1 : atomic_long_read(&dev->poll_threshold)))
+			ready = 1;
+	}
+	return ready;
+}
+
+/* Drop /dev/ibs/all's hold on every device */
+static void ibs_all_let_go(void)
+{
+	unsigned int ring;
+
+	for (ring = 0; ring < IBS_ALL_NR_RINGS; ring++) {
+		struct ibs_dev *dev = ibs_all_dev(ring);
+
+		if (dev == NULL)
+			continue;
+		mutex_lock(&dev->ctl_lock);
+		if (dev->all_held) {
+			dev->all_held = 0;
+			atomic_dec(&dev->mmapped);
+		}
+		mutex_unlock(&dev->ctl_lock);
+	}
+}
+
+int ibs_all_open(struct inode *inode, struct file *file)
+{
+	unsigned int ring;
+	int held = 0;
+	int retval = 0;
+
+	if (atomic_cmpxchg(&ibs_all_in_use, 0, 1) != 0)
+		return -EBUSY;
+
+	/* Hold on to the buffers of the devices this process has open, the
+	 * way a mapping does, so that none of them can be resized or
+	 * reformatted under ibs_all_read(). Other processes' devices are
+	 * left alone, and a process without any cannot keep /dev/ibs/all
+	 * from its real user. Batches have no room for records, so combined
+	 * rings are turned away. */
+	for (ring = 0; ring < IBS_ALL_NR_RINGS && !retval; ring++) {
+		struct ibs_dev *dev = ibs_all_dev(ring);
+
+		if (dev == NULL)
+			continue;
+		mutex_lock(&dev->ctl_lock);
+		if (atomic_read(&dev->in_use) && dev->owner == current->tgid) {
+			if (dev->combined) {
+				retval = -EBUSY;
+			} else {
+				dev->all_held = 1;
+				atomic_inc(&dev->mmapped);
+				held++;
+			}
+		}
+		mutex_unlock(&dev->ctl_lock);
+	}
+	if (!retval && !held)
+		retval = -ENODEV;
+	if (retval) {
+		ibs_all_let_go();
+		atomic_set(&ibs_all_in_use, 0);
+		return retval;
+	}
+	ibs_all_next = 0;
+	return 0;
+}
+
+int ibs_all_release(struct inode *inode, struct file *file)
+{
+	ibs_all_let_go();
+	atomic_set(&ibs_all_in_use, 0);
+	return 0;
+}
+
+ssize_t ibs_all_read(struct file *file, char __user *buf, size_t count,
+			loff_t *fpos)
+{
+	struct ibs_batch_header hdr;
+	unsigned int nr_rings = IBS_ALL_NR_RINGS;
+	unsigned int i, next;
+	ssize_t retval = 0;
+	int enabled;
+
+	if (count < sizeof(hdr))
+		return -EINVAL;
+
+	while (!ibs_all_ready(1, &enabled)) {	/* No data */
+		/* If IBS is disabled everywhere, return nothing */
+		if (!enabled)
+			return 0;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		/* The NMI handler only wakes us at the poll threshold */
+		if (wait_event_interruptible(ibs_all_waitq,
+					ibs_all_ready(0, &enabled) || !enabled))
+			return -ERESTARTSYS;
+	}
+
+	mutex_lock(&ibs_all_lock);
+	next = ibs_all_next;
+	for (i = 0; i < nr_rings; i++) {
+		unsigned int ring = (ibs_all_next + i) % nr_rings;
+		struct ibs_dev *dev = ibs_all_dev(ring);
+		size_t room;
+		long entries;
+		ssize_t bytes;
+
+		if (dev == NULL || !ibs_ring_readable(dev))
+			continue;
+
+		/* The device may have been closed, and even reopened by
+		 * someone else, since /dev/ibs/all was opened; ctl_lock keeps
+		 * that from happening during the copy */
+		mutex_lock(&dev->ctl_lock);
+		if (!dev->all_held || !atomic_read(&dev->in_use) ||
+				dev->owner != current->tgid) {
+			mutex_unlock(&dev->ctl_lock);
+			continue;
+		}
+		mutex_lock(&dev->read_lock);
+		entries = ibs_buffer_entries(dev);
+		if (entries == 0) {
+			mutex_unlock(&dev->read_lock);
+			mutex_unlock(&dev->ctl_lock);
+			continue;
+		}
+		if (count - retval < sizeof(hdr) + dev->entry_size) {
+			/* Out of room; start here next time */
+			mutex_unlock(&dev->read_lock);
+			mutex_unlock(&dev->ctl_lock);
+			next = ring;
+			break;
+		}
+		room = count - retval - sizeof(hdr);
+		bytes = do_ibs_read(dev, buf + retval + sizeof(hdr),
+				min_t(size_t, entries, room / dev->entry_size) *
+				dev->entry_size);
+		/* A failed read leaves the entries, and their losses, for
+		 * next time */
+		hdr.lost = (bytes < 0) ? 0 :
+			atomic_long_xchg(&dev->ring->lost, 0);
+		mutex_unlock(&dev->read_lock);
+		mutex_unlock(&dev->ctl_lock);
+		if (bytes < 0) {
+			if (retval == 0)
+				retval = bytes;
+			break;
+		}
+
+		hdr.cpu = dev->cpu;
+		hdr.flavor = (dev->flavor == IBS_OP) ?
+			IBS_BATCH_OP : IBS_BATCH_FETCH;
+		hdr.entry_size = dev->entry_size;
+		hdr.num_entries = bytes / dev->entry_size;
+		if (copy_to_user(buf + retval, &hdr, sizeof(hdr))) {
+			/* The entries are gone from the buffer by now; count
+			 * them, and the losses taken above, as lost again */
+			atomic_long_add(hdr.lost + hdr.num_entries,
+					&dev->ring->lost);
+			if (retval == 0)
+				retval = -EFAULT;
+			break;
+		}
+		retval += sizeof(hdr) + bytes;
+		next = (ring + 1) % nr_rings;
+	}
+	ibs_all_next = next;
+	mutex_unlock(&ibs_all_lock);
+	return retval;
+}
+
+unsigned int ibs_all_poll(struct file *file, poll_table *wait)
+{
+	int enabled;
+
+	poll_wait(file, &ibs_all_waitq, wait);
+
+	/* Pairs with the smp_mb() in ibs_wake_up() */
+	smp_mb();
+
+	if (ibs_all_ready(0, &enabled))
+		return POLLIN | POLLRDNORM;	/* There is enough data */
+	if (!enabled)
+		return POLLHUP;
+	return 0;
+}
@@ -43,6 +43,17 @@ unsigned int ibs_poll(struct file *file, poll_table *wait);
 ssize_t ibs_read(struct file *file, char __user *buf, size_t count,
             loff_t *fpos);
 
+/**
+ * ibs_mmap - map the sample buffer and its control page into user space
+ *
+ * The mapping starts with a struct ibs_ring_header page followed by the
+ * sample entries. It must be shared, since consumers advance the read index
+ * by writing to the control page. See ibs-uapi.h for the protocol.
+ *
+ * Returns: 0 on success, or negative error code
+ */
+int ibs_mmap(struct file *file, struct vm_area_struct *vma);
+
 /**
  * ibs_release - disable IBS and clear the data buffer
  */
@@ -57,6 +68,35 @@ int ibs_release(struct inode *inode, struct file *file);
  */
 long ibs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
+/**
+ * ibs_all_open - open /dev/ibs/all, the device that reads every CPU's buffers
+ *
+ * Only one opener at a time; others get -EBUSY. See ibs-uapi.h.
+ */
+int ibs_all_open(struct inode *inode, struct file *file);
+
+/**
+ * ibs_all_poll - check whether any buffer has reached its poll threshold
+ *
+ * Returns: (POLLIN | POLLRDNORM) if some buffer holds poll_threshold entries;
+ * 0 if not; or POLLHUP if not and every device is disabled.
+ */
+unsigned int ibs_all_poll(struct file *file, poll_table *wait);
+
+/**
+ * ibs_all_read - read batches of samples from every CPU's buffers
+ * @count:  number of bytes to read; must hold at least one batch header
+ *
+ * Returns: Number of bytes read, or negative error code
+ */
+ssize_t ibs_all_read(struct file *file, char __user *buf, size_t count,
+            loff_t *fpos);
+
+/**
+ * ibs_all_release - let go of the buffers held by /dev/ibs/all
+ */
+int ibs_all_release(struct inode *inode, struct file *file);
+
 /**
  * disable_ibs_op_on_cpu()
  *
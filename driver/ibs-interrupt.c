@@ -15,22 +15,28 @@
 #else
 #include <asm-x86_64/kdebug.h>
 #endif
+#include <linux/hash.h>
 #include <linux/sched.h>
+#include <linux/timex.h>
 
 #include "ibs-msr-index.h"
 #include "ibs-interrupt.h"
+#include "ibs-sched.h"
 #include "ibs-structs.h"
+#include "ibs-utils.h"
 
 extern void *pcpu_op_dev;
 extern void *pcpu_fetch_dev;
+extern wait_queue_head_t ibs_all_waitq;
 
 static inline void wake_up_queues(struct ibs_dev *dev)
 {
 	wake_up(&dev->readq);
-	if (atomic_long_read(&dev->entries) >=
+	if (ibs_buffer_entries(dev) >=
 		atomic_long_read(&dev->poll_threshold))
 	{
 		wake_up(&dev->pollq);
+		wake_up(&ibs_all_waitq);
 	}
 }
 
@@ -42,6 +48,60 @@ void handle_ibs_work(struct irq_work *w)
 }
 #endif
 
+/**
+ * ibs_wake_up - wake up readers from the NMI handler, if any need it
+ * @dev:	device whose buffer just took a sample
+ *
+ * Waking the queues costs an irq_work (a self-IPI) per sample, so skip it
+ * when nobody is waiting, or when only pollers (including those of
+ * /dev/ibs/all) are and the poll threshold has not been reached yet.
+ */
+static inline void ibs_wake_up(struct ibs_dev *dev)
+{
+	/* Order the new wr before the waitqueue checks. Pairs with the barrier
+	 * a waiter issues between queueing itself and looking at the buffer. */
+	smp_mb();
+	if (!waitqueue_active(&dev->readq) &&
+		!((waitqueue_active(&dev->pollq) ||
+		waitqueue_active(&ibs_all_waitq)) &&
+		ibs_buffer_entries(dev) >=
+		atomic_long_read(&dev->poll_threshold)))
+		return;
+
+	dev->stats.wakeups++;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	irq_work_queue(&dev->bottom_half);
+#else
+	/* Add more work directly into the NMI handler, but in older kernels, we
+	 * didn't have access to IRQ work queues. */
+	wake_up_queues(dev);
+#endif
+}
+
+/**
+ * ibs_account_nmi - charge one sample's handling time to the device
+ * @dev:	device that took the sample
+ * @cycles:	TSC cycles from entering the handler to re-arming IBS
+ */
+static inline void ibs_account_nmi(struct ibs_dev *dev, u64 cycles)
+{
+	int bucket = min(fls64(cycles), IBS_STATS_HIST_BUCKETS - 1);
+
+	dev->stats.nmis++;
+	dev->stats.nmi_cycles += cycles;
+	if (cycles > dev->stats.nmi_cycles_max)
+		dev->stats.nmi_cycles_max = cycles;
+	dev->stats.nmi_hist[bucket]++;
+}
+
+static inline void ibs_update_high_water(struct ibs_dev *dev)
+{
+	u64 entries = ibs_buffer_entries(dev);
+
+	if (entries > dev->stats.high_water)
+		dev->stats.high_water = entries;
+}
+
 /**
  * lfsr_random - 16-bit Linear Feedback Shift Register (LFSR)
  *
@@ -100,6 +160,8 @@ static inline void enable_ibs_fetch(const u64 fetch_ctl)
 
 /**
  * collect_op_data - fill fields of ibs_op specific to op flavor
+ * @dev:	op device that took the sample
+ * @sample:	entry to fill
  */
 static inline void collect_op_data(struct ibs_dev *dev, struct ibs_op *sample)
 {
@@ -121,6 +183,8 @@ static inline void collect_op_data(struct ibs_dev *dev, struct ibs_op *sample)
 
 /**
  * collect_fetch_data - fill fields of ibs_fetch specific to fetch flavor
+ * @dev:	fetch device that took the sample
+ * @sample:	entry to fill
  */
 static inline void collect_fetch_data(struct ibs_dev *dev, struct ibs_fetch *sample)
 {
@@ -158,6 +222,316 @@ static inline void collect_fetch_data(struct ibs_dev *dev, struct ibs_fetch *sam
 		sample->kern_mode = !user_mode(regs); \
 	} while (0)
 
+/**
+ * collect_msr_field - read an MSR into the next packed slot if it is wanted
+ * @fields:	sample_fields of the device
+ * @bit:	field that the MSR fills
+ * @msr:	MSR to read
+ * @slot:	next free 64-bit slot of the entry, advanced past the field
+ */
+#define collect_msr_field(fields, bit, msr, slot) \
+	do { \
+		if ((fields) & (bit)) { \
+			rdmsrl((msr), *(slot)); \
+			(slot)++; \
+		} \
+	} while (0)
+
+/**
+ * collect_common_fields - packed version of collect_common_data
+ * @fields:	sample_fields of the device
+ * @slot:	first free 64-bit slot of the entry
+ * @regs:	registers of the interrupted context
+ */
+static inline void collect_common_fields(u64 fields, u64 *slot,
+		struct pt_regs *regs)
+{
+	int *narrow;
+
+	if (fields & IBS_FIELD_TSC) {
+		AMD_IBS_RDTSC(*slot);
+		slot++;
+	}
+	if (fields & IBS_FIELD_CR3) {
+		asm ("movq %%cr3, %%rax\n\t"
+		     "movq %%rax, %0"
+		     : "=m"(*slot)
+		     : /* no input */
+		     : "%rax"
+		);
+		slot++;
+	}
+
+	narrow = (int *)slot;
+	if (fields & IBS_FIELD_TID)
+		*narrow++ = current->pid;
+	if (fields & IBS_FIELD_PID)
+		*narrow++ = current->tgid;
+	if (fields & IBS_FIELD_CPU)
+		*narrow++ = smp_processor_id();
+	if (fields & IBS_FIELD_KERN_MODE)
+		*narrow++ = !user_mode(regs);
+}
+
+/**
+ * collect_op_fields - fill a packed op entry with the fields in sample_fields
+ * @dev:	op device that took the sample
+ * @slot:	first 64-bit slot of the entry
+ * @op_ctl:	IbsOpCtl as read by the handler
+ * @regs:	registers of the interrupted context
+ *
+ * Registers whose fields were not selected are never read.
+ */
+static inline void collect_op_fields(struct ibs_dev *dev, u64 *slot,
+		u64 op_ctl, struct pt_regs *regs)
+{
+	u64 fields = dev->sample_fields;
+
+	if (fields & IBS_OP_FIELD_CTL)
+		*slot++ = op_ctl;
+	collect_msr_field(fields, IBS_OP_FIELD_RIP, MSR_IBS_OP_RIP, slot);
+	collect_msr_field(fields, IBS_OP_FIELD_DATA, MSR_IBS_OP_DATA, slot);
+	collect_msr_field(fields, IBS_OP_FIELD_DATA2, MSR_IBS_OP_DATA2, slot);
+	collect_msr_field(fields, IBS_OP_FIELD_DATA3, MSR_IBS_OP_DATA3, slot);
+	if (fields & IBS_OP_FIELD_DATA4) {
+		if (dev->ibs_op_data4_supported)
+			rdmsrl(MSR_IBS_OP_DATA4, *slot);
+		else
+			*slot = 0ULL;
+		slot++;
+	}
+	collect_msr_field(fields, IBS_OP_FIELD_DC_LIN_AD, MSR_IBS_DC_LIN_AD,
+			slot);
+	collect_msr_field(fields, IBS_OP_FIELD_DC_PHYS_AD, MSR_IBS_DC_PHYS_AD,
+			slot);
+	if (fields & IBS_OP_FIELD_BR_TARGET) {
+		if (dev->ibs_brn_trgt_supported)
+			rdmsrl(MSR_IBS_BR_TARGET, *slot);
+		else
+			*slot = 0ULL;
+		slot++;
+	}
+	collect_common_fields(fields, slot, regs);
+}
+
+/**
+ * collect_fetch_fields - fill a packed fetch entry with the fields in
+ * sample_fields
+ * @dev:	fetch device that took the sample
+ * @slot:	first 64-bit slot of the entry
+ * @regs:	registers of the interrupted context
+ */
+static inline void collect_fetch_fields(struct ibs_dev *dev, u64 *slot,
+		struct pt_regs *regs)
+{
+	u64 fields = dev->sample_fields;
+
+	collect_msr_field(fields, IBS_FETCH_FIELD_CTL, MSR_IBS_FETCH_CTL, slot);
+	if (fields & IBS_FETCH_FIELD_CTL_EXTD) {
+		if (dev->ibs_fetch_ctl_extd_supported)
+			rdmsrl(MSR_IBS_EXTD_CTL, *slot);
+		else
+			*slot = 0ULL;
+		slot++;
+	}
+	collect_msr_field(fields, IBS_FETCH_FIELD_LIN_AD, MSR_IBS_FETCH_LIN_AD,
+			slot);
+	collect_msr_field(fields, IBS_FETCH_FIELD_PHYS_AD,
+			MSR_IBS_FETCH_PHYS_AD, slot);
+	collect_common_fields(fields, slot, regs);
+}
+
+/**
+ * ibs_sample_filtered - check the interrupted context against the filters
+ * @dev:	device that took the sample
+ * @regs:	registers of the interrupted context
+ *
+ * This runs before a buffer slot is taken, so dropped samples never cost
+ * buffer space or reader bandwidth.
+ */
+static inline int ibs_sample_filtered(struct ibs_dev *dev,
+		struct pt_regs *regs)
+{
+	int mode = atomic_read(&dev->filter_mode);
+	unsigned long filter_cr3 = atomic_long_read(&dev->filter_cr3);
+
+	if (mode == IBS_FILTER_MODE_USER && !user_mode(regs))
+		return 1;
+	if (mode == IBS_FILTER_MODE_KERNEL && user_mode(regs))
+		return 1;
+
+	if (filter_cr3) {
+		unsigned long cr3;
+		asm ("movq %%cr3, %0" : "=r"(cr3));
+		if (cr3 != filter_cr3)
+			return 1;
+	}
+
+	return !ibs_task_targeted(dev, current);
+}
+
+/**
+ * ibs_ring_full - check whether the slot at wr may not be filled
+ * @dev:	device that owns the buffer
+ * @new_wr:	write index once the slot is filled
+ *
+ * In overwrite mode a full buffer gives up its oldest entry instead of the
+ * new sample. A frozen buffer is left alone entirely.
+ */
+static inline int ibs_ring_full(struct ibs_dev *dev, unsigned int new_wr)
+{
+	if (unlikely(atomic_read(&dev->frozen)))
+		return 1;
+	if (new_wr != atomic_long_read(&dev->ring->rd))
+		return 0;
+	if (dev->ring_mode == IBS_RING_MODE_OVERWRITE) {
+		atomic_long_set(&dev->ring->rd, (new_wr + 1) % dev->capacity);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * ibs_record_reserve - make room for one record in a combined ring
+ * @ring:	op device of the combined ring
+ * @type:	IBS_RECORD_OP or IBS_RECORD_FETCH
+ * @size:	bytes of sample data, not counting the record header
+ * @new_wr:	(output) write index once the record is in
+ *
+ * A record that would run past the end of the buffer starts over at the
+ * beginning, after a pad record that fills out the end. Both go in together,
+ * so readers never find a pad at wr. In overwrite mode, whole records at rd
+ * give way, and a size there that cannot be right (user space may scribble
+ * on a mapped ring) gives up everything that is buffered.
+ */
+static inline void *ibs_record_reserve(struct ibs_dev *ring, u32 type,
+		u64 size, unsigned int *new_wr)
+{
+	u64 cap = ring->capacity;
+	u64 wr = atomic_long_read(&ring->wr);
+	u64 words = (sizeof(struct ibs_record_header) + size) / IBS_RECORD_ALIGN;
+	u64 pad = (wr + words > cap) ? cap - wr : 0;
+	struct ibs_record_header *rec;
+
+	if (unlikely(atomic_read(&ring->frozen)))
+		return NULL;
+	while (ibs_buffer_entries(ring) + pad + words >= cap) {
+		u64 rd = atomic_long_read(&ring->ring->rd);
+		u64 skip;
+
+		if (ring->ring_mode != IBS_RING_MODE_OVERWRITE ||
+				pad + words >= cap)
+			return NULL;
+		rec = (struct ibs_record_header *)
+			(ring->buf + rd * IBS_RECORD_ALIGN);
+		skip = rec->size / IBS_RECORD_ALIGN;
+		if (skip == 0 || rec->size % IBS_RECORD_ALIGN || rd + skip > cap)
+			rd = wr;
+		else
+			rd = (rd + skip) % cap;
+		atomic_long_set(&ring->ring->rd, rd);
+	}
+
+	if (pad) {
+		rec = (struct ibs_record_header *)
+			(ring->buf + wr * IBS_RECORD_ALIGN);
+		rec->type = IBS_RECORD_PAD;
+		rec->size = pad * IBS_RECORD_ALIGN;
+		wr = 0;
+	}
+	rec = (struct ibs_record_header *)(ring->buf + wr * IBS_RECORD_ALIGN);
+	rec->type = type;
+	rec->size = words * IBS_RECORD_ALIGN;
+	*new_wr = (wr + words) % cap;
+	return rec + 1;
+}
+
+/**
+ * ibs_ring_reserve - find where the next sample of a device goes
+ * @ring:	ibs_ring_dev() of the device that took the sample
+ * @type:	IBS_RECORD_OP or IBS_RECORD_FETCH, for a combined ring
+ * @size:	bytes of sample data
+ * @new_wr:	(output) write index once the sample is in
+ *
+ * Returns: where to collect the sample, or NULL if it is lost
+ */
+static inline void *ibs_ring_reserve(struct ibs_dev *ring, u32 type,
+		u64 size, unsigned int *new_wr)
+{
+	unsigned int old_wr;
+
+	if (ibs_ring_combined(ring))
+		return ibs_record_reserve(ring, type, size, new_wr);
+
+	old_wr = atomic_long_read(&ring->wr);
+	*new_wr = (old_wr + 1) % ring->capacity;
+	if (ibs_ring_full(ring, *new_wr))
+		return NULL;
+	return ring->buf + (old_wr * ring->entry_size);
+}
+
+/**
+ * ibs_ring_publish - hand a collected sample over to the readers
+ * @ring:	ibs_ring_dev() of the device that took the sample
+ * @new_wr:	write index returned by ibs_ring_reserve()
+ */
+static inline void ibs_ring_publish(struct ibs_dev *ring, unsigned int new_wr)
+{
+	/* Readers, including ones that mmap() the buffer, must see the
+	 * sample before they see the new write index */
+	smp_wmb();
+	atomic_long_set(&ring->wr, new_wr);
+	atomic_long_set(&ring->ring->wr, new_wr);
+
+	ibs_update_high_water(ring);
+	ibs_wake_up(ring);
+}
+
+/**
+ * ibs_hist_update - add this op sample to the active histogram table
+ * @dev:	op device in histogram mode
+ *
+ * Only the registers that make up the key and the counters are read. Slots
+ * are claimed by linear probing from the key's hash; a sample that finds
+ * neither its key nor a free slot within IBS_HIST_MAX_PROBES is lost.
+ */
+static inline void ibs_hist_update(struct ibs_dev *dev)
+{
+	struct ibs_hist_entry *table;
+	u64 mask = dev->hist_slots - 1;
+	u64 rip, page = 0, data3, idx;
+	int i;
+
+	/* Pairs with the smp_wmb() in setup_ibs_hist() */
+	smp_rmb();
+	table = dev->hist[dev->hist_active];
+
+	rdmsrl(MSR_IBS_OP_RIP, rip);
+	rdmsrl(MSR_IBS_OP_DATA3, data3);
+	if (dev->hist_key_page && (data3 & IBS_DC_LIN_ADDR_VALID)) {
+		rdmsrl(MSR_IBS_DC_LIN_AD, page);
+		page &= PAGE_MASK;
+	}
+
+	idx = hash_64(rip ^ page, dev->hist_bits);
+	for (i = 0; i < IBS_HIST_MAX_PROBES; i++) {
+		struct ibs_hist_entry *e = &table[(idx + i) & mask];
+		if (e->count == 0) {
+			e->rip = rip;
+			e->page = page;
+		} else if (e->rip != rip || e->page != page) {
+			continue;
+		}
+		e->count++;
+		if (data3 & IBS_DC_MISS) {
+			e->dc_miss++;
+			e->dc_miss_lat += (data3 & IBS_DC_MISS_LAT) >> 32;
+		}
+		return;
+	}
+	atomic_long_inc(&dev->ring->lost);
+}
+
 static inline void handle_ibs_op_event(struct pt_regs *regs)
 {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)
@@ -165,9 +539,9 @@ static inline void handle_ibs_op_event(struct pt_regs *regs)
 #else
 	struct ibs_dev *dev = per_cpu_ptr(pcpu_op_dev, smp_processor_id());
 #endif
-	unsigned int old_wr = atomic_long_read(&dev->wr);
-	unsigned int new_wr = (old_wr + 1) % dev->capacity;
-	struct ibs_op *sample;
+	cycles_t start = get_cycles();
+	unsigned int new_wr;
+	void *entry;
 	u64 tmp;
 
 	/* See do_fam10h_workaround_420() definition for details */
@@ -176,39 +550,58 @@ static inline void handle_ibs_op_event(struct pt_regs *regs)
 		return;
 
 	/* See disable_ibs_op() definition for more detals about why we
-	 * potentially want to skip this IBS op sample. */
+	 * potentially want to skip this IBS op sample. The sched gate stops
+	 * IBS the same way, so this also keeps such an NMI from touching the
+	 * gate_cnt saved at switch-out. */
 	if (!(tmp & IBS_OP_MAX_CNT))
 		return;
 
-	if (new_wr == atomic_long_read(&dev->rd)) {	/* Full buffer */
-		atomic_long_inc(&dev->lost);
+	if (ibs_sample_filtered(dev, regs)) {
+		atomic_long_inc(&dev->filtered);
 		goto out;
 	}
-	sample = (struct ibs_op *)(dev->buf + (old_wr * dev->entry_size));
 
-	collect_op_data(dev, sample);
-	
-	/* Logically this is part of collect_common_data. However we can save
-	 * an MSR access beacause we already read the MSR_IBS_OP_CTL */
-	sample->op_ctl = tmp;
-	collect_common_data(sample);
+	if (dev->hist_slots) {
+		ibs_hist_update(dev);
+		goto out;
+	}
+
+	entry = ibs_ring_reserve(dev, IBS_RECORD_OP, dev->sample_size,
+			&new_wr);
+	if (!entry) {
+		atomic_long_inc(&dev->ring->lost);
+		goto out;
+	}
 
-	atomic_long_set(&dev->wr, new_wr);
-	atomic_long_inc(&dev->entries);
+	if (likely(dev->sample_fields == IBS_OP_FIELDS_ALL)) {
+		struct ibs_op *sample = entry;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
-	irq_work_queue(&dev->bottom_half);
-#else
-	/* Add more work directly into the NMI handler, but in older kernels, we
-	 * didn't have access to IRQ work queues. */
-	wake_up_queues(dev);
-#endif
+		collect_op_data(dev, sample);
+
+		/* Logically this is part of collect_common_data. However we
+		 * can save an MSR access beacause we already read the
+		 * MSR_IBS_OP_CTL */
+		sample->op_ctl = tmp;
+		collect_common_data(sample);
+	} else {
+		collect_op_fields(dev, entry, tmp, regs);
+	}
+	ibs_ring_publish(dev, new_wr);
 
 out:
-	tmp = randomize_op_ctl(dev->ctl);
-	if (dev->workaround_fam15h_err_718)
-		wrmsrl(MSR_IBS_OP_DATA3, 0ULL);
-	enable_ibs_op(tmp);
+	/* SET_MAX_CNT may change ctl under us */
+	tmp = randomize_op_ctl(READ_ONCE(dev->ctl));
+	if (ibs_gate_closed(dev)) {
+		/* The target was switched out after this sample was taken;
+		 * the next one starts over once a target runs again */
+		dev->gate_cnt = tmp & ibs_op_cur_cnt_bits(dev);
+		wrmsrl(MSR_IBS_OP_CTL, 0ULL);
+	} else {
+		if (dev->workaround_fam15h_err_718)
+			wrmsrl(MSR_IBS_OP_DATA3, 0ULL);
+		enable_ibs_op(tmp);
+	}
+	ibs_account_nmi(dev, get_cycles() - start);
 }
 
 static inline void handle_ibs_fetch_event(struct pt_regs *regs)
@@ -218,32 +611,45 @@ static inline void handle_ibs_fetch_event(struct pt_regs *regs)
 #else
 	struct ibs_dev *dev = per_cpu_ptr(pcpu_fetch_dev, smp_processor_id());
 #endif
-	unsigned int old_wr = atomic_long_read(&dev->wr);
-	unsigned int new_wr = (old_wr + 1) % dev->capacity;
-	struct ibs_fetch *sample;
-
-	if (new_wr == atomic_long_read(&dev->rd)) {	/* Full buffer */
-		atomic_long_inc(&dev->lost);
+	/* A combined ring's fetch samples go into the op device's buffer */
+	struct ibs_dev *ring = ibs_ring_dev(dev);
+	cycles_t start = get_cycles();
+	unsigned int new_wr;
+	void *entry;
+	u64 ctl;
+
+	if (ibs_sample_filtered(dev, regs)) {
+		atomic_long_inc(&dev->filtered);
 		goto out;
 	}
-	sample = (struct ibs_fetch *)(dev->buf + (old_wr * dev->entry_size));
 
-	collect_fetch_data(dev, sample);
-	collect_common_data(sample);
+	entry = ibs_ring_reserve(ring, IBS_RECORD_FETCH, dev->sample_size,
+			&new_wr);
+	if (!entry) {
+		atomic_long_inc(&ring->ring->lost);
+		goto out;
+	}
 
-	atomic_long_set(&dev->wr, new_wr);
-	atomic_long_inc(&dev->entries);
+	if (likely(dev->sample_fields == IBS_FETCH_FIELDS_ALL)) {
+		struct ibs_fetch *sample = entry;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
-	irq_work_queue(&dev->bottom_half);
-#else
-	/* Add more work directly into the NMI handler, but in older kernels, we
-	 * didn't have access to IRQ work queues. */
-	wake_up_queues(dev);
-#endif
+		collect_fetch_data(dev, sample);
+		collect_common_data(sample);
+	} else {
+		collect_fetch_fields(dev, entry, regs);
+	}
+	ibs_ring_publish(ring, new_wr);
 
 out:
-	enable_ibs_fetch(dev->ctl);
+	/* SET_MAX_CNT may change ctl under us */
+	ctl = READ_ONCE(dev->ctl);
+	if (ibs_gate_closed(dev)) {
+		dev->gate_cnt = ctl & IBS_FETCH_CNT;
+		wrmsrl(MSR_IBS_FETCH_CTL, 0ULL);
+	} else {
+		enable_ibs_fetch(ctl);
+	}
+	ibs_account_nmi(dev, get_cycles() - start);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0)
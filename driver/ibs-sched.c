@@ -0,0 +1,293 @@
+/*
+ * Linux kernel driver for the AMD Research IBS Toolkit
+ *
+ * Copyright (C) 2015-2018 Advanced Micro Devices, Inc.
+ *
+ * This driver is available under the Linux kernel's version of the GPLv2.
+ * See driver/LICENSE for more licensing details.
+ *
+ * This file contains the scheduler gating code. A gated device hooks the
+ * sched_switch tracepoint and only lets IBS count while a target task runs
+ * on its CPU, so that other tasks take no IBS interrupts at all.
+ * See "IBS scheduler gating" in ibs-uapi.h.
+ */
+#include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/smp.h>
+#include <linux/string.h>
+#include <linux/version.h>
+
+#include "ibs-msr-index.h"
+#include "ibs-sched.h"
+#include "ibs-structs.h"
+
+/* These depend on the IBS_HAVE_* tests in ibs-structs.h */
+#ifdef IBS_HAVE_SCHED_GATE
+#include <linux/tracepoint.h>
+#endif
+#ifdef IBS_HAVE_CGROUP_FILTER
+#include <linux/cgroup.h>
+#include <linux/err.h>
+#endif
+
+extern void *pcpu_op_dev;
+extern void *pcpu_fetch_dev;
+
+#ifdef IBS_HAVE_SCHED_GATE
+/* Opening and closing the gate run on the device's CPU with interrupts off,
+ * from the sched_switch probe or an IPI. The NMI handler may still come in
+ * between any two lines, which is why gate_open changes before the MSR when
+ * opening and before reading the MSR when closing. */
+static void ibs_gate_open_op(struct ibs_dev *dev)
+{
+	u64 cur = ibs_op_cur_cnt_bits(dev);
+
+	dev->gate_open = 1;
+	barrier();
+	if (dev->workaround_fam15h_err_718)
+		wrmsrl(MSR_IBS_OP_DATA3, 0ULL);
+	wrmsrl(MSR_IBS_OP_CTL, (READ_ONCE(dev->ctl) & ~cur) | dev->gate_cnt);
+}
+
+/* A sample may already be waiting for its NMI, which will then find the
+ * gate closed and leave IBS off. Otherwise the count is saved and IBS is
+ * stopped the way disable_ibs_op() does it. An NMI that comes in while
+ * IbsOpVal dangles finds no max count and leaves gate_cnt alone. */
+static void ibs_gate_close_op(struct ibs_dev *dev)
+{
+	u64 ctl;
+
+	dev->gate_open = 0;
+	barrier();
+	rdmsrl(MSR_IBS_OP_CTL, ctl);
+	if (!(ctl & IBS_OP_EN) || (ctl & IBS_OP_VAL))
+		return;
+	dev->gate_cnt = ctl & ibs_op_cur_cnt_bits(dev);
+	if (dev->workaround_fam10h_err_420)	/* see ibs_session_disable_local() */
+		wrmsrl(MSR_IBS_OP_CTL,
+			(ctl | IBS_OP_VAL) & ~IBS_OP_MAX_CNT_OLD);
+	wrmsrl(MSR_IBS_OP_CTL, IBS_OP_VAL);
+	udelay(1);
+	wrmsrl(MSR_IBS_OP_CTL, 0ULL);
+}
+
+static void ibs_gate_open_fetch(struct ibs_dev *dev)
+{
+	dev->gate_open = 1;
+	barrier();
+	/* IbsFetchVal must be reset first, as in enable_ibs_fetch() */
+	wrmsrl(MSR_IBS_FETCH_CTL, 0ULL);
+	wrmsrl(MSR_IBS_FETCH_CTL,
+		(READ_ONCE(dev->ctl) & ~IBS_FETCH_CNT) | dev->gate_cnt);
+}
+
+static void ibs_gate_close_fetch(struct ibs_dev *dev)
+{
+	u64 ctl;
+
+	dev->gate_open = 0;
+	barrier();
+	rdmsrl(MSR_IBS_FETCH_CTL, ctl);
+	if (!(ctl & IBS_FETCH_EN) || (ctl & IBS_FETCH_VAL))
+		return;
+	dev->gate_cnt = ctl & IBS_FETCH_CNT;
+	wrmsrl(MSR_IBS_FETCH_CTL, 0ULL);
+}
+
+static void ibs_gate_update(struct ibs_dev *dev, struct task_struct *next)
+{
+	int open = ibs_task_targeted(dev, next);
+
+	if (open == dev->gate_open)
+		return;
+
+	if (dev->flavor == IBS_OP) {
+		if (open)
+			ibs_gate_open_op(dev);
+		else
+			ibs_gate_close_op(dev);
+	} else {	/* dev->flavor == IBS_FETCH */
+		if (open)
+			ibs_gate_open_fetch(dev);
+		else
+			ibs_gate_close_fetch(dev);
+	}
+}
+
+/* Runs on the switching CPU, with its runqueue locked and interrupts off,
+ * just before next replaces prev */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+static void ibs_sched_switch(void *data, bool preempt,
+		struct task_struct *prev, struct task_struct *next,
+		unsigned int prev_state)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+static void ibs_sched_switch(void *data, bool preempt,
+		struct task_struct *prev, struct task_struct *next)
+#else
+static void ibs_sched_switch(void *data, struct task_struct *prev,
+		struct task_struct *next)
+#endif
+{
+	struct ibs_dev *dev = this_cpu_ptr(pcpu_op_dev);
+
+	if (dev->gate_on)
+		ibs_gate_update(dev, next);
+	dev = this_cpu_ptr(pcpu_fetch_dev);
+	if (dev->gate_on)
+		ibs_gate_update(dev, next);
+}
+
+/* The probe stays registered for as long as any device is gated */
+static DEFINE_MUTEX(ibs_gate_lock);
+static struct tracepoint *ibs_sched_switch_tp;
+static int ibs_gate_users;
+
+static void ibs_find_sched_switch(struct tracepoint *tp, void *priv)
+{
+	if (!strcmp(tp->name, "sched_switch"))
+		ibs_sched_switch_tp = tp;
+}
+
+static int ibs_gate_get(void)
+{
+	int err = 0;
+
+	mutex_lock(&ibs_gate_lock);
+	if (ibs_gate_users == 0) {
+		/* The tracepoint itself is not exported to modules */
+		if (ibs_sched_switch_tp == NULL)
+			for_each_kernel_tracepoint(ibs_find_sched_switch, NULL);
+		if (ibs_sched_switch_tp == NULL)
+			err = -ENOTTY;
+		else
+			err = tracepoint_probe_register(ibs_sched_switch_tp,
+					ibs_sched_switch, NULL);
+	}
+	if (!err)
+		ibs_gate_users++;
+	mutex_unlock(&ibs_gate_lock);
+	return err;
+}
+
+static void ibs_gate_put(void)
+{
+	mutex_lock(&ibs_gate_lock);
+	if (--ibs_gate_users == 0) {
+		tracepoint_probe_unregister(ibs_sched_switch_tp,
+				ibs_sched_switch, NULL);
+		/* No probe may still be running once the module can unload */
+		tracepoint_synchronize_unregister();
+	}
+	mutex_unlock(&ibs_gate_lock);
+}
+
+int ibs_sched_gate_set(struct ibs_dev *dev, int on)
+{
+	int err;
+
+	if (on == dev->gated)
+		return 0;
+	if (on) {
+		err = ibs_gate_get();
+		if (err)
+			return err;
+	} else {
+		ibs_gate_put();
+	}
+	dev->gated = on;
+	return 0;
+}
+
+void ibs_sched_gate_start(struct ibs_dev *dev)
+{
+	/* Start the first target from the count set with SET_CUR_CNT */
+	if (dev->flavor == IBS_OP)
+		dev->gate_cnt = dev->ctl & ibs_op_cur_cnt_bits(dev);
+	else	/* dev->flavor == IBS_FETCH */
+		dev->gate_cnt = dev->ctl & IBS_FETCH_CNT;
+	dev->gate_open = 0;
+	dev->gate_on = 1;
+	/* That may be whatever this IPI interrupted */
+	ibs_gate_update(dev, current);
+}
+
+void ibs_sched_gate_stop(struct ibs_dev *dev)
+{
+	dev->gate_on = 0;
+	dev->gate_open = 0;
+}
+
+static void ibs_sched_gate_start_local(void *info)
+{
+	ibs_sched_gate_start(info);
+}
+
+static void ibs_sched_gate_stop_local(void *info)
+{
+	ibs_sched_gate_stop(info);
+}
+
+void ibs_sched_gate_start_on_cpu(struct ibs_dev *dev)
+{
+	smp_call_function_single(dev->cpu, ibs_sched_gate_start_local, dev, 1);
+}
+
+/* Once this returns, no probe on the device's CPU can re-arm IBS: the probe
+ * runs with interrupts off, so it cannot be in the middle of that when the
+ * IPI is handled. */
+void ibs_sched_gate_stop_on_cpu(struct ibs_dev *dev)
+{
+	smp_call_function_single(dev->cpu, ibs_sched_gate_stop_local, dev, 1);
+}
+#else /* No sched_switch tracepoint for modules */
+int ibs_sched_gate_set(struct ibs_dev *dev, int on)
+{
+	return on ? -ENOTTY : 0;
+}
+
+/* dev->gated is never set, so these are never called */
+void ibs_sched_gate_start(struct ibs_dev *dev)
+{
+}
+
+void ibs_sched_gate_stop(struct ibs_dev *dev)
+{
+}
+
+void ibs_sched_gate_start_on_cpu(struct ibs_dev *dev)
+{
+}
+
+void ibs_sched_gate_stop_on_cpu(struct ibs_dev *dev)
+{
+}
+#endif
+
+#ifdef IBS_HAVE_CGROUP_FILTER
+int ibs_set_filter_cgroup(struct ibs_dev *dev, int fd)
+{
+	struct cgroup *cgrp = NULL, *old;
+
+	if (fd >= 0) {
+		cgrp = cgroup_get_from_fd(fd);
+		if (IS_ERR(cgrp))
+			return PTR_ERR(cgrp);
+	}
+	old = rcu_dereference_protected(dev->filter_cgrp,
+			lockdep_is_held(&dev->ctl_lock));
+	rcu_assign_pointer(dev->filter_cgrp, cgrp);
+	if (old) {
+		/* The NMI handler and the probe may still be looking at it */
+		synchronize_rcu();
+		cgroup_put(old);
+	}
+	return 0;
+}
+#else
+int ibs_set_filter_cgroup(struct ibs_dev *dev, int fd)
+{
+	return fd < 0 ? 0 : -ENOTTY;
+}
+#endif
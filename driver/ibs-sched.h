@@ -0,0 +1,101 @@
+/*
+ * Linux kernel driver for the AMD Research IBS Toolkit
+ *
+ * Copyright (C) 2015-2018 Advanced Micro Devices, Inc.
+ *
+ * This driver is available under the Linux kernel's version of the GPLv2.
+ * See driver/LICENSE for more licensing details.
+ *
+ * This file contains the scheduler gating code, which arms IBS on a CPU only
+ * while a target task runs there, and the task tests it shares with the
+ * sample filters.
+ */
+#ifndef IBS_SCHED_H
+#define IBS_SCHED_H
+
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+
+#include "ibs-msr-index.h"
+#include "ibs-structs.h"
+
+#ifdef IBS_HAVE_CGROUP_FILTER
+#include <linux/cgroup.h>
+#endif
+
+/* Turn gating on or off. Called with ctl_lock held while IBS is disabled;
+ * returns -ENOTTY on kernels without a sched_switch tracepoint to hook. */
+int ibs_sched_gate_set(struct ibs_dev *dev, int on);
+
+/* Start or stop following context switches on a gated device. The _on_cpu
+ * versions send an IPI to the device's CPU; the others must run there with
+ * interrupts off. Starting arms IBS at once if a target is running; the
+ * caller stops the hardware itself after stopping the gate. */
+void ibs_sched_gate_start(struct ibs_dev *dev);
+void ibs_sched_gate_stop(struct ibs_dev *dev);
+void ibs_sched_gate_start_on_cpu(struct ibs_dev *dev);
+void ibs_sched_gate_stop_on_cpu(struct ibs_dev *dev);
+
+/* SET_FILTER_CGROUP; a negative fd clears the filter */
+int ibs_set_filter_cgroup(struct ibs_dev *dev, int fd);
+
+/* The part of the current count that a gated op device saves and restores */
+static inline u64 ibs_op_cur_cnt_bits(struct ibs_dev *dev)
+{
+	return dev->ibs_op_cnt_ext_supported ? IBS_OP_CUR_CNT :
+		IBS_OP_CUR_CNT_OLD;
+}
+
+/* The NMI handler must leave IBS off, rather than re-arm it, when the target
+ * task it was counting for has already been switched out */
+static inline int ibs_gate_closed(struct ibs_dev *dev)
+{
+	return dev->gate_on && !dev->gate_open;
+}
+
+static inline int ibs_task_in_filter_cgroup(struct ibs_dev *dev,
+		struct task_struct *task)
+{
+#ifdef IBS_HAVE_CGROUP_FILTER
+	struct cgroup *cgrp;
+	int in = 1;
+
+	/* Pairs with the synchronize_rcu() in ibs_set_filter_cgroup() */
+	rcu_read_lock();
+	cgrp = rcu_dereference(dev->filter_cgrp);
+	if (cgrp)
+		in = task_under_cgroup_hierarchy(task, cgrp);
+	rcu_read_unlock();
+	return in;
+#else
+	return 1;
+#endif
+}
+
+/**
+ * ibs_task_targeted - check a task against the tgid and cgroup filters
+ * @dev:	device whose filters apply
+ * @task:	task to check
+ *
+ * Used for samples by the NMI handler and for gating by the sched_switch
+ * probe, so both agree on which tasks are targets.
+ */
+static inline int ibs_task_targeted(struct ibs_dev *dev,
+		struct task_struct *task)
+{
+	int num_tgids = atomic_read(&dev->filter_num_tgids);
+	int i;
+
+	if (!ibs_task_in_filter_cgroup(dev, task))
+		return 0;
+	if (!num_tgids)
+		return 1;
+	/* Pairs with the smp_wmb() in ADD_FILTER_TGID */
+	smp_rmb();
+	for (i = 0; i < num_tgids; i++)
+		if (dev->filter_tgids[i] == task->tgid)
+			return 1;
+	return 0;
+}
+
+#endif	/* IBS_SCHED_H */
@@ -13,6 +13,7 @@
 #ifndef IBS_STRUCTS_H
 #define IBS_STRUCTS_H
 
+#include <linux/compiler.h>
 #include <linux/types.h>
 #include <linux/version.h>
 #include <linux/wait.h>
@@ -21,6 +22,15 @@
 #include <linux/irq_work.h>
 #endif
 
+#include "ibs-uapi.h"
+
+/* dev->ctl changes under a running NMI handler (see SET_MAX_CNT). Kernels
+ * before 3.19 only have ACCESS_ONCE() for that. */
+#ifndef READ_ONCE
+#define READ_ONCE(x)		ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val)	(ACCESS_ONCE(x) = (val))
+#endif
+
 struct ibs_op {
 	__u64	op_ctl;
 	__u64	op_rip;
@@ -52,17 +62,101 @@ struct ibs_fetch {
 	int	kern_mode;
 };
 
+/*
+ * Control page at the start of every sample buffer. User space may mmap() the
+ * buffer and consume samples in place by advancing rd itself, so the layout
+ * must match ibs_ring_header_t in ibs-uapi.h.
+ */
+struct ibs_ring_header {
+	atomic_long_t wr;	/* published copy of the write index */
+	atomic_long_t rd;	/* read index, advanced by the reader */
+	atomic_long_t lost;	/* dropped samples counter */
+	__u64	entry_size;	/* size of each entry in bytes */
+	__u64	capacity;	/* buffer capacity in entries */
+	__u64	data_offset;	/* offset of the first entry from this header */
+};
+
+/*
+ * Starts every batch read from /dev/ibs/all; must match ibs_batch_header_t in
+ * ibs-uapi.h.
+ */
+struct ibs_batch_header {
+	__u32	cpu;
+	__u32	flavor;		/* IBS_BATCH_OP or IBS_BATCH_FETCH */
+	__u32	entry_size;
+	__u32	num_entries;
+	__u64	lost;
+};
+
+/* Starts every record of a combined ring; must match ibs_record_header_t in
+ * ibs-uapi.h. size counts the header too. */
+struct ibs_record_header {
+	__u32	type;		/* IBS_RECORD_* */
+	__u32	size;
+};
+
+/* One slot of an op histogram; must match ibs_hist_entry_t in ibs-uapi.h. */
+struct ibs_hist_entry {
+	__u64	rip;
+	__u64	page;
+	__u64	count;		/* 0 marks a free slot */
+	__u64	dc_miss;
+	__u64	dc_miss_lat;
+};
+
+/* What sampling costs on one device; must match ibs_stats_t in ibs-uapi.h.
+ * Everything but read_bytes is only written by the NMI handler. */
+struct ibs_stats {
+	__u64	nmis;
+	__u64	nmi_cycles;
+	__u64	nmi_cycles_max;
+	__u64	nmi_hist[IBS_STATS_HIST_BUCKETS];	/* log2 of cycles */
+	__u64	wakeups;
+	__u64	read_bytes;	/* written under read_lock */
+	__u64	high_water;
+};
+
+/* Argument of SESSION_CONFIG/SESSION_DISABLE; must match ibs_session_t in
+ * ibs-uapi.h. */
+struct ibs_session {
+	__u64	cpus;		/* user pointer to a CPU bitmap */
+	__u64	cpus_len;	/* bytes in that bitmap */
+	__u64	flags;		/* IBS_SESSION_* */
+	__u64	max_cnt;	/* each of these may be IBS_SESSION_KEEP */
+	__u64	buffer_size;
+	__u64	poll_size;
+	__u64	cnt_ctl;
+	__u64	rand_en;
+};
+
+/* Kernels that let a module follow context switches, and test tasks against
+ * a cgroup v2 directory handed over as a file descriptor */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0) && defined(CONFIG_TRACEPOINTS)
+#define IBS_HAVE_SCHED_GATE
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0) && defined(CONFIG_CGROUPS)
+#define IBS_HAVE_CGROUP_FILTER
+struct cgroup;
+#endif
+
 struct ibs_dev {
+	struct ibs_ring_header *ring;	/* control page, shared with users */
+	u64 ring_len;	/* bytes allocated at ring, control page included */
+	int ring_huge;	/* ring is one physically contiguous block */
 	char *buf;	/* buffer memory region */
 	u64 size;	/* size of buffer memory region in bytes */
-	u64 entry_size;	/* size of each entry in bytes */
+	u64 entry_size;	/* size of each entry in bytes, or IBS_RECORD_ALIGN */
 	u64 capacity;	/* buffer capacity in entries */
+	u64 sample_fields;	/* IBS_*FIELD* mask of what each entry holds */
+	u64 sample_size;	/* bytes of one sample with those fields */
 
+	/* The copy of wr in the control page can be scribbled on by user
+	 * space, so the NMI handler only ever trusts this one. */
 	atomic_long_t wr;	/* write index (0 <= wr < capacity) */
-	atomic_long_t rd;	/* read index */
-	atomic_long_t entries;	/* buffer occupancy in entries */
-	atomic_long_t lost;	/* dropped samples counter */
 	struct mutex read_lock;	/* read lock */
+	atomic_t mmapped;	/* live user mappings of buf, and /dev/ibs/all */
+	int ring_mode;		/* IBS_RING_MODE_*, set while IBS is disabled */
+	atomic_t frozen;	/* nonzero while a SNAPSHOT holds the buffer */
 
 	wait_queue_head_t readq;	/* wait queue for blocking read */
 	wait_queue_head_t pollq;	/* dedicated wait queue for polling */
@@ -70,10 +164,50 @@ struct ibs_dev {
 
 	u64 ctl;	/* copy of op/fetch ctl MSR to store control options */
 	struct mutex ctl_lock;	/* lock for device control options */
+	atomic_t enabled;	/* mirrors the EN bit of ctl, for lock-free readers */
+
+	/* Sample filters, see ibs-uapi.h. The NMI handler reads these without
+	 * taking ctl_lock, so they can change while IBS is enabled. */
+	pid_t filter_tgids[IBS_FILTER_MAX_TGIDS];
+	atomic_t filter_num_tgids;	/* 0 accepts any process */
+	atomic_long_t filter_cr3;	/* 0 accepts any address space */
+	atomic_t filter_mode;		/* IBS_FILTER_MODE_* */
+	atomic_long_t filtered;		/* samples dropped by the filters */
+#ifdef IBS_HAVE_CGROUP_FILTER
+	struct cgroup __rcu *filter_cgrp;	/* NULL accepts any cgroup */
+#endif
+
+	/* Scheduler gating, see ibs-uapi.h. gated changes under ctl_lock
+	 * while IBS is disabled; the rest is only touched on this device's
+	 * CPU, by the sched_switch probe, the NMI handler and IPIs. */
+	int gated;		/* SET_SCHED_GATE */
+	int gate_on;		/* IBS is enabled and following switches */
+	int gate_open;		/* IBS is armed for the running task */
+	u64 gate_cnt;		/* current count to resume from */
+
+	/* Histogram mode, see ibs-uapi.h. The NMI handler fills
+	 * hist[hist_active] while the reader drains the other table. */
+	struct ibs_hist_entry *hist[2];
+	u64 hist_slots;		/* slots per table, 0 when off */
+	int hist_bits;		/* log2 of hist_slots */
+	int hist_key_page;	/* key on the dc_lin_ad page as well */
+	int hist_active;	/* table the NMI handler is filling */
+
+	struct ibs_stats stats;	/* for GET_STATS, reset on open */
+
+	/* Combined ring, see ibs-uapi.h. On an op device, the fetch device of
+	 * the same CPU whose samples go into this buffer as well; on that
+	 * fetch device, the op device. NULL when not combined. Changes under
+	 * both ctl_locks, and on the fetch side only while it is disabled. */
+	struct ibs_dev *combined;
 
 	int cpu;		/* this device's cpu id */
 	int flavor;		/* IBS_FETCH or IBS_OP */
 	atomic_t in_use;	/* nonzero when device is open */
+	pid_t owner;		/* tgid that opened the device */
+	/* Nonzero while /dev/ibs/all reads this device and holds a count in
+	 * mmapped for it. Changes under ctl_lock. */
+	int all_held;
 
 	/* Information about what IBS stuff is supported on this CPU */
 	int ibs_fetch_supported;
@@ -9,46 +9,180 @@
  * These functions are useful across various files in the IBS driver, so they
  * are included in this general utilities file.
  */
+#include <linux/gfp.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/smp.h>
+#include <linux/string.h>
+#include <linux/topology.h>
+#include <linux/version.h>
 #include <linux/vmalloc.h>
 #include <asm/errno.h>
 
 #include "ibs-utils.h"
 
+static void ibs_nop(void *info)
+{
+}
+
+void sync_ibs_nmi(const int cpu)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
+	smp_call_function_single(cpu, ibs_nop, NULL, 1);
+#else
+	smp_call_function_single(cpu, ibs_nop, NULL, 1, 1);
+#endif
+}
+
 int reset_ibs_buffer(struct ibs_dev *dev)
 {
 	if (dev == NULL)
 		return -EACCES;
 	atomic_long_set(&dev->wr, 0);
-	atomic_long_set(&dev->rd, 0);
-	atomic_long_set(&dev->entries, 0);
-	atomic_long_set(&dev->lost, 0);
+	atomic_long_set(&dev->ring->wr, 0);
+	atomic_long_set(&dev->ring->rd, 0);
+	atomic_long_set(&dev->ring->lost, 0);
 	return 0;
 }
 
-int setup_ibs_buffer(struct ibs_dev *dev, u64 size)
+/*
+ * A huge ring is a single high-order allocation. The NMI handler then reaches
+ * it through the kernel's direct mapping, which is normally built from 2M/1G
+ * pages, instead of through 4K vmalloc mappings that would pollute the very
+ * TLBs that IBS is measuring. Such blocks are limited to the largest buddy
+ * allocation (usually 4 MB) and can fail on a fragmented system.
+ */
+static void *alloc_ibs_ring(int node, u64 len, int huge)
+{
+	void *ring = NULL;
+
+	if (huge) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,39)
+		ring = alloc_pages_exact_nid(node, len,
+				GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN);
+#endif
+	} else {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+		ring = vzalloc_node(len, node);
+#else
+		ring = vmalloc_node(len, node);
+		if (ring)
+			memset(ring, 0, len);
+#endif
+	}
+	return ring;
+}
+
+static void free_ibs_ring(void *ring, u64 len, int huge)
+{
+	if (ring == NULL)
+		return;
+	if (huge)
+		free_pages_exact(ring, len);
+	else
+		vfree(ring);
+}
+
+int setup_ibs_buffer(struct ibs_dev *dev, u64 size, int huge)
 {
 	void *tmp;
+	void *old;
+	u64 len, old_len;
+	int old_huge;
 	if (dev == NULL || size == 0)
 		return -EACCES;
 
-	tmp = vmalloc(size);
+	/* The control page and the samples are allocated as one region, on
+	 * the node of the CPU that fills it, so that ibs_mmap() can map all
+	 * of it. */
+	len = PAGE_ALIGN(IBS_RING_DATA_OFFSET + size);
+	tmp = alloc_ibs_ring(cpu_to_node(dev->cpu), len, huge);
 	if (!tmp)
 		return -ENOMEM;
 
-	dev->buf = tmp;
+	/* Only drop the old buffer once the new one exists, so that a failed
+	 * resize leaves the device usable. */
+	old = dev->ring;
+	old_len = dev->ring_len;
+	old_huge = dev->ring_huge;
+	dev->ring = tmp;
+	dev->ring_len = len;
+	dev->ring_huge = huge;
+	dev->buf = (char *)tmp + IBS_RING_DATA_OFFSET;
 	dev->size = size;
 	dev->capacity = size / dev->entry_size;
 
+	dev->ring->entry_size = dev->entry_size;
+	dev->ring->capacity = dev->capacity;
+	dev->ring->data_offset = IBS_RING_DATA_OFFSET;
+
 	reset_ibs_buffer(dev);
+	free_ibs_ring(old, old_len, old_huge);
 
 	return 0;
 }
+void set_ibs_sample_fields(struct ibs_dev *dev, u64 fields)
+{
+	dev->sample_fields = fields;
+	dev->sample_size = ibs_entry_size(fields);
+	dev->entry_size = ibs_ring_combined(dev) ? IBS_RECORD_ALIGN :
+		dev->sample_size;
+	dev->capacity = dev->size / dev->entry_size;
+	if (dev->ring) {
+		dev->ring->entry_size = dev->entry_size;
+		dev->ring->capacity = dev->capacity;
+	}
+}
+
 int free_ibs_buffer(struct ibs_dev *dev)
 {
 	if (dev == NULL)
 		return -EACCES;
-	vfree(dev->buf);
+	free_ibs_ring(dev->ring, dev->ring_len, dev->ring_huge);
+	dev->ring = NULL;
+	dev->ring_len = 0;
+	dev->buf = NULL;
+	return 0;
+}
+
+int setup_ibs_hist(struct ibs_dev *dev, u64 slots, int key_page)
+{
+	struct ibs_hist_entry *tmp[2] = { NULL, NULL };
+	u64 len = slots * sizeof(struct ibs_hist_entry);
+	int i;
+	if (dev == NULL)
+		return -EACCES;
+
+	if (slots) {
+		for (i = 0; i < 2; i++) {
+			tmp[i] = alloc_ibs_ring(cpu_to_node(dev->cpu), len, 0);
+			if (!tmp[i]) {
+				free_ibs_ring(tmp[0], len, 0);
+				return -ENOMEM;
+			}
+		}
+	}
+
+	/* read_lock keeps do_ibs_read_hist() off the tables while they are
+	 * swapped. The NMI handler only looks at them while hist_slots is
+	 * set, and one that had already seen it set is done after the sync. */
+	mutex_lock(&dev->read_lock);
+	if (dev->hist_slots) {
+		dev->hist_slots = 0;
+		smp_wmb();
+		sync_ibs_nmi(dev->cpu);
+	}
+	for (i = 0; i < 2; i++)
+		free_ibs_ring(dev->hist[i], 0, 0);
+	dev->hist[0] = tmp[0];
+	dev->hist[1] = tmp[1];
+	dev->hist_bits = slots ? ilog2(slots) : 0;
+	dev->hist_key_page = slots ? key_page : 0;
+	dev->hist_active = 0;
+	smp_wmb();
+	dev->hist_slots = slots;
+	mutex_unlock(&dev->read_lock);
 	return 0;
 }
 
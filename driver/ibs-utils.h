@@ -12,9 +12,12 @@
 #ifndef IBS_UTILS_H
 #define IBS_UTILS_H
 
+#include <linux/bitops.h>
 #include <linux/types.h>
+#include <asm/page.h>
 
 #include "ibs-structs.h"
+#include "ibs-uapi.h"
 
  /* IBS flavors as ints */
 #define IBS_OP		0
@@ -25,16 +28,110 @@
 #define IBS_CPU(minor)      (minor >> 1)
 #define IBS_FLAVOR(minor)   (minor & 1)
 
+/* The samples start one page after the ring's control page */
+#define IBS_RING_DATA_OFFSET	PAGE_SIZE
+
+/**
+ * ibs_buffer_entries() - number of unread entries in a device's buffer
+ * @dev:	an IBS device
+ *
+ * The read index lives in the control page, which user space may map and
+ * write, so an out-of-range value is treated as an empty buffer.
+ */
+static inline long ibs_buffer_entries(struct ibs_dev *dev)
+{
+	long wr = atomic_long_read(&dev->wr);
+	long rd = atomic_long_read(&dev->ring->rd);
+
+	if ((unsigned long)rd >= dev->capacity)
+		return 0;
+	return (wr >= rd) ? (wr - rd) : (wr + dev->capacity - rd);
+}
+
+/**
+ * ibs_ring_readable() - whether samples may be consumed from the buffer
+ * @dev:	an IBS device
+ *
+ * The NMI handler moves rd of an overwriting buffer until it is frozen.
+ */
+static inline int ibs_ring_readable(struct ibs_dev *dev)
+{
+	return dev->ring_mode != IBS_RING_MODE_OVERWRITE ||
+		atomic_read(&dev->frozen);
+}
+
+/**
+ * ibs_ring_combined() - whether a device's buffer holds records of both flavors
+ * @dev:	an IBS device
+ */
+static inline int ibs_ring_combined(struct ibs_dev *dev)
+{
+	return dev->flavor == IBS_OP && dev->combined != NULL;
+}
+
+/**
+ * ibs_ring_dev() - the device whose buffer takes this device's samples
+ * @dev:	an IBS device
+ *
+ * That is the op device of a combined ring, else the device itself.
+ */
+static inline struct ibs_dev *ibs_ring_dev(struct ibs_dev *dev)
+{
+	return (dev->flavor == IBS_FETCH && dev->combined) ? dev->combined : dev;
+}
+
+/**
+ * ibs_ring_enabled() - whether samples may still arrive in the buffer
+ * @dev:	an IBS device
+ */
+static inline int ibs_ring_enabled(struct ibs_dev *dev)
+{
+	return atomic_read(&dev->enabled) || (ibs_ring_combined(dev) &&
+			atomic_read(&dev->combined->enabled));
+}
+
+/**
+ * ibs_entry_size() - size of a buffer entry holding the given fields
+ * @fields: IBS_*FIELD* mask, see ibs-uapi.h
+ *
+ * Must agree with ibs_sample_entry_size() in ibs-uapi.h.
+ */
+static inline u64 ibs_entry_size(u64 fields)
+{
+	u64 narrow = hweight64(fields & IBS_FIELDS_NARROW);
+	u64 wide = hweight64(fields & ~IBS_FIELDS_NARROW);
+
+	return ALIGN(wide * sizeof(u64) + narrow * sizeof(u32), sizeof(u64));
+}
+
+/* Select the fields collected for each sample and resize the entries to
+ * match; a combined buffer keeps its IBS_RECORD_ALIGN units. Also called
+ * with the current fields when a buffer is combined or split. The caller
+ * must reset the buffer afterwards. */
+void set_ibs_sample_fields(struct ibs_dev *dev, u64 fields);
+
+/* The NMI handler runs with interrupts off, so once the IPI sent by this has
+ * been handled on cpu, any handler that started before the call is done. */
+void sync_ibs_nmi(const int cpu);
+
 /* Remove all entries in the current IBS sample buffer for the target device */
 int reset_ibs_buffer(struct ibs_dev *dev);
 
-/* Create the buffer that will store IBS samples for this target device */
-int setup_ibs_buffer(struct ibs_dev *dev, u64 size);
+/* Create the buffer that will store IBS samples for this target device, on
+ * the device's NUMA node. If huge is set, the buffer is physically contiguous
+ * (see IBS_BUFFER_HUGE in ibs-uapi.h). */
+int setup_ibs_buffer(struct ibs_dev *dev, u64 size, int huge);
 
 /* Free any allocations done after you're finished with a sample buffer in
  * the target device. */
 int free_ibs_buffer(struct ibs_dev *dev);
 
+/* Replace the device's histogram tables with two empty ones of the given
+ * number of slots (a power of two), or free them if slots is 0. IBS must be
+ * disabled. The old tables are kept if the allocation fails. Takes
+ * read_lock, so it is called with ctl_lock held or not at all. */
+int setup_ibs_hist(struct ibs_dev *dev, u64 slots, int key_page);
+
 /**
  * scatter_bits() - "scatter" a quantity over a certain positions
  * @qty: data to scatter, packed densely into the low bits
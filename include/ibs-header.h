@@ -0,0 +1,132 @@
+/*
+ * Text headers of IBS trace files for the AMD Research IBS Toolkit.
+ *
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in
+ * include/LICENSE.bsd
+ *
+ *
+ * This file is user-space only. It holds the lines of a trace header that
+ * depend on the processor, which ibs_monitor writes for the processor it
+ * runs on and ibs_gen writes for the one its synthetic traces come from.
+ *
+ */
+
+#ifndef IBS_HEADER_H
+#define IBS_HEADER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Last line of every header before the binary dump of IBS samples starts
+#define IBS_HEADER_END  "============================================="
+
+// Bits of CPUID_Fn8000_001B_EAX, the IBS feature flags
+#define IBS_CPUID_BRN_TRGT          (1U << 5)
+#define IBS_CPUID_OP_CNT_EXT        (1U << 6)
+#define IBS_CPUID_RIP_INVALID_CHK   (1U << 7)
+#define IBS_CPUID_OP_BRN_FUSE       (1U << 8)
+#define IBS_CPUID_FETCH_CTL_EXTD    (1U << 9)
+#define IBS_CPUID_OP_DATA4          (1U << 10)
+
+static inline void ibs_header_end(FILE *fp)
+{
+    fprintf(fp, "\n%s\n", IBS_HEADER_END);
+}
+
+/**
+ * ibs_header_op_support - write the op header's model-specific lines
+ * @fp:     the trace
+ * @fam:    the processor family
+ * @model:  the processor model
+ * @ibs_id: CPUID_Fn8000_001B_EAX
+ *
+ * These tell the decoder which IbsOp* bits the processor fills in. Some come
+ * from CPUID, but others are only known from the family and model. This also
+ * ends the header.
+ */
+static inline void ibs_header_op_support(FILE *fp, uint32_t fam,
+        uint32_t model, uint32_t ibs_id)
+{
+    // The following bits were only available on Family 10h, Family 12h,
+    // Family 14h, and Family 15h Models 00h-0Fh
+    uint32_t brn_resync = 0, misp_return = 0;
+    if (fam == 0x10 || fam == 0x12 || fam == 0x14 ||
+            (fam == 0x15 && model < 0x10))
+    {
+        brn_resync = 1;
+        misp_return = 1;
+    }
+
+    fprintf(fp, "IbsOpBrnResync: %u\n", brn_resync);
+    fprintf(fp, "IbsOpMispReturn: %u\n", misp_return);
+
+    fprintf(fp, "BrnTrgt: %u\n", !!(ibs_id & IBS_CPUID_BRN_TRGT));
+    fprintf(fp, "OpCntExt: %u\n", !!(ibs_id & IBS_CPUID_OP_CNT_EXT));
+    fprintf(fp, "RipInvalidChk: %u\n",
+            !!(ibs_id & IBS_CPUID_RIP_INVALID_CHK));
+    fprintf(fp, "OpBrnFuse: %u\n", !!(ibs_id & IBS_CPUID_OP_BRN_FUSE));
+    fprintf(fp, "IbsOpData4: %u\n", !!(ibs_id & IBS_CPUID_OP_DATA4));
+
+    // Unfortunately, this is based on family/model, not CPUID check.
+    // This tells us about IBS_OP_DATA[40]
+    uint32_t microcode = 0;
+    if ((fam == 0x15 && model >= 0x60) ||
+        fam == 0x17)
+        microcode = 1;
+    fprintf(fp, "Microcode: %u\n", microcode);
+
+    // Family 16h does not have these 2 bits defined.
+    uint32_t ibs_op_data2_4_5 = 1;
+    if (fam == 0x14 || fam == 0x16)
+        ibs_op_data2_4_5 = 0;
+    fprintf(fp, "IBSOpData2_4_5: %u\n", ibs_op_data2_4_5);
+
+    // The following are available on Fam 10h, 12h, and 15h Model 00h-0Fh
+    uint32_t ld_bnk_con = 0, st_to_ld_can = 0;
+    if (fam <= 0x12 || (fam == 0x15 && model < 0x10))
+    {
+        ld_bnk_con = 1;
+        st_to_ld_can = 1;
+    }
+    // Available on Fam 10h and 12h
+    uint32_t st_bnk_con = 0;
+    if (fam <= 0x12)
+        st_bnk_con = 1;
+    // Available on Fam 10h, 12h, 15h Model 00h-0Fh, and 16h
+    uint32_t st_to_ld_fw = 0;
+    if (fam <= 0x12 || fam == 0x14 || fam == 0x16 ||
+            (fam == 0x15 && model < 0x10))
+    {
+        st_to_ld_fw = 1;
+    }
+    fprintf(fp, "IbsDcLdBnkCon: %u\n", ld_bnk_con);
+    fprintf(fp, "IbsDcStBnkCon: %u\n", st_bnk_con);
+    fprintf(fp, "IbsDcStToLdFwd: %u\n", st_to_ld_fw);
+    fprintf(fp, "IbsDcStToLdCan: %u\n", st_to_ld_can);
+
+    // Available on Fam 15h Models >= 30h, Fam 16h, Fam 17h
+    uint32_t ibs_data_3_20_31_48_63 = 0;
+    if (fam >= 0x16 || (fam == 0x15 && model >= 0x30))
+        ibs_data_3_20_31_48_63 = 1;
+    fprintf(fp, "IbsData3_20_31_48_63: %u\n", ibs_data_3_20_31_48_63);
+
+    ibs_header_end(fp);
+}
+
+/**
+ * ibs_header_fetch_support - write the fetch header's model-specific lines
+ * @fp:     the trace
+ * @ibs_id: CPUID_Fn8000_001B_EAX
+ *
+ * This also ends the header.
+ */
+static inline void ibs_header_fetch_support(FILE *fp, uint32_t ibs_id)
+{
+    fprintf(fp, "IbsFetchCtlExtd: %u\n",
+            !!(ibs_id & IBS_CPUID_FETCH_CTL_EXTD));
+    ibs_header_end(fp);
+}
+
+#endif  /* IBS_HEADER_H */
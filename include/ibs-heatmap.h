@@ -0,0 +1,618 @@
+/*
+ * Per-page NUMA heatmaps for the AMD Research IBS Toolkit: how often each
+ * data page was loaded from and stored to, from which nodes' CPUs, how
+ * often that missed and how long the misses took.
+ *
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in
+ * include/LICENSE.bsd
+ *
+ *
+ * This file is user-space only. It holds the aggregation used by libibs,
+ * ibs_monitor and ibs_decoder, and a reader for the tables they write.
+ *
+ */
+
+#ifndef IBS_HEATMAP_H
+#define IBS_HEATMAP_H
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ibs-uapi.h"
+#include "ibs-trace.h"
+
+/**
+ * DOC: IBS heatmaps
+ *
+ * A heatmap file is a struct ibs_heatmap_header followed by two tables of
+ * struct ibs_heatmap_entry: num_lin entries for the linear (virtual) pages
+ * that sampled loads and stores touched, sorted by pid and then page, and
+ * then num_phys entries for the physical pages, sorted by page, with a pid
+ * of 0. A sample is counted in the linear table if its IbsDcLinAd is valid
+ * and in the physical table if its IbsDcPhysAd is valid, so the two tables
+ * need not hold the same samples.
+ *
+ * cpu_node counts the samples by the NUMA node of the CPU that took them.
+ * Nodes past IBS_HEATMAP_MAX_NODES - 1 are counted in the last slot.
+ * mem_node is the node that holds the physical page; for a linear page it
+ * is that of the physical page it was last seen backed by. Both come from
+ * /sys/devices/system/node on the machine that built the heatmap, so a
+ * trace should be aggregated where it was taken. A machine with one node
+ * (or no NUMA support) puts everything on node 0.
+ *
+ * All fields are in the byte order of the machine that wrote them.
+ */
+#define IBS_HEATMAP_MAGIC           "IBSHEAT"   /* 8 bytes with the '\0' */
+#define IBS_HEATMAP_VERSION         1
+
+#define IBS_HEATMAP_PAGE_4K         12
+#define IBS_HEATMAP_PAGE_2M         21
+
+#define IBS_HEATMAP_MAX_NODES       8
+#define IBS_HEATMAP_NODE_UNKNOWN    0xFFFF
+
+#define IBS_HEATMAP_NB_REQ_SRC_DRAM 3
+
+/* The op fields that a heatmap looks at */
+#define IBS_HEATMAP_FIELDS  (IBS_OP_FIELD_DATA2 | IBS_OP_FIELD_DATA3 | \
+        IBS_OP_FIELD_DC_LIN_AD | IBS_OP_FIELD_DC_PHYS_AD | IBS_FIELD_PID | \
+        IBS_FIELD_CPU)
+
+typedef struct ibs_heatmap_header {
+        char                magic[8];
+        uint32_t            version;
+        uint32_t            page_shift; /* IBS_HEATMAP_PAGE_* */
+        uint32_t            num_nodes;  /* Of the machine that built it */
+        uint32_t            reserved;
+        uint64_t            num_lin;
+        uint64_t            num_phys;
+        uint64_t            num_samples;/* Loads and stores counted */
+} ibs_heatmap_header_t;
+
+typedef struct ibs_heatmap_entry {
+        uint64_t            page;       /* Address >> page_shift */
+        uint32_t            pid;        /* 0 in the physical table */
+        uint16_t            mem_node;   /* Or IBS_HEATMAP_NODE_UNKNOWN */
+        uint16_t            reserved;
+        uint64_t            loads;
+        uint64_t            stores;
+        uint64_t            misses;     /* Data cache misses */
+        uint64_t            miss_lat;   /* Sum of their ibs_dc_miss_lat */
+        uint64_t            dram;       /* Misses served from DRAM */
+        uint64_t            remote;     /* Misses served by another node */
+        uint64_t            cpu_node[IBS_HEATMAP_MAX_NODES];
+} ibs_heatmap_entry_t;
+
+/* One table, hashed on (pid, page) while it is built */
+typedef struct ibs_heatmap_table {
+        ibs_heatmap_entry_t *entries;
+        size_t              num;
+        size_t              max;
+        uint32_t            *slots;     /* Index into entries + 1, or 0 */
+        unsigned int        bits;       /* log2 of the number of slots */
+} ibs_heatmap_table_t;
+
+typedef struct ibs_heatmap {
+        unsigned int        page_shift;
+        uint32_t            num_nodes;
+        uint64_t            num_samples;
+        ibs_heatmap_table_t lin;
+        ibs_heatmap_table_t phys;
+        uint16_t            *cpu_nodes; /* Node of each CPU */
+        size_t              num_cpus;
+        uint16_t            *block_nodes;/* Node of each memory block */
+        size_t              num_blocks;
+        unsigned int        block_shift;
+} ibs_heatmap_t;
+
+// Set map[idx] to node, growing map (with unknown nodes) to hold it
+static inline int ibs_heatmap_set_node(uint16_t **map, size_t *num,
+        size_t idx, uint16_t node)
+{
+    if (idx >= *num)
+    {
+        size_t new_num = *num ? *num : 64;
+        uint16_t *m;
+        while (new_num <= idx)
+            new_num *= 2;
+        m = realloc(*map, new_num * sizeof(*m));
+        if (m == NULL)
+            return -1;
+        for (size_t i = *num; i < new_num; i++)
+            m[i] = IBS_HEATMAP_NODE_UNKNOWN;
+        *map = m;
+        *num = new_num;
+    }
+    (*map)[idx] = node;
+    return 0;
+}
+
+// The CPUs and memory blocks of one /sys/devices/system/node/node<n>
+static inline int ibs_heatmap_read_node(ibs_heatmap_t *h, const char *dir_name,
+        int node)
+{
+    char path[320];
+    struct dirent *ent;
+    FILE *fp;
+    DIR *dir;
+    int lo, hi, n, ret = 0;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist",
+            dir_name);
+    fp = fopen(path, "r");
+    if (fp != NULL)
+    {
+        while ((n = fscanf(fp, "%d-%d", &lo, &hi)) >= 1 && ret == 0)
+        {
+            if (n == 1)
+                hi = lo;
+            for (int cpu = lo; cpu <= hi && ret == 0; cpu++)
+                ret = ibs_heatmap_set_node(&h->cpu_nodes, &h->num_cpus, cpu,
+                        node);
+            if (fgetc(fp) != ',')
+                break;
+        }
+        fclose(fp);
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/%s", dir_name);
+    dir = opendir(path);
+    if (dir == NULL)
+        return ret;
+    while (ret == 0 && (ent = readdir(dir)) != NULL)
+    {
+        unsigned long block;
+        char extra;
+        if (sscanf(ent->d_name, "memory%lu%c", &block, &extra) == 1)
+            ret = ibs_heatmap_set_node(&h->block_nodes, &h->num_blocks, block,
+                    node);
+    }
+    closedir(dir);
+    return ret;
+}
+
+static inline int ibs_heatmap_read_topology(ibs_heatmap_t *h)
+{
+    unsigned long long block_size = 0;
+    struct dirent *ent;
+    FILE *fp;
+    DIR *dir;
+    int ret = 0;
+
+    fp = fopen("/sys/devices/system/memory/block_size_bytes", "r");
+    if (fp != NULL)
+    {
+        if (fscanf(fp, "%llx", &block_size) != 1)
+            block_size = 0;
+        fclose(fp);
+    }
+    // Without memory blocks, physical pages have no node
+    if (block_size != 0 && !(block_size & (block_size - 1)))
+        h->block_shift = __builtin_ctzll(block_size);
+
+    dir = opendir("/sys/devices/system/node");
+    if (dir != NULL)
+    {
+        while (ret == 0 && (ent = readdir(dir)) != NULL)
+        {
+            int node;
+            char extra;
+            if (sscanf(ent->d_name, "node%d%c", &node, &extra) != 1 ||
+                    node < 0 || node >= IBS_HEATMAP_NODE_UNKNOWN)
+                continue;
+            if ((uint32_t)node >= h->num_nodes)
+                h->num_nodes = node + 1;
+            ret = ibs_heatmap_read_node(h, ent->d_name, node);
+        }
+        closedir(dir);
+    }
+    if (h->num_nodes == 0)
+        h->num_nodes = 1;
+    if (h->block_shift == 0)
+        h->num_blocks = 0;
+    return ret;
+}
+
+/**
+ * ibs_heatmap_init - start an empty heatmap
+ * @h:          the heatmap
+ * @page_shift: IBS_HEATMAP_PAGE_4K or IBS_HEATMAP_PAGE_2M
+ *
+ * Reads this machine's NUMA topology from sysfs. Returns 0, or -1 if
+ * page_shift is not one of the above or memory runs out.
+ */
+static inline int ibs_heatmap_init(ibs_heatmap_t *h, unsigned int page_shift)
+{
+    memset(h, 0, sizeof(*h));
+    if (page_shift != IBS_HEATMAP_PAGE_4K && page_shift != IBS_HEATMAP_PAGE_2M)
+        return -1;
+    h->page_shift = page_shift;
+    return ibs_heatmap_read_topology(h);
+}
+
+static inline void ibs_heatmap_fini(ibs_heatmap_t *h)
+{
+    free(h->lin.entries);
+    free(h->lin.slots);
+    free(h->phys.entries);
+    free(h->phys.slots);
+    free(h->cpu_nodes);
+    free(h->block_nodes);
+    memset(h, 0, sizeof(*h));
+}
+
+static inline uint32_t ibs_heatmap_hash(uint32_t pid, uint64_t page,
+        unsigned int bits)
+{
+    uint64_t x = (page ^ ((uint64_t)pid << 40)) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(x >> (64 - bits));
+}
+
+// Hash every entry of t into 2^bits fresh slots
+static inline int ibs_heatmap_index(ibs_heatmap_table_t *t, unsigned int bits)
+{
+    uint32_t mask = (1U << bits) - 1;
+    uint32_t *slots = calloc((size_t)1 << bits, sizeof(*slots));
+
+    if (slots == NULL)
+        return -1;
+    for (size_t i = 0; i < t->num; i++)
+    {
+        uint32_t s = ibs_heatmap_hash(t->entries[i].pid, t->entries[i].page,
+                bits);
+        while (slots[s])
+            s = (s + 1) & mask;
+        slots[s] = i + 1;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->bits = bits;
+    return 0;
+}
+
+// The entry for (pid, page), added if need be, or NULL if memory runs out
+static inline ibs_heatmap_entry_t *ibs_heatmap_get(ibs_heatmap_table_t *t,
+        uint32_t pid, uint64_t page)
+{
+    ibs_heatmap_entry_t *ent;
+    uint32_t s, mask;
+
+    // Keep the slots at most half full
+    if (t->slots == NULL || 2 * t->num >= ((size_t)1 << t->bits))
+    {
+        if (t->bits >= 31 ||
+                ibs_heatmap_index(t, t->slots ? t->bits + 1 : 12))
+            return NULL;
+    }
+    mask = (1U << t->bits) - 1;
+    for (s = ibs_heatmap_hash(pid, page, t->bits); t->slots[s];
+            s = (s + 1) & mask)
+    {
+        ent = &t->entries[t->slots[s] - 1];
+        if (ent->page == page && ent->pid == pid)
+            return ent;
+    }
+
+    if (t->num == t->max)
+    {
+        size_t max = t->max ? 2 * t->max : 1024;
+        ent = realloc(t->entries, max * sizeof(*ent));
+        if (ent == NULL)
+            return NULL;
+        t->entries = ent;
+        t->max = max;
+    }
+    ent = &t->entries[t->num++];
+    memset(ent, 0, sizeof(*ent));
+    ent->page = page;
+    ent->pid = pid;
+    ent->mem_node = IBS_HEATMAP_NODE_UNKNOWN;
+    t->slots[s] = t->num;
+    return ent;
+}
+
+static inline uint16_t ibs_heatmap_mem_node(const ibs_heatmap_t *h,
+        uint64_t phys_addr)
+{
+    uint64_t block;
+
+    if (h->num_nodes == 1)
+        return 0;
+    block = phys_addr >> h->block_shift;
+    return (block < h->num_blocks) ? h->block_nodes[block] :
+        IBS_HEATMAP_NODE_UNKNOWN;
+}
+
+static inline void ibs_heatmap_count(ibs_heatmap_entry_t *ent,
+        const ibs_op_t *op, uint16_t cpu_node)
+{
+    ent->loads += op->op_data3.reg.ibs_ld_op;
+    ent->stores += op->op_data3.reg.ibs_st_op;
+    if (op->op_data3.reg.ibs_dc_miss)
+    {
+        ent->misses++;
+        ent->miss_lat += op->op_data3.reg.ibs_dc_miss_lat;
+        ent->dram += (op->op_data2.reg.ibs_nb_req_src ==
+                IBS_HEATMAP_NB_REQ_SRC_DRAM);
+        ent->remote += op->op_data2.reg.ibs_nb_req_dst_node;
+    }
+    if (cpu_node != IBS_HEATMAP_NODE_UNKNOWN)
+        ent->cpu_node[cpu_node < IBS_HEATMAP_MAX_NODES ? cpu_node :
+            IBS_HEATMAP_MAX_NODES - 1]++;
+}
+
+/**
+ * ibs_heatmap_add - count one op sample
+ * @h:      the heatmap
+ * @op:     the sample
+ *
+ * Ops that are not loads or stores, or have neither a valid linear nor a
+ * valid physical address, are skipped. Returns 0, or -1 if memory runs out.
+ */
+static inline int ibs_heatmap_add(ibs_heatmap_t *h, const ibs_op_t *op)
+{
+    const ibs_op_data3_t *data3 = &op->op_data3;
+    uint16_t cpu_node = IBS_HEATMAP_NODE_UNKNOWN;
+    uint16_t mem_node = IBS_HEATMAP_NODE_UNKNOWN;
+    ibs_heatmap_entry_t *ent;
+
+    if (!data3->reg.ibs_ld_op && !data3->reg.ibs_st_op)
+        return 0;
+    if (!data3->reg.ibs_lin_addr_valid && !data3->reg.ibs_phy_addr_valid)
+        return 0;
+    h->num_samples++;
+    if (h->num_nodes == 1)
+        cpu_node = 0;
+    else if (op->cpu >= 0 && (size_t)op->cpu < h->num_cpus)
+        cpu_node = h->cpu_nodes[op->cpu];
+
+    if (data3->reg.ibs_phy_addr_valid)
+    {
+        uint64_t addr = op->dc_phys_ad.reg.ibs_dc_phys_addr;
+        mem_node = ibs_heatmap_mem_node(h, addr);
+        ent = ibs_heatmap_get(&h->phys, 0, addr >> h->page_shift);
+        if (ent == NULL)
+            return -1;
+        ibs_heatmap_count(ent, op, cpu_node);
+        ent->mem_node = mem_node;
+    }
+    if (data3->reg.ibs_lin_addr_valid)
+    {
+        ent = ibs_heatmap_get(&h->lin, op->pid, op->dc_lin_ad >> h->page_shift);
+        if (ent == NULL)
+            return -1;
+        ibs_heatmap_count(ent, op, cpu_node);
+        if (mem_node != IBS_HEATMAP_NODE_UNKNOWN)
+            ent->mem_node = mem_node;
+    }
+    return 0;
+}
+
+/**
+ * ibs_heatmap_add_records - count op samples as the monitor writes them
+ * @h:          the heatmap
+ * @data:       n records of entry_size bytes each
+ * @entry_size: bytes per record
+ * @n:          number of records
+ * @fields:     the IBS_OP_FIELD_* and IBS_FIELD_* mask that the records
+ *              hold (see ibs-trace.h), or ~0 for whole struct ibs_ops
+ *
+ * Records without IBS_OP_FIELD_DATA3 count nothing. Returns 0, or -1 if
+ * memory runs out.
+ */
+static inline int ibs_heatmap_add_records(ibs_heatmap_t *h, const void *data,
+        size_t entry_size, size_t n, uint64_t fields)
+{
+    static const uint64_t used[] = {
+        IBS_OP_FIELD_DATA2, IBS_OP_FIELD_DATA3, IBS_OP_FIELD_DC_LIN_AD,
+        IBS_OP_FIELD_DC_PHYS_AD, IBS_FIELD_PID, IBS_FIELD_CPU
+    };
+    const unsigned char *rec = data;
+    long off[sizeof(used) / sizeof(used[0])];
+    size_t len[sizeof(used) / sizeof(used[0])];
+    ibs_op_t op;
+
+    for (size_t k = 0; k < sizeof(used) / sizeof(used[0]); k++)
+    {
+        off[k] = ibs_trace_field_offset(ibs_op_field_order, IBS_OP_NUM_FIELDS,
+                fields, used[k]);
+        len[k] = ibs_trace_field_len(used[k]);
+    }
+    if (off[1] < 0)
+        return 0;
+
+    // Fields the records do not hold stay 0
+    memset(&op, 0, sizeof(op));
+    op.cpu = -1;
+    for (size_t i = 0; i < n; i++, rec += entry_size)
+    {
+        if (off[0] >= 0)
+            op.op_data2.val = ibs_trace_load(rec + off[0], len[0]);
+        op.op_data3.val = ibs_trace_load(rec + off[1], len[1]);
+        if (off[2] >= 0)
+            op.dc_lin_ad = ibs_trace_load(rec + off[2], len[2]);
+        else
+            op.op_data3.reg.ibs_lin_addr_valid = 0;
+        if (off[3] >= 0)
+            op.dc_phys_ad.val = ibs_trace_load(rec + off[3], len[3]);
+        else
+            op.op_data3.reg.ibs_phy_addr_valid = 0;
+        if (off[4] >= 0)
+            op.pid = (int)ibs_trace_load(rec + off[4], len[4]);
+        if (off[5] >= 0)
+            op.cpu = (int)ibs_trace_load(rec + off[5], len[5]);
+        if (ibs_heatmap_add(h, &op))
+            return -1;
+    }
+    return 0;
+}
+
+static inline void ibs_heatmap_add_entry(ibs_heatmap_entry_t *dst,
+        const ibs_heatmap_entry_t *src)
+{
+    dst->loads += src->loads;
+    dst->stores += src->stores;
+    dst->misses += src->misses;
+    dst->miss_lat += src->miss_lat;
+    dst->dram += src->dram;
+    dst->remote += src->remote;
+    for (int i = 0; i < IBS_HEATMAP_MAX_NODES; i++)
+        dst->cpu_node[i] += src->cpu_node[i];
+    if (src->mem_node != IBS_HEATMAP_NODE_UNKNOWN)
+        dst->mem_node = src->mem_node;
+}
+
+/**
+ * ibs_heatmap_merge - add the counts of one heatmap to another's
+ * @dst:    the heatmap to add to
+ * @src:    a heatmap with the same page_shift, for example one built by
+ *          another thread
+ *
+ * Returns 0, or -1 if the page sizes differ or memory runs out.
+ */
+static inline int ibs_heatmap_merge(ibs_heatmap_t *dst,
+        const ibs_heatmap_t *src)
+{
+    const ibs_heatmap_table_t *from[2] = {&src->lin, &src->phys};
+    ibs_heatmap_table_t *to[2] = {&dst->lin, &dst->phys};
+
+    if (dst->page_shift != src->page_shift)
+        return -1;
+    for (int t = 0; t < 2; t++)
+    {
+        for (size_t i = 0; i < from[t]->num; i++)
+        {
+            const ibs_heatmap_entry_t *ent = &from[t]->entries[i];
+            ibs_heatmap_entry_t *sum = ibs_heatmap_get(to[t], ent->pid,
+                    ent->page);
+            if (sum == NULL)
+                return -1;
+            ibs_heatmap_add_entry(sum, ent);
+        }
+    }
+    dst->num_samples += src->num_samples;
+    return 0;
+}
+
+static inline int ibs_heatmap_entry_cmp(const void *a, const void *b)
+{
+    const ibs_heatmap_entry_t *x = a, *y = b;
+    if (x->pid != y->pid)
+        return (x->pid < y->pid) ? -1 : 1;
+    if (x->page != y->page)
+        return (x->page < y->page) ? -1 : 1;
+    return 0;
+}
+
+/**
+ * ibs_heatmap_write - write a heatmap out as a sorted table
+ * @h:      the heatmap, which may go on being added to
+ * @fp:     where to write it
+ *
+ * Returns 0, or -1 if the write fails or memory runs out.
+ */
+static inline int ibs_heatmap_write(ibs_heatmap_t *h, FILE *fp)
+{
+    ibs_heatmap_table_t *tables[2] = {&h->lin, &h->phys};
+    ibs_heatmap_header_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IBS_HEATMAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = IBS_HEATMAP_VERSION;
+    hdr.page_shift = h->page_shift;
+    hdr.num_nodes = h->num_nodes;
+    hdr.num_lin = h->lin.num;
+    hdr.num_phys = h->phys.num;
+    hdr.num_samples = h->num_samples;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        return -1;
+
+    for (int t = 0; t < 2; t++)
+    {
+        ibs_heatmap_table_t *tab = tables[t];
+        if (tab->num == 0)
+            continue;
+        qsort(tab->entries, tab->num, sizeof(*tab->entries),
+                ibs_heatmap_entry_cmp);
+        // Sorting moved the entries out from under their slots
+        if (ibs_heatmap_index(tab, tab->bits))
+            return -1;
+        if (fwrite(tab->entries, sizeof(*tab->entries), tab->num, fp) !=
+                tab->num)
+            return -1;
+    }
+    return 0;
+}
+
+/* A heatmap read back from its file */
+typedef struct ibs_heatmap_file {
+        ibs_heatmap_header_t header;
+        ibs_heatmap_entry_t *lin;       /* By pid, then page */
+        ibs_heatmap_entry_t *phys;      /* By page */
+} ibs_heatmap_file_t;
+
+static inline void ibs_heatmap_unload(ibs_heatmap_file_t *f)
+{
+    free(f->lin);
+    free(f->phys);
+    memset(f, 0, sizeof(*f));
+}
+
+/**
+ * ibs_heatmap_load - read a heatmap file written by ibs_heatmap_write
+ * @f:      the tables
+ * @fp:     the file, at its start
+ *
+ * Returns 0, or -1 if fp is not a whole heatmap or memory runs out.
+ */
+static inline int ibs_heatmap_load(ibs_heatmap_file_t *f, FILE *fp)
+{
+    ibs_heatmap_header_t *hdr = &f->header;
+
+    memset(f, 0, sizeof(*f));
+    if (fread(hdr, sizeof(*hdr), 1, fp) != 1 ||
+            memcmp(hdr->magic, IBS_HEATMAP_MAGIC, sizeof(hdr->magic)) ||
+            hdr->version != IBS_HEATMAP_VERSION ||
+            hdr->num_lin > SIZE_MAX / sizeof(ibs_heatmap_entry_t) ||
+            hdr->num_phys > SIZE_MAX / sizeof(ibs_heatmap_entry_t))
+        return -1;
+    f->lin = malloc((hdr->num_lin ? hdr->num_lin : 1) * sizeof(*f->lin));
+    f->phys = malloc((hdr->num_phys ? hdr->num_phys : 1) * sizeof(*f->phys));
+    if (f->lin == NULL || f->phys == NULL ||
+            fread(f->lin, sizeof(*f->lin), hdr->num_lin, fp) != hdr->num_lin ||
+            fread(f->phys, sizeof(*f->phys), hdr->num_phys, fp) !=
+            hdr->num_phys)
+    {
+        ibs_heatmap_unload(f);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * ibs_heatmap_find - look up a page in one of a heatmap file's tables
+ * @entries:    f->lin or f->phys
+ * @num:        f->header.num_lin or f->header.num_phys
+ * @pid:        the process, or 0 in f->phys
+ * @page:       the address >> f->header.page_shift
+ *
+ * Returns NULL if no sample touched the page.
+ */
+static inline const ibs_heatmap_entry_t *ibs_heatmap_find(
+        const ibs_heatmap_entry_t *entries, size_t num, uint32_t pid,
+        uint64_t page)
+{
+    ibs_heatmap_entry_t key;
+
+    key.pid = pid;
+    key.page = page;
+    return bsearch(&key, entries, num, sizeof(*entries),
+            ibs_heatmap_entry_cmp);
+}
+
+#endif  /* IBS_HEATMAP_H */
@@ -0,0 +1,299 @@
+/*
+ * Timestamp-ordered merging of per-CPU IBS sample streams for the AMD
+ * Research IBS Toolkit.
+ *
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in
+ * include/LICENSE.bsd
+ *
+ *
+ * This file is user-space only. It holds the reorder buffer that ibs_monitor
+ * and ibs_decoder use to put samples in TSC order, and that libIBS callers
+ * can feed their per-CPU batches through.
+ *
+ */
+
+#ifndef IBS_MERGE_H
+#define IBS_MERGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * DOC: IBS sample merging
+ *
+ * The driver buffers samples per CPU, and a collector drains the buffers one
+ * after another, so its output is only in TSC order within each CPU. A merge
+ * holds the samples that have been read but not yet written out, in one
+ * queue per source (usually a CPU), and a min-heap of the queues by the TSC
+ * of their oldest sample.
+ *
+ * The caller decides when a sample is safe to write out by giving a
+ * watermark: every source promises that nothing it hands over later is
+ * older than the watermark. A collector that drains every buffer at least
+ * once per poll timeout can use the current TSC minus that timeout; a reader
+ * of an unordered trace can use the newest TSC it has seen minus a window.
+ * Samples wait in the merge only until the watermark passes them, so memory
+ * is bounded by the window, not by the trace.
+ *
+ * A sample older than one already written out is late. It is still written,
+ * as soon as possible, and counted in late. So is the oldest sample whenever
+ * more than max_held are waiting.
+ */
+#define IBS_MERGE_DEFAULT_MAX   (1 << 20)
+
+typedef struct ibs_merge_queue {
+        unsigned char *     recs;       /* Ring of max records */
+        uint64_t *          tscs;       /* And their TSCs */
+        size_t              head;
+        size_t              len;
+        size_t              max;
+        int                 heap_pos;   /* -1 when empty */
+} ibs_merge_queue_t;
+
+typedef struct ibs_merge {
+        size_t              entry_size;
+        ibs_merge_queue_t * queues;     /* Indexed by source */
+        int                 num_queues;
+        int *               heap;       /* Non-empty queues, oldest first */
+        int                 heap_len;
+        size_t              num_held;
+        size_t              max_held;
+        uint64_t            last_tsc;   /* Of the last record popped */
+        uint64_t            late;
+} ibs_merge_t;
+
+/**
+ * ibs_merge_init - start an empty merge
+ * @m:          the merge
+ * @entry_size: bytes of each record
+ * @max_held:   most records to hold before the oldest is let out early,
+ *              or 0 for IBS_MERGE_DEFAULT_MAX
+ */
+static inline void ibs_merge_init(ibs_merge_t *m, size_t entry_size,
+        size_t max_held)
+{
+    memset(m, 0, sizeof(*m));
+    m->entry_size = entry_size;
+    m->max_held = max_held ? max_held : IBS_MERGE_DEFAULT_MAX;
+}
+
+static inline void ibs_merge_fini(ibs_merge_t *m)
+{
+    for (int i = 0; i < m->num_queues; i++)
+    {
+        free(m->queues[i].recs);
+        free(m->queues[i].tscs);
+    }
+    free(m->queues);
+    free(m->heap);
+    memset(m, 0, sizeof(*m));
+}
+
+static inline uint64_t ibs_merge_head_tsc(const ibs_merge_t *m, int q)
+{
+    const ibs_merge_queue_t *queue = &m->queues[q];
+    return queue->tscs[queue->head];
+}
+
+static inline int ibs_merge_less(const ibs_merge_t *m, int a, int b)
+{
+    uint64_t ta = ibs_merge_head_tsc(m, a), tb = ibs_merge_head_tsc(m, b);
+    return ta < tb || (ta == tb && a < b);
+}
+
+static inline void ibs_merge_heap_set(ibs_merge_t *m, int pos, int q)
+{
+    m->heap[pos] = q;
+    m->queues[q].heap_pos = pos;
+}
+
+static inline void ibs_merge_sift_up(ibs_merge_t *m, int pos)
+{
+    int q = m->heap[pos];
+
+    while (pos > 0)
+    {
+        int parent = (pos - 1) / 2;
+        if (!ibs_merge_less(m, q, m->heap[parent]))
+            break;
+        ibs_merge_heap_set(m, pos, m->heap[parent]);
+        pos = parent;
+    }
+    ibs_merge_heap_set(m, pos, q);
+}
+
+static inline void ibs_merge_sift_down(ibs_merge_t *m, int pos)
+{
+    int q = m->heap[pos];
+
+    for (;;)
+    {
+        int child = 2 * pos + 1;
+        if (child >= m->heap_len)
+            break;
+        if (child + 1 < m->heap_len &&
+                ibs_merge_less(m, m->heap[child + 1], m->heap[child]))
+            child++;
+        if (!ibs_merge_less(m, m->heap[child], q))
+            break;
+        ibs_merge_heap_set(m, pos, m->heap[child]);
+        pos = child;
+    }
+    ibs_merge_heap_set(m, pos, q);
+}
+
+// Make room for src's queue and one more record in it
+static inline int ibs_merge_reserve(ibs_merge_t *m, int src)
+{
+    ibs_merge_queue_t *q;
+
+    if (src >= m->num_queues)
+    {
+        int num = src + 1;
+        ibs_merge_queue_t *queues = realloc(m->queues,
+                num * sizeof(*queues));
+        int *heap = realloc(m->heap, num * sizeof(*heap));
+        if (queues != NULL)
+            m->queues = queues;
+        if (heap != NULL)
+            m->heap = heap;
+        if (queues == NULL || heap == NULL)
+            return -1;
+        memset(&queues[m->num_queues], 0,
+                (num - m->num_queues) * sizeof(*queues));
+        for (int i = m->num_queues; i < num; i++)
+            queues[i].heap_pos = -1;
+        m->num_queues = num;
+    }
+
+    q = &m->queues[src];
+    if (q->len == q->max)
+    {
+        size_t max = q->max ? 2 * q->max : 1024;
+        unsigned char *recs = malloc(max * m->entry_size);
+        uint64_t *tscs = malloc(max * sizeof(*tscs));
+        if (recs == NULL || tscs == NULL)
+        {
+            free(recs);
+            free(tscs);
+            return -1;
+        }
+        // Straighten the ring out as it is copied
+        for (size_t i = 0; i < q->len; i++)
+        {
+            size_t from = (q->head + i) % q->max;
+            memcpy(recs + i * m->entry_size, q->recs + from * m->entry_size,
+                    m->entry_size);
+            tscs[i] = q->tscs[from];
+        }
+        free(q->recs);
+        free(q->tscs);
+        q->recs = recs;
+        q->tscs = tscs;
+        q->head = 0;
+        q->max = max;
+    }
+    return 0;
+}
+
+/**
+ * ibs_merge_put - hand the merge a record
+ * @m:      the merge
+ * @src:    where it came from, from 0 up; usually a CPU
+ * @tsc:    when it was taken
+ * @record: entry_size bytes, which are copied
+ *
+ * Records from one source normally come in TSC order, but need not.
+ * Returns 0, or -1 if out of memory.
+ */
+static inline int ibs_merge_put(ibs_merge_t *m, int src, uint64_t tsc,
+        const void *record)
+{
+    ibs_merge_queue_t *q;
+    size_t i;
+
+    if (src < 0 || ibs_merge_reserve(m, src))
+        return -1;
+    q = &m->queues[src];
+    if (tsc < m->last_tsc)
+        m->late++;
+
+    // Find its place from the newest end, which is almost always right away
+    for (i = q->len; i > 0; i--)
+    {
+        size_t prev = (q->head + i - 1) % q->max;
+        size_t cur = (q->head + i) % q->max;
+        if (q->tscs[prev] <= tsc)
+            break;
+        memcpy(q->recs + cur * m->entry_size, q->recs + prev * m->entry_size,
+                m->entry_size);
+        q->tscs[cur] = q->tscs[prev];
+    }
+    i = (q->head + i) % q->max;
+    memcpy(q->recs + i * m->entry_size, record, m->entry_size);
+    q->tscs[i] = tsc;
+    q->len++;
+    m->num_held++;
+
+    if (q->heap_pos < 0)
+    {
+        m->heap_len++;
+        ibs_merge_heap_set(m, m->heap_len - 1, src);
+        ibs_merge_sift_up(m, m->heap_len - 1);
+    }
+    else if (i == q->head)
+        ibs_merge_sift_up(m, q->heap_pos);
+    return 0;
+}
+
+/**
+ * ibs_merge_pop - take the oldest record, if it is old enough
+ * @m:         the merge
+ * @watermark: no record older than this will be put from now on
+ * @src:       set to the record's source, if not NULL
+ *
+ * Returns the oldest record if its TSC is at most watermark, or if more than
+ * max_held are waiting; otherwise NULL. The record is only valid until the
+ * next ibs_merge_put. Pop with a watermark of UINT64_MAX to empty the merge.
+ */
+static inline const void *ibs_merge_pop(ibs_merge_t *m, uint64_t watermark,
+        int *src)
+{
+    ibs_merge_queue_t *q;
+    const void *rec;
+    int top;
+
+    if (m->heap_len == 0)
+        return NULL;
+    top = m->heap[0];
+    q = &m->queues[top];
+    if (q->tscs[q->head] > watermark && m->num_held <= m->max_held)
+        return NULL;
+
+    rec = q->recs + q->head * m->entry_size;
+    if (q->tscs[q->head] > m->last_tsc)
+        m->last_tsc = q->tscs[q->head];
+    q->head = (q->head + 1) % q->max;
+    q->len--;
+    m->num_held--;
+    if (q->len)
+        ibs_merge_sift_down(m, 0);
+    else
+    {
+        q->heap_pos = -1;
+        if (--m->heap_len)
+        {
+            ibs_merge_heap_set(m, 0, m->heap[m->heap_len]);
+            ibs_merge_sift_down(m, 0);
+        }
+    }
+    if (src != NULL)
+        *src = top;
+    return rec;
+}
+
+#endif  /* IBS_MERGE_H */
@@ -0,0 +1,290 @@
+/*
+ * Module maps for the AMD Research IBS Toolkit: where each executable file
+ * (or anonymous region) was mapped in the monitored processes, and when.
+ *
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in
+ * include/LICENSE.bsd
+ *
+ *
+ * This file is user-space only. It holds the writer used by ibs_monitor and
+ * the reader used by ibs_annotate.
+ *
+ */
+
+#ifndef IBS_MODMAP_H
+#define IBS_MODMAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * DOC: IBS module maps
+ *
+ * A module map is a struct ibs_modmap_header followed by records. Each
+ * record is a struct ibs_modmap_record and then name_len bytes of name,
+ * padded with zeros to a multiple of 8 bytes.
+ *
+ * An IBS_MODMAP_MAP record says that [start, end) of process pid held an
+ * executable mapping of name from file offset offset, from tsc on. An
+ * IBS_MODMAP_UNMAP record with the same pid, start, end and offset says it
+ * was gone by tsc, and has no name. A mapping of no file (for example
+ * code written by a JIT) has a name_len of 0, and [heap]-style pseudo
+ * files keep their names from /proc/<pid>/maps.
+ *
+ * The writer only sees mappings when it looks, so a map record's tsc is
+ * the last time it looked without finding the mapping, and an unmap
+ * record's tsc is the first time it looked and found it gone. Samples in a
+ * mapping always fall between the two, but mappings of the same addresses
+ * may overlap by up to one look.
+ *
+ * Records are in the order they were seen, and all fields are in the byte
+ * order of the machine that wrote them.
+ */
+#define IBS_MODMAP_MAGIC        "IBSMODS"   /* 8 bytes with the '\0' */
+#define IBS_MODMAP_VERSION      1
+
+#define IBS_MODMAP_MAP          1
+#define IBS_MODMAP_UNMAP        2
+
+typedef struct ibs_modmap_header {
+        char                magic[8];
+        uint32_t            version;
+        uint32_t            pid;        /* Of the monitored program */
+        uint64_t            start_tsc;  /* When monitoring started */
+} ibs_modmap_header_t;
+
+typedef struct ibs_modmap_record {
+        uint64_t            tsc;
+        uint64_t            start;
+        uint64_t            end;
+        uint64_t            offset;
+        uint32_t            pid;
+        uint16_t            type;
+        uint16_t            name_len;
+} ibs_modmap_record_t;
+
+static inline int ibs_modmap_write_header(FILE *fp, uint32_t pid,
+        uint64_t start_tsc)
+{
+    ibs_modmap_header_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IBS_MODMAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = IBS_MODMAP_VERSION;
+    hdr.pid = pid;
+    hdr.start_tsc = start_tsc;
+    return fwrite(&hdr, sizeof(hdr), 1, fp) == 1 ? 0 : -1;
+}
+
+// name is ignored for IBS_MODMAP_UNMAP, and may be NULL for anonymous code
+static inline int ibs_modmap_write(FILE *fp, uint16_t type, uint32_t pid,
+        uint64_t tsc, uint64_t start, uint64_t end, uint64_t offset,
+        const char *name)
+{
+    static const char pad[8];
+    ibs_modmap_record_t rec;
+    size_t len = (type == IBS_MODMAP_MAP && name != NULL) ? strlen(name) : 0;
+
+    if (len > 0xFFFF)
+        len = 0xFFFF;
+    rec.tsc = tsc;
+    rec.start = start;
+    rec.end = end;
+    rec.offset = offset;
+    rec.pid = pid;
+    rec.type = type;
+    rec.name_len = len;
+    if (fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+            (len && fwrite(name, 1, len, fp) != len) ||
+            ((len & 7) && fwrite(pad, 1, 8 - (len & 7), fp) != 8 - (len & 7)))
+        return -1;
+    return 0;
+}
+
+// One mapping, from its map record to its unmap record
+typedef struct ibs_modmap_entry {
+        uint64_t            start;
+        uint64_t            end;
+        uint64_t            offset;
+        uint64_t            map_tsc;
+        uint64_t            unmap_tsc;  /* ~0 if it was never unmapped */
+        uint64_t            max_end;    /* Of this and the pid's entries
+                                           before it */
+        const char          *name;      /* "" for anonymous code */
+        uint32_t            pid;
+} ibs_modmap_entry_t;
+
+typedef struct ibs_modmap {
+        ibs_modmap_header_t header;
+        ibs_modmap_entry_t  *entries;   /* By pid, then start, then map_tsc */
+        size_t              num_entries;
+        char                *names;
+} ibs_modmap_t;
+
+static inline int ibs_modmap_entry_cmp(const void *a, const void *b)
+{
+    const ibs_modmap_entry_t *x = a, *y = b;
+    if (x->pid != y->pid)
+        return (x->pid < y->pid) ? -1 : 1;
+    if (x->start != y->start)
+        return (x->start < y->start) ? -1 : 1;
+    if (x->map_tsc != y->map_tsc)
+        return (x->map_tsc < y->map_tsc) ? -1 : 1;
+    return 0;
+}
+
+static inline void ibs_modmap_close(ibs_modmap_t *m)
+{
+    free(m->entries);
+    free(m->names);
+    memset(m, 0, sizeof(*m));
+}
+
+/**
+ * ibs_modmap_open - read a module map into a table for ibs_modmap_find
+ * @m:      the table
+ * @fp:     the module map, at its start
+ *
+ * A map that was cut short, for example because the monitor was killed,
+ * is read up to its last whole record. Returns 0, or -1 if fp is not a
+ * module map or memory runs out.
+ */
+static inline int ibs_modmap_open(ibs_modmap_t *m, FILE *fp)
+{
+    ibs_modmap_record_t rec;
+    size_t max_entries = 0, names_len = 0, names_max = 0;
+
+    memset(m, 0, sizeof(*m));
+    if (fread(&m->header, sizeof(m->header), 1, fp) != 1 ||
+            memcmp(m->header.magic, IBS_MODMAP_MAGIC,
+                sizeof(m->header.magic)) ||
+            m->header.version != IBS_MODMAP_VERSION)
+        return -1;
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        size_t padded = (rec.name_len + 7) & ~(size_t)7;
+        ibs_modmap_entry_t *ent;
+
+        if (names_len + padded + 1 > names_max)
+        {
+            char *names;
+            names_max = names_max ? names_max * 2 : 4096;
+            while (names_len + padded + 1 > names_max)
+                names_max *= 2;
+            names = realloc(m->names, names_max);
+            if (names == NULL)
+                goto fail;
+            m->names = names;
+        }
+        if (padded && fread(m->names + names_len, 1, padded, fp) != padded)
+            break;
+
+        if (rec.type == IBS_MODMAP_UNMAP)
+        {
+            // Close the most recent open mapping of the same range
+            for (size_t i = m->num_entries; i-- > 0; )
+            {
+                ent = &m->entries[i];
+                if (ent->pid == rec.pid && ent->start == rec.start &&
+                        ent->end == rec.end && ent->offset == rec.offset &&
+                        ent->unmap_tsc == ~0ULL)
+                {
+                    ent->unmap_tsc = rec.tsc;
+                    break;
+                }
+            }
+            continue;
+        }
+        if (rec.type != IBS_MODMAP_MAP)
+            continue;
+
+        if (m->num_entries == max_entries)
+        {
+            max_entries = max_entries ? 2 * max_entries : 64;
+            ent = realloc(m->entries, max_entries * sizeof(*ent));
+            if (ent == NULL)
+                goto fail;
+            m->entries = ent;
+        }
+        ent = &m->entries[m->num_entries++];
+        ent->start = rec.start;
+        ent->end = rec.end;
+        ent->offset = rec.offset;
+        ent->map_tsc = rec.tsc;
+        ent->unmap_tsc = ~0ULL;
+        ent->pid = rec.pid;
+        // An offset until names stops moving
+        ent->name = (const char *)(uintptr_t)names_len;
+        m->names[names_len + rec.name_len] = '\0';
+        names_len += rec.name_len + 1;
+    }
+
+    if (m->names == NULL && m->num_entries)
+        goto fail;
+    for (size_t i = 0; i < m->num_entries; i++)
+        m->entries[i].name = m->names + (uintptr_t)m->entries[i].name;
+    qsort(m->entries, m->num_entries, sizeof(*m->entries),
+            ibs_modmap_entry_cmp);
+    for (size_t i = 0; i < m->num_entries; i++)
+    {
+        ibs_modmap_entry_t *ent = &m->entries[i];
+        ent->max_end = ent->end;
+        if (i > 0 && ent[-1].pid == ent->pid && ent[-1].max_end > ent->end)
+            ent->max_end = ent[-1].max_end;
+    }
+    return 0;
+
+fail:
+    ibs_modmap_close(m);
+    return -1;
+}
+
+/**
+ * ibs_modmap_find - which mapping held an address
+ * @m:      the table
+ * @pid:    process the address is in
+ * @addr:   the address
+ * @tsc:    when, or 0 if that is not known
+ *
+ * Of the pid's mappings holding addr, returns one that was there at tsc,
+ * or failing that (or without a tsc) the most recent one.
+ * Returns NULL if no mapping held addr.
+ */
+static inline const ibs_modmap_entry_t *ibs_modmap_find(const ibs_modmap_t *m,
+        uint32_t pid, uint64_t addr, uint64_t tsc)
+{
+    const ibs_modmap_entry_t *any = NULL;
+    size_t lo = 0, hi = m->num_entries;
+
+    // The first entry after (pid, addr)
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        const ibs_modmap_entry_t *ent = &m->entries[mid];
+        if (ent->pid < pid || (ent->pid == pid && ent->start <= addr))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    // Walk back until nothing earlier can reach addr
+    while (lo-- > 0)
+    {
+        const ibs_modmap_entry_t *ent = &m->entries[lo];
+        if (ent->pid != pid || ent->max_end <= addr)
+            break;
+        if (addr >= ent->end)
+            continue;
+        if (tsc && ent->map_tsc <= tsc && tsc < ent->unmap_tsc)
+            return ent;
+        if (any == NULL || ent->map_tsc > any->map_tsc)
+            any = ent;
+    }
+    return any;
+}
+
+#endif  /* IBS_MODMAP_H */
@@ -0,0 +1,411 @@
+/*
+ * Streaming of IBS sample files over the network for the AMD Research IBS
+ * Toolkit.
+ *
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in
+ * include/LICENSE.bsd
+ *
+ *
+ * This file is user-space only. It holds the sending side of the stream
+ * protocol, which ibs_monitor and the libIBS daemon write through in place
+ * of a local file, and the pieces ibs_receiver uses to read it back. The
+ * including file must define _GNU_SOURCE before its first system header,
+ * for fopencookie(), and link with -lz.
+ *
+ */
+
+#ifndef IBS_STREAM_H
+#define IBS_STREAM_H
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/**
+ * DOC: IBS sample streams
+ *
+ * A stream carries one sample file to a receiver over a TCP or Unix-domain
+ * socket, byte for byte, so that the file the receiver writes is the one the
+ * sender would have written locally (format 3 chunk offsets included) and
+ * ibs_decoder reads it as usual.
+ *
+ * The sender opens the connection with an ibs_stream_hello_t, followed by
+ * name_len bytes: its host name and the file's name, each ending in '\0'.
+ * The rest is blocks, each an ibs_stream_block_t and len bytes holding the
+ * next raw_len bytes of the file. A block is deflated (zlib) if the hello
+ * has IBS_STREAM_DEFLATE and that made it smaller, which len < raw_len
+ * tells; otherwise it is stored. The sender closes the connection after the
+ * last block.
+ *
+ * Blocks are whatever the sender's buffer hands over at once, typically a
+ * whole output buffer of read() results, so the framing costs next to
+ * nothing per sample. Sending waits while the network or the receiver is
+ * behind. A collector that writes through a background thread keeps reading
+ * the driver until all of its buffers are queued; after that the driver's
+ * buffers fill, and what does not fit is counted as lost, as with slow
+ * storage.
+ *
+ * Traces in format 2 or 3 (see ibs-trace.h) are compressed already, so
+ * IBS_STREAM_DEFLATE is mostly worth it for raw samples.
+ */
+#define IBS_STREAM_MAGIC        "IBSSTRM1"
+#define IBS_STREAM_DEFLATE      0x1U
+#define IBS_STREAM_MAX_NAME     4096
+#define IBS_STREAM_MAX_BLOCK    (16U << 20)
+// stdio buffer of a stream, so that small writes still go out in big blocks
+#define IBS_STREAM_BUFFER       (1U << 20)
+
+typedef struct ibs_stream_hello {
+        char                magic[8];   /* IBS_STREAM_MAGIC, no '\0' */
+        uint32_t            flags;
+        uint32_t            name_len;
+} ibs_stream_hello_t;
+
+typedef struct ibs_stream_block {
+        uint32_t            raw_len;
+        uint32_t            len;        /* == raw_len if stored */
+} ibs_stream_block_t;
+
+typedef struct ibs_stream_cookie {
+        int                 fd;
+        uint32_t            flags;
+        off64_t             raw_bytes;  /* Of the file, sent so far */
+        unsigned char *     zbuf;
+        size_t              zbuf_len;
+        char *              iobuf;      /* The FILE's buffer */
+} ibs_stream_cookie_t;
+
+// Parse "unix:/path", "host:port" or "[v6 address]:port" and make a
+// connected socket, or a listening one. Returns -1 with errno set on failure.
+static inline int ibs_stream_socket(const char *addr, int listening)
+{
+    struct addrinfo hints, *res, *ai;
+    char *host, *port;
+    int fd = -1, err;
+
+    if (strncmp(addr, "unix:", 5) == 0)
+    {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(addr + 5) == 0 || strlen(addr + 5) >= sizeof(sa.sun_path))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        strcpy(sa.sun_path, addr + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        if (listening)
+            unlink(sa.sun_path);
+        if (listening ?
+                (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+                 listen(fd, SOMAXCONN)) :
+                connect(fd, (struct sockaddr *)&sa, sizeof(sa)))
+        {
+            err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        return fd;
+    }
+
+    host = strdup(addr);
+    if (host == NULL)
+        return -1;
+    port = strrchr(host, ':');
+    if (port == NULL || port[1] == '\0')
+    {
+        free(host);
+        errno = EINVAL;
+        return -1;
+    }
+    *port++ = '\0';
+    if (host[0] == '[' && port - host >= 3 && port[-2] == ']')
+    {
+        port[-2] = '\0';
+        memmove(host, host + 1, strlen(host));
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    free(host);
+    if (err)
+    {
+        errno = (err == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    // A listener tries IPv6 first, which also takes IPv4 senders
+    for (int pass = listening ? 0 : 1; pass < 2 && fd < 0; pass++)
+    {
+        for (ai = res; ai != NULL; ai = ai->ai_next)
+        {
+            int one = 1, zero = 0;
+            if (pass == 0 && ai->ai_family != AF_INET6)
+                continue;
+            fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (listening)
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (listening && ai->ai_family == AF_INET6)
+                setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero,
+                        sizeof(zero));
+            if (listening ?
+                    !bind(fd, ai->ai_addr, ai->ai_addrlen) &&
+                    !listen(fd, SOMAXCONN) :
+                    !connect(fd, ai->ai_addr, ai->ai_addrlen))
+                break;
+            err = errno;
+            close(fd);
+            errno = err;
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/**
+ * ibs_stream_connect - connect to a receiver
+ * @addr: "host:port", "[v6 address]:port" or "unix:/path/to/socket"
+ *
+ * Returns the socket, or -1 with errno set.
+ */
+static inline int ibs_stream_connect(const char *addr)
+{
+    return ibs_stream_socket(addr, 0);
+}
+
+/**
+ * ibs_stream_listen - listen for senders
+ * @addr: as for ibs_stream_connect; an empty host means every address
+ *
+ * A Unix-domain socket left behind by an earlier receiver is removed first.
+ * Returns the socket, or -1 with errno set.
+ */
+static inline int ibs_stream_listen(const char *addr)
+{
+    return ibs_stream_socket(addr, 1);
+}
+
+// Send all of iov (which is used up), waiting as long as the receiver needs
+static inline int ibs_stream_send(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        struct msghdr msg;
+        ssize_t sent;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0)
+            return -1;
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+/**
+ * ibs_stream_recv - read exactly len bytes
+ *
+ * Returns 0, 1 if the sender closed the connection before the first byte,
+ * or -1 with errno set (EPIPE if it closed part way).
+ */
+static inline int ibs_stream_recv(int fd, void *data, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len)
+    {
+        ssize_t got = recv(fd, (char *)data + done, len - done, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return -1;
+        if (got == 0)
+        {
+            if (done == 0)
+                return 1;
+            errno = EPIPE;
+            return -1;
+        }
+        done += got;
+    }
+    return 0;
+}
+
+static inline ssize_t ibs_stream_cookie_write(void *cookie, const char *buf,
+        size_t size)
+{
+    ibs_stream_cookie_t *s = cookie;
+    size_t done = 0;
+
+    while (done < size)
+    {
+        size_t n = size - done;
+        ibs_stream_block_t block;
+        struct iovec iov[2];
+
+        if (n > IBS_STREAM_MAX_BLOCK)
+            n = IBS_STREAM_MAX_BLOCK;
+        block.raw_len = n;
+        block.len = n;
+        iov[1].iov_base = (void *)(buf + done);
+        if (s->flags & IBS_STREAM_DEFLATE)
+        {
+            uLongf zlen = compressBound(n);
+            if (zlen > s->zbuf_len)
+            {
+                unsigned char *zbuf = realloc(s->zbuf, zlen);
+                if (zbuf == NULL)
+                    return -1;
+                s->zbuf = zbuf;
+                s->zbuf_len = zlen;
+            }
+            if (compress2(s->zbuf, &zlen, (const Bytef *)buf + done, n,
+                        Z_BEST_SPEED) == Z_OK && zlen < n)
+            {
+                block.len = zlen;
+                iov[1].iov_base = s->zbuf;
+            }
+        }
+        iov[0].iov_base = &block;
+        iov[0].iov_len = sizeof(block);
+        iov[1].iov_len = block.len;
+        if (ibs_stream_send(s->fd, iov, 2))
+            return -1;
+        s->raw_bytes += n;
+        done += n;
+    }
+    return size;
+}
+
+// Only ftello() is supported, which the trace writers need
+static inline int ibs_stream_cookie_seek(void *cookie, off64_t *off,
+        int whence)
+{
+    ibs_stream_cookie_t *s = cookie;
+
+    if (whence != SEEK_CUR || *off != 0)
+    {
+        errno = ESPIPE;
+        return -1;
+    }
+    *off = s->raw_bytes;
+    return 0;
+}
+
+static inline int ibs_stream_cookie_close(void *cookie)
+{
+    ibs_stream_cookie_t *s = cookie;
+    int ret = close(s->fd);
+
+    free(s->zbuf);
+    free(s->iobuf);
+    free(s);
+    return ret;
+}
+
+/**
+ * ibs_stream_open - stream a file to a receiver
+ * @addr:  where the receiver listens, as for ibs_stream_connect
+ * @name:  the file's name; the receiver keeps what follows the last '/'
+ * @flags: IBS_STREAM_DEFLATE, or 0
+ *
+ * The returned FILE stands in for the local file: write to it, and fclose()
+ * it to end the stream. ftello() works, but there is no fileno().
+ * Returns NULL with errno set on failure.
+ */
+static inline FILE *ibs_stream_open(const char *addr, const char *name,
+        uint32_t flags)
+{
+    cookie_io_functions_t funcs = {
+        .read = NULL,
+        .write = ibs_stream_cookie_write,
+        .seek = ibs_stream_cookie_seek,
+        .close = ibs_stream_cookie_close,
+    };
+    ibs_stream_hello_t hello;
+    ibs_stream_cookie_t *s;
+    const char *base = strrchr(name, '/');
+    char host[256];
+    struct iovec iov[3];
+    FILE *fp;
+    int err;
+
+    base = (base != NULL) ? base + 1 : name;
+    if (gethostname(host, sizeof(host)))
+        strcpy(host, "localhost");
+    host[sizeof(host) - 1] = '\0';
+
+    s = calloc(1, sizeof(*s));
+    if (s == NULL)
+        return NULL;
+    s->flags = flags;
+    s->iobuf = malloc(IBS_STREAM_BUFFER);
+    s->fd = ibs_stream_connect(addr);
+    if (s->iobuf == NULL || s->fd < 0)
+        goto fail;
+
+    memcpy(hello.magic, IBS_STREAM_MAGIC, sizeof(hello.magic));
+    hello.flags = flags;
+    hello.name_len = strlen(host) + 1 + strlen(base) + 1;
+    iov[0].iov_base = &hello;
+    iov[0].iov_len = sizeof(hello);
+    iov[1].iov_base = host;
+    iov[1].iov_len = strlen(host) + 1;
+    iov[2].iov_base = (void *)base;
+    iov[2].iov_len = strlen(base) + 1;
+    if (ibs_stream_send(s->fd, iov, 3))
+        goto fail;
+
+    fp = fopencookie(s, "w", funcs);
+    if (fp == NULL)
+        goto fail;
+    setvbuf(fp, s->iobuf, _IOFBF, IBS_STREAM_BUFFER);
+    return fp;
+
+fail:
+    err = errno;
+    if (s->fd >= 0)
+        close(s->fd);
+    free(s->iobuf);
+    free(s);
+    errno = err;
+    return NULL;
+}
+
+#endif  /* IBS_STREAM_H */
@@ -0,0 +1,1077 @@
+/*
+ * Compressed IBS trace formats (trace formats 2 and 3) for the AMD Research
+ * IBS Toolkit.
+ *
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in
+ * include/LICENSE.bsd
+ *
+ *
+ * This file is user-space only. It holds the writer used by ibs_monitor and
+ * the libIBS daemon, and the readers used by ibs_decoder. Link with -lz.
+ *
+ */
+
+#ifndef IBS_TRACE_H
+#define IBS_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "ibs-uapi.h"
+
+/**
+ * DOC: IBS trace format 2
+ *
+ * A format 1 trace is a text header followed by raw records, exactly as the
+ * driver hands them out. A format 2 trace has the same header, with an extra
+ * "IBS Trace Format: 2" line, followed by chunks. Each chunk is a struct
+ * ibs_trace_chunk and then len bytes of payload, which is a deflate (zlib)
+ * stream when codec is IBS_TRACE_CODEC_DEFLATE, or stored as is when the
+ * stream would not have been smaller.
+ *
+ * A chunk holds up to IBS_TRACE_CHUNK_RECORDS samples from one CPU, and can
+ * be decoded without any other chunk. Chunks from different CPUs are written
+ * as they fill, so samples are only in order within each CPU.
+ * Its uncompressed payload holds raw_len bytes of records. Each record holds
+ * the fields in the header's field mask, in the order of the full struct,
+ * encoded as:
+ *
+ * tsc and op_rip or fetch_lin_ad: the difference from the last record in
+ *      the chunk (or from 0), zigzag-encoded as a varint.
+ * cr3, tid and pid: a varint code. 0 is followed by the value as a varint,
+ *      which is added to the field's dictionary unless it already holds
+ *      IBS_TRACE_DICT_SIZE values. Code n is the dictionary's (n-1)th value.
+ *      Dictionaries start empty in each chunk.
+ * cpu and kern_mode: a varint.
+ * Everything else: the 8 bytes of the register, little-endian.
+ *
+ * Varints are 7 bits per byte, least significant first, with the top bit set
+ * on every byte but the last.
+ */
+#define IBS_TRACE_FORMAT_DELTA  2
+#define IBS_TRACE_MAGIC         0x43534249U     /* "IBSC" */
+#define IBS_TRACE_CHUNK_RECORDS 1024
+#define IBS_TRACE_DICT_SIZE     32
+#define IBS_TRACE_CPU_UNKNOWN   0xFFFFFFFFU
+
+#define IBS_TRACE_CODEC_NONE    0
+#define IBS_TRACE_CODEC_DEFLATE 1
+
+typedef struct ibs_trace_chunk {
+        uint32_t            magic;
+        uint32_t            cpu;
+        uint32_t            num_records;
+        uint32_t            codec;
+        uint32_t            raw_len;
+        uint32_t            len;
+} ibs_trace_chunk_t;
+
+/**
+ * DOC: IBS trace format 3
+ *
+ * Format 3 stores the same chunks column by column, so that a reader can
+ * pick out a few fields without decompressing the rest, and ends with an
+ * index of the chunks so that a reader can skip the ones it does not need.
+ *
+ * Each chunk's struct ibs_trace_chunk has codec IBS_TRACE_CODEC_NONE, and its
+ * len bytes of payload start with one struct ibs_trace_column per field in
+ * the field mask, in the order of the full struct. Then come the columns,
+ * each len bytes long. A column holds the field of every record in the chunk,
+ * encoded as in format 2, and compressed on its own as given by its codec.
+ * raw_len is the sum of the columns' raw_len.
+ *
+ * After the last chunk, a capture that ended cleanly has one struct
+ * ibs_trace_index per chunk, in file order, and then a struct
+ * ibs_trace_footer as the last bytes of the file. A trace without one, for
+ * example from a capture that was killed, can still be read chunk by chunk.
+ */
+#define IBS_TRACE_FORMAT_COLUMNS 3
+#define IBS_TRACE_FOOTER_MAGIC  0x46534249U     /* "IBSF" */
+// Most pids struct ibs_trace_index can list
+#define IBS_TRACE_INDEX_PIDS    7
+#define IBS_TRACE_PIDS_MANY     0xFFFFFFFFU
+
+// Newest format this header reads
+#define IBS_TRACE_FORMAT        IBS_TRACE_FORMAT_COLUMNS
+
+typedef struct ibs_trace_column {
+        uint64_t            field;
+        uint32_t            codec;
+        uint32_t            raw_len;
+        uint32_t            len;
+        uint32_t            reserved;
+} ibs_trace_column_t;
+
+typedef struct ibs_trace_index {
+        uint64_t            offset;     /* Of the chunk, in the file */
+        uint64_t            min_tsc;    /* 0 and ~0 without IBS_FIELD_TSC */
+        uint64_t            max_tsc;
+        uint32_t            cpu;
+        uint32_t            num_records;
+        uint32_t            num_pids;   /* IBS_TRACE_PIDS_MANY if there were
+                                           too many, or no IBS_FIELD_PID */
+        uint32_t            pids[IBS_TRACE_INDEX_PIDS];
+} ibs_trace_index_t;
+
+typedef struct ibs_trace_footer {
+        uint64_t            index_offset;
+        uint32_t            num_chunks;
+        uint32_t            magic;
+} ibs_trace_footer_t;
+
+// Order of the fields in the full ibs_op_t and ibs_fetch_t structs, which is
+// also the order of whatever subset of them a record holds.
+static const uint64_t ibs_op_field_order[] = {
+    IBS_OP_FIELD_CTL, IBS_OP_FIELD_RIP, IBS_OP_FIELD_DATA, IBS_OP_FIELD_DATA2,
+    IBS_OP_FIELD_DATA3, IBS_OP_FIELD_DATA4, IBS_OP_FIELD_DC_LIN_AD,
+    IBS_OP_FIELD_DC_PHYS_AD, IBS_OP_FIELD_BR_TARGET, IBS_FIELD_TSC,
+    IBS_FIELD_CR3, IBS_FIELD_TID, IBS_FIELD_PID, IBS_FIELD_CPU,
+    IBS_FIELD_KERN_MODE
+};
+#define IBS_OP_NUM_FIELDS \
+    (sizeof(ibs_op_field_order) / sizeof(ibs_op_field_order[0]))
+
+static const uint64_t ibs_fetch_field_order[] = {
+    IBS_FETCH_FIELD_CTL, IBS_FETCH_FIELD_CTL_EXTD, IBS_FETCH_FIELD_LIN_AD,
+    IBS_FETCH_FIELD_PHYS_AD, IBS_FIELD_TSC, IBS_FIELD_CR3, IBS_FIELD_TID,
+    IBS_FIELD_PID, IBS_FIELD_CPU, IBS_FIELD_KERN_MODE
+};
+#define IBS_FETCH_NUM_FIELDS \
+    (sizeof(ibs_fetch_field_order) / sizeof(ibs_fetch_field_order[0]))
+
+// A varint is at most 10 bytes, and a dictionary literal one more
+#define IBS_TRACE_MAX_VALUE     11
+#define IBS_TRACE_MAX_RECORD    (IBS_OP_NUM_FIELDS * IBS_TRACE_MAX_VALUE)
+#define IBS_TRACE_MAX_COLUMN    (IBS_TRACE_CHUNK_RECORDS * IBS_TRACE_MAX_VALUE)
+
+// How a field is encoded; see the documentation above
+enum ibs_trace_coding {
+    IBS_TRACE_RAW,
+    IBS_TRACE_DELTA,
+    IBS_TRACE_DICT,
+    IBS_TRACE_VARINT,
+};
+
+// What a writer or reader keeps between the records of one chunk
+typedef struct ibs_trace_state {
+        uint64_t            last[2];    /* tsc, op_rip or fetch_lin_ad */
+        uint64_t            dict[3][IBS_TRACE_DICT_SIZE];   /* cr3, tid, pid */
+        uint32_t            dict_len[3];
+} ibs_trace_state_t;
+
+// Samples from one CPU that have not been written out yet. Format 2 keeps
+// them encoded; format 3 keeps the packed records until the chunk is full.
+typedef struct ibs_trace_cpu {
+        ibs_trace_state_t   state;
+        unsigned char *     buf;
+        size_t              len;
+        uint32_t            num_records;
+} ibs_trace_cpu_t;
+
+typedef void (*ibs_trace_emit_t)(void *arg, const void *data, size_t len);
+
+typedef struct ibs_trace_writer {
+        uint32_t            format;
+        uint64_t            fields;
+        uint64_t            addr_field;
+        const uint64_t *    order;
+        size_t              num_fields;
+        size_t              entry_size;
+        ibs_trace_emit_t    emit;
+        void *              arg;
+        ibs_trace_cpu_t *   cpus;       /* Indexed by CPU + 1 */
+        int                 num_cpus;
+        unsigned char *     out;
+        size_t              out_len;
+        unsigned char *     scratch;    /* One format 3 column */
+        uint64_t            offset;     /* Where the next chunk goes */
+        ibs_trace_index_t * index;      /* Format 3 chunks so far */
+        uint32_t            num_chunks;
+        uint32_t            index_len;
+        uint64_t            raw_bytes;  /* Records handed to the writer */
+        uint64_t            out_bytes;  /* Chunks handed to emit */
+} ibs_trace_writer_t;
+
+// A format 3 trace mapped into memory. Once opened, it is only read, so
+// several threads can decode chunks out of it at once.
+typedef struct ibs_trace_map {
+        const unsigned char *base;
+        size_t              len;
+        uint64_t            fields;
+        uint64_t            addr_field;
+        const uint64_t *    order;
+        size_t              num_fields;
+        size_t              full_size;  /* Of an ibs_op_t or ibs_fetch_t */
+        ibs_trace_index_t * index;
+        uint32_t            num_chunks;
+} ibs_trace_map_t;
+
+typedef struct ibs_trace_reader {
+        uint64_t            fields;
+        uint64_t            addr_field;
+        const uint64_t *    order;
+        size_t              num_fields;
+        ibs_trace_state_t   state;
+        unsigned char *     raw;
+        size_t              raw_len;
+        unsigned char *     in;
+        size_t              in_len;
+        const unsigned char *pos;
+        const unsigned char *end;
+        uint32_t            left;       /* Records left in this chunk */
+        // Format 3 only
+        ibs_trace_map_t     map;
+        unsigned char *     recs;       /* The current chunk, decoded */
+        uint32_t            next_chunk;
+        uint32_t            next_rec;
+        uint32_t            num_recs;
+} ibs_trace_reader_t;
+
+static inline enum ibs_trace_coding ibs_trace_coding(uint64_t field,
+        uint64_t addr_field, int *slot)
+{
+    if (field == IBS_FIELD_TSC || field == addr_field)
+    {
+        *slot = (field == IBS_FIELD_TSC) ? 0 : 1;
+        return IBS_TRACE_DELTA;
+    }
+    if (field == IBS_FIELD_CR3 || field == IBS_FIELD_TID ||
+            field == IBS_FIELD_PID)
+    {
+        *slot = (field == IBS_FIELD_CR3) ? 0 :
+            (field == IBS_FIELD_TID) ? 1 : 2;
+        return IBS_TRACE_DICT;
+    }
+    if (field == IBS_FIELD_CPU || field == IBS_FIELD_KERN_MODE)
+        return IBS_TRACE_VARINT;
+    return IBS_TRACE_RAW;
+}
+
+static inline size_t ibs_trace_field_len(uint64_t field)
+{
+    return (field & IBS_FIELDS_NARROW) ? 4 : 8;
+}
+
+// Offset of field in a record holding fields (or in the full struct, when
+// fields has every bit set). Returns -1 if the record does not hold it.
+static inline long ibs_trace_field_offset(const uint64_t *order,
+        size_t num_fields, uint64_t fields, uint64_t field)
+{
+    size_t off = 0;
+    for (size_t i = 0; i < num_fields; i++)
+    {
+        if (order[i] == field)
+            return (fields & field) ? (long)off : -1;
+        if (fields & order[i])
+            off += ibs_trace_field_len(order[i]);
+    }
+    return -1;
+}
+
+static inline uint64_t ibs_trace_load(const unsigned char *src, size_t len)
+{
+    uint64_t val = 0;
+    uint32_t narrow;
+
+    if (len == 4)
+    {
+        memcpy(&narrow, src, sizeof(narrow));
+        return narrow;
+    }
+    memcpy(&val, src, sizeof(val));
+    return val;
+}
+
+static inline void ibs_trace_store(unsigned char *dst, size_t len,
+        uint64_t val)
+{
+    uint32_t narrow = (uint32_t)val;
+
+    if (len == 4)
+        memcpy(dst, &narrow, sizeof(narrow));
+    else
+        memcpy(dst, &val, sizeof(val));
+}
+
+static inline unsigned char *ibs_trace_put_varint(unsigned char *p,
+        uint64_t val)
+{
+    while (val >= 0x80)
+    {
+        *p++ = (unsigned char)(val | 0x80);
+        val >>= 7;
+    }
+    *p++ = (unsigned char)val;
+    return p;
+}
+
+// Returns NULL if the varint runs past end
+static inline const unsigned char *ibs_trace_get_varint(
+        const unsigned char *p, const unsigned char *end, uint64_t *val)
+{
+    uint64_t v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        v |= (uint64_t)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80))
+        {
+            *val = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Encode one field at p, which has room for IBS_TRACE_MAX_VALUE bytes
+static inline unsigned char *ibs_trace_put_value(unsigned char *p,
+        ibs_trace_state_t *st, enum ibs_trace_coding coding, int slot,
+        uint64_t val)
+{
+    int64_t delta;
+    uint32_t n, j;
+
+    switch (coding)
+    {
+        case IBS_TRACE_DELTA:
+            delta = (int64_t)(val - st->last[slot]);
+            st->last[slot] = val;
+            return ibs_trace_put_varint(p,
+                    ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        case IBS_TRACE_DICT:
+            n = st->dict_len[slot];
+            for (j = 0; j < n; j++)
+                if (st->dict[slot][j] == val)
+                    return ibs_trace_put_varint(p, j + 1);
+            *p++ = 0;
+            if (n < IBS_TRACE_DICT_SIZE)
+            {
+                st->dict[slot][n] = val;
+                st->dict_len[slot]++;
+            }
+            return ibs_trace_put_varint(p, val);
+        case IBS_TRACE_VARINT:
+            return ibs_trace_put_varint(p, val);
+        default:
+            memcpy(p, &val, sizeof(val));
+            return p + sizeof(val);
+    }
+}
+
+// Decode one field at p. Returns NULL if it is damaged or runs past end.
+static inline const unsigned char *ibs_trace_get_value(const unsigned char *p,
+        const unsigned char *end, ibs_trace_state_t *st,
+        enum ibs_trace_coding coding, int slot, uint64_t *val)
+{
+    switch (coding)
+    {
+        case IBS_TRACE_DELTA:
+            if ((p = ibs_trace_get_varint(p, end, val)) == NULL)
+                return NULL;
+            *val = st->last[slot] + ((*val >> 1) ^ (0 - (*val & 1)));
+            st->last[slot] = *val;
+            return p;
+        case IBS_TRACE_DICT:
+            if ((p = ibs_trace_get_varint(p, end, val)) == NULL ||
+                    *val > st->dict_len[slot])
+                return NULL;
+            if (*val > 0)
+            {
+                *val = st->dict[slot][*val - 1];
+                return p;
+            }
+            if ((p = ibs_trace_get_varint(p, end, val)) == NULL)
+                return NULL;
+            if (st->dict_len[slot] < IBS_TRACE_DICT_SIZE)
+                st->dict[slot][st->dict_len[slot]++] = *val;
+            return p;
+        case IBS_TRACE_VARINT:
+            return ibs_trace_get_varint(p, end, val);
+        default:
+            if (end - p < (ptrdiff_t)sizeof(*val))
+                return NULL;
+            memcpy(val, p, sizeof(*val));
+            return p + sizeof(*val);
+    }
+}
+
+static inline void ibs_trace_init_fields(uint64_t fields, int is_op,
+        uint64_t *out_fields, uint64_t *addr_field, const uint64_t **order,
+        size_t *num_fields)
+{
+    *out_fields = fields;
+    *addr_field = is_op ? IBS_OP_FIELD_RIP : IBS_FETCH_FIELD_LIN_AD;
+    *order = is_op ? ibs_op_field_order : ibs_fetch_field_order;
+    *num_fields = is_op ? IBS_OP_NUM_FIELDS : IBS_FETCH_NUM_FIELDS;
+}
+
+static inline int ibs_trace_reserve(unsigned char **buf, size_t *len,
+        size_t want)
+{
+    unsigned char *tmp;
+
+    if (*len >= want)
+        return 0;
+    tmp = realloc(*buf, want);
+    if (tmp == NULL)
+        return -1;
+    *buf = tmp;
+    *len = want;
+    return 0;
+}
+
+/**
+ * ibs_trace_writer_init - start writing a format 2 or 3 trace
+ * @w:      the writer
+ * @format: IBS_TRACE_FORMAT_DELTA or IBS_TRACE_FORMAT_COLUMNS
+ * @is_op:  op samples rather than fetch samples
+ * @fields: the field mask the records were taken with
+ * @offset: where the first chunk will go in the file, after the header
+ * @emit:   called with each finished chunk, in pieces
+ * @arg:    passed to emit
+ *
+ * The caller writes the text header before the first chunk is emitted.
+ */
+static inline void ibs_trace_writer_init(ibs_trace_writer_t *w,
+        uint32_t format, int is_op, uint64_t fields, uint64_t offset,
+        ibs_trace_emit_t emit, void *arg)
+{
+    memset(w, 0, sizeof(*w));
+    w->format = format;
+    ibs_trace_init_fields(fields, is_op, &w->fields, &w->addr_field,
+            &w->order, &w->num_fields);
+    w->entry_size = ibs_sample_entry_size(fields);
+    w->offset = offset;
+    w->emit = emit;
+    w->arg = arg;
+}
+
+static inline void ibs_trace_emit_chunk(ibs_trace_writer_t *w,
+        ibs_trace_chunk_t *hdr, const void *payload)
+{
+    w->emit(w->arg, hdr, sizeof(*hdr));
+    w->emit(w->arg, payload, hdr->len);
+    w->offset += sizeof(*hdr) + hdr->len;
+    w->out_bytes += sizeof(*hdr) + hdr->len;
+}
+
+// Format 2: compress the records that c holds encoded
+static inline int ibs_trace_flush_rows(ibs_trace_writer_t *w,
+        ibs_trace_cpu_t *c, ibs_trace_chunk_t *hdr)
+{
+    uLongf len = compressBound(c->len);
+
+    if (ibs_trace_reserve(&w->out, &w->out_len, len))
+        return -1;
+
+    hdr->raw_len = c->len;
+    // Speed matters more than ratio here: this runs as samples come in
+    if (compress2(w->out, &len, c->buf, c->len, Z_BEST_SPEED) == Z_OK &&
+            len < c->len)
+    {
+        hdr->codec = IBS_TRACE_CODEC_DEFLATE;
+        hdr->len = len;
+        ibs_trace_emit_chunk(w, hdr, w->out);
+    }
+    else
+    {
+        hdr->codec = IBS_TRACE_CODEC_NONE;
+        hdr->len = c->len;
+        ibs_trace_emit_chunk(w, hdr, c->buf);
+    }
+    return 0;
+}
+
+// Format 3: encode and compress each column of the packed records in c, and
+// add the chunk to the index
+static inline int ibs_trace_flush_columns(ibs_trace_writer_t *w,
+        ibs_trace_cpu_t *c, ibs_trace_chunk_t *hdr)
+{
+    size_t num_cols = __builtin_popcountll(w->fields);
+    size_t pos = num_cols * sizeof(ibs_trace_column_t);
+    ibs_trace_index_t ent;
+    size_t col = 0, rec_off = 0;
+
+    if (ibs_trace_reserve(&w->out, &w->out_len,
+                pos + num_cols * compressBound(IBS_TRACE_MAX_COLUMN)))
+        return -1;
+    if (w->scratch == NULL &&
+            (w->scratch = malloc(IBS_TRACE_MAX_COLUMN)) == NULL)
+        return -1;
+    if (w->num_chunks == w->index_len)
+    {
+        uint32_t len = w->index_len ? 2 * w->index_len : 64;
+        ibs_trace_index_t *index = realloc(w->index, len * sizeof(*index));
+        if (index == NULL)
+            return -1;
+        w->index = index;
+        w->index_len = len;
+    }
+
+    memset(&ent, 0, sizeof(ent));
+    ent.offset = w->offset;
+    ent.cpu = hdr->cpu;
+    ent.num_records = hdr->num_records;
+    ent.min_tsc = 0;
+    ent.max_tsc = ~0ULL;
+    ent.num_pids = IBS_TRACE_PIDS_MANY;
+
+    hdr->codec = IBS_TRACE_CODEC_NONE;
+    hdr->raw_len = 0;
+    for (size_t i = 0; i < w->num_fields; i++)
+    {
+        uint64_t field = w->order[i];
+        size_t flen = ibs_trace_field_len(field);
+        ibs_trace_column_t dir;
+        ibs_trace_state_t st;
+        unsigned char *p = w->scratch;
+        uLongf len;
+        int slot = 0;
+        enum ibs_trace_coding coding;
+
+        if (!(w->fields & field))
+            continue;
+        coding = ibs_trace_coding(field, w->addr_field, &slot);
+        memset(&st, 0, sizeof(st));
+        if (field == IBS_FIELD_TSC)
+        {
+            ent.min_tsc = ~0ULL;
+            ent.max_tsc = 0;
+        }
+        if (field == IBS_FIELD_PID)
+            ent.num_pids = 0;
+
+        for (uint32_t r = 0; r < c->num_records; r++)
+        {
+            uint64_t val = ibs_trace_load(c->buf + r * w->entry_size +
+                    rec_off, flen);
+            p = ibs_trace_put_value(p, &st, coding, slot, val);
+            if (field == IBS_FIELD_TSC)
+            {
+                if (val < ent.min_tsc)
+                    ent.min_tsc = val;
+                if (val > ent.max_tsc)
+                    ent.max_tsc = val;
+            }
+            if (field == IBS_FIELD_PID && ent.num_pids != IBS_TRACE_PIDS_MANY)
+            {
+                uint32_t j;
+                for (j = 0; j < ent.num_pids; j++)
+                    if (ent.pids[j] == (uint32_t)val)
+                        break;
+                if (j == ent.num_pids && j == IBS_TRACE_INDEX_PIDS)
+                    ent.num_pids = IBS_TRACE_PIDS_MANY;
+                else if (j == ent.num_pids)
+                    ent.pids[ent.num_pids++] = (uint32_t)val;
+            }
+        }
+        rec_off += flen;
+
+        memset(&dir, 0, sizeof(dir));
+        dir.field = field;
+        dir.raw_len = p - w->scratch;
+        len = compressBound(dir.raw_len);
+        if (compress2(w->out + pos, &len, w->scratch, dir.raw_len,
+                    Z_BEST_SPEED) == Z_OK && len < dir.raw_len)
+        {
+            dir.codec = IBS_TRACE_CODEC_DEFLATE;
+            dir.len = len;
+        }
+        else
+        {
+            dir.codec = IBS_TRACE_CODEC_NONE;
+            dir.len = dir.raw_len;
+            memcpy(w->out + pos, w->scratch, dir.raw_len);
+        }
+        memcpy(w->out + col * sizeof(dir), &dir, sizeof(dir));
+        hdr->raw_len += dir.raw_len;
+        pos += dir.len;
+        col++;
+    }
+
+    hdr->len = pos;
+    w->index[w->num_chunks++] = ent;
+    ibs_trace_emit_chunk(w, hdr, w->out);
+    return 0;
+}
+
+// Compress and emit what cpu holds. Returns -1 if out of memory.
+static inline int ibs_trace_flush_cpu(ibs_trace_writer_t *w,
+        ibs_trace_cpu_t *c, int cpu)
+{
+    ibs_trace_chunk_t hdr;
+    int ret;
+
+    if (c->num_records == 0)
+        return 0;
+
+    hdr.magic = IBS_TRACE_MAGIC;
+    hdr.cpu = (cpu < 0) ? IBS_TRACE_CPU_UNKNOWN : (uint32_t)cpu;
+    hdr.num_records = c->num_records;
+    if (w->format == IBS_TRACE_FORMAT_COLUMNS)
+        ret = ibs_trace_flush_columns(w, c, &hdr);
+    else
+        ret = ibs_trace_flush_rows(w, c, &hdr);
+    if (ret)
+        return ret;
+
+    memset(&c->state, 0, sizeof(c->state));
+    c->len = 0;
+    c->num_records = 0;
+    return 0;
+}
+
+/**
+ * ibs_trace_put - add one sample to a trace
+ * @w:      the writer
+ * @cpu:    the CPU it was read from, or -1 if that is not known
+ * @record: the sample, packed as the driver hands it out for w's field mask
+ *
+ * Returns 0, or -1 if out of memory.
+ */
+static inline int ibs_trace_put(ibs_trace_writer_t *w, int cpu,
+        const void *record)
+{
+    const unsigned char *src = record;
+    ibs_trace_cpu_t *c;
+    unsigned char *p;
+
+    if (cpu < -1)
+        cpu = -1;
+    if (cpu + 1 >= w->num_cpus)
+    {
+        int num_cpus = cpu + 2;
+        ibs_trace_cpu_t *cpus = realloc(w->cpus,
+                num_cpus * sizeof(ibs_trace_cpu_t));
+        if (cpus == NULL)
+            return -1;
+        memset(&cpus[w->num_cpus], 0,
+                (num_cpus - w->num_cpus) * sizeof(ibs_trace_cpu_t));
+        w->cpus = cpus;
+        w->num_cpus = num_cpus;
+    }
+    c = &w->cpus[cpu + 1];
+    if (c->buf == NULL)
+    {
+        c->buf = malloc(IBS_TRACE_CHUNK_RECORDS *
+                ((w->format == IBS_TRACE_FORMAT_COLUMNS) ?
+                 w->entry_size : IBS_TRACE_MAX_RECORD));
+        if (c->buf == NULL)
+            return -1;
+    }
+
+    p = c->buf + c->len;
+    if (w->format == IBS_TRACE_FORMAT_COLUMNS)
+    {
+        memcpy(p, src, w->entry_size);
+        p += w->entry_size;
+    }
+    else
+    {
+        for (size_t i = 0; i < w->num_fields; i++)
+        {
+            uint64_t field = w->order[i];
+            size_t len = ibs_trace_field_len(field);
+            int slot = 0;
+            enum ibs_trace_coding coding;
+
+            if (!(w->fields & field))
+                continue;
+            coding = ibs_trace_coding(field, w->addr_field, &slot);
+            p = ibs_trace_put_value(p, &c->state, coding, slot,
+                    ibs_trace_load(src, len));
+            src += len;
+        }
+    }
+
+    w->raw_bytes += w->entry_size;
+    c->len = p - c->buf;
+    if (++c->num_records == IBS_TRACE_CHUNK_RECORDS)
+        return ibs_trace_flush_cpu(w, c, cpu);
+    return 0;
+}
+
+// Emit every partial chunk. Returns -1 if out of memory.
+static inline int ibs_trace_flush(ibs_trace_writer_t *w)
+{
+    int ret = 0;
+    for (int i = 0; i < w->num_cpus; i++)
+        if (ibs_trace_flush_cpu(w, &w->cpus[i], i - 1))
+            ret = -1;
+    return ret;
+}
+
+// Flush, write the format 3 index, and free the writer
+static inline int ibs_trace_writer_fini(ibs_trace_writer_t *w)
+{
+    int ret = ibs_trace_flush(w);
+
+    if (w->format == IBS_TRACE_FORMAT_COLUMNS)
+    {
+        ibs_trace_footer_t footer;
+        footer.index_offset = w->offset;
+        footer.num_chunks = w->num_chunks;
+        footer.magic = IBS_TRACE_FOOTER_MAGIC;
+        if (w->num_chunks)
+            w->emit(w->arg, w->index, w->num_chunks * sizeof(*w->index));
+        w->emit(w->arg, &footer, sizeof(footer));
+        w->out_bytes += w->num_chunks * sizeof(*w->index) + sizeof(footer);
+    }
+
+    for (int i = 0; i < w->num_cpus; i++)
+        free(w->cpus[i].buf);
+    free(w->cpus);
+    free(w->out);
+    free(w->scratch);
+    free(w->index);
+    w->cpus = NULL;
+    w->num_cpus = 0;
+    w->out = NULL;
+    w->scratch = NULL;
+    w->index = NULL;
+    return ret;
+}
+
+// Read a chunk header out of a mapped trace. Returns -1 if there is none.
+static inline int ibs_trace_map_header(const ibs_trace_map_t *m,
+        uint64_t off, ibs_trace_chunk_t *hdr)
+{
+    if (off > m->len || m->len - off < sizeof(*hdr))
+        return -1;
+    memcpy(hdr, m->base + off, sizeof(*hdr));
+    if (hdr->magic != IBS_TRACE_MAGIC ||
+            m->len - off - sizeof(*hdr) < hdr->len)
+        return -1;
+    return 0;
+}
+
+/**
+ * ibs_trace_map_open - map a format 3 trace and load its index
+ * @m:      the map
+ * @fd:     the trace
+ * @data_offset: where the first chunk starts, just after the header
+ * @is_op:  op samples rather than fetch samples
+ * @fields: the field mask from the trace header
+ *
+ * Without a footer, the index is rebuilt by walking the chunks, and its
+ * tsc and pid entries are left unknown. Returns 0, or -1 if fd cannot be
+ * mapped or memory runs out.
+ */
+static inline int ibs_trace_map_open(ibs_trace_map_t *m, int fd,
+        uint64_t data_offset, int is_op, uint64_t fields)
+{
+    ibs_trace_footer_t footer;
+    ibs_trace_chunk_t hdr;
+    struct stat st;
+    uint32_t len = 0;
+    void *base;
+
+    memset(m, 0, sizeof(*m));
+    ibs_trace_init_fields(fields, is_op, &m->fields, &m->addr_field,
+            &m->order, &m->num_fields);
+    m->full_size = is_op ? sizeof(ibs_op_t) : sizeof(ibs_fetch_t);
+
+    if (fstat(fd, &st) || (uint64_t)st.st_size < data_offset)
+        return -1;
+    m->len = st.st_size;
+    if (m->len == 0)
+        return 0;
+    base = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    m->base = base;
+
+    if (m->len - data_offset >= sizeof(footer))
+    {
+        memcpy(&footer, m->base + m->len - sizeof(footer), sizeof(footer));
+        if (footer.magic == IBS_TRACE_FOOTER_MAGIC &&
+                footer.index_offset >= data_offset &&
+                footer.index_offset <= m->len - sizeof(footer) &&
+                (m->len - sizeof(footer) - footer.index_offset) ==
+                footer.num_chunks * sizeof(ibs_trace_index_t))
+        {
+            m->index = malloc((footer.num_chunks + 1) *
+                    sizeof(ibs_trace_index_t));
+            if (m->index == NULL)
+                return -1;
+            memcpy(m->index, m->base + footer.index_offset,
+                    footer.num_chunks * sizeof(ibs_trace_index_t));
+            m->num_chunks = footer.num_chunks;
+            return 0;
+        }
+    }
+
+    // No footer: walk the chunks until something is not one
+    for (uint64_t off = data_offset; !ibs_trace_map_header(m, off, &hdr);
+            off += sizeof(hdr) + hdr.len)
+    {
+        ibs_trace_index_t *ent;
+        if (m->num_chunks == len)
+        {
+            len = len ? 2 * len : 64;
+            ent = realloc(m->index, len * sizeof(*ent));
+            if (ent == NULL)
+                return -1;
+            m->index = ent;
+        }
+        ent = &m->index[m->num_chunks++];
+        memset(ent, 0, sizeof(*ent));
+        ent->offset = off;
+        ent->cpu = hdr.cpu;
+        ent->num_records = hdr.num_records;
+        ent->max_tsc = ~0ULL;
+        ent->num_pids = IBS_TRACE_PIDS_MANY;
+    }
+    return 0;
+}
+
+static inline void ibs_trace_map_close(ibs_trace_map_t *m)
+{
+    if (m->base != NULL)
+        munmap((void *)m->base, m->len);
+    free(m->index);
+    m->base = NULL;
+    m->index = NULL;
+    m->num_chunks = 0;
+}
+
+/**
+ * ibs_trace_map_chunk - decode one chunk of a mapped format 3 trace
+ * @m:      the map
+ * @i:      which chunk, in index order
+ * @want:   the fields to decode. Only their columns are decompressed.
+ * @out:    room for IBS_TRACE_CHUNK_RECORDS full ibs_op_t or ibs_fetch_t.
+ *          Fields that were not recorded or not wanted are left as zero.
+ * @scratch: IBS_TRACE_MAX_COLUMN bytes. Each thread needs its own.
+ *
+ * Returns the number of records in the chunk, or -1 if it is damaged.
+ */
+static inline long ibs_trace_map_chunk(const ibs_trace_map_t *m, uint32_t i,
+        uint64_t want, void *out, unsigned char *scratch)
+{
+    const unsigned char *dir, *col, *end;
+    ibs_trace_chunk_t hdr;
+    size_t num_cols = __builtin_popcountll(m->fields);
+
+    if (i >= m->num_chunks ||
+            ibs_trace_map_header(m, m->index[i].offset, &hdr) ||
+            hdr.num_records > IBS_TRACE_CHUNK_RECORDS ||
+            hdr.len < num_cols * sizeof(ibs_trace_column_t))
+        return -1;
+
+    dir = m->base + m->index[i].offset + sizeof(hdr);
+    end = dir + hdr.len;
+    col = dir + num_cols * sizeof(ibs_trace_column_t);
+    memset(out, 0, hdr.num_records * m->full_size);
+
+    for (size_t k = 0; k < num_cols; k++)
+    {
+        ibs_trace_column_t c;
+        const unsigned char *p, *p_end;
+        ibs_trace_state_t st;
+        long off;
+        int slot = 0;
+        enum ibs_trace_coding coding;
+
+        memcpy(&c, dir + k * sizeof(c), sizeof(c));
+        if (c.len > (size_t)(end - col) || c.raw_len > IBS_TRACE_MAX_COLUMN)
+            return -1;
+        off = ibs_trace_field_offset(m->order, m->num_fields, ~0ULL, c.field);
+        if (off < 0 || !(m->fields & c.field))
+            return -1;
+        if (!(want & c.field))
+        {
+            col += c.len;
+            continue;
+        }
+
+        if (c.codec == IBS_TRACE_CODEC_DEFLATE)
+        {
+            uLongf raw_len = c.raw_len;
+            if (uncompress(scratch, &raw_len, col, c.len) != Z_OK ||
+                    raw_len != c.raw_len)
+                return -1;
+            p = scratch;
+        }
+        else if (c.codec == IBS_TRACE_CODEC_NONE && c.len == c.raw_len)
+            p = col;
+        else
+            return -1;
+        p_end = p + c.raw_len;
+        col += c.len;
+
+        coding = ibs_trace_coding(c.field, m->addr_field, &slot);
+        memset(&st, 0, sizeof(st));
+        for (uint32_t r = 0; r < hdr.num_records; r++)
+        {
+            uint64_t val;
+            if ((p = ibs_trace_get_value(p, p_end, &st, coding, slot,
+                            &val)) == NULL)
+                return -1;
+            ibs_trace_store((unsigned char *)out + r * m->full_size + off,
+                    ibs_trace_field_len(c.field), val);
+        }
+    }
+    return hdr.num_records;
+}
+
+/**
+ * ibs_trace_reader_init - start reading a format 2 or 3 trace
+ * @r:      the reader
+ * @is_op:  op samples rather than fetch samples
+ * @fields: the field mask from the trace header
+ */
+static inline void ibs_trace_reader_init(ibs_trace_reader_t *r, int is_op,
+        uint64_t fields)
+{
+    memset(r, 0, sizeof(*r));
+    ibs_trace_init_fields(fields, is_op, &r->fields, &r->addr_field,
+            &r->order, &r->num_fields);
+}
+
+/**
+ * ibs_trace_reader_map - read a format 3 trace through ibs_trace_read
+ * @r:      a reader set up with ibs_trace_reader_init
+ * @fd:     the trace
+ * @data_offset: where the first chunk starts, just after the header
+ * @is_op:  op samples rather than fetch samples
+ *
+ * Returns 0, or -1 if the trace cannot be mapped or memory runs out.
+ */
+static inline int ibs_trace_reader_map(ibs_trace_reader_t *r, int fd,
+        uint64_t data_offset, int is_op)
+{
+    if (ibs_trace_map_open(&r->map, fd, data_offset, is_op, r->fields))
+        return -1;
+    r->recs = malloc(IBS_TRACE_CHUNK_RECORDS * r->map.full_size);
+    if (r->recs == NULL ||
+            ibs_trace_reserve(&r->raw, &r->raw_len, IBS_TRACE_MAX_COLUMN))
+        return -1;
+    return 0;
+}
+
+static inline void ibs_trace_reader_fini(ibs_trace_reader_t *r)
+{
+    ibs_trace_map_close(&r->map);
+    free(r->recs);
+    free(r->raw);
+    free(r->in);
+    r->recs = NULL;
+    r->raw = NULL;
+    r->in = NULL;
+}
+
+// Read and decompress the next format 2 chunk. Returns 1, 0 at the end of
+// the trace, or -1 if the trace is damaged or memory runs out.
+static inline int ibs_trace_next_chunk(ibs_trace_reader_t *r, FILE *fp)
+{
+    ibs_trace_chunk_t hdr;
+    uLongf raw_len;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1)
+        return 0;
+    if (hdr.magic != IBS_TRACE_MAGIC || hdr.codec > IBS_TRACE_CODEC_DEFLATE ||
+            hdr.raw_len > IBS_TRACE_CHUNK_RECORDS * IBS_TRACE_MAX_RECORD ||
+            hdr.len > compressBound(hdr.raw_len))
+        return -1;
+
+    if (ibs_trace_reserve(&r->raw, &r->raw_len, hdr.raw_len))
+        return -1;
+    if (hdr.codec == IBS_TRACE_CODEC_NONE)
+    {
+        if (hdr.len != hdr.raw_len ||
+                fread(r->raw, 1, hdr.len, fp) != hdr.len)
+            return -1;
+    }
+    else
+    {
+        if (ibs_trace_reserve(&r->in, &r->in_len, hdr.len))
+            return -1;
+        raw_len = hdr.raw_len;
+        if (fread(r->in, 1, hdr.len, fp) != hdr.len ||
+                uncompress(r->raw, &raw_len, r->in, hdr.len) != Z_OK ||
+                raw_len != hdr.raw_len)
+            return -1;
+    }
+
+    memset(&r->state, 0, sizeof(r->state));
+    r->pos = r->raw;
+    r->end = r->raw + hdr.raw_len;
+    r->left = hdr.num_records;
+    return 1;
+}
+
+/**
+ * ibs_trace_read - read the next record of a format 2 or 3 trace
+ * @r:      the reader
+ * @fp:     a format 2 trace, just after its header or the last record read
+ * @out:    a full ibs_op_t or ibs_fetch_t. Fields that were not recorded
+ *          are left as zero.
+ *
+ * Returns 1, 0 at the end of the trace, or -1 if the trace is damaged.
+ */
+static inline int ibs_trace_read(ibs_trace_reader_t *r, FILE *fp, void *out)
+{
+    unsigned char *dst = out;
+    const unsigned char *p;
+
+    if (r->recs != NULL)
+    {
+        while (r->next_rec == r->num_recs)
+        {
+            long n;
+            if (r->next_chunk == r->map.num_chunks)
+                return 0;
+            n = ibs_trace_map_chunk(&r->map, r->next_chunk++, r->fields,
+                    r->recs, r->raw);
+            if (n < 0)
+                return -1;
+            r->next_rec = 0;
+            r->num_recs = n;
+        }
+        memcpy(out, r->recs + r->next_rec++ * r->map.full_size,
+                r->map.full_size);
+        return 1;
+    }
+
+    while (r->left == 0)
+    {
+        int ret = ibs_trace_next_chunk(r, fp);
+        if (ret <= 0)
+            return ret;
+    }
+
+    p = r->pos;
+    for (size_t i = 0; i < r->num_fields; i++)
+    {
+        uint64_t field = r->order[i];
+        size_t len = ibs_trace_field_len(field);
+        uint64_t val = 0;
+        int slot = 0;
+        enum ibs_trace_coding coding;
+
+        if (r->fields & field)
+        {
+            coding = ibs_trace_coding(field, r->addr_field, &slot);
+            if ((p = ibs_trace_get_value(p, r->end, &r->state, coding, slot,
+                            &val)) == NULL)
+                return -1;
+        }
+        ibs_trace_store(dst, len, val);
+        dst += len;
+    }
+
+    r->pos = p;
+    r->left--;
+    return 1;
+}
+
+#endif        /* IBS_TRACE_H */
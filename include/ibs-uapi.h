@@ -18,12 +18,18 @@
  *     and passed to user-level applications.
  * (2) definition and documentation of ioctl commands that may be issued
  *     to the driver from user-space applications
+ * (3) the layout of the control page at the start of an mmap()ed buffer
+ * (4) the batch format of the all-CPU device, /dev/ibs/all
+ * (5) the record format of a combined op and fetch ring
  *
  */
 
 #ifndef IBS_UAPI_H
 #define IBS_UAPI_H
 
+// Number of ibs_stats_t.nmi_hist buckets; see "IBS device statistics" below
+#define IBS_STATS_HIST_BUCKETS  32
+
 #if !defined(__KERNEL__) && !defined(MODULE)
 #include <sys/ioctl.h>
 #include <stdint.h>
@@ -32,8 +38,11 @@
 // data structures, raw dumps of these values may be impossible to read.
 // As such, we need to version this data structure so that parsing
 // applications can read old IBS dumps.
-#define IBS_OP_STRUCT_VERSION 1
-#define IBS_FETCH_STRUCT_VERSION 1
+// Version 2 records hold only the fields selected with SET_SAMPLE_FIELDS,
+// packed as described in the "IBS sample field masks" documentation below.
+// A version 2 record with every field selected is identical to version 1.
+#define IBS_OP_STRUCT_VERSION 2
+#define IBS_FETCH_STRUCT_VERSION 2
 
 /* The following unions can be used to pull out specific values from inside of
    an IBS sample. */
@@ -199,8 +208,416 @@ typedef struct ibs_fetch {
         int                 kern_mode;
 } ibs_fetch_t;
 typedef ibs_fetch_t ibs_fetch_v1_t;
+
+// Control page at the start of an mmap()ed IBS buffer. See the
+// "IBS buffer mmap() interface" documentation below.
+typedef struct ibs_ring_header {
+        uint64_t            wr;
+        uint64_t            rd;
+        uint64_t            lost;
+        uint64_t            entry_size;
+        uint64_t            capacity;
+        uint64_t            data_offset;
+} ibs_ring_header_t;
+
+// Starts every batch of samples read from /dev/ibs/all. See the
+// "IBS all-CPU device" documentation below.
+typedef struct ibs_batch_header {
+        uint32_t            cpu;
+        uint32_t            flavor;
+        uint32_t            entry_size;
+        uint32_t            num_entries;
+        uint64_t            lost;
+} ibs_batch_header_t;
+
+// One slot of an op histogram, as returned by read() on a device in
+// histogram mode. See the "IBS op histograms" documentation below.
+typedef struct ibs_hist_entry {
+        uint64_t            rip;
+        uint64_t            page;
+        uint64_t            count;
+        uint64_t            dc_miss;
+        uint64_t            dc_miss_lat;
+} ibs_hist_entry_t;
+
+// Filled in by GET_STATS. See the "IBS device statistics" documentation
+// below.
+typedef struct ibs_stats {
+        uint64_t            nmis;
+        uint64_t            nmi_cycles;
+        uint64_t            nmi_cycles_max;
+        uint64_t            nmi_hist[IBS_STATS_HIST_BUCKETS];
+        uint64_t            wakeups;
+        uint64_t            read_bytes;
+        uint64_t            high_water;
+} ibs_stats_t;
+
+// Argument of SESSION_CONFIG and SESSION_DISABLE. See the "IBS sessions"
+// documentation below.
+typedef struct ibs_session {
+        uint64_t            cpus;
+        uint64_t            cpus_len;
+        uint64_t            flags;
+        uint64_t            max_cnt;
+        uint64_t            buffer_size;
+        uint64_t            poll_size;
+        uint64_t            cnt_ctl;
+        uint64_t            rand_en;
+} ibs_session_t;
+
+// Starts every record in a combined op and fetch ring. See the
+// "IBS combined rings" documentation below.
+typedef struct ibs_record_header {
+        uint32_t            type;
+        uint32_t            size;
+} ibs_record_header_t;
 #endif
 
+/**
+ * DOC: IBS sample field masks
+ *
+ * By default every entry in the buffer is a full struct ibs_op or struct
+ * ibs_fetch. SET_SAMPLE_FIELDS takes a mask of the IBS_FIELD_*, IBS_OP_FIELD_*
+ * or IBS_FETCH_FIELD_* bits below, and from then on the driver only collects
+ * the selected fields. Registers whose fields are left out are not read at
+ * all in the interrupt handler.
+ *
+ * Each entry holds the selected fields in the order they appear in the full
+ * struct, with no gaps: the 64-bit fields first, then the 32-bit ones (tid,
+ * pid, cpu, kern_mode). The entry is padded to a multiple of 8 bytes; see
+ * ibs_sample_entry_size(). With every field selected, this is exactly the
+ * full struct.
+ */
+#define IBS_FIELD_TSC           (1ULL << 0)
+#define IBS_FIELD_CR3           (1ULL << 1)
+#define IBS_FIELD_TID           (1ULL << 2)
+#define IBS_FIELD_PID           (1ULL << 3)
+#define IBS_FIELD_CPU           (1ULL << 4)
+#define IBS_FIELD_KERN_MODE     (1ULL << 5)
+#define IBS_FIELDS_COMMON       0x3FULL
+#define IBS_FIELDS_NARROW       (IBS_FIELD_TID | IBS_FIELD_PID | \
+                                 IBS_FIELD_CPU | IBS_FIELD_KERN_MODE)
+
+#define IBS_OP_FIELD_CTL        (1ULL << 8)
+#define IBS_OP_FIELD_RIP        (1ULL << 9)
+#define IBS_OP_FIELD_DATA       (1ULL << 10)
+#define IBS_OP_FIELD_DATA2      (1ULL << 11)
+#define IBS_OP_FIELD_DATA3      (1ULL << 12)
+#define IBS_OP_FIELD_DATA4      (1ULL << 13)
+#define IBS_OP_FIELD_DC_LIN_AD  (1ULL << 14)
+#define IBS_OP_FIELD_DC_PHYS_AD (1ULL << 15)
+#define IBS_OP_FIELD_BR_TARGET  (1ULL << 16)
+#define IBS_OP_FIELDS_ALL       (0x1FF00ULL | IBS_FIELDS_COMMON)
+
+#define IBS_FETCH_FIELD_CTL     (1ULL << 8)
+#define IBS_FETCH_FIELD_CTL_EXTD (1ULL << 9)
+#define IBS_FETCH_FIELD_LIN_AD  (1ULL << 10)
+#define IBS_FETCH_FIELD_PHYS_AD (1ULL << 11)
+#define IBS_FETCH_FIELDS_ALL    (0xF00ULL | IBS_FIELDS_COMMON)
+
+#if !defined(__KERNEL__) && !defined(MODULE)
+// Size in bytes of one packed record holding the given fields
+static inline uint64_t ibs_sample_entry_size(uint64_t fields)
+{
+    uint64_t narrow = __builtin_popcountll(fields & IBS_FIELDS_NARROW);
+    uint64_t wide = __builtin_popcountll(fields & ~IBS_FIELDS_NARROW);
+    return (wide * 8 + narrow * 4 + 7) & ~7ULL;
+}
+#endif
+
+/**
+ * DOC: IBS sample filters
+ *
+ * Each device can drop samples in its interrupt handler, before they take up
+ * space in the buffer. A sample is kept only if it passes every filter that
+ * is set:
+ *
+ * tgids:         Up to IBS_FILTER_MAX_TGIDS process IDs (tgids), added one at
+ *                a time with ADD_FILTER_TGID. Child processes are not
+ *                followed. An empty set accepts every process.
+ *
+ * cr3:           Only keep samples whose cr3 value (as recorded in the cr3
+ *                field of a sample) equals this. Zero accepts any cr3.
+ *
+ * mode:          IBS_FILTER_MODE_ALL, IBS_FILTER_MODE_USER (drop samples
+ *                taken in kernel mode) or IBS_FILTER_MODE_KERNEL (drop samples
+ *                taken in user mode).
+ *
+ * cgroup:        Only keep samples from tasks in this cgroup v2 directory or
+ *                any cgroup below it, set with SET_FILTER_CGROUP.
+ *
+ * Filters may be changed while IBS is enabled. Dropped samples are counted by
+ * GET_FILTERED. All filters are cleared when the device is closed.
+ */
+#define IBS_FILTER_MAX_TGIDS    16
+
+#define IBS_FILTER_MODE_ALL     0
+#define IBS_FILTER_MODE_USER    1
+#define IBS_FILTER_MODE_KERNEL  2
+
+/**
+ * DOC: IBS buffer mmap() interface
+ *
+ * Instead of read()ing samples, which copies them out of the driver, a
+ * process may mmap() an open IBS device and consume the samples in place.
+ * The mapping must be MAP_SHARED with PROT_READ | PROT_WRITE, start at offset
+ * zero, and may be up to one page plus GET_BUFFER_SIZE bytes (rounded up to a
+ * page) long. It begins with an ibs_ring_header_t:
+ *
+ * wr:            Index of the next entry the driver will fill. Only the
+ *                driver writes this. Load it with acquire semantics before
+ *                touching the entries it covers.
+ *
+ * rd:            Index of the next entry to consume. The consumer advances
+ *                this (modulo capacity, with release semantics) once it is
+ *                done with the entries; the driver reuses those slots. The
+ *                buffer is empty when rd == wr.
+ *
+ * lost:          Same counter as GET_LOST. It may be reset by atomically
+ *                exchanging it with zero.
+ *
+ * entry_size, capacity: Size of one entry in bytes and number of entries.
+ *
+ * data_offset:   Byte offset of entry 0 from the start of the mapping.
+ *
+ * poll() works on a mapped device exactly as it does for read(). Do not mix
+ * read() and in-place consumption on the same device. SET_BUFFER_SIZE fails
+ * with -EBUSY while any mapping of the buffer exists.
+ */
+
+/**
+ * DOC: IBS all-CPU device
+ *
+ * /dev/ibs/all reads the buffers of every per-CPU op and fetch device at
+ * once, so that a collector needs a single fd to poll() and read() no matter
+ * how many CPUs there are. The per-CPU devices are still opened and set up
+ * (and enabled) as usual; open /dev/ibs/all once their buffer sizes and
+ * sample fields are final. While it is open, SET_BUFFER_SIZE and
+ * SET_SAMPLE_FIELDS fail with -EBUSY, as they do for a mapped buffer. Only
+ * one process may have it open at a time, and its buffers should not also be
+ * read() or consumed through a mapping.
+ *
+ * It only covers the per-CPU devices that the process opening it already
+ * has open. Devices opened by other processes are neither read nor held, so
+ * a second process cannot read the first one's samples through it; opening
+ * it fails with -ENODEV when the process has no per-CPU device open, and
+ * with -EBUSY if any of them is combined. A device that its owner closes
+ * drops out for good, and its sample fields are reset as usual.
+ *
+ * A read() returns zero or more batches, each an ibs_batch_header_t followed
+ * by num_entries entries of entry_size bytes, taken from one buffer:
+ *
+ * cpu:           CPU that took the samples.
+ * flavor:        IBS_BATCH_OP or IBS_BATCH_FETCH.
+ * entry_size:    Size of one entry, as set by that device's SET_SAMPLE_FIELDS.
+ * num_entries:   Number of entries that follow the header.
+ * lost:          That buffer's GET_LOST counter, which this resets.
+ *
+ * Buffers are visited round-robin, starting after the last one read, so that
+ * a small read() does not starve the higher-numbered CPUs. The count given
+ * to read() must hold at least a header. Headers and entries are all
+ * multiples of 8 bytes.
+ *
+ * poll() reports the device as ready once any buffer holds its device's
+ * POLL_SIZE samples, and returns POLLHUP instead when it is not ready and
+ * every device is disabled. A blocking read() with nothing buffered waits
+ * until poll() would return. Buffers in IBS_RING_MODE_OVERWRITE are skipped unless they
+ * are frozen.
+ */
+#define IBS_BATCH_OP            0
+#define IBS_BATCH_FETCH         1
+
+/**
+ * DOC: IBS ring modes
+ *
+ * IBS_RING_MODE_DROP:  The default. When the buffer is full, new samples are
+ *                dropped and counted by GET_LOST until the reader catches up.
+ *
+ * IBS_RING_MODE_OVERWRITE: A flight recorder. When the buffer is full, the
+ *                oldest sample gives way to the new one, so the buffer always
+ *                holds the most recent capacity - 1 samples. Since the driver
+ *                moves rd itself, samples can only be consumed (by read() or
+ *                through a mapping) while the buffer is frozen with SNAPSHOT;
+ *                read() returns -EBUSY otherwise, and poll() never reports the
+ *                device as ready.
+ *
+ * A frozen buffer takes no new samples. Those that arrive are counted by
+ * GET_LOST. Once the frozen window has been consumed, read() returns 0, and
+ * a later IBS_SNAPSHOT_THAW resumes recording. Snapshots work in either mode.
+ */
+#define IBS_RING_MODE_DROP      0
+#define IBS_RING_MODE_OVERWRITE 1
+
+#define IBS_SNAPSHOT_THAW       0
+#define IBS_SNAPSHOT_FREEZE     1
+
+/**
+ * DOC: IBS op histograms
+ *
+ * SET_HISTOGRAM puts an op device into histogram mode. Instead of storing
+ * each sample in the buffer, the interrupt handler adds it to a fixed-size
+ * open-addressing hash table keyed on its op_rip, and (with
+ * IBS_HIST_KEY_PAGE) the 4 KB page of dc_lin_ad, when that is valid. Each
+ * slot is an ibs_hist_entry_t:
+ *
+ * rip, page:     The key. page is 0 unless IBS_HIST_KEY_PAGE is set and the
+ *                op had a valid data cache linear address.
+ * count:         Number of samples with this key.
+ * dc_miss:       How many of them missed in the data cache.
+ * dc_miss_lat:   Sum of their data cache miss latencies, in cycles.
+ *
+ * The driver keeps two tables and fills one at a time. read() swaps them,
+ * waits out any interrupt handler still adding to the old one, and returns
+ * the old table's used slots (in no particular order) before clearing it, so
+ * each read() covers the samples since the previous one. The count given to
+ * read() must hold slots * sizeof(ibs_hist_entry_t) bytes, else -EINVAL; it
+ * never blocks. poll() never reports a device in histogram mode as ready, so
+ * read it on a timer. Samples whose slot cannot be found within
+ * IBS_HIST_MAX_PROBES probes of their hash are counted by GET_LOST.
+ *
+ * The sample buffer, ring mode and sample fields are unused in this mode,
+ * but the filters still apply.
+ */
+#define IBS_HIST_MAX_SLOTS      (1ULL << 16)
+#define IBS_HIST_MAX_PROBES     16
+
+/**
+ * DOC: IBS device statistics
+ *
+ * Every device keeps counters of what sampling costs, which GET_STATS copies
+ * into the ibs_stats_t that its argument points to. They count from when
+ * the device was opened:
+ *
+ * nmis:          Samples this device's interrupt handler dealt with,
+ *                including those it then filtered or lost.
+ * nmi_cycles:    TSC cycles spent handling them, from the start of the
+ *                handler until the counter is re-armed. The cost of
+ *                entering and leaving the NMI itself is not included.
+ * nmi_cycles_max: The longest of those.
+ * nmi_hist:      nmi_hist[i] counts handlers that took at least 2^(i-1)
+ *                and fewer than 2^i cycles; the last bucket also counts all
+ *                slower ones.
+ * wakeups:       Deferred wakeups of blocked readers and pollers that the
+ *                handler queued.
+ * read_bytes:    Bytes copied out by read(), on this device or through
+ *                /dev/ibs/all.
+ * high_water:    The most entries the buffer has held at once.
+ */
+
+/**
+ * DOC: IBS sessions
+ *
+ * Setting up and enabling each device with its own ioctl() costs an IPI per
+ * device, one after another, so a large machine takes a while to start
+ * sampling and its CPUs start at noticeably different times. SESSION_CONFIG
+ * and SESSION_DISABLE work on many devices at once, and turn IBS on or off
+ * on all of them with a single broadcast IPI. Both take a pointer to an
+ * ibs_session_t, and may be sent to any open IBS device:
+ *
+ * cpus:          Pointer to a bitmap of CPUs, bit n of byte n / 8 standing
+ *                for CPU 8 * (n / 8) + n % 8. Offline CPUs are skipped.
+ *
+ * cpus_len:      Size of that bitmap in bytes.
+ *
+ * flags:         IBS_SESSION_OP and/or IBS_SESSION_FETCH pick the devices
+ *                of those CPUs to work on. Each of them must be open in the
+ *                calling process, else -EPERM. With IBS_SESSION_ENABLE,
+ *                SESSION_CONFIG turns IBS on once every device is set up.
+ *
+ * max_cnt, buffer_size, poll_size, cnt_ctl, rand_en: Passed to SET_MAX_CNT,
+ *                SET_BUFFER_SIZE, SET_POLL_SIZE, SET_CNT_CTL (op devices) and
+ *                SET_RAND_EN (fetch devices) on every device, in that
+ *                order. IBS_SESSION_KEEP leaves a setting alone. The first
+ *                error ends the command and is returned; IBS is then not
+ *                enabled anywhere. SESSION_DISABLE ignores these fields.
+ *
+ * Per-device settings that are not listed (sample fields, filters, ring
+ * mode and so on) still need their own ioctl() before SESSION_CONFIG.
+ */
+#define IBS_SESSION_OP          0x1ULL
+#define IBS_SESSION_FETCH       0x2ULL
+#define IBS_SESSION_ENABLE      0x4ULL
+#define IBS_SESSION_FLAGS       (IBS_SESSION_OP | IBS_SESSION_FETCH | \
+                                 IBS_SESSION_ENABLE)
+#define IBS_SESSION_KEEP        (~0ULL)
+
+/**
+ * DOC: IBS scheduler gating
+ *
+ * Filtering still takes an interrupt for every sample it drops, so a target
+ * that shares its CPUs with busy neighbours pays the neighbours' sampling
+ * costs as well. A gated device (SET_SCHED_GATE) only lets IBS count while
+ * the task running on its CPU is a target: a member of the tgid set and of
+ * the cgroup filter above, when those are set. The driver follows context
+ * switches through the sched_switch tracepoint. When a target task is
+ * switched out, IBS is stopped and the count it had reached is saved in the
+ * device. When a target is switched back in, IBS resumes from that count,
+ * so other tasks take no IBS interrupts at all, and the sample interval
+ * holds across switches.
+ *
+ * The cr3 and mode filters still drop samples in the interrupt handler.
+ * With neither a tgid set nor a cgroup, every task is a target. Gating needs
+ * a kernel with the sched_switch tracepoint available to modules (3.15 and
+ * above); elsewhere SET_SCHED_GATE returns -ENOTTY. The cgroup filter needs
+ * cgroup v2 support (4.11 and above).
+ */
+
+/**
+ * DOC: IBS combined rings
+ *
+ * Normally every CPU has an op and a fetch device, each with its own buffer,
+ * fd and wait queues, so a collector that wants both flavors polls and reads
+ * twice as many devices. SET_COMBINED 1 on an op device takes over the fetch
+ * device of the same CPU and puts both flavors' samples into the op device's
+ * buffer, in the order they were taken. The fetch device must not be open
+ * (-EBUSY otherwise); it counts as held by the op device's process until the
+ * op device is closed or gets SET_COMBINED 0, and is then disabled and
+ * returned to its defaults.
+ *
+ * The fetch half is controlled through the op device, by ORing IBS_CMD_FETCH
+ * into any of the commands below that set up sampling: ENABLE, DISABLE, the
+ * counter and randomization commands, SET_SAMPLE_FIELDS, the filters,
+ * SET_SCHED_GATE, GET_STATS and GET_FILTERED, and their GET_ forms. Commands
+ * about the buffer itself (SET_BUFFER_SIZE, SET_POLL_SIZE, SET_RING_MODE,
+ * RESET_BUFFER, SNAPSHOT, GET_LOST and so on) return -EINVAL with
+ * IBS_CMD_FETCH, since there is only the one buffer. SESSION_CONFIG and
+ * SESSION_DISABLE work on the fetch half as they do on an open fetch device.
+ *
+ * A combined buffer holds variable-size records rather than fixed entries,
+ * so fetch samples take no more room than they need. Each record is an
+ * ibs_record_header_t followed by one sample:
+ *
+ * type:          IBS_RECORD_OP or IBS_RECORD_FETCH, followed by a sample
+ *                packed by that flavor's SET_SAMPLE_FIELDS; or
+ *                IBS_RECORD_PAD, followed by nothing of use.
+ * size:          Bytes in the record, header included; a multiple of
+ *                IBS_RECORD_ALIGN.
+ *
+ * read() returns whole records only, without the pads. The count given to
+ * read() must hold the next record, else -EINVAL; one op record with every
+ * field is always enough. Sizes, capacities and positions of a combined
+ * buffer are counted in IBS_RECORD_ALIGN-byte units instead of entries: the
+ * entry_size of its ring header is IBS_RECORD_ALIGN, and SET_POLL_SIZE,
+ * FIONREAD and high_water use those units too. No record wraps around the
+ * end of the buffer; a pad fills out the end instead, and is always followed
+ * by a real record at the start, so a mapping consumer that gets to a pad
+ * moves rd to 0. In IBS_RING_MODE_OVERWRITE, whole records give way to new
+ * ones. Losses of either flavor are counted by the op device's GET_LOST,
+ * and its GET_STATS wakeups and high_water cover both flavors as well.
+ *
+ * IBS must be disabled on both halves to change the buffer, with
+ * SET_BUFFER_SIZE, SET_RING_MODE, RESET_BUFFER or either half's
+ * SET_SAMPLE_FIELDS (which empties it). The op device must not be in
+ * histogram mode, be mmap()ed or be held by /dev/ibs/all when
+ * SET_COMBINED is sent, and SET_HISTOGRAM and mmap() return -EBUSY on a
+ * combined device. /dev/ibs/all cannot be opened while any ring is
+ * combined.
+ */
+#define IBS_RECORD_OP           0
+#define IBS_RECORD_FETCH        1
+#define IBS_RECORD_PAD          2
+#define IBS_RECORD_ALIGN        8
+
 /**
  * DOC: IBS ioctl commands
  *
@@ -239,6 +656,11 @@ typedef ibs_fetch_t ibs_fetch_v1_t;
  *                Possible values satisfy 0<= MAX_CNT < 2^16 *and* CNT <= MAX_CNT
  *                (see SET_CNT ioctl).
  *
+ *                Unlike the other SET_* commands, this works while IBS is
+ *                enabled. The new maximum takes effect when the counter is
+ *                re-armed after the next sample; every sample's op_ctl or
+ *                fetch_ctl holds the maximum that produced it.
+ *
  * GET_MAX_CNT:   Return the counter maximum value.
  *
  * SET_CNT_CTL:   IBS op counter control - count ops or count cycles. Possible
@@ -277,16 +699,115 @@ typedef ibs_fetch_t ibs_fetch_v1_t;
  * GET_POLL_SIZE: Returns the current POLL_SIZE.
  *
  * SET_BUFFER_SIZE: Set the size of the IBS sample buffer in number of bytes.
- *                If the requested buffer size equals the existing buffer size,
+ *                The buffer is allocated on the NUMA node of the device's CPU.
+ *                OR in IBS_BUFFER_HUGE to ask for one physically contiguous
+ *                buffer, which the driver reaches through the kernel's large
+ *                page mappings; this keeps the sampler's own TLB misses out of
+ *                the samples. Such buffers are limited to the largest page
+ *                allocation the kernel can make (usually 4 MB including one
+ *                control page), and may fail on a fragmented system.
+ *                If the requested buffer size and kind equal the existing ones,
  *                then the buffer is simply cleared; otherwise, the existing
  *                buffer is freed and a new one of requested size is allocated.
- *                (If this allocation fails, -ENOMEM is returned.) IBS must be
- *                disabled. The argument must be at least the size of one buffer
- *                entry (i.e. the size of one of the structs ibs_op or ibs_fetch
- *                defined above).
+ *                (If this allocation fails, -ENOMEM is returned and the old
+ *                buffer is kept.) IBS must be disabled, and the buffer must not
+ *                be mmap()ed. The argument must be at least the size of one
+ *                full buffer entry (i.e. the size of one of the structs ibs_op
+ *                or ibs_fetch defined above), whatever SET_SAMPLE_FIELDS says.
  *
  * GET_BUFFER_SIZE: Get the size of the IBS sample buffer in number of bytes.
  *
+ * SET_SAMPLE_FIELDS: Select which fields of each sample are recorded; see
+ *                "IBS sample field masks" above. The argument must be a
+ *                non-zero subset of IBS_OP_FIELDS_ALL (op devices) or
+ *                IBS_FETCH_FIELDS_ALL (fetch devices), else -EINVAL. The
+ *                buffer is emptied, and its capacity changes to match the new
+ *                entry size. IBS must be disabled, and the buffer must not be
+ *                mmap()ed. The mask returns to all fields when the device is
+ *                closed.
+ *
+ * GET_SAMPLE_FIELDS: Return the current field mask.
+ *
+ * ADD_FILTER_TGID: Add a process ID to the set of processes whose samples are
+ *                kept; see "IBS sample filters" above. Returns -ENOSPC if
+ *                the set already holds IBS_FILTER_MAX_TGIDS entries, and
+ *                -EINVAL for IDs that are not positive.
+ *
+ * CLEAR_FILTER_TGIDS: Empty the process ID set, so that samples from every
+ *                process are kept.
+ *
+ * SET_FILTER_CR3: Only keep samples with this cr3 value. 0 turns the filter
+ *                off.
+ *
+ * GET_FILTER_CR3: Return the cr3 filter value.
+ *
+ * SET_FILTER_MODE: One of the IBS_FILTER_MODE_* values above. Any other
+ *                input returns -EINVAL.
+ *
+ * GET_FILTER_MODE: Return the filter mode.
+ *
+ * SET_RING_MODE: One of the IBS_RING_MODE_* values above; any other input
+ *                returns -EINVAL. The buffer is emptied. IBS must be disabled.
+ *                The mode returns to IBS_RING_MODE_DROP when the device is
+ *                closed.
+ *
+ * GET_RING_MODE: Return the ring mode.
+ *
+ * SNAPSHOT:      IBS_SNAPSHOT_FREEZE stops the buffer from taking new samples
+ *                and returns once no interrupt handler can still be writing
+ *                to it, so the window may be consumed safely.
+ *                IBS_SNAPSHOT_THAW lets it take samples again. Any other
+ *                input returns -EINVAL. This works while IBS is enabled.
+ *
+ * SET_HISTOGRAM: Turn on histogram mode with the given number of slots per
+ *                table, a power of two no larger than IBS_HIST_MAX_SLOTS,
+ *                optionally ORed with IBS_HIST_KEY_PAGE; see "IBS op
+ *                histograms" above. 0 goes back to storing samples. Two
+ *                tables are allocated on the NUMA node of the device's CPU,
+ *                -ENOMEM if that fails. Other inputs, or use on a fetch
+ *                device, return -EINVAL. IBS must be disabled. Histogram mode
+ *                is turned off when the device is closed.
+ *
+ * GET_HISTOGRAM: Return the number of slots per table, 0 when histogram mode
+ *                is off.
+ *
+ * GET_STATS:     Copy this device's statistics to the ibs_stats_t pointed to
+ *                by the argument; see "IBS device statistics" above. Returns
+ *                -EFAULT if that memory cannot be written. This works while
+ *                IBS is enabled.
+ *
+ * SET_FILTER_CGROUP: Only keep samples from tasks under the cgroup v2
+ *                directory open at this file descriptor; see "IBS sample
+ *                filters" above. A negative descriptor turns the filter off.
+ *                Descriptors that are not cgroup v2 directories return an
+ *                error from the kernel's cgroup code, and kernels without
+ *                cgroup v2 return -ENOTTY.
+ *
+ * SET_SCHED_GATE: 1 makes IBS count only while a target task runs on this
+ *                device's CPU, 0 (the default) makes it count all the time;
+ *                see "IBS scheduler gating" above. Other inputs return
+ *                -EINVAL. IBS must be disabled. Gating is turned off when the
+ *                device is closed.
+ *
+ * GET_SCHED_GATE: Return 1 if the device is gated, else 0.
+ *
+ * SET_COMBINED:  1 puts this op device's and its CPU's fetch device's
+ *                samples into one buffer of records, 0 (the default) gives
+ *                each its own buffer again; see "IBS combined rings" above.
+ *                Either way the buffer is emptied. Other inputs, or use on a
+ *                fetch device, return -EINVAL, and CPUs without IBS fetch
+ *                return -ENODEV. IBS must be disabled.
+ *
+ * GET_COMBINED:  Return 1 if the buffer is combined, else 0.
+ *
+ * SESSION_CONFIG: Set up, and optionally enable, many devices at once; see
+ *                "IBS sessions" above.
+ *
+ * SESSION_DISABLE: Disable many devices at once; see "IBS sessions" above.
+ *
+ * GET_FILTERED:  Return the number of IBS samples that the filters dropped.
+ *                Reading this resets the counter to zero (0).
+ *
  * DEBUG_BUFFER: Print information about the buffers to the kernel log.
  *
  * RESET_BUFFER: Empty the sample buffer, throwing away existing data.
@@ -315,8 +836,51 @@ typedef ibs_fetch_t ibs_fetch_v1_t;
 #define SET_BUFFER_SIZE 0xEU
 #define GET_BUFFER_SIZE 0xFU
 
+// Flag for the SET_BUFFER_SIZE argument
+#define IBS_BUFFER_HUGE         (1ULL << 63)
+#define IBS_BUFFER_SIZE_MASK    (IBS_BUFFER_HUGE - 1)
+
 #define RESET_BUFFER    0x10U
 
+#define SET_SAMPLE_FIELDS   0x11U
+#define GET_SAMPLE_FIELDS   0x12U
+
+#define ADD_FILTER_TGID     0x13U
+#define CLEAR_FILTER_TGIDS  0x14U
+#define SET_FILTER_CR3      0x15U
+#define GET_FILTER_CR3      0x16U
+#define SET_FILTER_MODE     0x17U
+#define GET_FILTER_MODE     0x18U
+
+#define SET_RING_MODE       0x19U
+#define GET_RING_MODE       0x1AU
+#define SNAPSHOT            0x1BU
+
+#define SET_HISTOGRAM       0x1CU
+#define GET_HISTOGRAM       0x1DU
+
+#define GET_STATS           0x1EU
+
+#define SESSION_CONFIG      0x1FU
+#define SESSION_DISABLE     0x20U
+
+#define SET_FILTER_CGROUP   0x21U
+#define SET_SCHED_GATE      0x22U
+#define GET_SCHED_GATE      0x23U
+
+#define SET_COMBINED        0x24U
+#define GET_COMBINED        0x25U
+
+// ORed into a command sent to a combined op device, to send it to the fetch
+// half instead
+#define IBS_CMD_FETCH       0x100U
+
+// Flag for the SET_HISTOGRAM argument
+#define IBS_HIST_KEY_PAGE       (1ULL << 63)
+#define IBS_HIST_SLOTS_MASK     (IBS_HIST_KEY_PAGE - 1)
+
+#define GET_FILTERED    0xEDU
+
 #define GET_LOST        0xEEU
 #define DEBUG_BUFFER    0xEFU
 
@@ -16,15 +16,36 @@
 #include <string.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <stdint.h>
 #include <assert.h>
 #include <sys/sysinfo.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <cpuid.h>
+#include <inttypes.h>
 
 #include "ibs.h"
 #include "ibs-uapi.h"
+#include "ibs-trace.h"
+#include "ibs-heatmap.h"
+#include "ibs-stream.h"
 
 #define MSEC_PER_SEC  1000
 #define USEC_PER_MSEC 1000
+#define NSEC_PER_MSEC 1000000
+
+/* How often IBS_ADAPTIVE_RATE retunes the max counts, and the range it keeps
+ * them in (the smallest range every IBS generation supports) */
+#define IBS_ADAPT_INTERVAL_MS   1000
+#define IBS_ADAPT_MIN_CNT       0x9
+#define IBS_ADAPT_MAX_CNT       0xffff
 
 
 static unsigned char ibs_debug_on           = DEFAULT_IBS_DEBUG;
@@ -35,6 +56,15 @@ static unsigned char ibs_read_on_timeout    = DEFAULT_IBS_READ_ON_TIMEOUT;
 static unsigned long ibs_poll_timeout       = DEFAULT_IBS_POLL_TIMEOUT;
 static unsigned long ibs_poll_num_samples   = DEFAULT_IBS_POLL_NUM_SAMPLES;
 static unsigned long ibs_max_cnt            = DEFAULT_IBS_MAX_CNT;
+static unsigned char ibs_mmap               = DEFAULT_IBS_MMAP;
+static unsigned char ibs_flight_recorder    = DEFAULT_IBS_FLIGHT_RECORDER;
+static unsigned long ibs_adaptive_rate      = DEFAULT_IBS_ADAPTIVE_RATE;
+static unsigned long ibs_buffer_size        = DEFAULT_IBS_BUFFER_SIZE;
+static int ibs_daemon_readers               = DEFAULT_IBS_DAEMON_READERS;
+static unsigned char ibs_daemon_trace       = DEFAULT_IBS_DAEMON_TRACE;
+
+/* Set while ibs_snapshot() drains the frozen buffers */
+static unsigned char ibs_frozen             = 0;
 
 static char * ibs_cpu_list = NULL;
 
@@ -42,6 +72,8 @@ static unsigned long ibs_daemon_max_samples = DEFAULT_IBS_DAEMON_MAX_SAMPLES;
 static word_t ibs_daemon_cpu_list           = DEFAULT_IBS_DAEMON_CPU_LIST;
 static char * ibs_daemon_op_file            = DEFAULT_IBS_DAEMON_OP_FILE;
 static char * ibs_daemon_fetch_file         = DEFAULT_IBS_DAEMON_FETCH_FILE;
+static char * ibs_daemon_stream             = DEFAULT_IBS_DAEMON_STREAM;
+static unsigned char ibs_daemon_stream_deflate = DEFAULT_IBS_DAEMON_STREAM_DEFLATE;
 
 
     static void
@@ -63,6 +95,13 @@ static void (*ibs_daemon_op_write) (FILE * fp, ibs_op_t *)      = DEFAULT_IBS_DA
 static void (*ibs_daemon_fetch_write)(FILE * fp, ibs_fetch_t *) = DEFAULT_IBS_DAEMON_FETCH_WRITE;
 
 
+/* Sample rate controller state of one device, for IBS_ADAPTIVE_RATE */
+typedef struct ibs_rate {
+    unsigned long max_cnt;
+    unsigned long samples;  /* read since the last adjustment */
+    long buffered;          /* FIONREAD at the last adjustment */
+} ibs_rate_t;
+
 /* Per CPU IBS stuff */
 typedef struct ibs_cpu {
     int op_enabled;
@@ -70,15 +109,41 @@ typedef struct ibs_cpu {
     int fetch_enabled;
     int fetch_fd;
     int cpu;
+    /* Mapped driver buffers, when IBS_MMAP is set */
+    ibs_ring_header_t * op_ring;
+    size_t op_ring_len;
+    ibs_ring_header_t * fetch_ring;
+    size_t fetch_ring_len;
+    ibs_rate_t op_rate;
+    ibs_rate_t fetch_rate;
+    /* Lost samples that IBS_ADAPTIVE_RATE took from the driver, until
+     * ibs_get_lost() hands them out; updated atomically */
+    unsigned long op_lost;
+    unsigned long fetch_lost;
+    /* Set by ibs_wait() for the devices that have samples */
+    int op_ready;
+    int fetch_ready;
 } ibs_cpu_t;
 
 static int       ibs_initialized    = 0;
 static pid_t     ibs_daemon         = 0;
-static int       ibs_max_op_fd      = -1;
-static int       ibs_max_fetch_fd   = -1;
 static int       num_cpus           = 0;
 ibs_cpu_t *      ibs_cpus           = NULL;
 
+/* Persistent epoll sets. ibs_epfd[IBS_OP_SAMPLE] and
+ * ibs_epfd[IBS_FETCH_SAMPLE] watch the enabled devices of each flavor, and
+ * ibs_epfd[IBS_OP_SAMPLE | IBS_FETCH_SAMPLE] watches those two sets. */
+static int       ibs_epfd[4]        = {-1, -1, -1, -1};
+static struct epoll_event * ibs_events = NULL;
+static int       ibs_max_events     = 0;
+
+/* When ibs_sample() and ibs_sample_batch() last retuned the sample rates */
+static struct timespec ibs_adapt_last;
+
+/* Staging buffer for ibs_sample(), kept between calls */
+static void *    ibs_staging        = NULL;
+static size_t    ibs_staging_len    = 0;
+
 
 extern int errno;
 
@@ -170,6 +235,23 @@ ibs_apply_options_on_cpu(int cpu)
         ibs_error("Could not apply ibs option SET_MAX_CNT on cpu %d", cpu);
         return status;
     }
+    ibs_cpus[cpu].op_rate.max_cnt = ibs_max_cnt;
+    ibs_cpus[cpu].fetch_rate.max_cnt = ibs_max_cnt;
+    ibs_cpus[cpu].op_lost = 0;
+    ibs_cpus[cpu].fetch_lost = 0;
+
+    /* Before the poll size, which the driver checks against the buffer */
+    if (ibs_buffer_size) {
+        ibs_debug("Setting IBS buffer size on CPU %d to %lu", cpu, ibs_buffer_size);
+        status = ibs_apply_ioctl_on_cpu(
+                SET_BUFFER_SIZE,
+                ibs_buffer_size,
+                cpu);
+        if (status < 0) {
+            ibs_error("Could not apply ibs option SET_BUFFER_SIZE on cpu %d", cpu);
+            return status;
+        }
+    }
 
     ibs_debug("Setting IBS poll size count on CPU %d to %lu", cpu, ibs_poll_num_samples);
     status = ibs_apply_ioctl_on_cpu(
@@ -181,9 +263,59 @@ ibs_apply_options_on_cpu(int cpu)
         return status;
     }
 
+    if (ibs_flight_recorder) {
+        ibs_debug("Setting IBS ring mode on CPU %d to overwrite", cpu);
+        status = ibs_apply_ioctl_on_cpu(
+                SET_RING_MODE,
+                IBS_RING_MODE_OVERWRITE,
+                cpu);
+        if (status < 0) {
+            ibs_error("Could not apply ibs option SET_RING_MODE on cpu %d", cpu);
+            return status;
+        }
+    }
+
     return 0;
 }
 
+/* Map the driver's buffer (and its control page) for an open IBS device */
+    static ibs_ring_header_t *
+ibs_map_ring(int      fd,
+        size_t * len)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    int buf_size = ioctl(fd, GET_BUFFER_SIZE);
+    void * ring;
+
+    if (buf_size < 0) {
+        ibs_error_no("Could not get buffer size of fd %d", fd);
+        return NULL;
+    }
+
+    *len = page_size + ((buf_size + page_size - 1) / page_size) * page_size;
+    ring = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED) {
+        ibs_error_no("Could not mmap the IBS buffer of fd %d", fd);
+        return NULL;
+    }
+
+    return (ibs_ring_header_t *)ring;
+}
+
+    static void
+ibs_unmap_rings(ibs_cpu_t * ibs_cpu)
+{
+    if (ibs_cpu->op_ring != NULL) {
+        munmap(ibs_cpu->op_ring, ibs_cpu->op_ring_len);
+        ibs_cpu->op_ring = NULL;
+    }
+
+    if (ibs_cpu->fetch_ring != NULL) {
+        munmap(ibs_cpu->fetch_ring, ibs_cpu->fetch_ring_len);
+        ibs_cpu->fetch_ring = NULL;
+    }
+}
+
     int
 ibs_set_option(ibs_option_t opt,
         ibs_val_t    val)
@@ -276,6 +408,55 @@ ibs_set_option(ibs_option_t opt,
             ibs_debug("Set IBS_DAEMON_FETCH_WRITE %s", "");
             break;
 
+        case IBS_MMAP:
+            ibs_mmap = (unsigned char)(unsigned long)val;
+            ibs_debug("Setting IBS MMAP mode to %u", ibs_mmap);
+            break;
+
+        case IBS_FLIGHT_RECORDER:
+            ibs_flight_recorder = (unsigned char)(unsigned long)val;
+            ibs_debug("Setting IBS FLIGHT_RECORDER mode to %u", ibs_flight_recorder);
+            break;
+
+        case IBS_ADAPTIVE_RATE:
+            ibs_adaptive_rate = (unsigned long)val;
+            ibs_debug("Setting IBS ADAPTIVE_RATE to %lu samples/s", ibs_adaptive_rate);
+            break;
+
+        case IBS_DAEMON_READERS:
+            ibs_daemon_readers = (int)(long)val;
+            ibs_debug("Setting IBS_DAEMON_READERS to %d", ibs_daemon_readers);
+            break;
+
+        case IBS_DAEMON_TRACE:
+            ibs_daemon_trace = (unsigned char)(unsigned long)val;
+            if (ibs_daemon_trace != 0 &&
+                    ibs_daemon_trace != IBS_TRACE_FORMAT_DELTA &&
+                    ibs_daemon_trace != IBS_TRACE_FORMAT_COLUMNS) {
+                ibs_error("IBS_DAEMON_TRACE takes 0, 2 or 3, not %u",
+                        ibs_daemon_trace);
+                return -1;
+            }
+            ibs_debug("Setting IBS_DAEMON_TRACE to %u", ibs_daemon_trace);
+            break;
+
+        case IBS_BUFFER_SIZE:
+            ibs_buffer_size = (unsigned long)val;
+            ibs_debug("Setting IBS_BUFFER_SIZE to %lu bytes", ibs_buffer_size);
+            break;
+
+        case IBS_DAEMON_STREAM:
+            ibs_daemon_stream = (char *)val;
+            ibs_debug("Setting IBS_DAEMON_STREAM to %s",
+                    ibs_daemon_stream ? ibs_daemon_stream : "(none)");
+            break;
+
+        case IBS_DAEMON_STREAM_DEFLATE:
+            ibs_daemon_stream_deflate = (unsigned char)(unsigned long)val;
+            ibs_debug("Setting IBS_DAEMON_STREAM_DEFLATE to %u",
+                    ibs_daemon_stream_deflate);
+            break;
+
         default:
             ibs_error("Unrecognized IBS option: %d", opt);
             return -1;
@@ -284,6 +465,84 @@ ibs_set_option(ibs_option_t opt,
     return 0;
 }
 
+/* Set up the epoll sets. Devices join them as they are enabled. */
+    static int
+ibs_epoll_init(void)
+{
+    struct epoll_event ev;
+    int type;
+
+    ibs_max_events = 2 * num_cpus;
+    ibs_events = calloc(ibs_max_events, sizeof(struct epoll_event));
+    if (ibs_events == NULL) {
+        ibs_error_no("calloc failed.%s", "");
+        return -1;
+    }
+
+    for (type = IBS_OP_SAMPLE; type <= (IBS_OP_SAMPLE | IBS_FETCH_SAMPLE);
+            type++) {
+        ibs_epfd[type] = epoll_create1(EPOLL_CLOEXEC);
+        if (ibs_epfd[type] < 0) {
+            ibs_error_no("Could not create an epoll set.%s", "");
+            return -1;
+        }
+    }
+
+    for (type = IBS_OP_SAMPLE; type <= IBS_FETCH_SAMPLE; type++) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = type;
+        if (epoll_ctl(ibs_epfd[IBS_OP_SAMPLE | IBS_FETCH_SAMPLE],
+                    EPOLL_CTL_ADD, ibs_epfd[type], &ev) < 0) {
+            ibs_error_no("Could not nest the epoll sets.%s", "");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+    static void
+ibs_epoll_fini(void)
+{
+    for (int type = 0; type < 4; type++) {
+        if (ibs_epfd[type] >= 0)
+            close(ibs_epfd[type]);
+        ibs_epfd[type] = -1;
+    }
+
+    free(ibs_events);
+    ibs_events = NULL;
+    ibs_max_events = 0;
+    free(ibs_staging);
+    ibs_staging = NULL;
+    ibs_staging_len = 0;
+}
+
+/* Mark a device enabled or not. Only enabled devices are in the epoll sets,
+ * since a disabled one always polls as POLLHUP. */
+    static void
+ibs_set_enabled(ibs_cpu_t * ibs_cpu,
+        ibs_sample_type_t type,
+        int enabled)
+{
+    int * flag = (type == IBS_OP_SAMPLE) ?
+        &ibs_cpu->op_enabled : &ibs_cpu->fetch_enabled;
+    int fd = (type == IBS_OP_SAMPLE) ? ibs_cpu->op_fd : ibs_cpu->fetch_fd;
+    struct epoll_event ev;
+
+    if (!*flag == !enabled)
+        return;
+    *flag = enabled;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = ibs_cpu->cpu;
+    if (epoll_ctl(ibs_epfd[type], enabled ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                fd, &ev) < 0)
+        ibs_error_no("Could not update the epoll set for fd %d", fd);
+}
+
     int
 ibs_enable_cpu(int cpu)
 {
@@ -306,7 +565,7 @@ ibs_enable_cpu(int cpu)
         }
 
         ibs_debug("Enabled IBS OP on CPU %d", cpu);
-        ibs_cpu->op_enabled = 1;
+        ibs_set_enabled(ibs_cpu, IBS_OP_SAMPLE, 1);
     }
 
     if (ibs_cpu->fetch_fd > 0) {
@@ -317,7 +576,7 @@ ibs_enable_cpu(int cpu)
         }
 
         ibs_debug("Enabled IBS FETCH on CPU %d", cpu);
-        ibs_cpu->fetch_enabled = 1;
+        ibs_set_enabled(ibs_cpu, IBS_FETCH_SAMPLE, 1);
     }
 
     return 0;
@@ -327,11 +586,82 @@ err:
     return status;
 }
 
+/* Send SESSION_CONFIG or SESSION_DISABLE for every initialized CPU, so the
+ * driver turns them all on or off with one broadcast. Returns -1 when the
+ * driver cannot, and the caller should go CPU by CPU instead. */
+    static int
+ibs_session_ioctl(unsigned long cmd, uint64_t flags)
+{
+    ibs_session_t session;
+    unsigned char * cpus;
+    int cpu, fd = -1, status;
+
+    cpus = calloc((num_cpus + 7) / 8, 1);
+    if (cpus == NULL)
+        return -1;
+
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
+        if (!ibs_cpu_list[cpu])
+            continue;
+        if ((ibs_op && ibs_cpu->op_fd <= 0) ||
+                (ibs_fetch && ibs_cpu->fetch_fd <= 0)) {
+            free(cpus);
+            return -1;
+        }
+        cpus[cpu / 8] |= 1 << (cpu % 8);
+        if (fd < 0)
+            fd = ibs_op ? ibs_cpu->op_fd : ibs_cpu->fetch_fd;
+    }
+
+    status = -1;
+    if (fd >= 0) {
+        memset(&session, 0xff, sizeof(session));
+        session.cpus = (uint64_t)(uintptr_t)cpus;
+        session.cpus_len = (num_cpus + 7) / 8;
+        session.flags = flags;
+        if (ibs_op)
+            session.flags |= IBS_SESSION_OP;
+        if (ibs_fetch)
+            session.flags |= IBS_SESSION_FETCH;
+        status = ioctl(fd, cmd, &session);
+        if (status < 0)
+            ibs_debug("Session ioctl failed (%s), going CPU by CPU",
+                    strerror(errno));
+    }
+
+    free(cpus);
+    return status;
+}
+
+/* Mark what ibs_session_ioctl() turned on or off */
+    static void
+ibs_session_mark(int enabled)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
+        if (!ibs_cpu_list[cpu])
+            continue;
+        ibs_set_enabled(ibs_cpu, IBS_OP_SAMPLE,
+                enabled && ibs_cpu->op_fd > 0);
+        ibs_set_enabled(ibs_cpu, IBS_FETCH_SAMPLE,
+                enabled && ibs_cpu->fetch_fd > 0);
+    }
+}
+
     int
 ibs_enable_all(void)
 {
     int cpu, status = 0;
 
+    if (ibs_session_ioctl(SESSION_CONFIG, IBS_SESSION_ENABLE) == 0) {
+        ibs_debug("Enabled IBS on %d CPUs with one session", num_cpus);
+        ibs_session_mark(1);
+        return 0;
+    }
+
     for (cpu = 0; cpu < num_cpus; cpu++) {
         ibs_debug("Checking if IBS is initialized for CPU %d: %d", cpu, ibs_cpu_list[cpu]);
         if (ibs_cpu_list[cpu]) {
@@ -376,7 +706,7 @@ ibs_disable_cpu(int cpu)
             ibs_error_no("Cannot disable IBS OP on cpu %d", cpu);
         }
 
-        ibs_cpu->op_enabled = 0;
+        ibs_set_enabled(ibs_cpu, IBS_OP_SAMPLE, 0);
         ibs_debug("Disabled IBS OP on CPU %d", cpu);
     }
 
@@ -386,7 +716,7 @@ ibs_disable_cpu(int cpu)
             ibs_error_no("Cannot disable IBS FETCH on cpu %d", cpu);
         }
 
-        ibs_cpu->fetch_enabled = 0;
+        ibs_set_enabled(ibs_cpu, IBS_FETCH_SAMPLE, 0);
         ibs_debug("Disabled IBS FETCH on CPU %d", cpu);
     }
 }
@@ -396,6 +726,12 @@ ibs_disable_all(void)
 {
     int cpu;
 
+    if (ibs_session_ioctl(SESSION_DISABLE, 0) == 0) {
+        ibs_debug("Disabled IBS on %d CPUs with one session", num_cpus);
+        ibs_session_mark(0);
+        return;
+    }
+
     for (cpu = 0; cpu < num_cpus; cpu++) {
         if (ibs_cpu_list[cpu]) {
             ibs_disable_cpu(cpu);
@@ -421,11 +757,14 @@ do_ibs_get_sample(ibs_sample_type_t   type,
             return -1;
 
         case 0:
+            /* A frozen buffer may well have been drained already */
+            if (ibs_frozen)
+                return 0;
             ibs_error("No samples avaialable in fd %d", fd);
             return -1;
 
         default:
-            if ((ibs_aggressive_read == 0) &&
+            if ((ibs_aggressive_read == 0) && (ibs_frozen == 0) &&
                     (samples_available < ibs_poll_num_samples))
             {
                 ibs_error("%u samples available in fd %d, but select said at least %lu were!!",
@@ -440,46 +779,37 @@ do_ibs_get_sample(ibs_sample_type_t   type,
     if (samples_available > max_samples)
         samples_available = max_samples;
 
-    ibs_op_t *temp_op_buffer = NULL;
-    ibs_fetch_t *temp_fetch_buffer = NULL;
     if (type == IBS_OP_SAMPLE)
-    {
         bytes_wanted = samples_available * sizeof(ibs_op_t);
-        temp_op_buffer = malloc(bytes_wanted);
-        bytes_read = read(fd, (void*)temp_op_buffer, bytes_wanted);
-    }
     else
-    {
         bytes_wanted = samples_available * sizeof(ibs_fetch_t);
-        temp_fetch_buffer = malloc(bytes_wanted);
-        bytes_read = read(fd, (void*)temp_fetch_buffer, bytes_wanted);
+
+    /* The staging buffer only ever grows, so a steady caller stops
+     * allocating after its first few calls */
+    if ((size_t)bytes_wanted > ibs_staging_len) {
+        void * staging = realloc(ibs_staging, bytes_wanted);
+        if (staging == NULL) {
+            ibs_error_no("realloc of %d bytes failed", bytes_wanted);
+            return -1;
+        }
+        ibs_staging = staging;
+        ibs_staging_len = bytes_wanted;
     }
+    bytes_read = read(fd, ibs_staging, bytes_wanted);
 
     switch (bytes_read) {
         case -1:
             ibs_error_no("Could not read samples from fd %d", fd);
-            if (temp_op_buffer)
-                free(temp_op_buffer);
-            if (temp_fetch_buffer)
-                free(temp_fetch_buffer);
             return -1;
 
         case 0:
             ibs_error("Read 0 bytes from fd %d, which should be impossible with O_NONBLOCK", fd);
-            if (temp_op_buffer)
-                free(temp_op_buffer);
-            if (temp_fetch_buffer)
-                free(temp_fetch_buffer);
             return -1;
 
         default:
             if (bytes_read < bytes_wanted) {
                 ibs_error("Read %d bytes out %d avaialable. This should not be possible",
                         bytes_read, bytes_wanted);
-                if (temp_op_buffer)
-                    free(temp_op_buffer);
-                if (temp_fetch_buffer)
-                    free(temp_fetch_buffer);
                 return -1;
             }
             break;
@@ -488,25 +818,53 @@ do_ibs_get_sample(ibs_sample_type_t   type,
     for (unsigned int i = 0; i < samples_available; i++)
     {
         if (type == IBS_OP_SAMPLE)
-            samples[sample_off + i].ibs_sample.op = temp_op_buffer[i];
+            samples[sample_off + i].ibs_sample.op =
+                ((ibs_op_t *)ibs_staging)[i];
         else
-            samples[sample_off + i].ibs_sample.fetch = temp_fetch_buffer[i];
+            samples[sample_off + i].ibs_sample.fetch =
+                ((ibs_fetch_t *)ibs_staging)[i];
     }
 
-    if (temp_op_buffer != NULL)
-        free(temp_op_buffer);
-    if (temp_fetch_buffer != NULL)
-        free(temp_fetch_buffer);
-
     return samples_available;
 }
 
+/* Consume samples in place from a mapped driver buffer. Unlike
+ * do_ibs_get_sample(), this needs no syscalls and no staging buffer. */
+    static int
+do_ibs_get_mapped_sample(ibs_sample_type_t   type,
+        ibs_ring_header_t * ring,
+        ibs_sample_t      * samples,
+        int                 sample_off,
+        unsigned int        max_samples)
+{
+    uint64_t rd = ring->rd;
+    uint64_t wr = __atomic_load_n(&ring->wr, __ATOMIC_ACQUIRE);
+    char * data = (char *)ring + ring->data_offset;
+    unsigned int n = 0;
+
+    while (rd != wr && n < max_samples) {
+        void * entry = data + rd * ring->entry_size;
+
+        if (type == IBS_OP_SAMPLE)
+            samples[sample_off + n].ibs_sample.op = *(ibs_op_t *)entry;
+        else
+            samples[sample_off + n].ibs_sample.fetch = *(ibs_fetch_t *)entry;
+
+        if (++rd == ring->capacity)
+            rd = 0;
+        n++;
+    }
+
+    /* Hand the slots back to the driver once we are done copying */
+    __atomic_store_n(&ring->rd, rd, __ATOMIC_RELEASE);
+    return n;
+}
+
     static int
 do_ibs_get_all_samples(int                 max_samples,
         int                 sample_flags,
         ibs_sample_t      * samples,
         ibs_sample_type_t * sample_types,
-        fd_set            * fd_set,
         char *              cpu_list)
 {
     int total_new_samples, sample_off, new_samples, cpu;
@@ -527,17 +885,24 @@ do_ibs_get_all_samples(int                 max_samples,
         if ((sample_flags & IBS_OP_SAMPLE) &
                 (ibs_cpu->op_fd > 0) &&
                 (
-                 (ibs_aggressive_read ||
-                  (FD_ISSET(ibs_cpu->op_fd, fd_set)))
+                 (ibs_aggressive_read || ibs_frozen || ibs_cpu->op_ready)
                 )
            )
         {
-            new_samples = do_ibs_get_sample(
-                    IBS_OP_SAMPLE,
-                    ibs_cpu->op_fd,
-                    samples,
-                    sample_off,
-                    max_samples - total_new_samples);
+            if (ibs_cpu->op_ring != NULL)
+                new_samples = do_ibs_get_mapped_sample(
+                        IBS_OP_SAMPLE,
+                        ibs_cpu->op_ring,
+                        samples,
+                        sample_off,
+                        max_samples - total_new_samples);
+            else
+                new_samples = do_ibs_get_sample(
+                        IBS_OP_SAMPLE,
+                        ibs_cpu->op_fd,
+                        samples,
+                        sample_off,
+                        max_samples - total_new_samples);
 
             if (new_samples < 0) {
                 ibs_error("Could not get OP sample from cpu %d", cpu);
@@ -550,6 +915,7 @@ do_ibs_get_all_samples(int                 max_samples,
                         *type = IBS_OP_SAMPLE;
                     }
                 }
+                ibs_cpu->op_rate.samples += new_samples;
 
                 total_new_samples += new_samples;
                 sample_off        += new_samples;
@@ -562,17 +928,25 @@ do_ibs_get_all_samples(int                 max_samples,
         if ((sample_flags & IBS_FETCH_SAMPLE) &&
                 (ibs_cpu->fetch_fd > 0) &&
                 (
-                 (ibs_aggressive_read ||
-                  (FD_ISSET(ibs_cpu->fetch_fd, fd_set)))
+                 (ibs_aggressive_read || ibs_frozen ||
+                  ibs_cpu->fetch_ready)
                 )
            )
         {
-            new_samples = do_ibs_get_sample(
-                    IBS_FETCH_SAMPLE,
-                    ibs_cpu->fetch_fd,
-                    samples,
-                    sample_off,
-                    max_samples - total_new_samples);
+            if (ibs_cpu->fetch_ring != NULL)
+                new_samples = do_ibs_get_mapped_sample(
+                        IBS_FETCH_SAMPLE,
+                        ibs_cpu->fetch_ring,
+                        samples,
+                        sample_off,
+                        max_samples - total_new_samples);
+            else
+                new_samples = do_ibs_get_sample(
+                        IBS_FETCH_SAMPLE,
+                        ibs_cpu->fetch_fd,
+                        samples,
+                        sample_off,
+                        max_samples - total_new_samples);
 
             if (new_samples < 0) {
                 ibs_error("Could not get FETCH sample from cpu %d", cpu);
@@ -585,6 +959,7 @@ do_ibs_get_all_samples(int                 max_samples,
                         *type = IBS_FETCH_SAMPLE;
                     }
                 }
+                ibs_cpu->fetch_rate.samples += new_samples;
 
                 total_new_samples += new_samples;
                 sample_off        += new_samples;
@@ -598,130 +973,559 @@ do_ibs_get_all_samples(int                 max_samples,
     return total_new_samples;
 }
 
-    static int
-do_ibs_sample(int           max_samples,
-        int                 sample_flags,
-        ibs_sample_t      * samples,
-        ibs_sample_type_t * sample_types,
-        char              * cpu_list)
+/* Scale one device's max count so that the samples it generated over
+ * elapsed_ms (read, lost, or still buffered) would have come in at
+ * ibs_adaptive_rate per second. Lost samples always make it back off. Steps
+ * are at most 2x, and errors under 10% are left alone. Every sample's
+ * op_ctl/fetch_ctl holds the max count that produced it, so consumers can
+ * reweight samples across changes. The lost samples that GET_LOST takes
+ * from the driver are kept in *total_lost for ibs_get_lost(). */
+    static void
+ibs_adapt_rate(int             fd,
+        ibs_rate_t    * rate,
+        unsigned long * total_lost,
+        const char    * flavor,
+        int             cpu,
+        long            elapsed_ms)
 {
-    int max_fd, cpu, status;
-    struct timeval timeout;
-    fd_set rfds;
+    long lost = ioctl(fd, GET_LOST);
+    long buffered = ioctl(fd, FIONREAD);
+    long generated;
+    unsigned long new_cnt;
+    double scale;
+
+    if (lost < 0)
+        lost = 0;
+    if (lost)
+        __atomic_fetch_add(total_lost, lost, __ATOMIC_RELAXED);
+    if (buffered < 0)
+        buffered = rate->buffered;
+    generated = rate->samples + lost + (buffered - rate->buffered);
+    rate->samples = 0;
+    rate->buffered = buffered;
+
+    /* An idle core tells us nothing about its next busy phase */
+    if (generated <= 0 || elapsed_ms <= 0)
+        return;
 
-    if (max_samples <= 0) {
-        ibs_error("max_samples must be > 0. Sent %d instead.", max_samples);
-        return -1;
+    scale = (generated * (double)MSEC_PER_SEC / elapsed_ms) / ibs_adaptive_rate;
+    if (lost && scale < 1.25)
+        scale = 1.25;
+    if (scale > 0.9 && scale < 1.1)
+        return;
+    if (scale > 2.0)
+        scale = 2.0;
+    if (scale < 0.5)
+        scale = 0.5;
+
+    new_cnt = rate->max_cnt * scale;
+    if (new_cnt > IBS_ADAPT_MAX_CNT)
+        new_cnt = IBS_ADAPT_MAX_CNT;
+    if (new_cnt < IBS_ADAPT_MIN_CNT)
+        new_cnt = IBS_ADAPT_MIN_CNT;
+    if (new_cnt == rate->max_cnt)
+        return;
+
+    if (ioctl(fd, SET_MAX_CNT, new_cnt) < 0) {
+        ibs_error_no("Could not retune IBS %s max count on cpu %d", flavor, cpu);
+        return;
     }
+    ibs_debug("Retuned IBS %s max count on cpu %d from %lu to %lu",
+            flavor, cpu, rate->max_cnt, new_cnt);
+    rate->max_cnt = new_cnt;
+}
 
-    if (!(sample_flags & IBS_OP_SAMPLE) &&
-            !(sample_flags & IBS_FETCH_SAMPLE))
-    {
-        ibs_error("Must supply IBS_OP_SAMPLE and/or IBS_FETCH_SAMPLE. Sent %d instead.",
-                sample_flags);
-        return -1;
+/* Retune every enabled device of cpu_list, at most once per
+ * IBS_ADAPT_INTERVAL_MS since *last. Each caller keeps its own last. */
+    static void
+ibs_adapt_rates(char * cpu_list, struct timespec * last)
+{
+    struct timespec now;
+    long elapsed_ms;
+    int cpu;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (last->tv_sec == 0 && last->tv_nsec == 0) {
+        *last = now;
+        return;
     }
+    elapsed_ms = (now.tv_sec - last->tv_sec) * MSEC_PER_SEC +
+        (now.tv_nsec - last->tv_nsec) / NSEC_PER_MSEC;
+    if (elapsed_ms < IBS_ADAPT_INTERVAL_MS)
+        return;
+    *last = now;
 
-    FD_ZERO(&rfds);
     for (cpu = 0; cpu < num_cpus; cpu++) {
-        if (cpu_list[cpu]) {
-            ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
-            if ((sample_flags & IBS_OP_SAMPLE) && ibs_cpu->op_enabled) {
-                FD_SET(ibs_cpu->op_fd, &rfds);
-            }
+        ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
 
-            if ((sample_flags & IBS_FETCH_SAMPLE) && ibs_cpu->fetch_enabled) {
-                FD_SET(ibs_cpu->fetch_fd, &rfds);
-            }
-        }
+        if (!cpu_list[cpu])
+            continue;
+        if (ibs_cpu->op_enabled)
+            ibs_adapt_rate(ibs_cpu->op_fd, &ibs_cpu->op_rate,
+                    &ibs_cpu->op_lost, "OP", cpu, elapsed_ms);
+        if (ibs_cpu->fetch_enabled)
+            ibs_adapt_rate(ibs_cpu->fetch_fd, &ibs_cpu->fetch_rate,
+                    &ibs_cpu->fetch_lost, "FETCH", cpu, elapsed_ms);
     }
+}
 
-    /* Get max select fd */
-    max_fd = (ibs_max_op_fd > ibs_max_fetch_fd) ? ibs_max_op_fd : ibs_max_fetch_fd;
+/* Mark the devices of the epoll set's events ready for reading */
+    static void
+ibs_mark_ready(ibs_sample_type_t type, int nevents)
+{
+    for (int i = 0; i < nevents; i++) {
+        ibs_cpu_t * ibs_cpu = &(ibs_cpus[ibs_events[i].data.u32]);
+        if (type == IBS_OP_SAMPLE)
+            ibs_cpu->op_ready = 1;
+        else
+            ibs_cpu->fetch_ready = 1;
+    }
+}
 
-    if (ibs_poll_timeout > 0) {
-        timeout.tv_sec  = (ibs_poll_timeout / MSEC_PER_SEC);
-        timeout.tv_usec = (ibs_poll_timeout % MSEC_PER_SEC) * USEC_PER_MSEC;
-        status = select(max_fd + 1, &rfds, NULL, NULL, &timeout);
-    } else {
-        status = select(max_fd + 1, &rfds, NULL, NULL, NULL);
+/* Wait up to ibs_poll_timeout for enabled devices of the sample_flags
+ * flavors to reach ibs_poll_num_samples, and mark the ones that did.
+ * Returns 1 if samples should be read now, 0 if not, or -1 on error. */
+    static int
+ibs_wait(int sample_flags)
+{
+    int timeout = (ibs_poll_timeout > 0) ? (int)ibs_poll_timeout : -1;
+    int cpu, status, type, types = 0;
+
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        ibs_cpus[cpu].op_ready = 0;
+        ibs_cpus[cpu].fetch_ready = 0;
     }
 
+    status = epoll_wait(ibs_epfd[sample_flags], ibs_events, ibs_max_events,
+            timeout);
+
     switch (status) {
         case -1:
             if (errno != EINTR)
             {
-                ibs_error_no("Select failed.%s", "");
+                ibs_error_no("epoll_wait failed.%s", "");
                 return -1;
             }
             /* We may still want to read whatever's there */
-            if (ibs_read_on_timeout)
-                break;
-
-            /* Else we bail */
-            return 0;
+            return ibs_read_on_timeout;
 
         case 0:
-            ibs_debug("select timed out after %lu ms of no more than %lu samples",
+            ibs_debug("epoll_wait timed out after %lu ms of no more than %lu samples",
                     ibs_poll_timeout,
                     ibs_poll_num_samples);
 
             /* We may still want to read whatever's there */
-            if (ibs_read_on_timeout)
-                break;
-
-            /* Else we bail */
-            return 0;
+            return ibs_read_on_timeout;
 
         default:
             break;
     }
 
-    return do_ibs_get_all_samples(
-            max_samples,
-            sample_flags,
-            samples,
-            sample_types,
-            &rfds,
-            cpu_list);
+    if (sample_flags != (IBS_OP_SAMPLE | IBS_FETCH_SAMPLE)) {
+        ibs_mark_ready(sample_flags, status);
+        return 1;
+    }
+
+    /* The outer set only says which of the inner sets are ready */
+    for (int i = 0; i < status; i++)
+        types |= ibs_events[i].data.u32;
+    for (type = IBS_OP_SAMPLE; type <= IBS_FETCH_SAMPLE; type++) {
+        if (!(types & type))
+            continue;
+        status = epoll_wait(ibs_epfd[type], ibs_events, ibs_max_events, 0);
+        if (status > 0)
+            ibs_mark_ready(type, status);
+    }
+
+    return 1;
 }
 
+    static int
+ibs_check_sample_flags(int sample_flags)
+{
+    if (!(sample_flags & IBS_OP_SAMPLE) &&
+            !(sample_flags & IBS_FETCH_SAMPLE))
+    {
+        ibs_error("Must supply IBS_OP_SAMPLE and/or IBS_FETCH_SAMPLE. Sent %d instead.",
+                sample_flags);
+        return -1;
+    }
 
-/* Get some IBS samples */
-    int
-ibs_sample(int                 max_samples,
+    return 0;
+}
+
+    static int
+do_ibs_sample(int           max_samples,
         int                 sample_flags,
         ibs_sample_t      * samples,
-        ibs_sample_type_t * sample_types)
+        ibs_sample_type_t * sample_types,
+        char              * cpu_list)
 {
-    return do_ibs_sample(
+    int status;
+
+    if (max_samples <= 0) {
+        ibs_error("max_samples must be > 0. Sent %d instead.", max_samples);
+        return -1;
+    }
+
+    if (ibs_check_sample_flags(sample_flags) < 0)
+        return -1;
+    sample_flags &= IBS_OP_SAMPLE | IBS_FETCH_SAMPLE;
+
+    status = ibs_wait(sample_flags);
+    if (status <= 0)
+        return status;
+
+    status = do_ibs_get_all_samples(
             max_samples,
             sample_flags,
             samples,
             sample_types,
-            ibs_cpu_list);
+            cpu_list);
+
+    if (ibs_adaptive_rate)
+        ibs_adapt_rates(cpu_list, &ibs_adapt_last);
+
+    return status;
 }
 
-static int is_cpu_online(int cpu_num)
+/* Take up to max samples from one device straight into buf. Mapped buffers
+ * take at most two memcpy()s and no syscalls; others take one FIONREAD and
+ * one read(). */
+    static int
+do_ibs_get_batch(ibs_sample_type_t   type,
+        int                 fd,
+        ibs_ring_header_t * ring,
+        void              * buf,
+        unsigned int        max)
 {
-    char *online_name;
+    size_t entry_size = (type == IBS_OP_SAMPLE) ?
+        sizeof(ibs_op_t) : sizeof(ibs_fetch_t);
+    long available;
+    ssize_t bytes_read;
+
+    if (ring != NULL) {
+        uint64_t rd = ring->rd;
+        uint64_t wr = __atomic_load_n(&ring->wr, __ATOMIC_ACQUIRE);
+        char * data = (char *)ring + ring->data_offset;
+        unsigned int n = 0;
+
+        while (rd != wr && n < max) {
+            uint64_t end = (wr > rd) ? wr : ring->capacity;
+            uint64_t chunk = end - rd;
+
+            if (chunk > max - n)
+                chunk = max - n;
+            memcpy((char *)buf + n * entry_size,
+                    data + rd * ring->entry_size, chunk * entry_size);
+            n += chunk;
+            rd += chunk;
+            if (rd == ring->capacity)
+                rd = 0;
+        }
 
-    // CPU 0 is the bootstrap processor and is always on
-    if (cpu_num == 0)
-        return 1;
+        /* Hand the slots back to the driver once we are done copying */
+        __atomic_store_n(&ring->rd, rd, __ATOMIC_RELEASE);
+        return n;
+    }
 
-    int num_bytes = asprintf(&online_name,
-            "/sys/devices/system/cpu/cpu%d/online", cpu_num);
-    if (num_bytes <= 0)
-    {
-        fprintf(stderr, "asprintf failed at %s:%d\n", __FILE__, __LINE__);
-        exit(EXIT_FAILURE);
+    available = ioctl(fd, FIONREAD);
+    if (available < 0) {
+        ibs_error_no("Could not read number of samples in fd %d", fd);
+        return -1;
     }
-    FILE *online_fp = fopen(online_name, "r");
-    if (online_fp == NULL)
-    {
-        fprintf(stderr, "Could not open %s\n", online_name);
-        exit(EXIT_FAILURE);
+    if (available == 0)
+        return 0;
+    if ((unsigned long)available > max)
+        available = max;
+
+    bytes_read = read(fd, buf, available * entry_size);
+    if (bytes_read < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        ibs_error_no("Could not read samples from fd %d", fd);
+        return -1;
+    }
+
+    return bytes_read / entry_size;
+}
+
+/* Fill batch from the ready devices of cpu_list */
+    static void
+do_ibs_fill_batch(ibs_batch_t * batch,
+        int           sample_flags,
+        char *        cpu_list)
+{
+    int cpu;
+
+    batch->num_ops = 0;
+    batch->num_fetches = 0;
+
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
+        int new_samples;
+
+        if (!cpu_list[cpu])
+            continue;
+
+        if ((sample_flags & IBS_OP_SAMPLE) && ibs_cpu->op_enabled &&
+                batch->num_ops < batch->max_ops &&
+                (ibs_aggressive_read || ibs_cpu->op_ready)) {
+            new_samples = do_ibs_get_batch(IBS_OP_SAMPLE, ibs_cpu->op_fd,
+                    ibs_cpu->op_ring, batch->ops + batch->num_ops,
+                    batch->max_ops - batch->num_ops);
+            if (new_samples < 0) {
+                ibs_error("Could not get OP sample from cpu %d", cpu);
+            } else {
+                ibs_cpu->op_rate.samples += new_samples;
+                batch->num_ops += new_samples;
+            }
+        }
+
+        if ((sample_flags & IBS_FETCH_SAMPLE) && ibs_cpu->fetch_enabled &&
+                batch->num_fetches < batch->max_fetches &&
+                (ibs_aggressive_read || ibs_cpu->fetch_ready)) {
+            new_samples = do_ibs_get_batch(IBS_FETCH_SAMPLE,
+                    ibs_cpu->fetch_fd, ibs_cpu->fetch_ring,
+                    batch->fetches + batch->num_fetches,
+                    batch->max_fetches - batch->num_fetches);
+            if (new_samples < 0) {
+                ibs_error("Could not get FETCH sample from cpu %d", cpu);
+            } else {
+                ibs_cpu->fetch_rate.samples += new_samples;
+                batch->num_fetches += new_samples;
+            }
+        }
+    }
+}
+
+
+/* Get some IBS samples, sorted by type, without staging or copying them */
+    int
+ibs_sample_batch(ibs_batch_t * batch)
+{
+    int sample_flags = 0;
+    int status;
+
+    batch->num_ops = 0;
+    batch->num_fetches = 0;
+    if (batch->max_ops > 0 && ibs_op)
+        sample_flags |= IBS_OP_SAMPLE;
+    if (batch->max_fetches > 0 && ibs_fetch)
+        sample_flags |= IBS_FETCH_SAMPLE;
+    if (ibs_check_sample_flags(sample_flags) < 0)
+        return -1;
+
+    status = ibs_wait(sample_flags);
+    if (status <= 0)
+        return status;
+
+    do_ibs_fill_batch(batch, sample_flags, ibs_cpu_list);
+
+    if (ibs_adaptive_rate)
+        ibs_adapt_rates(ibs_cpu_list, &ibs_adapt_last);
+
+    return batch->num_ops + batch->num_fetches;
+}
+
+/* Get some IBS samples */
+    int
+ibs_sample(int                 max_samples,
+        int                 sample_flags,
+        ibs_sample_t      * samples,
+        ibs_sample_type_t * sample_types)
+{
+    return do_ibs_sample(
+            max_samples,
+            sample_flags,
+            samples,
+            sample_types,
+            ibs_cpu_list);
+}
+
+    static int
+ibs_snapshot_ioctl_all(unsigned long arg)
+{
+    int cpu, status = 0;
+
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        if (ibs_cpu_list[cpu] &&
+                ibs_apply_ioctl_on_cpu(SNAPSHOT, arg, cpu) < 0) {
+            ibs_error("Could not apply SNAPSHOT %lu on cpu %d", arg, cpu);
+            status = -1;
+        }
+    }
+
+    return status;
+}
+
+/* Freeze the buffers and take up to max_samples from them */
+    int
+ibs_snapshot(int                 max_samples,
+        int                 sample_flags,
+        ibs_sample_t      * samples,
+        ibs_sample_type_t * sample_types)
+{
+    int status;
+
+    if (max_samples <= 0) {
+        ibs_error("max_samples must be > 0. Sent %d instead.", max_samples);
+        return -1;
+    }
+
+    status = ibs_snapshot_ioctl_all(IBS_SNAPSHOT_FREEZE);
+    if (status == 0) {
+        /* Every buffer is read, ready or not */
+        ibs_frozen = 1;
+        status = do_ibs_get_all_samples(
+                max_samples,
+                sample_flags,
+                samples,
+                sample_types,
+                ibs_cpu_list);
+        ibs_frozen = 0;
+    }
+
+    if (ibs_snapshot_ioctl_all(IBS_SNAPSHOT_THAW) < 0)
+        return -1;
+
+    return status;
+}
+
+/* Ask the daemon to write out a snapshot */
+    int
+ibs_request_snapshot(void)
+{
+    if (!ibs_daemon) {
+        ibs_error("No IBS daemon to take a snapshot. %s", "");
+        errno = ESRCH;
+        return -1;
+    }
+
+    return kill(ibs_daemon, SIGUSR2);
+}
+
+/* Add up and reset the drivers' lost sample counters, along with what
+ * IBS_ADAPTIVE_RATE already took from them */
+    int
+ibs_get_lost(unsigned long * op_lost, unsigned long * fetch_lost)
+{
+    long lost;
+
+    if (!ibs_initialized) {
+        ibs_error("IBS not initialized. %s", "");
+        return -1;
+    }
+
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+        ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
+
+        if (ibs_cpu->op_fd > 0) {
+            lost = ioctl(ibs_cpu->op_fd, GET_LOST);
+            if (lost < 0) {
+                ibs_error_no("Could not get lost op samples on cpu %d", cpu);
+                return -1;
+            }
+            lost += __atomic_exchange_n(&ibs_cpu->op_lost, 0,
+                    __ATOMIC_RELAXED);
+            if (op_lost != NULL)
+                *op_lost += lost;
+        }
+
+        if (ibs_cpu->fetch_fd > 0) {
+            lost = ioctl(ibs_cpu->fetch_fd, GET_LOST);
+            if (lost < 0) {
+                ibs_error_no("Could not get lost fetch samples on cpu %d", cpu);
+                return -1;
+            }
+            lost += __atomic_exchange_n(&ibs_cpu->fetch_lost, 0,
+                    __ATOMIC_RELAXED);
+            if (fetch_lost != NULL)
+                *fetch_lost += lost;
+        }
+    }
+
+    return 0;
+}
+
+/* Start an empty per-page NUMA heatmap of 4K or 2M pages */
+    ibs_heatmap_t *
+ibs_heatmap_create(unsigned int page_shift)
+{
+    ibs_heatmap_t * heatmap = malloc(sizeof(ibs_heatmap_t));
+
+    if (heatmap == NULL)
+        return NULL;
+    if (ibs_heatmap_init(heatmap, page_shift) < 0) {
+        ibs_error("Cannot start a heatmap with page shift %u", page_shift);
+        ibs_heatmap_fini(heatmap);
+        free(heatmap);
+        return NULL;
+    }
+    return heatmap;
+}
+
+/* Count the op samples of a batch from ibs_sample_batch() */
+    int
+ibs_heatmap_add_batch(ibs_heatmap_t * heatmap, const ibs_batch_t * batch)
+{
+    for (unsigned int i = 0; i < batch->num_ops; i++) {
+        if (ibs_heatmap_add(heatmap, &(batch->ops[i])) < 0) {
+            ibs_error("Out of memory for the heatmap.%s", "");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Write the heatmap to path as a sorted table */
+    int
+ibs_heatmap_save(ibs_heatmap_t * heatmap, const char * path)
+{
+    FILE * fp = fopen(path, "w");
+    int status;
+
+    if (fp == NULL) {
+        ibs_error("Cannot open heatmap file %s", path);
+        return -1;
+    }
+    status = ibs_heatmap_write(heatmap, fp);
+    if (fclose(fp) != 0)
+        status = -1;
+    if (status < 0)
+        ibs_error("Cannot write heatmap file %s", path);
+    return status;
+}
+
+    void
+ibs_heatmap_destroy(ibs_heatmap_t * heatmap)
+{
+    if (heatmap == NULL)
+        return;
+    ibs_heatmap_fini(heatmap);
+    free(heatmap);
+}
+
+static int is_cpu_online(int cpu_num)
+{
+    char *online_name;
+
+    // CPU 0 is the bootstrap processor and is always on
+    if (cpu_num == 0)
+        return 1;
+
+    int num_bytes = asprintf(&online_name,
+            "/sys/devices/system/cpu/cpu%d/online", cpu_num);
+    if (num_bytes <= 0)
+    {
+        fprintf(stderr, "asprintf failed at %s:%d\n", __FILE__, __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    FILE *online_fp = fopen(online_name, "r");
+    if (online_fp == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", online_name);
+        exit(EXIT_FAILURE);
     }
     free(online_name);
 
@@ -757,6 +1561,14 @@ do_ibs_initialize(ibs_option_list_t * options,
         ibs_set_option(o->opt, o->val);
     }
 
+    /* In overwrite mode the driver moves rd itself, and a mapping's
+     * consumer storing rd at the same time would replay or skip entries */
+    if (ibs_mmap && ibs_flight_recorder) {
+        ibs_error("IBS_MMAP cannot be combined with IBS_FLIGHT_RECORDER.%s", "");
+        errno = EINVAL;
+        return -1;
+    }
+
     int online_cpus = get_nprocs();
     ibs_debug("%d total cpus - %d cpus online", num_cpus, online_cpus);
 
@@ -773,8 +1585,11 @@ do_ibs_initialize(ibs_option_list_t * options,
         ibs_cpu->cpu = cpu;
     }
 
-    ibs_max_op_fd    = -1;
-    ibs_max_fetch_fd = -1;
+    if (ibs_epoll_init() < 0) {
+        ibs_epoll_fini();
+        free(ibs_cpus);
+        return -1;
+    }
 
     /* Open IBS files and store fds */
     for (cpu = 0; cpu < num_cpus; cpu++) {
@@ -794,9 +1609,6 @@ do_ibs_initialize(ibs_option_list_t * options,
             }
 
             ibs_cpu->op_fd = fd;
-            if (fd > ibs_max_op_fd) {
-                ibs_max_op_fd = fd;
-            }
         }
 
         if (ibs_fetch) {
@@ -810,9 +1622,6 @@ do_ibs_initialize(ibs_option_list_t * options,
             }
 
             ibs_cpu->fetch_fd = fd;
-            if (fd > ibs_max_fetch_fd) {
-                ibs_max_fetch_fd = fd;
-            }
         }
 
         /* Apply options on the cpus before enabling IBS */
@@ -821,6 +1630,23 @@ do_ibs_initialize(ibs_option_list_t * options,
             ibs_error("Could not apply options on cpu %d", cpu);
             goto err;
         }
+
+        /* The buffer size is final now, so the buffers can be mapped */
+        if (ibs_mmap) {
+            if (ibs_cpu->op_fd > 0) {
+                ibs_cpu->op_ring = ibs_map_ring(ibs_cpu->op_fd,
+                        &ibs_cpu->op_ring_len);
+                if (ibs_cpu->op_ring == NULL)
+                    goto err;
+            }
+
+            if (ibs_cpu->fetch_fd > 0) {
+                ibs_cpu->fetch_ring = ibs_map_ring(ibs_cpu->fetch_fd,
+                        &ibs_cpu->fetch_ring_len);
+                if (ibs_cpu->fetch_ring == NULL)
+                    goto err;
+            }
+        }
     }
 
     ibs_debug("IBS Initialized.%s", "");
@@ -831,6 +1657,7 @@ do_ibs_initialize(ibs_option_list_t * options,
 err:
     while (cpu >= 0) {
         ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
+        ibs_unmap_rings(ibs_cpu);
         if (ibs_cpu->op_fd > 0) {
             close(ibs_cpu->op_fd);
             ibs_cpu->op_fd = 0;
@@ -845,9 +1672,7 @@ err:
     }
 
     free(ibs_cpus);
-
-    ibs_max_op_fd    = -1;
-    ibs_max_fetch_fd = -1;
+    ibs_epoll_fini();
 
     return fd;
 }
@@ -916,30 +1741,565 @@ ibs_finalize(void)
     /* Disable IBS on all cpus */
     ibs_disable_all();
 
-    /* Free resources */
+    /* Free resources, so that IBS can be initialized again */
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+        ibs_unmap_rings(&(ibs_cpus[cpu]));
+        if (ibs_cpus[cpu].op_fd > 0)
+            close(ibs_cpus[cpu].op_fd);
+        if (ibs_cpus[cpu].fetch_fd > 0)
+            close(ibs_cpus[cpu].fetch_fd);
+    }
     free(ibs_cpus);
+    ibs_cpus = NULL;
+    free(ibs_cpu_list);
+    ibs_cpu_list = NULL;
+    ibs_epoll_fini();
 
-    ibs_max_op_fd    = -1;
-    ibs_max_fetch_fd = -1;
     ibs_initialized  = 0;
 }
 
 
 
 static int die = 0;
+static int snapshot = 0;
 
     static void
 sig_handler(int sig)
 {
+    if (sig == SIGUSR2) {
+        snapshot = 1;
+        return;
+    }
+
     if (sig != SIGUSR1 && sig != SIGINT) {
         ibs_error("Child received a weird signal (%d)", sig);
         return;
     }
 
+    /* A flight recorder writes out what it holds before it goes */
+    if (ibs_flight_recorder)
+        snapshot = 1;
     die = 1;
 }
 
 
+/* Reader threads for the daemon, with IBS_DAEMON_READERS. Each one is
+ * pinned to one NUMA node or L3 cache and drains only the devices of the
+ * CPUs there. Full batches go to the daemon's main thread, which alone calls
+ * the write functions. Each reader owns IBS_QUEUE_LEN batches, which travel
+ * back and forth through two single-producer, single-consumer queues. */
+#define IBS_QUEUE_LEN        4   /* A power of two */
+#define IBS_READER_IDLE_US   1000
+
+typedef struct ibs_queue {
+    ibs_batch_t * slot[IBS_QUEUE_LEN];
+    unsigned long head __attribute__((aligned(64)));  /* Consumer's */
+    unsigned long tail __attribute__((aligned(64)));  /* Producer's */
+} ibs_queue_t;
+
+typedef struct ibs_reader {
+    pthread_t            thread;
+    int                  group;      /* Lowest CPU of its node or L3 */
+    char *               cpu_list;   /* The CPUs whose devices it drains */
+    cpu_set_t *          affinity;
+    size_t               affinity_size;
+    int                  epfd;
+    struct epoll_event * events;
+    int                  max_events;
+    struct timespec      adapt_last;
+    ibs_queue_t          full;       /* To the main thread */
+    ibs_queue_t          empty;      /* Back from the main thread */
+    ibs_batch_t          batches[IBS_QUEUE_LEN];
+} ibs_reader_t;
+
+static ibs_reader_t * ibs_readers     = NULL;
+static int            ibs_num_readers = 0;
+static int            ibs_readers_stop = 0;
+static int            ibs_readers_efd = -1;  /* Rung on every full batch */
+
+    static int
+ibs_queue_push(ibs_queue_t * q, ibs_batch_t * batch)
+{
+    unsigned long tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == IBS_QUEUE_LEN)
+        return -1;
+    q->slot[tail % IBS_QUEUE_LEN] = batch;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+    static ibs_batch_t *
+ibs_queue_pop(ibs_queue_t * q)
+{
+    unsigned long head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    ibs_batch_t * batch;
+
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    batch = q->slot[head % IBS_QUEUE_LEN];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return batch;
+}
+
+/* Parse a sysfs CPU list such as "0-7,64-71" into set, and return its
+ * lowest CPU, or -1 if it cannot be read */
+    static int
+ibs_read_cpulist(const char * path,
+        cpu_set_t *  set,
+        size_t       set_size)
+{
+    FILE * fp = fopen(path, "r");
+    int first = -1, lo, hi, n;
+
+    if (fp == NULL)
+        return -1;
+
+    while ((n = fscanf(fp, "%d-%d", &lo, &hi)) >= 1) {
+        if (n == 1)
+            hi = lo;
+        if (first < 0 || lo < first)
+            first = lo;
+        for (int cpu = lo; cpu <= hi; cpu++)
+            CPU_SET_S(cpu, set_size, set);
+        if (fgetc(fp) != ',')
+            break;
+    }
+
+    fclose(fp);
+    return first;
+}
+
+/* Find the sysfs CPU list of the node or L3 cache that cpu is in */
+    static int
+ibs_group_path(int cpu, char * path, size_t path_len)
+{
+    char cpu_dir[64];
+    struct dirent * ent;
+    DIR * dir;
+    int node = -1;
+
+    if (ibs_daemon_readers == IBS_READERS_PER_L3) {
+        snprintf(path, path_len,
+                "/sys/devices/system/cpu/cpu%d/cache/index3/shared_cpu_list",
+                cpu);
+        return 0;
+    }
+
+    /* The CPU's directory links to its node as nodeN */
+    snprintf(cpu_dir, sizeof(cpu_dir), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(cpu_dir);
+    if (dir == NULL)
+        return -1;
+    while ((ent = readdir(dir)) != NULL)
+        if (sscanf(ent->d_name, "node%d", &node) == 1)
+            break;
+    closedir(dir);
+    if (node < 0)
+        return -1;
+
+    snprintf(path, path_len, "/sys/devices/system/node/node%d/cpulist",
+            node);
+    return 0;
+}
+
+    static void
+ibs_free_readers(void)
+{
+    for (int i = 0; i < ibs_num_readers; i++) {
+        ibs_reader_t * reader = &(ibs_readers[i]);
+
+        if (reader->epfd >= 0)
+            close(reader->epfd);
+        free(reader->events);
+        free(reader->cpu_list);
+        if (reader->affinity)
+            CPU_FREE(reader->affinity);
+        for (int j = 0; j < IBS_QUEUE_LEN; j++) {
+            free(reader->batches[j].ops);
+            free(reader->batches[j].fetches);
+        }
+    }
+
+    free(ibs_readers);
+    ibs_readers = NULL;
+    ibs_num_readers = 0;
+    if (ibs_readers_efd >= 0)
+        close(ibs_readers_efd);
+    ibs_readers_efd = -1;
+}
+
+/* Find or make the reader for cpu's node or L3 cache */
+    static ibs_reader_t *
+ibs_group_reader(int cpu)
+{
+    char path[128];
+    size_t set_size = CPU_ALLOC_SIZE(num_cpus);
+    cpu_set_t * set = CPU_ALLOC(num_cpus);
+    ibs_reader_t * reader;
+    int group = -1;
+
+    if (set == NULL)
+        return NULL;
+    CPU_ZERO_S(set_size, set);
+
+    /* CPUs that sysfs says nothing about all go to one reader */
+    if (ibs_group_path(cpu, path, sizeof(path)) == 0)
+        group = ibs_read_cpulist(path, set, set_size);
+
+    for (int i = 0; i < ibs_num_readers; i++) {
+        if (ibs_readers[i].group == group) {
+            CPU_FREE(set);
+            return &(ibs_readers[i]);
+        }
+    }
+
+    reader = &(ibs_readers[ibs_num_readers++]);
+    reader->group = group;
+    reader->affinity = set;
+    reader->affinity_size = set_size;
+    reader->cpu_list = calloc(num_cpus, sizeof(char));
+    reader->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reader->cpu_list == NULL || reader->epfd < 0)
+        return NULL;
+
+    for (int j = 0; j < IBS_QUEUE_LEN; j++) {
+        ibs_batch_t * batch = &(reader->batches[j]);
+
+        if (ibs_op) {
+            batch->ops = malloc(sizeof(ibs_op_t) * ibs_daemon_max_samples);
+            batch->max_ops = ibs_daemon_max_samples;
+            if (batch->ops == NULL)
+                return NULL;
+        }
+        if (ibs_fetch) {
+            batch->fetches = malloc(sizeof(ibs_fetch_t) *
+                    ibs_daemon_max_samples);
+            batch->max_fetches = ibs_daemon_max_samples;
+            if (batch->fetches == NULL)
+                return NULL;
+        }
+        ibs_queue_push(&reader->empty, batch);
+    }
+
+    return reader;
+}
+
+/* Watch fd in the reader's epoll set. The event is (cpu << 1) | is_fetch. */
+    static int
+ibs_reader_watch(ibs_reader_t * reader, int fd, int cpu, int is_fetch)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = (cpu << 1) | is_fetch;
+    if (epoll_ctl(reader->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        ibs_error_no("Could not watch fd %d", fd);
+        return -1;
+    }
+
+    reader->max_events++;
+    return 0;
+}
+
+/* Split the enabled devices among readers, one per node or L3 cache */
+    static int
+ibs_setup_readers(void)
+{
+    int cpu;
+
+    ibs_readers = calloc(num_cpus, sizeof(ibs_reader_t));
+    ibs_readers_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ibs_readers == NULL || ibs_readers_efd < 0) {
+        ibs_error_no("Cannot set up the reader threads.%s", "");
+        goto err;
+    }
+
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        ibs_cpu_t * ibs_cpu = &(ibs_cpus[cpu]);
+        ibs_reader_t * reader;
+
+        if (!ibs_cpu_list[cpu] ||
+                (!ibs_cpu->op_enabled && !ibs_cpu->fetch_enabled))
+            continue;
+
+        reader = ibs_group_reader(cpu);
+        if (reader == NULL) {
+            ibs_error_no("Cannot set up a reader for cpu %d", cpu);
+            goto err;
+        }
+        reader->cpu_list[cpu] = 1;
+        if (ibs_cpu->op_enabled &&
+                ibs_reader_watch(reader, ibs_cpu->op_fd, cpu, 0) < 0)
+            goto err;
+        if (ibs_cpu->fetch_enabled &&
+                ibs_reader_watch(reader, ibs_cpu->fetch_fd, cpu, 1) < 0)
+            goto err;
+    }
+
+    for (int i = 0; i < ibs_num_readers; i++) {
+        ibs_reader_t * reader = &(ibs_readers[i]);
+
+        reader->events = calloc(reader->max_events,
+                sizeof(struct epoll_event));
+        if (reader->events == NULL)
+            goto err;
+        ibs_debug("Reader %d drains %d devices near cpu %d", i,
+                reader->max_events, reader->group);
+    }
+
+    return 0;
+
+err:
+    ibs_free_readers();
+    return -1;
+}
+
+    static void *
+ibs_reader_main(void * arg)
+{
+    ibs_reader_t * reader = arg;
+    int sample_flags = (ibs_op ? IBS_OP_SAMPLE : 0) |
+        (ibs_fetch ? IBS_FETCH_SAMPLE : 0);
+    int timeout = (ibs_poll_timeout > 0) ? (int)ibs_poll_timeout : -1;
+    ibs_batch_t * batch = NULL;
+    uint64_t one = 1;
+
+    while (!__atomic_load_n(&ibs_readers_stop, __ATOMIC_ACQUIRE)) {
+        int nevents;
+
+        /* The main thread is behind; the driver buffers meanwhile */
+        if (batch == NULL && (batch = ibs_queue_pop(&reader->empty)) == NULL) {
+            usleep(IBS_READER_IDLE_US);
+            continue;
+        }
+
+        nevents = epoll_wait(reader->epfd, reader->events,
+                reader->max_events, timeout);
+        if (nevents < 0 && errno != EINTR) {
+            ibs_error_no("epoll_wait failed in reader %d", reader->group);
+            break;
+        }
+
+        /* Only this reader touches its CPUs' ready flags */
+        for (int cpu = 0; cpu < num_cpus; cpu++) {
+            if (reader->cpu_list[cpu]) {
+                ibs_cpus[cpu].op_ready = 0;
+                ibs_cpus[cpu].fetch_ready = 0;
+            }
+        }
+        for (int i = 0; i < nevents; i++) {
+            ibs_cpu_t * ibs_cpu = &(ibs_cpus[reader->events[i].data.u32 >> 1]);
+            if (reader->events[i].data.u32 & 1)
+                ibs_cpu->fetch_ready = 1;
+            else
+                ibs_cpu->op_ready = 1;
+        }
+
+        if (nevents > 0 || ibs_aggressive_read)
+            do_ibs_fill_batch(batch, sample_flags, reader->cpu_list);
+        if (ibs_adaptive_rate)
+            ibs_adapt_rates(reader->cpu_list, &reader->adapt_last);
+
+        if (batch->num_ops + batch->num_fetches == 0)
+            continue;
+        ibs_queue_push(&reader->full, batch);
+        batch = NULL;
+        if (write(ibs_readers_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            ibs_error_no("Cannot wake the writer.%s", "");
+    }
+
+    if (batch != NULL)
+        ibs_queue_push(&reader->empty, batch);
+    return NULL;
+}
+
+/* Start one thread per reader, pinned to its node or L3 cache. Signals stay
+ * with the main thread. */
+    static int
+ibs_start_readers(void)
+{
+    sigset_t all, old;
+    int i, status = 0;
+
+    if (ibs_setup_readers() < 0)
+        return -1;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < ibs_num_readers; i++) {
+        ibs_reader_t * reader = &(ibs_readers[i]);
+        pthread_attr_t attr;
+
+        pthread_attr_init(&attr);
+        if (reader->group >= 0)
+            pthread_attr_setaffinity_np(&attr, reader->affinity_size,
+                    reader->affinity);
+        status = pthread_create(&reader->thread, &attr, ibs_reader_main,
+                reader);
+        pthread_attr_destroy(&attr);
+        if (status != 0) {
+            ibs_error("Cannot start reader %d: %s", i, strerror(status));
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (status != 0) {
+        __atomic_store_n(&ibs_readers_stop, 1, __ATOMIC_RELEASE);
+        while (--i >= 0)
+            pthread_join(ibs_readers[i].thread, NULL);
+        ibs_free_readers();
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Write out every full batch, and hand it back to its reader */
+    static void
+ibs_drain_readers(FILE *          op_fp,
+        FILE *          fetch_fp,
+        unsigned long * num_ops,
+        unsigned long * num_fetches)
+{
+    for (int i = 0; i < ibs_num_readers; i++) {
+        ibs_reader_t * reader = &(ibs_readers[i]);
+        ibs_batch_t * batch;
+
+        while ((batch = ibs_queue_pop(&reader->full)) != NULL) {
+            for (unsigned int j = 0; j < batch->num_ops; j++)
+                ibs_daemon_op_write(op_fp, &batch->ops[j]);
+            for (unsigned int j = 0; j < batch->num_fetches; j++)
+                ibs_daemon_fetch_write(fetch_fp, &batch->fetches[j]);
+            *num_ops += batch->num_ops;
+            *num_fetches += batch->num_fetches;
+            ibs_queue_push(&reader->empty, batch);
+        }
+    }
+}
+
+/* The daemon's main loop with reader threads: write whatever they hand
+ * over until told to die */
+    static void
+ibs_run_readers(FILE *          op_fp,
+        FILE *          fetch_fp,
+        unsigned long * num_ops,
+        unsigned long * num_fetches)
+{
+    struct pollfd pfd = { .fd = ibs_readers_efd, .events = POLLIN };
+    int timeout = (ibs_poll_timeout > 0) ? (int)ibs_poll_timeout : -1;
+    uint64_t rings;
+
+    while (die == 0) {
+        /* Unlike read(), poll() is never restarted after a signal */
+        if (poll(&pfd, 1, timeout) > 0 &&
+                read(ibs_readers_efd, &rings, sizeof(rings)) < 0 &&
+                errno != EAGAIN)
+            ibs_error_no("Cannot read the reader eventfd.%s", "");
+
+        /* The readers drain everything as it comes, so a snapshot would
+         * find nothing new */
+        snapshot = 0;
+        ibs_drain_readers(op_fp, fetch_fp, num_ops, num_fetches);
+    }
+
+    __atomic_store_n(&ibs_readers_stop, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < ibs_num_readers; i++)
+        pthread_join(ibs_readers[i].thread, NULL);
+    ibs_drain_readers(op_fp, fetch_fp, num_ops, num_fetches);
+    ibs_free_readers();
+}
+
+
+/* Trace format 2 output for IBS_DAEMON_TRACE. Only the daemon's main thread
+ * writes, so one writer per flavor is enough. */
+static ibs_trace_writer_t ibs_op_trace;
+static ibs_trace_writer_t ibs_fetch_trace;
+
+    static void
+ibs_trace_emit(void *          arg,
+        const void *    data,
+        size_t          len)
+{
+    if (fwrite(data, 1, len, (FILE *)arg) != len)
+        ibs_error_no("Cannot write %zu bytes of samples", len);
+}
+
+    static void
+ibs_trace_op_write(FILE *       fp,
+        ibs_op_t *      op)
+{
+    (void)fp;
+    if (ibs_trace_put(&ibs_op_trace, op->cpu, op))
+        ibs_error("Cannot compress an op sample.%s", "");
+}
+
+    static void
+ibs_trace_fetch_write(FILE *    fp,
+        ibs_fetch_t *   fetch)
+{
+    (void)fp;
+    if (ibs_trace_put(&ibs_fetch_trace, fetch->cpu, fetch))
+        ibs_error("Cannot compress a fetch sample.%s", "");
+}
+
+/* The part of ibs_monitor's header that ibs_decoder needs. The CPU feature
+ * lines are left out, so the decoder leaves those columns empty. */
+    static void
+ibs_trace_header(FILE *         fp,
+        int             is_op)
+{
+    unsigned int eax = 0, ebx, ecx, edx;
+    unsigned int family, model;
+
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    family = ((eax >> 8) & 0xf) + ((eax >> 20) & 0xff);
+    model = (((eax >> 16) & 0xf) << 4) | ((eax >> 4) & 0xf);
+
+    fprintf(fp, "IBS %s Sample File\n", is_op ? "Op" : "Fetch");
+    fprintf(fp, "AMD Processor Family: 0x%x\n", family);
+    fprintf(fp, "AMD Processor Model: 0x%x\n", model);
+    fprintf(fp, "IBS %s Structure Version: %u\n", is_op ? "Op" : "Fetch",
+            is_op ? IBS_OP_STRUCT_VERSION : IBS_FETCH_STRUCT_VERSION);
+    fprintf(fp, "IBS %s Field Mask: 0x%" PRIx64 "\n", is_op ? "Op" : "Fetch",
+            (uint64_t)(is_op ? IBS_OP_FIELDS_ALL : IBS_FETCH_FIELDS_ALL));
+    fprintf(fp, "IBS Trace Format: %u\n", ibs_daemon_trace);
+    fprintf(fp, "\n=============================================\n");
+
+    if (is_op) {
+        ibs_trace_writer_init(&ibs_op_trace, ibs_daemon_trace, 1,
+                IBS_OP_FIELDS_ALL, ftello(fp), ibs_trace_emit, fp);
+        ibs_daemon_op_write = ibs_trace_op_write;
+    } else {
+        ibs_trace_writer_init(&ibs_fetch_trace, ibs_daemon_trace, 0,
+                IBS_FETCH_FIELDS_ALL, ftello(fp), ibs_trace_emit, fp);
+        ibs_daemon_fetch_write = ibs_trace_fetch_write;
+    }
+}
+
+/* Open one of the daemon's files, or with IBS_DAEMON_STREAM a stream that
+ * stands in for it. A stream's sends wait on the receiver, which holds up
+ * this loop until the driver's buffers start dropping samples. */
+    static FILE *
+ibs_daemon_open(const char * name)
+{
+    FILE * fp;
+
+    if (ibs_daemon_stream == NULL) {
+        fp = fopen(name, "w");
+        if (fp == NULL)
+            ibs_error_no("Cannot open output file %s", name);
+        return fp;
+    }
+    fp = ibs_stream_open(ibs_daemon_stream, name,
+            ibs_daemon_stream_deflate ? IBS_STREAM_DEFLATE : 0);
+    if (fp == NULL)
+        ibs_error_no("Cannot stream %s to %s", name, ibs_daemon_stream);
+    return fp;
+}
+
 /* Setup a simple sample loop */
     static int
 start_ibs_daemon(void)
@@ -970,9 +2330,8 @@ start_ibs_daemon(void)
     /* Open the op file */
     if (ibs_op)
     {
-        op_fp = fopen(ibs_daemon_op_file, "w");
+        op_fp = ibs_daemon_open(ibs_daemon_op_file);
         if (op_fp == NULL) {
-            ibs_error_no("Cannot open output file %s", ibs_daemon_op_file);
             free(samples);
             free(sample_types);
             return -1;
@@ -982,9 +2341,8 @@ start_ibs_daemon(void)
     /* Open the fetch file */
     if (ibs_fetch)
     {
-        fetch_fp = fopen(ibs_daemon_fetch_file, "w");
+        fetch_fp = ibs_daemon_open(ibs_daemon_fetch_file);
         if (fetch_fp == NULL) {
-            ibs_error_no("Cannot open output file %s", ibs_daemon_fetch_file);
             free(samples);
             free(sample_types);
             if (op_fp)
@@ -993,6 +2351,13 @@ start_ibs_daemon(void)
         }
     }
 
+    if (ibs_daemon_trace) {
+        if (op_fp)
+            ibs_trace_header(op_fp, 1);
+        if (fetch_fp)
+            ibs_trace_header(fetch_fp, 0);
+    }
+
     /* Enable all CPUs */
     status = ibs_enable_all();
     if (status != 0) {
@@ -1012,7 +2377,21 @@ start_ibs_daemon(void)
     /* Also catch ctrl-C */
     signal(SIGINT, sig_handler);
 
-    while (die == 0) {
+    /* And requests for a snapshot */
+    signal(SIGUSR2, sig_handler);
+
+    /* A flight recorder's samples are only read by snapshots, which all go
+     * through this thread */
+    if (ibs_daemon_readers != IBS_READERS_NONE && !ibs_flight_recorder) {
+        if (ibs_start_readers() == 0) {
+            ibs_run_readers(op_fp, fetch_fp, &num_ops, &num_fetches);
+            num_samples = num_ops + num_fetches;
+        } else {
+            ibs_error("Reading from one thread instead.%s", "");
+        }
+    }
+
+    while (die == 0 || snapshot) {
         int new_samples, i, sample_flags = 0;
 
         if (ibs_op)
@@ -1021,11 +2400,24 @@ start_ibs_daemon(void)
         if (ibs_fetch)
             sample_flags |= IBS_FETCH_SAMPLE;
 
-        new_samples = ibs_sample(
-                ibs_daemon_max_samples,
-                sample_flags,
-                samples,
-                sample_types);
+        if (snapshot) {
+            snapshot = 0;
+            new_samples = ibs_snapshot(
+                    ibs_daemon_max_samples,
+                    sample_flags,
+                    samples,
+                    sample_types);
+        } else if (ibs_flight_recorder) {
+            /* Nothing can be read until someone asks for a snapshot */
+            usleep(ibs_poll_timeout * USEC_PER_MSEC);
+            continue;
+        } else {
+            new_samples = ibs_sample(
+                    ibs_daemon_max_samples,
+                    sample_flags,
+                    samples,
+                    sample_types);
+        }
 
         if (new_samples >= 0)
             num_samples += new_samples;
@@ -1048,13 +2440,28 @@ start_ibs_daemon(void)
         }
     }
 
-    if (op_fp)
+    /* A trace ends with its last chunk, so the counts only go to the log */
+    if (op_fp && ibs_daemon_trace)
+    {
+        if (ibs_trace_writer_fini(&ibs_op_trace))
+            ibs_error("Cannot compress the last op samples.%s", "");
+        ibs_debug("IBS OP samples: %lu of %lu", num_ops, num_samples);
+        fclose(op_fp);
+    }
+    else if (op_fp)
     {
         fprintf(op_fp, "IBS OP    samples: %lu\n", num_ops);
         fprintf(op_fp, "IBS total samples: %lu\n", num_samples);
         fclose(op_fp);
     }
-    if (fetch_fp)
+    if (fetch_fp && ibs_daemon_trace)
+    {
+        if (ibs_trace_writer_fini(&ibs_fetch_trace))
+            ibs_error("Cannot compress the last fetch samples.%s", "");
+        ibs_debug("IBS FETCH samples: %lu of %lu", num_fetches, num_samples);
+        fclose(fetch_fp);
+    }
+    else if (fetch_fp)
     {
         fprintf(fetch_fp, "IBS FETCH samples: %lu\n", num_fetches);
         fprintf(fetch_fp, "IBS total samples: %lu\n", num_samples);
@@ -28,11 +28,19 @@ extern "C" {
 #define DEFAULT_IBS_POLL_NUM_SAMPLES 4096
 #define DEFAULT_IBS_MAX_CNT			 0x3fff
 #define DEFAULT_IBS_CPU_LIST         (word_t)-1
+#define DEFAULT_IBS_MMAP             0
+#define DEFAULT_IBS_FLIGHT_RECORDER  0
+#define DEFAULT_IBS_ADAPTIVE_RATE    0
+#define DEFAULT_IBS_BUFFER_SIZE      0
 
 #define DEFAULT_IBS_DAEMON_MAX_SAMPLES  10000
 #define DEFAULT_IBS_DAEMON_OP_FILE		"op.ibs"
 #define DEFAULT_IBS_DAEMON_FETCH_FILE	"fetch.ibs"
 #define DEFAULT_IBS_DAEMON_CPU_LIST     (word_t)-1
+#define DEFAULT_IBS_DAEMON_READERS      IBS_READERS_NONE
+#define DEFAULT_IBS_DAEMON_TRACE        0
+#define DEFAULT_IBS_DAEMON_STREAM       NULL
+#define DEFAULT_IBS_DAEMON_STREAM_DEFLATE 0
 
 
 
@@ -66,8 +74,35 @@ typedef enum {
     IBS_DAEMON_FETCH_FILE,
     IBS_DAEMON_OP_WRITE,
     IBS_DAEMON_FETCH_WRITE,
+    IBS_MMAP,               /* 1: read the driver's buffers through a
+                               mapping instead of read() */
+    IBS_FLIGHT_RECORDER,    /* 1: overwrite the oldest samples and only
+                               hand them out through ibs_snapshot(). Cannot
+                               be combined with IBS_MMAP */
+    IBS_ADAPTIVE_RATE,      /* Target samples per second per device, or 0.
+                               IBS_MAX_CNT is then only the starting point */
+    IBS_DAEMON_READERS,     /* An ibs_readers_t */
+    IBS_DAEMON_TRACE,       /* 2 or 3: write the daemon's files in that IBS
+                               trace format (see ibs-trace.h), for
+                               ibs_decoder, instead of through
+                               IBS_DAEMON_*_WRITE. 0 for the latter */
+    IBS_BUFFER_SIZE,        /* Bytes of driver buffer per device, or 0 to
+                               keep the driver's */
+    IBS_DAEMON_STREAM,      /* "host:port" or "unix:path" of an ibs_receiver
+                               to send the daemon's files to instead of
+                               writing them (see ibs-stream.h), or NULL */
+    IBS_DAEMON_STREAM_DEFLATE, /* 1: also compress what is streamed */
 } ibs_option_t;
 
+/* How the daemon reads samples. With reader threads, one thread per NUMA
+ * node or L3 cache (CCX) drains that group's devices, and the daemon's
+ * main thread calls IBS_DAEMON_OP_WRITE / IBS_DAEMON_FETCH_WRITE. */
+typedef enum {
+    IBS_READERS_NONE,       /* One thread reads and writes everything */
+    IBS_READERS_PER_NODE,
+    IBS_READERS_PER_L3,
+} ibs_readers_t;
+
 typedef void * ibs_val_t;
 
 
@@ -92,6 +127,18 @@ typedef struct ibs_sample {
 
 
 
+/* Caller-owned arrays for ibs_sample_batch(). Set the pointers and the
+ * max_* counts; a flavor with max 0 is not read. */
+typedef struct ibs_batch {
+    ibs_op_t *    ops;
+    unsigned int  max_ops;
+    unsigned int  num_ops;      /* set by ibs_sample_batch() */
+    ibs_fetch_t * fetches;
+    unsigned int  max_fetches;
+    unsigned int  num_fetches;  /* set by ibs_sample_batch() */
+} ibs_batch_t;
+
+
 /* Initialize IBS with list of options */
 int
 ibs_initialize(ibs_option_list_t *, int num_opts, int daemonize);
@@ -126,6 +173,50 @@ ibs_sample(int				   max_samples,
            struct ibs_sample * samples,
            ibs_sample_type_t * sample_types);
 
+/* Get some IBS samples, read straight into batch->ops and batch->fetches.
+ * Returns the number of samples taken, 0 on timeout, or -1 on error. Unlike
+ * ibs_sample(), this allocates and copies nothing on the way. */
+int
+ibs_sample_batch(ibs_batch_t * batch);
+
+/* Freeze the buffers and take up to max_samples of the samples they hold.
+ * With IBS_FLIGHT_RECORDER set, this is the only way to get samples. */
+int
+ibs_snapshot(int                 max_samples,
+             int                 sample_flags,
+             struct ibs_sample * samples,
+             ibs_sample_type_t * sample_types);
+
+/* Ask the daemon to write out a snapshot; the same as sending it SIGUSR2 */
+int
+ibs_request_snapshot(void);
+
+/* Add the samples that the driver dropped since the last call, because
+ * its buffers were full, to *op_lost and *fetch_lost (either may be NULL).
+ * This includes the losses that IBS_ADAPTIVE_RATE read from the driver to
+ * retune the sample rate. Returns 0, or -1 on error. */
+int
+ibs_get_lost(unsigned long * op_lost, unsigned long * fetch_lost);
+
+/* Per-page NUMA heatmaps of op samples (the format is in ibs-heatmap.h,
+ * which C programs may also use directly). page_shift is 12 for 4K pages
+ * or 21 for 2M pages. Returns NULL on error. */
+typedef struct ibs_heatmap ibs_heatmap_t;
+
+ibs_heatmap_t *
+ibs_heatmap_create(unsigned int page_shift);
+
+/* Count batch->ops into heatmap. Returns 0, or -1 if memory runs out. */
+int
+ibs_heatmap_add_batch(ibs_heatmap_t * heatmap, const ibs_batch_t * batch);
+
+/* Write heatmap to path as a table sorted by page. Returns 0 or -1. */
+int
+ibs_heatmap_save(ibs_heatmap_t * heatmap, const char * path);
+
+void
+ibs_heatmap_destroy(ibs_heatmap_t * heatmap);
+
 #ifdef __cplusplus
 }
 #endif
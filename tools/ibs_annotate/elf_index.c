@@ -0,0 +1,1040 @@
+/*
+ * Copyright (C) 2019 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ *
+ * Builds an elf_index: the function symbols, DWARF line tables and code
+ * segments of one ELF binary. Only the line tables are read out of the
+ * DWARF (versions 2 through 5); nothing else needs .debug_info.
+ */
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "elf_index.h"
+
+// The ELF32 and ELF64 headers this reads, widened
+struct elf_file {
+    const unsigned char *map;
+    size_t len;
+    int is64;
+    uint64_t shoff, phoff;
+    unsigned shnum, phnum, shstrndx;
+};
+
+struct elf_section {
+    const char *name;
+    uint32_t type;
+    uint64_t flags, offset, size;
+    uint32_t link;
+};
+
+// A bounds-checked reader over part of a section
+struct cursor {
+    const unsigned char *p, *end;
+    int bad;
+};
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    void *ret = realloc(ptr, size);
+    if (ret == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Out of memory indexing binaries.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    return ret;
+}
+
+static const unsigned char *take(struct cursor *c, size_t n)
+{
+    const unsigned char *p = c->p;
+    if (c->bad || (size_t)(c->end - c->p) < n)
+    {
+        c->bad = 1;
+        c->p = c->end;
+        return NULL;
+    }
+    c->p += n;
+    return p;
+}
+
+static uint64_t read_uint(struct cursor *c, size_t n)
+{
+    const unsigned char *p = take(c, n);
+    uint64_t v = 0;
+    if (p == NULL)
+        return 0;
+    for (size_t i = n; i > 0; i--)
+        v = (v << 8) | p[i - 1];
+    return v;
+}
+
+static uint64_t read_uleb(struct cursor *c)
+{
+    uint64_t v = 0;
+    unsigned shift = 0;
+    const unsigned char *p;
+    do {
+        p = take(c, 1);
+        if (p == NULL)
+            return 0;
+        if (shift < 64)
+            v |= (uint64_t)(*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p & 0x80);
+    return v;
+}
+
+static int64_t read_sleb(struct cursor *c)
+{
+    uint64_t v = 0;
+    unsigned shift = 0;
+    const unsigned char *p;
+    do {
+        p = take(c, 1);
+        if (p == NULL)
+            return 0;
+        if (shift < 64)
+            v |= (uint64_t)(*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p & 0x80);
+    if (shift < 64 && (*p & 0x40))
+        v |= ~(uint64_t)0 << shift;
+    return (int64_t)v;
+}
+
+static const char *read_str(struct cursor *c)
+{
+    const unsigned char *nul;
+    const char *s = (const char *)c->p;
+    if (c->bad || (nul = memchr(c->p, 0, c->end - c->p)) == NULL)
+    {
+        c->bad = 1;
+        return NULL;
+    }
+    c->p = nul + 1;
+    return s;
+}
+
+// The NUL-terminated string at off in a string section, or NULL
+static const char *section_str(const unsigned char *data, uint64_t size,
+        uint64_t off)
+{
+    if (data == NULL || off >= size ||
+            memchr(data + off, 0, size - off) == NULL)
+        return NULL;
+    return (const char *)data + off;
+}
+
+static int elf_file_open(const char *path, struct elf_file *f)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    const unsigned char *m;
+
+    memset(f, 0, sizeof(*f));
+    if (fd < 0)
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(Elf32_Ehdr))
+    {
+        fprintf(stderr, "Cannot read %s\n", path);
+        close(fd);
+        return -1;
+    }
+    m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    f->map = m;
+    f->len = st.st_size;
+
+    if (memcmp(m, ELFMAG, SELFMAG) || m[EI_DATA] != ELFDATA2LSB ||
+            (m[EI_CLASS] != ELFCLASS32 && m[EI_CLASS] != ELFCLASS64))
+    {
+        fprintf(stderr, "%s is not a little-endian ELF file\n", path);
+        munmap((void *)m, f->len);
+        return -1;
+    }
+    f->is64 = (m[EI_CLASS] == ELFCLASS64);
+    if (f->is64 && f->len >= sizeof(Elf64_Ehdr))
+    {
+        Elf64_Ehdr eh;
+        memcpy(&eh, m, sizeof(eh));
+        f->shoff = eh.e_shoff;
+        f->phoff = eh.e_phoff;
+        f->shnum = eh.e_shnum;
+        f->phnum = eh.e_phnum;
+        f->shstrndx = eh.e_shstrndx;
+    }
+    else if (!f->is64)
+    {
+        Elf32_Ehdr eh;
+        memcpy(&eh, m, sizeof(eh));
+        f->shoff = eh.e_shoff;
+        f->phoff = eh.e_phoff;
+        f->shnum = eh.e_shnum;
+        f->phnum = eh.e_phnum;
+        f->shstrndx = eh.e_shstrndx;
+    }
+    else
+    {
+        fprintf(stderr, "%s is truncated\n", path);
+        munmap((void *)m, f->len);
+        return -1;
+    }
+    return 0;
+}
+
+static int get_section(const struct elf_file *f, unsigned i,
+        struct elf_section *s)
+{
+    size_t entsize = f->is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr);
+    uint64_t off = f->shoff + (uint64_t)i * entsize;
+
+    if (i >= f->shnum || off > f->len || f->len - off < entsize)
+        return -1;
+    if (f->is64)
+    {
+        Elf64_Shdr sh;
+        memcpy(&sh, f->map + off, sizeof(sh));
+        s->type = sh.sh_type;
+        s->flags = sh.sh_flags;
+        s->offset = sh.sh_offset;
+        s->size = sh.sh_size;
+        s->link = sh.sh_link;
+        s->name = (const char *)(uintptr_t)sh.sh_name;
+    }
+    else
+    {
+        Elf32_Shdr sh;
+        memcpy(&sh, f->map + off, sizeof(sh));
+        s->type = sh.sh_type;
+        s->flags = sh.sh_flags;
+        s->offset = sh.sh_offset;
+        s->size = sh.sh_size;
+        s->link = sh.sh_link;
+        s->name = (const char *)(uintptr_t)sh.sh_name;
+    }
+    if (s->type != SHT_NOBITS &&
+            (s->offset > f->len || f->len - s->offset < s->size))
+        return -1;
+    return 0;
+}
+
+// Find a section by name; returns -1 if there is none
+static int find_section(const struct elf_file *f, const char *name,
+        struct elf_section *s)
+{
+    struct elf_section names;
+
+    if (get_section(f, f->shstrndx, &names))
+        return -1;
+    for (unsigned i = 1; i < f->shnum; i++)
+    {
+        const char *n;
+        if (get_section(f, i, s))
+            continue;
+        n = section_str(f->map + names.offset, names.size,
+                (uintptr_t)s->name);
+        if (n != NULL && !strcmp(n, name))
+        {
+            s->name = n;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// The contents of s, inflated first if it is SHF_COMPRESSED
+static const unsigned char *section_data(struct elf_index *ei,
+        const struct elf_file *f, const struct elf_section *s,
+        uint64_t *size)
+{
+    const unsigned char *data = f->map + s->offset;
+    uint64_t type, full;
+    size_t hdr;
+    uLongf out_len;
+    unsigned char *out;
+
+    if (s->type == SHT_NOBITS)
+        return NULL;
+    *size = s->size;
+    if (!(s->flags & SHF_COMPRESSED))
+        return data;
+
+    if (f->is64)
+    {
+        Elf64_Chdr ch;
+        if (s->size < sizeof(ch))
+            return NULL;
+        memcpy(&ch, data, sizeof(ch));
+        type = ch.ch_type;
+        full = ch.ch_size;
+        hdr = sizeof(ch);
+    }
+    else
+    {
+        Elf32_Chdr ch;
+        if (s->size < sizeof(ch))
+            return NULL;
+        memcpy(&ch, data, sizeof(ch));
+        type = ch.ch_type;
+        full = ch.ch_size;
+        hdr = sizeof(ch);
+    }
+    if (type != ELFCOMPRESS_ZLIB)
+    {
+        fprintf(stderr, "WARNING. %s in %s is compressed in a way that is ",
+                s->name, ei->path);
+        fprintf(stderr, "not supported; skipping it.\n");
+        return NULL;
+    }
+    out = malloc(full ? full : 1);
+    out_len = full;
+    if (out == NULL || uncompress(out, &out_len, data + hdr,
+                s->size - hdr) != Z_OK || out_len != full)
+    {
+        fprintf(stderr, "WARNING. Could not inflate %s in %s.\n", s->name,
+                ei->path);
+        free(out);
+        return NULL;
+    }
+    ei->buffers = xrealloc(ei->buffers,
+            (ei->num_buffers + 1) * sizeof(*ei->buffers));
+    ei->buffers[ei->num_buffers++] = out;
+    *size = full;
+    return out;
+}
+
+static void load_segments(struct elf_index *ei, const struct elf_file *f)
+{
+    size_t entsize = f->is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+
+    for (unsigned i = 0; i < f->phnum; i++)
+    {
+        uint64_t off = f->phoff + (uint64_t)i * entsize;
+        struct elf_segment seg;
+        uint32_t type, flags;
+
+        if (off > f->len || f->len - off < entsize)
+            break;
+        if (f->is64)
+        {
+            Elf64_Phdr ph;
+            memcpy(&ph, f->map + off, sizeof(ph));
+            type = ph.p_type;
+            flags = ph.p_flags;
+            seg.vaddr = ph.p_vaddr;
+            seg.filesz = ph.p_filesz;
+            seg.offset = ph.p_offset;
+        }
+        else
+        {
+            Elf32_Phdr ph;
+            memcpy(&ph, f->map + off, sizeof(ph));
+            type = ph.p_type;
+            flags = ph.p_flags;
+            seg.vaddr = ph.p_vaddr;
+            seg.filesz = ph.p_filesz;
+            seg.offset = ph.p_offset;
+        }
+        if (type != PT_LOAD || !(flags & PF_X) || seg.offset > f->len)
+            continue;
+        if (f->len - seg.offset < seg.filesz)
+            seg.filesz = f->len - seg.offset;
+        ei->segs = xrealloc(ei->segs, (ei->num_segs + 1) * sizeof(seg));
+        ei->segs[ei->num_segs++] = seg;
+    }
+}
+
+static int in_code(const struct elf_index *ei, uint64_t addr)
+{
+    for (size_t i = 0; i < ei->num_segs; i++)
+        if (addr - ei->segs[i].vaddr < ei->segs[i].filesz)
+            return 1;
+    return 0;
+}
+
+static void load_symbols(struct elf_index *ei, const struct elf_file *f,
+        const char *name)
+{
+    struct elf_section s, strs;
+    const unsigned char *strtab;
+    size_t entsize = f->is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+
+    if (find_section(f, name, &s) || get_section(f, s.link, &strs) ||
+            strs.type == SHT_NOBITS || s.type == SHT_NOBITS)
+        return;
+    strtab = f->map + strs.offset;
+
+    for (uint64_t off = 0; off + entsize <= s.size; off += entsize)
+    {
+        struct elf_symbol sym;
+        unsigned type, shndx;
+        uint32_t st_name;
+
+        if (f->is64)
+        {
+            Elf64_Sym es;
+            memcpy(&es, f->map + s.offset + off, sizeof(es));
+            st_name = es.st_name;
+            type = ELF64_ST_TYPE(es.st_info);
+            shndx = es.st_shndx;
+            sym.addr = es.st_value;
+            sym.size = es.st_size;
+        }
+        else
+        {
+            Elf32_Sym es;
+            memcpy(&es, f->map + s.offset + off, sizeof(es));
+            st_name = es.st_name;
+            type = ELF32_ST_TYPE(es.st_info);
+            shndx = es.st_shndx;
+            sym.addr = es.st_value;
+            sym.size = es.st_size;
+        }
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+                shndx == SHN_UNDEF || sym.addr == 0)
+            continue;
+        sym.name = section_str(strtab, strs.size, st_name);
+        if (sym.name == NULL || sym.name[0] == '\0')
+            continue;
+        if ((ei->num_syms & (ei->num_syms - 1)) == 0)
+            ei->syms = xrealloc(ei->syms, (ei->num_syms ? ei->num_syms * 2 :
+                        1) * sizeof(sym));
+        ei->syms[ei->num_syms++] = sym;
+    }
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+    const struct elf_symbol *x = a, *y = b;
+    if (x->addr != y->addr)
+        return (x->addr < y->addr) ? -1 : 1;
+    if (x->size != y->size)
+        return (x->size > y->size) ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// Keep one symbol per address, the largest
+static void sort_symbols(struct elf_index *ei)
+{
+    size_t n = 0;
+
+    if (ei->num_syms == 0)
+        return;
+    qsort(ei->syms, ei->num_syms, sizeof(*ei->syms), symbol_cmp);
+    for (size_t i = 0; i < ei->num_syms; i++)
+        if (n == 0 || ei->syms[i].addr != ei->syms[n - 1].addr)
+            ei->syms[n++] = ei->syms[i];
+    ei->num_syms = n;
+}
+
+// Line table rows while they are gathered; order breaks ties in the sort
+struct line_row {
+    uint64_t addr;
+    uint32_t file;
+    uint32_t line;
+    uint64_t order;
+};
+
+struct line_tables {
+    struct line_row *rows;
+    size_t num_rows, max_rows;
+    size_t seq_start;       // First row of the sequence being read
+    // Sections that DW_FORM_strp and DW_FORM_line_strp point into
+    const unsigned char *str, *line_str;
+    uint64_t str_size, line_str_size;
+};
+
+static void add_row(struct line_tables *t, uint64_t addr, uint32_t file,
+        uint32_t line)
+{
+    if (t->num_rows == t->max_rows)
+    {
+        t->max_rows = t->max_rows ? t->max_rows * 2 : 1024;
+        t->rows = xrealloc(t->rows, t->max_rows * sizeof(*t->rows));
+    }
+    t->rows[t->num_rows].addr = addr;
+    t->rows[t->num_rows].file = file;
+    t->rows[t->num_rows].line = line;
+    t->rows[t->num_rows].order = t->num_rows;
+    t->num_rows++;
+}
+
+static uint32_t add_file(struct elf_index *ei, const char *dir,
+        const char *name)
+{
+    char *path;
+
+    if (name == NULL)
+        name = "??";
+    if (dir != NULL && dir[0] != '\0' && name[0] != '/')
+    {
+        if (asprintf(&path, "%s/%s", dir, name) < 0)
+            path = NULL;
+    }
+    else
+        path = strdup(name);
+    if (path == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Out of memory indexing binaries.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((ei->num_files & (ei->num_files - 1)) == 0)
+        ei->files = xrealloc(ei->files, (ei->num_files ? ei->num_files * 2 :
+                    1) * sizeof(*ei->files));
+    ei->files[ei->num_files] = path;
+    return ei->num_files++;
+}
+
+// A DWARF 5 directory or file name entry attribute. Returns the string for
+// string forms and sets *num for constant forms.
+static const char *read_form(struct cursor *c, const struct line_tables *t,
+        uint64_t form, int dwarf64, uint64_t *num)
+{
+    uint64_t off;
+
+    *num = 0;
+    switch (form) {
+        case 0x08:  // DW_FORM_string
+            return read_str(c);
+        case 0x0e:  // DW_FORM_strp
+            off = read_uint(c, dwarf64 ? 8 : 4);
+            return section_str(t->str, t->str_size, off);
+        case 0x1f:  // DW_FORM_line_strp
+            off = read_uint(c, dwarf64 ? 8 : 4);
+            return section_str(t->line_str, t->line_str_size, off);
+        case 0x0b:  // DW_FORM_data1
+            *num = read_uint(c, 1);
+            return NULL;
+        case 0x05:  // DW_FORM_data2
+            *num = read_uint(c, 2);
+            return NULL;
+        case 0x06:  // DW_FORM_data4
+            *num = read_uint(c, 4);
+            return NULL;
+        case 0x07:  // DW_FORM_data8
+            *num = read_uint(c, 8);
+            return NULL;
+        case 0x0f:  // DW_FORM_udata
+            *num = read_uleb(c);
+            return NULL;
+        case 0x1e:  // DW_FORM_data16
+            take(c, 16);
+            return NULL;
+        case 0x09:  // DW_FORM_block
+            take(c, read_uleb(c));
+            return NULL;
+        case 0x1a:  // DW_FORM_strx, which needs .debug_str_offsets
+            read_uleb(c);
+            return NULL;
+        case 0x25:  // DW_FORM_strx1 through strx4
+        case 0x26:
+        case 0x27:
+        case 0x28:
+            take(c, form - 0x24);
+            return NULL;
+        default:
+            c->bad = 1;
+            return NULL;
+    }
+}
+
+// A DWARF 5 directory or file name table. dir_ids, if not NULL, gets each
+// entry's DW_LNCT_directory_index.
+static size_t read_entry_table(struct cursor *c, const struct line_tables *t,
+        int dwarf64, const char ***names, uint64_t **dir_ids)
+{
+    uint64_t formats[2 * 16];
+    unsigned num_formats = read_uint(c, 1);
+    uint64_t count;
+
+    if (num_formats > 16)
+    {
+        c->bad = 1;
+        return 0;
+    }
+    for (unsigned i = 0; i < 2 * num_formats; i++)
+        formats[i] = read_uleb(c);
+    count = read_uleb(c);
+    if (c->bad || count > (uint64_t)(c->end - c->p))
+    {
+        c->bad = 1;
+        return 0;
+    }
+    *names = xrealloc(NULL, (count + 1) * sizeof(**names));
+    if (dir_ids != NULL)
+        *dir_ids = xrealloc(NULL, (count + 1) * sizeof(**dir_ids));
+    for (uint64_t i = 0; i < count; i++)
+    {
+        (*names)[i] = NULL;
+        if (dir_ids != NULL)
+            (*dir_ids)[i] = 0;
+        for (unsigned j = 0; j < num_formats; j++)
+        {
+            uint64_t num;
+            const char *s = read_form(c, t, formats[2 * j + 1], dwarf64,
+                    &num);
+            if (formats[2 * j] == 1)        // DW_LNCT_path
+                (*names)[i] = s;
+            else if (formats[2 * j] == 2 && dir_ids != NULL)
+                (*dir_ids)[i] = num;        // DW_LNCT_directory_index
+        }
+    }
+    return count;
+}
+
+// Drop the sequence just read if it does not start in code that was
+// loaded, as happens to functions the linker threw away
+static void end_sequence(struct elf_index *ei, struct line_tables *t,
+        uint64_t addr)
+{
+    if (t->seq_start == t->num_rows ||
+            !in_code(ei, t->rows[t->seq_start].addr))
+        t->num_rows = t->seq_start;
+    else
+        add_row(t, addr, 0, 0);
+    t->seq_start = t->num_rows;
+}
+
+// Run one line number program, the unit c has just been pointed at
+static void read_line_unit(struct elf_index *ei, struct line_tables *t,
+        struct cursor *c, int dwarf64)
+{
+    unsigned version = read_uint(c, 2);
+    uint64_t header_len;
+    struct cursor prog;
+    unsigned min_inst, line_range, opcode_base;
+    int line_base;
+    unsigned char std_lengths[256];
+    uint32_t *file_ids = NULL;
+    size_t num_file_ids = 0;
+
+    if (version < 2 || version > 5)
+        return;
+    if (version >= 5)
+    {
+        read_uint(c, 1);                // address_size
+        read_uint(c, 1);                // segment_selector_size
+    }
+    header_len = read_uint(c, dwarf64 ? 8 : 4);
+    if (c->bad || header_len > (uint64_t)(c->end - c->p))
+        return;
+    prog.p = c->p + header_len;
+    prog.end = c->end;
+    prog.bad = 0;
+
+    min_inst = read_uint(c, 1);
+    if (version >= 4)
+        read_uint(c, 1);                // maximum_operations_per_instruction
+    read_uint(c, 1);                    // default_is_stmt
+    line_base = (int8_t)read_uint(c, 1);
+    line_range = read_uint(c, 1);
+    opcode_base = read_uint(c, 1);
+    if (c->bad || line_range == 0 || opcode_base == 0)
+        return;
+    memset(std_lengths, 0, sizeof(std_lengths));
+    for (unsigned i = 1; i < opcode_base; i++)
+        std_lengths[i] = read_uint(c, 1);
+
+    if (version >= 5)
+    {
+        const char **dirs = NULL, **names = NULL;
+        uint64_t *dir_ids = NULL;
+        size_t num_dirs = read_entry_table(c, t, dwarf64, &dirs, NULL);
+        size_t num_names = c->bad ? 0 :
+            read_entry_table(c, t, dwarf64, &names, &dir_ids);
+
+        file_ids = xrealloc(NULL, (num_names + 1) * sizeof(*file_ids));
+        for (size_t i = 0; i < num_names; i++)
+        {
+            const char *dir = (dir_ids[i] < num_dirs) ? dirs[dir_ids[i]] :
+                NULL;
+            char *full = NULL;
+            // Directories after the first are relative to the first, the
+            // compilation directory
+            if (dir != NULL && dir[0] != '/' && dir_ids[i] != 0 &&
+                    dirs[0] != NULL)
+            {
+                if (asprintf(&full, "%s/%s", dirs[0], dir) < 0)
+                    full = NULL;
+                dir = full;
+            }
+            file_ids[i] = add_file(ei, dir, names[i]);
+            free(full);
+        }
+        num_file_ids = num_names;
+        free(dirs);
+        free(names);
+        free(dir_ids);
+    }
+    else
+    {
+        const char **dirs = NULL;
+        size_t num_dirs = 1;
+        const char *s;
+
+        // File 0 is unused before version 5; directory 0 is the
+        // compilation directory, which is only in .debug_info
+        dirs = xrealloc(NULL, sizeof(*dirs));
+        dirs[0] = NULL;
+        while ((s = read_str(c)) != NULL && s[0] != '\0')
+        {
+            dirs = xrealloc(dirs, (num_dirs + 1) * sizeof(*dirs));
+            dirs[num_dirs++] = s;
+        }
+        file_ids = xrealloc(NULL, sizeof(*file_ids));
+        file_ids[0] = UINT32_MAX;
+        num_file_ids = 1;
+        while ((s = read_str(c)) != NULL && s[0] != '\0')
+        {
+            uint64_t dir = read_uleb(c);
+            read_uleb(c);
+            read_uleb(c);
+            file_ids = xrealloc(file_ids, (num_file_ids + 1) *
+                    sizeof(*file_ids));
+            file_ids[num_file_ids++] = add_file(ei,
+                    (dir < num_dirs) ? dirs[dir] : NULL, s);
+        }
+        free(dirs);
+    }
+
+    // The state machine, without the parts (columns, VLIW op indexes,
+    // is_stmt) that the annotator does not use
+    uint64_t addr = 0, file = 1, line = 1;
+    t->seq_start = t->num_rows;
+    while (prog.p < prog.end && !prog.bad)
+    {
+        unsigned op = read_uint(&prog, 1);
+        uint32_t fid;
+
+        if (op >= opcode_base)
+        {
+            unsigned adj = op - opcode_base;
+            addr += (uint64_t)(adj / line_range) * min_inst;
+            line += line_base + (int)(adj % line_range);
+        }
+        else if (op == 0)
+        {
+            uint64_t len = read_uleb(&prog);
+            struct cursor ext;
+            unsigned sub;
+
+            if (prog.bad || len == 0 || len > (uint64_t)(prog.end - prog.p))
+                break;
+            ext.p = prog.p;
+            ext.end = prog.p + len;
+            ext.bad = 0;
+            prog.p += len;
+            sub = read_uint(&ext, 1);
+            if (sub == 1)               // DW_LNE_end_sequence
+            {
+                end_sequence(ei, t, addr);
+                addr = 0;
+                file = 1;
+                line = 1;
+            }
+            else if (sub == 2)          // DW_LNE_set_address
+                addr = read_uint(&ext, (len - 1 < 8) ? len - 1 : 8);
+            else if (sub == 3 && version < 5)   // DW_LNE_define_file
+            {
+                const char *s = read_str(&ext);
+                file_ids = xrealloc(file_ids, (num_file_ids + 1) *
+                        sizeof(*file_ids));
+                file_ids[num_file_ids++] = add_file(ei, NULL, s);
+            }
+            continue;
+        }
+        else
+        {
+            switch (op) {
+                case 1:                 // DW_LNS_copy
+                    break;
+                case 2:                 // DW_LNS_advance_pc
+                    addr += read_uleb(&prog) * min_inst;
+                    continue;
+                case 3:                 // DW_LNS_advance_line
+                    line += read_sleb(&prog);
+                    continue;
+                case 4:                 // DW_LNS_set_file
+                    file = read_uleb(&prog);
+                    continue;
+                case 8:                 // DW_LNS_const_add_pc
+                    addr += (uint64_t)((255 - opcode_base) / line_range) *
+                        min_inst;
+                    continue;
+                case 9:                 // DW_LNS_fixed_advance_pc
+                    addr += read_uint(&prog, 2);
+                    continue;
+                default:
+                    for (unsigned i = 0; i < std_lengths[op]; i++)
+                        read_uleb(&prog);
+                    continue;
+            }
+        }
+        fid = (file < num_file_ids) ? file_ids[file] : UINT32_MAX;
+        if (fid != UINT32_MAX && line != 0 && (uint32_t)line == line)
+            add_row(t, addr, fid, line);
+    }
+    // A program that stopped short of its end_sequence
+    t->num_rows = t->seq_start;
+    free(file_ids);
+}
+
+static int row_cmp(const void *a, const void *b)
+{
+    const struct line_row *x = a, *y = b;
+    if (x->addr != y->addr)
+        return (x->addr < y->addr) ? -1 : 1;
+    // The end of one sequence gives way to a row starting the next
+    if ((x->line == 0) != (y->line == 0))
+        return (x->line == 0) ? -1 : 1;
+    return (x->order < y->order) ? -1 : (x->order > y->order);
+}
+
+static void load_lines(struct elf_index *ei, const struct elf_file *f)
+{
+    struct elf_section s, ss;
+    struct line_tables t;
+    const unsigned char *data;
+    uint64_t size;
+    struct cursor c;
+
+    if (find_section(f, ".debug_line", &s) ||
+            (data = section_data(ei, f, &s, &size)) == NULL)
+        return;
+    memset(&t, 0, sizeof(t));
+    if (!find_section(f, ".debug_str", &ss))
+        t.str = section_data(ei, f, &ss, &t.str_size);
+    if (!find_section(f, ".debug_line_str", &ss))
+        t.line_str = section_data(ei, f, &ss, &t.line_str_size);
+
+    c.p = data;
+    c.end = data + size;
+    c.bad = 0;
+    while (c.p < c.end && !c.bad)
+    {
+        uint64_t len = read_uint(&c, 4);
+        int dwarf64 = (len == 0xffffffffULL);
+        struct cursor unit;
+
+        if (dwarf64)
+            len = read_uint(&c, 8);
+        if (c.bad || len > (uint64_t)(c.end - c.p))
+            break;
+        unit.p = c.p;
+        unit.end = c.p + len;
+        unit.bad = 0;
+        c.p += len;
+        read_line_unit(ei, &t, &unit, dwarf64);
+    }
+
+    qsort(t.rows, t.num_rows, sizeof(*t.rows), row_cmp);
+    ei->lines = xrealloc(NULL, (t.num_rows + 1) * sizeof(*ei->lines));
+    for (size_t i = 0; i < t.num_rows; i++)
+    {
+        // Of several rows for one address, the last one read wins
+        if (ei->num_lines &&
+                ei->lines[ei->num_lines - 1].addr == t.rows[i].addr)
+            ei->num_lines--;
+        ei->lines[ei->num_lines].addr = t.rows[i].addr;
+        ei->lines[ei->num_lines].file = t.rows[i].file;
+        ei->lines[ei->num_lines].line = t.rows[i].line;
+        ei->num_lines++;
+    }
+    free(t.rows);
+}
+
+// /usr/lib/debug/.build-id/xx/yyyy.debug, from the NT_GNU_BUILD_ID note
+static char *build_id_path(const struct elf_file *f)
+{
+    struct elf_section s;
+    struct cursor c;
+    char *path, *p;
+
+    if (find_section(f, ".note.gnu.build-id", &s) || s.type != SHT_NOTE)
+        return NULL;
+    c.p = f->map + s.offset;
+    c.end = c.p + s.size;
+    c.bad = 0;
+    while (c.p < c.end && !c.bad)
+    {
+        uint32_t namesz = read_uint(&c, 4);
+        uint32_t descsz = read_uint(&c, 4);
+        uint32_t type = read_uint(&c, 4);
+        const unsigned char *name = take(&c, (namesz + 3) & ~3U);
+        const unsigned char *desc = take(&c, (descsz + 3) & ~3U);
+
+        if (c.bad || type != NT_GNU_BUILD_ID || namesz != 4 ||
+                memcmp(name, "GNU", 4) || descsz < 2)
+            continue;
+        path = malloc(sizeof("/usr/lib/debug/.build-id//.debug") +
+                2 * descsz + 1);
+        if (path == NULL)
+            return NULL;
+        p = path + sprintf(path, "/usr/lib/debug/.build-id/%02x/", desc[0]);
+        for (uint32_t i = 1; i < descsz; i++)
+            p += sprintf(p, "%02x", desc[i]);
+        strcpy(p, ".debug");
+        return path;
+    }
+    return NULL;
+}
+
+struct elf_index *elf_index_open(const char *path)
+{
+    struct elf_index *ei;
+    struct elf_file f, dbg;
+    struct elf_section s;
+    char *debug_path;
+    int have_dbg = 0;
+
+    if (elf_file_open(path, &f))
+        return NULL;
+    ei = calloc(1, sizeof(*ei));
+    if (ei == NULL || (ei->path = strdup(path)) == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Out of memory indexing binaries.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    ei->is64 = f.is64;
+    ei->map = f.map;
+    ei->map_len = f.len;
+    load_segments(ei, &f);
+
+    // Distribution packages keep their symbols and lines apart
+    if (find_section(&f, ".debug_line", &s) &&
+            (debug_path = build_id_path(&f)) != NULL)
+    {
+        if (access(debug_path, R_OK) == 0 &&
+                elf_file_open(debug_path, &dbg) == 0)
+        {
+            have_dbg = 1;
+            ei->debug_map = dbg.map;
+            ei->debug_map_len = dbg.len;
+        }
+        free(debug_path);
+    }
+
+    load_symbols(ei, &f, ".symtab");
+    load_symbols(ei, &f, ".dynsym");
+    if (have_dbg)
+        load_symbols(ei, &dbg, ".symtab");
+    sort_symbols(ei);
+    load_lines(ei, have_dbg ? &dbg : &f);
+    return ei;
+}
+
+void elf_index_close(struct elf_index *ei)
+{
+    if (ei == NULL)
+        return;
+    for (size_t i = 0; i < ei->num_files; i++)
+        free(ei->files[i]);
+    for (size_t i = 0; i < ei->num_buffers; i++)
+        free(ei->buffers[i]);
+    free(ei->files);
+    free(ei->buffers);
+    free(ei->lines);
+    free(ei->syms);
+    free(ei->segs);
+    munmap((void *)ei->map, ei->map_len);
+    if (ei->debug_map != NULL)
+        munmap((void *)ei->debug_map, ei->debug_map_len);
+    free(ei->path);
+    free(ei);
+}
+
+const struct elf_symbol *elf_index_symbol(const struct elf_index *ei,
+        uint64_t addr)
+{
+    size_t lo = 0, hi = ei->num_syms;
+    const struct elf_symbol *sym;
+
+    // The last symbol at or below addr
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ei->syms[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    sym = &ei->syms[lo - 1];
+    if (sym->size != 0 && addr - sym->addr >= sym->size)
+        return NULL;
+    return sym;
+}
+
+const char *elf_index_line(const struct elf_index *ei, uint64_t addr,
+        uint32_t *line)
+{
+    size_t lo = 0, hi = ei->num_lines;
+    const struct elf_line *row;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ei->lines[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return NULL;
+    row = &ei->lines[lo - 1];
+    if (row->line == 0)
+        return NULL;
+    *line = row->line;
+    return ei->files[row->file];
+}
+
+size_t elf_index_code(const struct elf_index *ei, uint64_t addr,
+        unsigned char *buf, size_t len)
+{
+    for (size_t i = 0; i < ei->num_segs; i++)
+    {
+        const struct elf_segment *seg = &ei->segs[i];
+        uint64_t off = addr - seg->vaddr;
+        if (off >= seg->filesz)
+            continue;
+        if (len > seg->filesz - off)
+            len = seg->filesz - off;
+        memcpy(buf, ei->map + seg->offset + off, len);
+        return len;
+    }
+    return 0;
+}
+
+int elf_index_vaddr(const struct elf_index *ei, uint64_t offset,
+        uint64_t *vaddr)
+{
+    for (size_t i = 0; i < ei->num_segs; i++)
+    {
+        const struct elf_segment *seg = &ei->segs[i];
+        if (offset - seg->offset >= seg->filesz)
+            continue;
+        *vaddr = seg->vaddr + (offset - seg->offset);
+        return 0;
+    }
+    return -1;
+}
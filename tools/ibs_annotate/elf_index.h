@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2019 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ */
+#ifndef ELF_INDEX_H
+#define ELF_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// What the annotator needs to know about one ELF binary, read in once and
+// kept in sorted arrays so that every lookup is a binary search. The index
+// is read-only once built and may be shared by any number of threads.
+// Addresses are the binary's own (link-time) virtual addresses.
+
+struct elf_symbol {
+    uint64_t addr;
+    uint64_t size;          // 0 if unknown: runs up to the next symbol
+    const char *name;
+};
+
+// A row of the DWARF line tables. A row with line 0 marks the end of a
+// run of addresses (DW_LNE_end_sequence).
+struct elf_line {
+    uint64_t addr;
+    uint32_t file;          // Index into files
+    uint32_t line;
+};
+
+struct elf_segment {
+    uint64_t vaddr;
+    uint64_t filesz;
+    uint64_t offset;
+};
+
+struct elf_index {
+    char *path;
+    int is64;
+    const unsigned char *map;
+    size_t map_len;
+    // Executable PT_LOAD segments, for the instruction bytes
+    struct elf_segment *segs;
+    size_t num_segs;
+    // Functions from .symtab and .dynsym, sorted by address
+    struct elf_symbol *syms;
+    size_t num_syms;
+    // From .debug_line, sorted by address
+    struct elf_line *lines;
+    size_t num_lines;
+    char **files;
+    size_t num_files;
+    // A separate debug file found through the build ID, if any
+    const unsigned char *debug_map;
+    size_t debug_map_len;
+    // Decompressed copies of SHF_COMPRESSED sections
+    void **buffers;
+    size_t num_buffers;
+};
+
+// Read the binary at path (and its separate debug file, when there is one
+// under /usr/lib/debug/.build-id). Prints why and returns NULL if path is
+// not a readable little-endian x86 ELF file.
+struct elf_index *elf_index_open(const char *path);
+void elf_index_close(struct elf_index *ei);
+
+// The function holding addr, or NULL
+const struct elf_symbol *elf_index_symbol(const struct elf_index *ei,
+        uint64_t addr);
+// The source file that addr came from, with its line in *line, or NULL
+const char *elf_index_line(const struct elf_index *ei, uint64_t addr,
+        uint32_t *line);
+// Copy up to len bytes of code starting at addr into buf. Returns how many
+// there were, which is 0 if addr is not in an executable segment.
+size_t elf_index_code(const struct elf_index *ei, uint64_t addr,
+        unsigned char *buf, size_t len);
+// The address that file offset offset of an executable segment is linked
+// at, for turning a mapping of the file into the binary's own addresses.
+// Returns 0, or -1 if offset is not in an executable segment.
+int elf_index_vaddr(const struct elf_index *ei, uint64_t offset,
+        uint64_t *vaddr);
+
+#endif  /* ELF_INDEX_H */
@@ -0,0 +1,801 @@
+/*
+ * Copyright (C) 2019 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ *
+ * Annotates the CSV files from the IBS decoder with the source line,
+ * binary offset, opcode bytes and function of each sample's instruction,
+ * like ibs_run_and_annotate does with objdump. Each binary is read once
+ * into an elf_index, which every thread then shares. Where each binary was
+ * mapped comes from the monitor's LD_DEBUG output or, better, from its
+ * module map (see ibs-modmap.h).
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ibs-modmap.h"
+
+#include "elf_index.h"
+#include "x86_len.h"
+
+// Each thread annotates one block of about this many bytes of CSV at a
+// time, and the blocks are written out in order.
+#define ANNOTATE_BLOCK_SIZE     (1 << 20)
+
+// Room for the annotation columns besides the path and function name
+#define ANNOTATION_MAX_LINE     (64 + 2 * X86_MAX_INSN_LEN)
+
+char *in_file = NULL;
+FILE *out_fp = NULL;
+char *ld_debug_file = NULL;
+char *module_map_file = NULL;
+char *binary_file = NULL;
+// Worker threads for --threads
+static int num_threads = 1;
+// Only samples from this process are annotated; -1 for every process
+static long target_pid = -1;
+
+// A binary, and where it sat in the process
+struct module {
+    uint64_t base;
+    uint64_t size;
+    struct elf_index *ei;
+};
+
+// Shared by every thread, and read-only once built
+static struct module *modules = NULL;
+static size_t num_modules = 0;
+static struct elf_index *main_binary = NULL;
+static struct elf_index **indexes = NULL;
+static size_t num_indexes = 0;
+// The longest function or file name in any of them
+static size_t longest_name = 0;
+// With --module_map, the mappings, and the binary of each (NULL for
+// anonymous code or files that could not be read)
+static ibs_modmap_t modmap;
+static int have_modmap = 0;
+static struct elf_index **modmap_indexes = NULL;
+
+void set_in_file(char *opt)
+{
+    in_file = opt;
+}
+
+void set_out_file(char *opt)
+{
+    out_fp = fopen(opt, "w");
+    if (out_fp == NULL) {
+        fprintf(stderr, "Cannot fopen Output File: %s\n", opt);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void set_num_threads(char *opt)
+{
+    long n = strtol(opt, NULL, 0);
+    if (n == 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1 || n > 1024)
+    {
+        fprintf(stderr, "Bad number of threads: %s\n", opt);
+        exit(EXIT_FAILURE);
+    }
+    num_threads = n;
+}
+
+void set_target_pid(char *opt)
+{
+    char *end;
+    target_pid = strtol(opt, &end, 0);
+    if (*end != '\0' || end == opt || target_pid < 0)
+    {
+        fprintf(stderr, "Bad PID: %s\n", opt);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void parse_args(int argc, char *argv[])
+{
+    static struct option longopts[] =
+    {
+        {"in_file", required_argument, NULL, 'i'},
+        {"out_file", required_argument, NULL, 'o'},
+        {"ld_debug", required_argument, NULL, 'l'},
+        {"module_map", required_argument, NULL, 'm'},
+        {"binary", required_argument, NULL, 'b'},
+        {"pid", required_argument, NULL, 'p'},
+        {"threads", required_argument, NULL, 't'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    char c;
+    while ((c = getopt_long(argc, argv, "+hi:o:l:m:b:p:t:", longopts, NULL)) != -1)
+    {
+        switch (c) {
+            case 'h':
+            case '?':
+                fprintf(stderr, "This program annotates the CSV files from the IBS decoder with the\n");
+                fprintf(stderr, "instruction that each sample came from. It adds Source_Line,\n");
+                fprintf(stderr, "Binary_Offset, Opcode, and Symbol columns, keeping only the user-mode\n");
+                fprintf(stderr, "samples of the program whose instructions could be found.\n");
+                fprintf(stderr, "Usage: ./ibs_annotate -i op.csv -o annotated.csv {-b program [-l ld_debug] | -m module_map}\n");
+                fprintf(stderr, "--in_file (or -i):\n");
+                fprintf(stderr, "       Op or fetch CSV file from the IBS decoder.\n");
+                fprintf(stderr, "--out_file (or -o):\n");
+                fprintf(stderr, "       Annotated CSV file to write.\n");
+                fprintf(stderr, "--binary (or -b):\n");
+                fprintf(stderr, "       The program that was sampled.\n");
+                fprintf(stderr, "--ld_debug (or -l):\n");
+                fprintf(stderr, "       LD_DEBUG output that the monitor saved with its -l option,\n");
+                fprintf(stderr, "       giving the PID and where the shared libraries were loaded.\n");
+                fprintf(stderr, "--module_map (or -m):\n");
+                fprintf(stderr, "       Module map that the monitor saved with its -M option, giving the\n");
+                fprintf(stderr, "       PID and where every file (and anonymous code) was mapped, and when.\n");
+                fprintf(stderr, "       Samples in anonymous code get the name of the mapping as their\n");
+                fprintf(stderr, "       Symbol. --binary and --ld_debug are not needed with it.\n");
+                fprintf(stderr, "--pid (or -p):\n");
+                fprintf(stderr, "       Annotate this process's samples rather than the one named\n");
+                fprintf(stderr, "       in the LD_DEBUG output or module map. Without either, every\n");
+                fprintf(stderr, "       process's are.\n");
+                fprintf(stderr, "--threads (or -t):\n");
+                fprintf(stderr, "       Annotate on this many threads, or 0 for one per CPU.\n");
+                exit(EXIT_SUCCESS);
+            case 'i':
+                set_in_file(optarg);
+                break;
+            case 'o':
+                set_out_file(optarg);
+                break;
+            case 'l':
+                ld_debug_file = optarg;
+                break;
+            case 'm':
+                module_map_file = optarg;
+                break;
+            case 'b':
+                binary_file = optarg;
+                break;
+            case 'p':
+                set_target_pid(optarg);
+                break;
+            case 't':
+                set_num_threads(optarg);
+                break;
+            default:
+                fprintf(stderr, "Found this bad argument: %s\n", argv[optind]);
+                break;
+        }
+    }
+
+    if (in_file == NULL || out_fp == NULL ||
+            (binary_file == NULL && module_map_file == NULL))
+    {
+        fprintf(stderr, "\n\nERROR. --in_file, --out_file and --binary (or ");
+        fprintf(stderr, "--module_map) are all needed.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    if (ld_debug_file != NULL && module_map_file != NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Use --ld_debug or --module_map, ");
+        fprintf(stderr, "not both.\n\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Read each binary once, however many times it was mapped
+static struct elf_index *get_index(const char *path)
+{
+    struct elf_index *ei;
+
+    for (size_t i = 0; i < num_indexes; i++)
+        if (!strcmp(indexes[i]->path, path))
+            return indexes[i];
+    ei = elf_index_open(path);
+    if (ei == NULL)
+        return NULL;
+    indexes = realloc(indexes, (num_indexes + 1) * sizeof(*indexes));
+    if (indexes == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Out of memory for the binaries.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    indexes[num_indexes++] = ei;
+    printf("Read %s: %zu functions, %zu line table rows.\n", path,
+            ei->num_syms, ei->num_lines);
+    return ei;
+}
+
+static int module_cmp(const void *a, const void *b)
+{
+    const struct module *x = a, *y = b;
+    return (x->base > y->base) - (x->base < y->base);
+}
+
+// Pull the PID and the shared libraries' load addresses out of ld.so's
+// LD_DEBUG=files output. Each "base:" line follows the name of the file
+// that was mapped there, either on a "trying file=" line or, for a library
+// named by its full path, on its "file=" line.
+static void read_ld_debug(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char *line = NULL, *pending = NULL;
+    size_t cap = 0;
+    int first = 1;
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Cannot fopen LD_DEBUG File: %s\n", path);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while (getline(&line, &cap, fp) > 0)
+    {
+        char *s, *base, *size;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (first && target_pid < 0)
+            target_pid = strtol(line, NULL, 10);
+        first = 0;
+
+        if ((s = strstr(line, "trying file=")) != NULL)
+        {
+            free(pending);
+            pending = strdup(s + strlen("trying file="));
+        }
+        else if ((s = strstr(line, "file=")) != NULL &&
+                strstr(line, "generating link map") != NULL &&
+                s[strlen("file=")] == '/')
+        {
+            free(pending);
+            pending = strndup(s + strlen("file="),
+                    strcspn(s + strlen("file="), " "));
+        }
+        else if ((base = strstr(line, "base: ")) != NULL &&
+                (size = strstr(line, "size: ")) != NULL && pending != NULL)
+        {
+            struct module m;
+            m.base = strtoull(base + strlen("base: "), NULL, 16);
+            m.size = strtoull(size + strlen("size: "), NULL, 16);
+            m.ei = get_index(pending);
+            free(pending);
+            pending = NULL;
+            if (m.ei == NULL || m.size == 0)
+                continue;
+            modules = realloc(modules, (num_modules + 1) * sizeof(m));
+            if (modules == NULL)
+            {
+                fprintf(stderr, "\n\nERROR. Out of memory for the ");
+                fprintf(stderr, "libraries.\n\n");
+                exit(EXIT_FAILURE);
+            }
+            modules[num_modules++] = m;
+        }
+    }
+    free(pending);
+    free(line);
+    fclose(fp);
+    qsort(modules, num_modules, sizeof(*modules), module_cmp);
+}
+
+// Load the module map and read every file in it. Names that are not
+// absolute paths are pseudo-files like [vdso], and " (deleted)" ones are
+// gone.
+static void read_module_map(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Cannot fopen Module Map File: %s\n", path);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (ibs_modmap_open(&modmap, fp))
+    {
+        fprintf(stderr, "\n\nERROR. %s is not a module map.\n\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+    have_modmap = 1;
+    if (target_pid < 0)
+        target_pid = modmap.header.pid;
+
+    modmap_indexes = calloc(modmap.num_entries + 1, sizeof(*modmap_indexes));
+    if (modmap_indexes == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Out of memory for the module map.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < modmap.num_entries; i++)
+    {
+        const char *name = modmap.entries[i].name;
+        size_t len = strlen(name);
+
+        if (len > longest_name)
+            longest_name = len;
+        if (name[0] != '/' || (len > strlen(" (deleted)") &&
+                    !strcmp(name + len - strlen(" (deleted)"), " (deleted)")))
+            continue;
+        // Only try each file once, even if it could not be read
+        size_t j = 0;
+        while (j < i && strcmp(modmap.entries[j].name, name))
+            j++;
+        modmap_indexes[i] = (j < i) ? modmap_indexes[j] : get_index(name);
+    }
+}
+
+// Which binary rip of pid was in at tsc, and where. Returns NULL for an
+// address in no mapping, and sets *anon instead for anonymous code and
+// files that could not be read.
+static struct elf_index *find_mapping(uint32_t pid, uint64_t rip,
+        uint64_t tsc, uint64_t *offset, const ibs_modmap_entry_t **anon)
+{
+    const ibs_modmap_entry_t *ent = ibs_modmap_find(&modmap, pid, rip, tsc);
+    struct elf_index *ei;
+
+    *anon = NULL;
+    if (ent == NULL)
+        return NULL;
+    ei = modmap_indexes[ent - modmap.entries];
+    if (ei == NULL ||
+            elf_index_vaddr(ei, rip - ent->start + ent->offset, offset))
+    {
+        *anon = ent;
+        *offset = rip - ent->start;
+        return NULL;
+    }
+    return ei;
+}
+
+// Which binary rip is in and where. Like ibs_run_and_annotate, anything
+// below the first library is taken to be in the main program itself.
+static struct elf_index *find_module(uint64_t rip, uint64_t *offset)
+{
+    size_t lo = 0, hi = num_modules;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (modules[mid].base <= rip)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+    {
+        *offset = rip;
+        return main_binary;
+    }
+    if (rip - modules[lo - 1].base >= modules[lo - 1].size)
+        return NULL;
+    *offset = rip - modules[lo - 1].base;
+    return modules[lo - 1].ei;
+}
+
+// Where the columns annotate_line looks at are
+struct csv_columns {
+    int tsc;                // -1 if there is none
+    int pid;
+    int kern_mode;
+    int rip;
+    int phy_addr_valid;     // Fetch traces only; -1 otherwise
+    int max;
+};
+
+static int find_column(const char *header, const char *name)
+{
+    size_t len = strlen(name);
+    int col = 0;
+    const char *p = header;
+
+    for (;;)
+    {
+        if (!strncmp(p, name, len) && (p[len] == ',' || p[len] == '\n' ||
+                    p[len] == '\0'))
+            return col;
+        p = strpbrk(p, ",\n");
+        if (p == NULL || *p == '\n')
+            return -1;
+        p++;
+        col++;
+    }
+}
+
+static void find_columns(const char *header, struct csv_columns *cols)
+{
+    cols->tsc = find_column(header, "TSC");
+    cols->pid = find_column(header, "PID");
+    cols->kern_mode = find_column(header, "Kern_mode");
+    cols->rip = find_column(header, "IbsOpRip");
+    cols->phy_addr_valid = -1;
+    if (cols->rip < 0)
+    {
+        cols->rip = find_column(header, "IbsFetchLinAd");
+        cols->phy_addr_valid = find_column(header, "IbsPhyAddrValid");
+    }
+    if (cols->pid < 0 || cols->kern_mode < 0 || cols->rip < 0 ||
+            (find_column(header, "IbsFetchLinAd") >= 0 &&
+             cols->phy_addr_valid < 0))
+    {
+        fprintf(stderr, "\n\nERROR. %s does not look like an op or fetch ",
+                in_file);
+        fprintf(stderr, "CSV file from the IBS decoder.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    cols->max = cols->pid;
+    if (cols->tsc > cols->max)
+        cols->max = cols->tsc;
+    if (cols->kern_mode > cols->max)
+        cols->max = cols->kern_mode;
+    if (cols->rip > cols->max)
+        cols->max = cols->rip;
+    if (cols->phy_addr_valid > cols->max)
+        cols->max = cols->phy_addr_valid;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Write out the annotated line, or nothing if the sample is not annotated.
+// line runs up to and including its '\n'.
+static char *annotate_line(char *p, const char *line, size_t len,
+        const struct csv_columns *cols)
+{
+    const char *field = line;
+    uint64_t values[5] = {0, 0, 0, 0, 0};
+    uint64_t offset = 0;
+    struct elf_index *ei;
+    const ibs_modmap_entry_t *anon = NULL;
+    const struct elf_symbol *sym = NULL;
+    const char *src = NULL;
+    uint32_t src_line = 0;
+    unsigned char code[X86_MAX_INSN_LEN];
+    size_t code_len = 0;
+
+    for (int col = 0; col <= cols->max; col++)
+    {
+        if (col == cols->pid)
+            values[0] = strtoull(field, NULL, 10);
+        else if (col == cols->kern_mode)
+            values[1] = strtoull(field, NULL, 10);
+        else if (col == cols->rip)
+            values[2] = strtoull(field, NULL, 16);
+        else if (col == cols->phy_addr_valid)
+            values[3] = strtoull(field, NULL, 10);
+        else if (col == cols->tsc)
+            values[4] = strtoull(field, NULL, 10);
+        field = memchr(field, ',', line + len - field);
+        if (field == NULL)
+            return p;
+        field++;
+    }
+    if ((target_pid >= 0 && values[0] != (uint64_t)target_pid) ||
+            values[1] != 0 || (cols->phy_addr_valid >= 0 && values[3] != 1))
+        return p;
+
+    if (have_modmap)
+        ei = find_mapping(values[0], values[2], values[4], &offset, &anon);
+    else
+        ei = find_module(values[2], &offset);
+    if (ei == NULL && anon == NULL)
+        return p;
+    if (ei != NULL)
+    {
+        code_len = elf_index_code(ei, offset, code, sizeof(code));
+        if (code_len == 0)
+            return p;
+        code_len = x86_insn_length(code, code_len, ei->is64);
+        src = elf_index_line(ei, offset, &src_line);
+        sym = elf_index_symbol(ei, offset);
+    }
+
+    // The decoder's line already ends in a ','
+    memcpy(p, line, len - 1);
+    p += len - 1;
+    if (src != NULL)
+    {
+        // Commas would split the column
+        for (const char *s = src; *s; s++)
+            *p++ = (*s == ',') ? ' ' : *s;
+        p += sprintf(p, ":%" PRIu32, src_line);
+    }
+    p += sprintf(p, ",0x%" PRIx64 ",", offset);
+    if (code_len)
+    {
+        *p++ = '0';
+        *p++ = 'x';
+        for (size_t i = 0; i < code_len; i++)
+        {
+            *p++ = hex_digits[code[i] >> 4];
+            *p++ = hex_digits[code[i] & 0xf];
+        }
+    }
+    *p++ = ',';
+    if (sym != NULL)
+    {
+        size_t n = strlen(sym->name);
+        memcpy(p, sym->name, n);
+        p += n;
+        if (offset != sym->addr)
+            p += sprintf(p, "+0x%" PRIx64, offset - sym->addr);
+    }
+    else if (anon != NULL)
+    {
+        const char *name = anon->name[0] ? anon->name : "[anon]";
+        for (const char *s = name; *s; s++)
+            *p++ = (*s == ',') ? ' ' : *s;
+    }
+    *p++ = ',';
+    *p++ = '\n';
+    return p;
+}
+
+struct annotate_job {
+    const char *data;
+    const size_t *block_starts;     // num_blocks + 1 of them
+    size_t num_blocks;
+    struct csv_columns cols;
+    int num_threads;
+    int stop;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+};
+
+struct annotate_worker {
+    pthread_t thread;
+    int id;
+    struct annotate_job *job;
+    char *out;
+    size_t len, size;
+    uint64_t num_lines;
+};
+
+// Room for one more annotated line of in_len input bytes
+static void reserve(struct annotate_worker *w, size_t in_len)
+{
+    size_t need = w->len + in_len + ANNOTATION_MAX_LINE + 2 * longest_name;
+
+    if (need <= w->size)
+        return;
+    while (w->size < need)
+        w->size = w->size ? w->size * 2 : ANNOTATE_BLOCK_SIZE;
+    w->out = realloc(w->out, w->size);
+    if (w->out == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Could not grow an output buffer.\n\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void annotate_block(struct annotate_worker *w, size_t block)
+{
+    const struct annotate_job *job = w->job;
+    const char *p = job->data + job->block_starts[block];
+    const char *end = job->data + job->block_starts[block + 1];
+
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t len = nl ? (size_t)(nl - p + 1) : (size_t)(end - p);
+
+        reserve(w, len);
+        if (nl != NULL)
+            w->len = annotate_line(w->out + w->len, p, len, &job->cols) -
+                w->out;
+        w->num_lines++;
+        p += len;
+    }
+}
+
+static void *annotate_worker_main(void *arg)
+{
+    struct annotate_worker *w = arg;
+    struct annotate_job *job = w->job;
+
+    for (uint64_t round = 0; ; round++)
+    {
+        uint64_t block = round * job->num_threads + w->id;
+
+        pthread_barrier_wait(&job->start);
+        if (job->stop)
+            break;
+
+        w->len = 0;
+        w->num_lines = 0;
+        if (block < job->num_blocks)
+            annotate_block(w, block);
+        pthread_barrier_wait(&job->done);
+    }
+    return NULL;
+}
+
+// Blocks of the CSV after its header, each ending at a line break
+static size_t *split_blocks(const char *data, size_t start, size_t len,
+        size_t *num_blocks)
+{
+    size_t *starts = NULL, n = 0, max = 0;
+
+    for (;;)
+    {
+        if (n == max)
+        {
+            max = max ? max * 2 : 64;
+            starts = realloc(starts, max * sizeof(*starts));
+            if (starts == NULL)
+            {
+                fprintf(stderr, "\n\nERROR. Out of memory.\n\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        starts[n++] = start;
+        if (start >= len)
+            break;
+        if (len - start <= ANNOTATE_BLOCK_SIZE)
+            start = len;
+        else
+        {
+            const char *nl = memchr(data + start + ANNOTATE_BLOCK_SIZE, '\n',
+                    len - start - ANNOTATE_BLOCK_SIZE);
+            start = nl ? (size_t)(nl - data + 1) : len;
+        }
+    }
+    *num_blocks = n - 1;
+    return starts;
+}
+
+static size_t longest_symbol(void)
+{
+    size_t longest = longest_name;
+
+    for (size_t i = 0; i < num_indexes; i++)
+    {
+        for (size_t j = 0; j < indexes[i]->num_syms; j++)
+        {
+            size_t n = strlen(indexes[i]->syms[j].name);
+            if (n > longest)
+                longest = n;
+        }
+        for (size_t j = 0; j < indexes[i]->num_files; j++)
+        {
+            size_t n = strlen(indexes[i]->files[j]);
+            if (n > longest)
+                longest = n;
+        }
+    }
+    return longest;
+}
+
+static void annotate_file(void)
+{
+    int fd = open(in_file, O_RDONLY);
+    struct stat st;
+    const char *data, *nl;
+    size_t header_len, num_blocks;
+    struct annotate_job job;
+    struct annotate_worker *workers;
+    uint64_t num_lines = 0;
+
+    if (fd < 0 || fstat(fd, &st))
+    {
+        fprintf(stderr, "Cannot open Input File: %s\n", in_file);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size == 0)
+    {
+        fprintf(stderr, "\n\nERROR. %s is empty.\n\n", in_file);
+        exit(EXIT_FAILURE);
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map Input File: %s\n", in_file);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    nl = memchr(data, '\n', st.st_size);
+    header_len = nl ? (size_t)(nl - data + 1) : (size_t)st.st_size;
+    memset(&job, 0, sizeof(job));
+    find_columns(data, &job.cols);
+
+    // The header loses the decoder's trailing ',' and gains four columns
+    fwrite(data, 1, (header_len >= 2 && data[header_len - 2] == ',') ?
+            header_len - 2 : header_len - 1, out_fp);
+    fprintf(out_fp, ",Source_Line,Binary_Offset,Opcode,Symbol\n");
+
+    job.data = data;
+    job.block_starts = split_blocks(data, header_len, st.st_size,
+            &num_blocks);
+    job.num_blocks = num_blocks;
+    job.num_threads = num_threads;
+    pthread_barrier_init(&job.start, NULL, num_threads + 1);
+    pthread_barrier_init(&job.done, NULL, num_threads + 1);
+
+    workers = calloc(num_threads, sizeof(*workers));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Could not allocate the workers.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_threads; i++)
+    {
+        workers[i].id = i;
+        workers[i].job = &job;
+        if (pthread_create(&workers[i].thread, NULL, annotate_worker_main,
+                    &workers[i]))
+        {
+            fprintf(stderr, "\n\nERROR. Could not start worker %d.\n\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t block = 0; block < num_blocks; block += num_threads)
+    {
+        pthread_barrier_wait(&job.start);
+        pthread_barrier_wait(&job.done);
+        for (int i = 0; i < num_threads; i++)
+        {
+            fwrite(workers[i].out, 1, workers[i].len, out_fp);
+            num_lines += workers[i].num_lines;
+        }
+        printf("Working on sample number %" PRIu64 "...\n", num_lines);
+    }
+
+    job.stop = 1;
+    pthread_barrier_wait(&job.start);
+    for (int i = 0; i < num_threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].out);
+    }
+    pthread_barrier_destroy(&job.start);
+    pthread_barrier_destroy(&job.done);
+    free(workers);
+    free((void *)job.block_starts);
+    munmap((void *)data, st.st_size);
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+
+    if (module_map_file != NULL)
+        read_module_map(module_map_file);
+    else
+    {
+        main_binary = get_index(binary_file);
+        if (main_binary == NULL)
+            exit(EXIT_FAILURE);
+        if (ld_debug_file != NULL)
+            read_ld_debug(ld_debug_file);
+    }
+
+    longest_name = longest_symbol();
+
+    printf("Annotating %s. This may take a while...\n", in_file);
+    annotate_file();
+    fclose(out_fp);
+
+    for (size_t i = 0; i < num_indexes; i++)
+        elf_index_close(indexes[i]);
+    free(indexes);
+    free(modules);
+    free(modmap_indexes);
+    ibs_modmap_close(&modmap);
+    printf("Annotation complete. Exiting application.\n\n");
+    exit(EXIT_SUCCESS);
+}
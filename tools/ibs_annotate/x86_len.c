@@ -0,0 +1,316 @@
+/*
+ * Copyright (C) 2019 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ *
+ * An x86 instruction length decoder. It walks the prefixes, opcode, ModRM,
+ * SIB, displacement and immediate of an instruction without working out
+ * what the instruction does, which is all the annotator needs in order to
+ * pull an instruction's bytes out of a binary. The opcode maps follow the
+ * AMD64 Architecture Programmer's Manual, Volume 3, Appendix A.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "x86_len.h"
+
+// What follows each opcode
+#define M   0x001   // ModRM byte
+#define B   0x002   // 8-bit immediate
+#define Z   0x004   // 16-bit or 32-bit immediate, by operand size
+#define W   0x008   // 16-bit immediate
+#define V   0x010   // 16, 32 or 64-bit immediate (MOV reg, imm)
+#define A   0x020   // Address-sized memory offset
+#define X   0x040   // Invalid in 64-bit mode
+#define P   0x080   // Far pointer: 16-bit selector and Z-sized offset
+#define T   0x100   // F6/F7: the immediate is only there for /0 and /1
+#define N   0x200   // Invalid
+#define _   0
+
+static const uint16_t one_byte[256] = {
+    /* 00 */ M,   M,   M,   M,   B,   Z,   X,   X,
+    /* 08 */ M,   M,   M,   M,   B,   Z,   X,   _,
+    /* 10 */ M,   M,   M,   M,   B,   Z,   X,   X,
+    /* 18 */ M,   M,   M,   M,   B,   Z,   X,   X,
+    /* 20 */ M,   M,   M,   M,   B,   Z,   _,   X,
+    /* 28 */ M,   M,   M,   M,   B,   Z,   _,   X,
+    /* 30 */ M,   M,   M,   M,   B,   Z,   _,   X,
+    /* 38 */ M,   M,   M,   M,   B,   Z,   _,   X,
+    /* 40 */ _,   _,   _,   _,   _,   _,   _,   _,
+    /* 48 */ _,   _,   _,   _,   _,   _,   _,   _,
+    /* 50 */ _,   _,   _,   _,   _,   _,   _,   _,
+    /* 58 */ _,   _,   _,   _,   _,   _,   _,   _,
+    /* 60 */ X,   X,   M|X, M,   _,   _,   _,   _,
+    /* 68 */ Z,   M|Z, B,   M|B, _,   _,   _,   _,
+    /* 70 */ B,   B,   B,   B,   B,   B,   B,   B,
+    /* 78 */ B,   B,   B,   B,   B,   B,   B,   B,
+    /* 80 */ M|B, M|Z, M|B|X, M|B, M, M,   M,   M,
+    /* 88 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 90 */ _,   _,   _,   _,   _,   _,   _,   _,
+    /* 98 */ _,   _,   P|X, _,   _,   _,   _,   _,
+    /* A0 */ A,   A,   A,   A,   _,   _,   _,   _,
+    /* A8 */ B,   Z,   _,   _,   _,   _,   _,   _,
+    /* B0 */ B,   B,   B,   B,   B,   B,   B,   B,
+    /* B8 */ V,   V,   V,   V,   V,   V,   V,   V,
+    /* C0 */ M|B, M|B, W,   _,   M|X, M|X, M|B, M|Z,
+    /* C8 */ W|B, _,   W,   _,   _,   B,   X,   _,
+    /* D0 */ M,   M,   M,   M,   B|X, B|X, X,   _,
+    /* D8 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* E0 */ B,   B,   B,   B,   B,   B,   B,   B,
+    /* E8 */ Z,   Z,   P|X, B,   _,   _,   _,   _,
+    /* F0 */ _,   _,   _,   _,   _,   _,   M|T, M|T,
+    /* F8 */ _,   _,   _,   _,   _,   _,   M,   M,
+};
+
+// After 0F. 0F 0F (3DNow!) carries its opcode as a trailing byte, counted
+// here as an immediate; 0F 38 and 0F 3A are handled separately.
+static const uint16_t two_byte[256] = {
+    /* 00 */ M,   M,   M,   M,   N,   _,   _,   _,
+    /* 08 */ _,   _,   N,   _,   N,   M,   _,   M|B,
+    /* 10 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 18 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 20 */ M,   M,   M,   M,   N,   N,   N,   N,
+    /* 28 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 30 */ _,   _,   _,   _,   _,   _,   N,   _,
+    /* 38 */ _,   N,   _,   N,   N,   N,   N,   N,
+    /* 40 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 48 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 50 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 58 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 60 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 68 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 70 */ M|B, M|B, M|B, M|B, M,   M,   M,   _,
+    /* 78 */ M,   M,   N,   N,   M,   M,   M,   M,
+    /* 80 */ Z,   Z,   Z,   Z,   Z,   Z,   Z,   Z,
+    /* 88 */ Z,   Z,   Z,   Z,   Z,   Z,   Z,   Z,
+    /* 90 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* 98 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* A0 */ _,   _,   _,   M,   M|B, M,   N,   N,
+    /* A8 */ _,   _,   _,   M,   M|B, M,   M,   M,
+    /* B0 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* B8 */ M,   M,   M|B, M,   M,   M,   M,   M,
+    /* C0 */ M,   M,   M|B, M,   M|B, M|B, M|B, M,
+    /* C8 */ _,   _,   _,   _,   _,   _,   _,   _,
+    /* D0 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* D8 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* E0 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* E8 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* F0 */ M,   M,   M,   M,   M,   M,   M,   M,
+    /* F8 */ M,   M,   M,   M,   M,   M,   M,   M,
+};
+
+// Bytes taken by a ModRM byte and what it implies (SIB, displacement)
+static size_t modrm_length(const unsigned char *p, size_t avail, int addr16)
+{
+    unsigned mod, rm;
+
+    if (avail < 1)
+        return 0;
+    mod = p[0] >> 6;
+    rm = p[0] & 7;
+    if (mod == 3)
+        return 1;
+    if (addr16)
+    {
+        if (mod == 1)
+            return 2;
+        if (mod == 2 || rm == 6)
+            return 3;
+        return 1;
+    }
+    if (rm == 4)
+    {
+        if (avail < 2)
+            return 0;
+        if (mod == 1)
+            return 3;
+        if (mod == 2 || (p[1] & 7) == 5)
+            return 6;
+        return 2;
+    }
+    if (mod == 1)
+        return 2;
+    if (mod == 2 || rm == 5)
+        return 5;
+    return 1;
+}
+
+// VEX (C4, C5), XOP (8F) and EVEX (62) encoded instructions. pos points at
+// the escape byte; the ModRM that follows the opcode is always there except
+// for VZEROUPPER/VZEROALL.
+static size_t vex_length(const unsigned char *p, size_t avail, size_t pos,
+        int addr16)
+{
+    unsigned char esc = p[pos];
+    unsigned map;
+    size_t ext, len, imm = 0;
+    unsigned char op;
+
+    if (esc == 0xc5)
+    {
+        ext = 2;
+        map = 1;
+    }
+    else if (esc == 0x62)
+    {
+        ext = 4;
+        if (avail < pos + 2)
+            return 0;
+        map = p[pos + 1] & 7;
+    }
+    else
+    {
+        ext = 3;
+        if (avail < pos + 2)
+            return 0;
+        map = p[pos + 1] & 0x1f;
+    }
+    pos += ext;
+    if (avail < pos + 1)
+        return 0;
+    op = p[pos++];
+
+    if (esc == 0x8f)
+    {
+        if (map == 8)
+            imm = 1;
+        else if (map == 0xa)
+            imm = 4;
+        else if (map != 9)
+            return 0;
+    }
+    else if (map == 3)
+        imm = 1;
+    else if (map == 1)
+    {
+        if (esc != 0x62 && op == 0x77)
+            return pos;
+        if ((op >= 0x70 && op <= 0x73) || op == 0xc2 ||
+                (op >= 0xc4 && op <= 0xc6))
+            imm = 1;
+    }
+    else if (map == 0 || map == 4 || map == 7 ||
+            (esc != 0x62 && map > 3))
+        return 0;
+
+    len = modrm_length(p + pos, avail - pos, addr16);
+    if (len == 0)
+        return 0;
+    pos += len + imm;
+    return (pos <= avail && pos <= X86_MAX_INSN_LEN) ? pos : 0;
+}
+
+size_t x86_insn_length(const unsigned char *p, size_t avail, int is64)
+{
+    int opsize16 = 0, addr_ovr = 0, addr16, rex_w = 0, rep = 0;
+    size_t pos = 0, imm = 0;
+    unsigned flags;
+    unsigned char op;
+
+    if (avail > X86_MAX_INSN_LEN)
+        avail = X86_MAX_INSN_LEN;
+
+    // Legacy prefixes, then in 64-bit mode a REX prefix. A REX prefix
+    // that is followed by a legacy prefix is ignored.
+    for (;;)
+    {
+        if (pos >= avail)
+            return 0;
+        op = p[pos];
+        if (op == 0x66)
+            opsize16 = 1;
+        else if (op == 0x67)
+            addr_ovr = 1;
+        else if (op == 0xf2 || op == 0xf3)
+            rep = op;
+        else if (is64 && (op & 0xf0) == 0x40)
+        {
+            rex_w = (op & 8) != 0;
+            pos++;
+            continue;
+        }
+        else if (op != 0xf0 && op != 0x2e && op != 0x36 && op != 0x3e &&
+                op != 0x26 && op != 0x64 && op != 0x65)
+            break;
+        rex_w = 0;
+        pos++;
+    }
+    if (pos >= avail)
+        return 0;
+    op = p[pos];
+    // 67 only picks 16-bit ModRM addressing outside of 64-bit mode
+    addr16 = addr_ovr && !is64;
+
+    // C4, C5 and 62 are only VEX and EVEX in 32-bit mode when what would
+    // be their ModRM byte has mod == 3; 8F is only XOP when the map is 8+.
+    if (op == 0xc4 || op == 0xc5 || op == 0x62 || op == 0x8f)
+    {
+        if (pos + 1 >= avail)
+            return 0;
+        if (op == 0x8f ? (p[pos + 1] & 0x1f) >= 8 :
+                (is64 || (p[pos + 1] >> 6) == 3))
+            return vex_length(p, avail, pos, addr16);
+    }
+
+    pos++;
+    if (op != 0x0f)
+    {
+        flags = one_byte[op];
+        if ((flags & X) && is64)
+            return 0;
+    }
+    else
+    {
+        if (pos >= avail)
+            return 0;
+        op = p[pos++];
+        if (op == 0x38 || op == 0x3a)
+        {
+            if (pos >= avail)
+                return 0;
+            pos++;
+            flags = (op == 0x3a) ? (M | B) : M;
+        }
+        else if (op >= 0x20 && op <= 0x23)
+        {
+            // MOV to and from CR and DR always take registers, whatever
+            // the ModRM's mod field says
+            if (pos >= avail)
+                return 0;
+            return pos + 1;
+        }
+        else
+        {
+            flags = two_byte[op];
+            // EXTRQ and INSERTQ with their two immediates
+            if (op == 0x78 && (opsize16 || rep == 0xf2))
+                imm = 2;
+        }
+    }
+    if (flags & N)
+        return 0;
+
+    if (flags & M)
+    {
+        size_t len = modrm_length(p + pos, avail - pos, addr16);
+        if (len == 0)
+            return 0;
+        if ((flags & T) && ((p[pos] >> 3) & 7) < 2)
+            flags |= (op & 1) ? Z : B;
+        pos += len;
+    }
+    if (flags & B)
+        imm += 1;
+    if (flags & W)
+        imm += 2;
+    if (flags & Z)
+        imm += (opsize16 && !rex_w) ? 2 : 4;
+    if (flags & V)
+        imm += rex_w ? 8 : (opsize16 ? 2 : 4);
+    if (flags & A)
+        imm += is64 ? (addr_ovr ? 4 : 8) : (addr_ovr ? 2 : 4);
+    if (flags & P)
+        imm += 2 + (opsize16 ? 2 : 4);
+    pos += imm;
+    return (pos <= avail) ? pos : 0;
+}
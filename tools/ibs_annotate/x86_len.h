@@ -0,0 +1,20 @@
+/*
+ * Copyright (C) 2019 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ */
+#ifndef X86_LEN_H
+#define X86_LEN_H
+
+#include <stddef.h>
+
+// The longest legal AMD64 instruction
+#define X86_MAX_INSN_LEN    15
+
+// Length in bytes of the instruction at the start of p, of which avail
+// bytes are readable, decoded for 64-bit mode or (is64 == 0) 32-bit
+// protected mode. Returns 0 if the bytes are not a valid instruction or
+// run past avail.
+size_t x86_insn_length(const unsigned char *p, size_t avail, int is64);
+
+#endif  /* X86_LEN_H */
@@ -0,0 +1,628 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This is a benchmark of the cost of collecting IBS samples. It runs a set
+ * of calibrated kernels (see kernels.h) on one CPU while a collector thread
+ * on another CPU drains that CPU's IBS op device, for every combination of
+ * the sample rates, buffer sizes and poll thresholds it is given, both
+ * through the driver's device files directly and through libIBS.
+ *
+ * For each combination it prints one CSV line with how much slower the
+ * kernel ran than without IBS, how many samples per second were drained,
+ * how long samples sat in the driver's buffer before they were read, and
+ * what fraction of them the driver lost.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sysinfo.h>
+#include <x86intrin.h>
+
+#include "ibs.h"
+#include "ibs-uapi.h"
+#include "kernels.h"
+
+#define MAX_LIST    16
+
+#define PATH_RAW    0x1
+#define PATH_LIB    0x2
+
+struct list {
+    unsigned long vals[MAX_LIST];
+    int num;
+};
+
+// The sweep, and how to run each point of it
+static struct list max_cnts = {{0x4000, 0x1000, 0x400}, 3};
+static struct list buffer_kbs = {{256, 1024, 4096}, 3};
+static struct list poll_pcts = {{25, 75}, 2};
+static const struct kernel *kernels_to_run[MAX_LIST];
+static int num_kernels = 0;
+static int paths = PATH_RAW | PATH_LIB;
+static int reps = 3;
+static unsigned long duration_ms = 500;
+static unsigned long mem_mb = 256;
+static int poll_timeout = 100;
+static int work_cpu = -1;
+static int collector_cpu = 0;
+static FILE *out_fp = NULL;
+
+static double tsc_per_us = 0;
+
+// One point of the sweep
+struct bench_config {
+    int path;
+    unsigned long max_cnt;
+    unsigned long buffer_kb;
+    unsigned long poll_pct;
+    unsigned long poll_samples;
+};
+
+// What the collector thread saw while IBS was on
+struct collector {
+    const struct bench_config *cfg;
+    pthread_t thread;
+    int stop;
+    int fd;                     // PATH_RAW
+    void *buf;
+    size_t buf_len;
+    ibs_batch_t batch;          // PATH_LIB
+    uint64_t samples;
+    uint64_t lost;
+    double age_sum;             // In TSC cycles
+    uint64_t age_max;
+    int failed;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    {
+        fprintf(stderr, "Could not pin a thread to CPU %d\n", cpu);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void measure_tsc(void)
+{
+    uint64_t t0 = now_ns(), c0 = __rdtsc();
+    while (now_ns() - t0 < 50000000ULL)
+        ;
+    tsc_per_us = (double)(__rdtsc() - c0) * 1000 / (now_ns() - t0);
+}
+
+static void parse_list(const char *opt, struct list *list, const char *what)
+{
+    char *copy = strdup(opt), *save = NULL;
+
+    list->num = 0;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save))
+    {
+        char *end;
+        unsigned long val;
+        errno = 0;
+        val = strtoul(tok, &end, 0);
+        if (*end != '\0' || end == tok || errno || val == 0)
+        {
+            fprintf(stderr, "Bad %s: %s\n", what, tok);
+            exit(EXIT_FAILURE);
+        }
+        if (list->num == MAX_LIST)
+        {
+            fprintf(stderr, "At most %d %s values\n", MAX_LIST, what);
+            exit(EXIT_FAILURE);
+        }
+        list->vals[list->num++] = val;
+    }
+    free(copy);
+}
+
+static void parse_kernels(const char *opt)
+{
+    char *copy = strdup(opt), *save = NULL;
+
+    num_kernels = 0;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save))
+    {
+        const struct kernel *k = find_kernel(tok);
+        if (k == NULL)
+        {
+            fprintf(stderr, "No kernel called %s. There are: %s\n", tok,
+                    kernel_names());
+            exit(EXIT_FAILURE);
+        }
+        if (num_kernels == MAX_LIST)
+        {
+            fprintf(stderr, "At most %d kernels\n", MAX_LIST);
+            exit(EXIT_FAILURE);
+        }
+        kernels_to_run[num_kernels++] = k;
+    }
+    free(copy);
+}
+
+static void parse_paths(const char *opt)
+{
+    char *copy = strdup(opt), *save = NULL;
+
+    paths = 0;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save))
+    {
+        if (!strcmp(tok, "raw"))
+            paths |= PATH_RAW;
+        else if (!strcmp(tok, "lib"))
+            paths |= PATH_LIB;
+        else
+        {
+            fprintf(stderr, "Bad path: %s (raw or lib)\n", tok);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(copy);
+}
+
+static void set_out_file(const char *opt)
+{
+    out_fp = fopen(opt, "w");
+    if (out_fp == NULL)
+    {
+        fprintf(stderr, "Cannot fopen output file: %s\n", opt);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    static struct option longopts[] =
+    {
+        {"kernels", required_argument, NULL, 'k'},
+        {"max_cnts", required_argument, NULL, 'c'},
+        {"buffer_sizes", required_argument, NULL, 'b'},
+        {"poll_percents", required_argument, NULL, 'p'},
+        {"paths", required_argument, NULL, 'P'},
+        {"reps", required_argument, NULL, 'n'},
+        {"duration", required_argument, NULL, 'd'},
+        {"memory", required_argument, NULL, 'm'},
+        {"poll_timeout", required_argument, NULL, 't'},
+        {"cpu", required_argument, NULL, 'w'},
+        {"collector_cpu", required_argument, NULL, 'C'},
+        {"output", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "hk:c:b:p:P:n:d:m:t:w:C:o:",
+                    longopts, NULL)) != -1)
+    {
+        switch (c) {
+            case 'h':
+            case '?':
+                fprintf(stderr, "This program measures what collecting IBS op samples costs.\n");
+                fprintf(stderr, "It runs each kernel on one CPU, first without IBS and then with IBS on that CPU\n");
+                fprintf(stderr, "for every combination of the settings below, while another CPU drains the samples.\n");
+                fprintf(stderr, "Each combination is one CSV line on stdout (or --output).\n");
+                fprintf(stderr, "Usage: ./ibs_bench [options below]\n");
+                fprintf(stderr, "--kernels (or -k) {name,...}:\n");
+                fprintf(stderr, "       Kernels to run, from %s. Defaults to all\n", kernel_names());
+                fprintf(stderr, "--max_cnts (or -c) {count,...}:\n");
+                fprintf(stderr, "       IBS_MAX_CNT values to sample at; 16 times this is about the number of ops\n");
+                fprintf(stderr, "       between samples. Defaults to 0x4000,0x1000,0x400\n");
+                fprintf(stderr, "--buffer_sizes (or -b) {# kB,...}:\n");
+                fprintf(stderr, "       Driver buffer sizes to try. Defaults to 256,1024,4096\n");
+                fprintf(stderr, "--poll_percents (or -p) {%%age,...}:\n");
+                fprintf(stderr, "       How full the buffer gets before the collector is woken. Defaults to 25,75\n");
+                fprintf(stderr, "--paths (or -P) {raw,lib}:\n");
+                fprintf(stderr, "       Drain the device with poll() and read() (raw), through ibs_sample_batch()\n");
+                fprintf(stderr, "       (lib), or both. Defaults to both\n");
+                fprintf(stderr, "--reps (or -n) {# runs}:\n");
+                fprintf(stderr, "       Runs of each kernel per combination; the median time is used. Defaults to 3\n");
+                fprintf(stderr, "--duration (or -d) {# ms}:\n");
+                fprintf(stderr, "       How long each kernel is calibrated to run without IBS. Defaults to 500 ms\n");
+                fprintf(stderr, "--memory (or -m) {# MB}:\n");
+                fprintf(stderr, "       Memory for the chase and stream kernels. Defaults to 256 MB\n");
+                fprintf(stderr, "--poll_timeout (or -t) {# ms}:\n");
+                fprintf(stderr, "       How long the collector waits before reading a buffer that is not full\n");
+                fprintf(stderr, "       enough. Defaults to 100 ms\n");
+                fprintf(stderr, "--cpu (or -w) {cpu}:\n");
+                fprintf(stderr, "       CPU to run the kernels on. Defaults to 1 (0 on one-CPU machines)\n");
+                fprintf(stderr, "--collector_cpu (or -C) {cpu}:\n");
+                fprintf(stderr, "       CPU to drain the samples from. Defaults to 0\n");
+                fprintf(stderr, "--output (or -o) {filename}:\n");
+                fprintf(stderr, "       CSV file to write the results to\n");
+                exit(EXIT_SUCCESS);
+            case 'k':
+                parse_kernels(optarg);
+                break;
+            case 'c':
+                parse_list(optarg, &max_cnts, "max count");
+                break;
+            case 'b':
+                parse_list(optarg, &buffer_kbs, "buffer size");
+                break;
+            case 'p':
+                parse_list(optarg, &poll_pcts, "poll percent");
+                break;
+            case 'P':
+                parse_paths(optarg);
+                break;
+            case 'n':
+                reps = atoi(optarg);
+                break;
+            case 'd':
+                duration_ms = strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                mem_mb = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                poll_timeout = atoi(optarg);
+                break;
+            case 'w':
+                work_cpu = atoi(optarg);
+                break;
+            case 'C':
+                collector_cpu = atoi(optarg);
+                break;
+            case 'o':
+                set_out_file(optarg);
+                break;
+        }
+    }
+
+    if (num_kernels == 0)
+        parse_kernels(kernel_names());
+    for (int i = 0; i < poll_pcts.num; i++)
+    {
+        if (poll_pcts.vals[i] > 100)
+        {
+            fprintf(stderr, "Bad poll percent: %lu\n", poll_pcts.vals[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (reps < 1 || duration_ms == 0 || mem_mb == 0 || poll_timeout < 0)
+    {
+        fprintf(stderr, "--reps, --duration and --memory must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (work_cpu < 0)
+        work_cpu = (get_nprocs() > 1) ? 1 : 0;
+    if (work_cpu == collector_cpu)
+    {
+        fprintf(stderr, "Warning, the collector shares CPU %d with the ",
+                work_cpu);
+        fprintf(stderr, "kernels, so their slowdown includes draining\n");
+    }
+    if (out_fp == NULL)
+        out_fp = stdout;
+}
+
+// Account for n samples that were just drained
+static void count_samples(struct collector *col, const ibs_op_t *ops,
+        size_t n)
+{
+    uint64_t now = __rdtsc();
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint64_t age = (now > ops[i].tsc) ? now - ops[i].tsc : 0;
+        col->age_sum += age;
+        if (age > col->age_max)
+            col->age_max = age;
+    }
+    col->samples += n;
+}
+
+static void *raw_collector(void *arg)
+{
+    struct collector *col = arg;
+    struct pollfd pfd = {.fd = col->fd, .events = POLLIN | POLLRDNORM};
+
+    pin_to_cpu(collector_cpu);
+    while (!__atomic_load_n(&col->stop, __ATOMIC_ACQUIRE))
+    {
+        ssize_t len;
+        long lost;
+
+        if (poll(&pfd, 1, poll_timeout) < 0 && errno != EINTR)
+        {
+            col->failed = 1;
+            break;
+        }
+        len = read(col->fd, col->buf, col->buf_len);
+        if (len > 0)
+            count_samples(col, col->buf, len / sizeof(ibs_op_t));
+        lost = ioctl(col->fd, GET_LOST);
+        if (lost > 0)
+            col->lost += lost;
+    }
+    return NULL;
+}
+
+static void *lib_collector(void *arg)
+{
+    struct collector *col = arg;
+
+    pin_to_cpu(collector_cpu);
+    while (!__atomic_load_n(&col->stop, __ATOMIC_ACQUIRE))
+    {
+        int n = ibs_sample_batch(&col->batch);
+        unsigned long lost = 0;
+
+        if (n < 0)
+        {
+            col->failed = 1;
+            break;
+        }
+        count_samples(col, col->batch.ops, col->batch.num_ops);
+        if (ibs_get_lost(&lost, NULL) == 0)
+            col->lost += lost;
+    }
+    return NULL;
+}
+
+static int raw_ioctl(int fd, unsigned long cmd, unsigned long arg,
+        const char *name)
+{
+    if (ioctl(fd, cmd, arg) < 0)
+    {
+        fprintf(stderr, "Could not %s on CPU %d\n", name, work_cpu);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Set up the driver for cfg and turn IBS on
+static int collector_start(struct collector *col)
+{
+    const struct bench_config *cfg = col->cfg;
+    size_t buf_bytes = cfg->buffer_kb * 1024;
+
+    col->buf_len = buf_bytes;
+    col->buf = malloc(buf_bytes);
+    if (col->buf == NULL)
+        return -1;
+
+    if (cfg->path == PATH_RAW)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/dev/cpu/%d/ibs/op", work_cpu);
+        col->fd = open(path, O_RDONLY | O_NONBLOCK);
+        if (col->fd < 0)
+        {
+            fprintf(stderr, "Could not open %s\n", path);
+            fprintf(stderr, "    %s\n", strerror(errno));
+            return -1;
+        }
+        if (raw_ioctl(col->fd, SET_BUFFER_SIZE, buf_bytes, "set the buffer size") ||
+                raw_ioctl(col->fd, SET_POLL_SIZE, cfg->poll_samples,
+                    "set the poll size") ||
+                raw_ioctl(col->fd, SET_MAX_CNT, cfg->max_cnt,
+                    "set the max count") ||
+                raw_ioctl(col->fd, RESET_BUFFER, 0, "reset the buffer"))
+            return -1;
+        ioctl(col->fd, GET_LOST);
+        if (raw_ioctl(col->fd, IBS_ENABLE, 0, "enable IBS"))
+            return -1;
+        return pthread_create(&col->thread, NULL, raw_collector, col);
+    }
+
+    int num_cpus = get_nprocs_conf();
+    char *cpu_list = calloc(num_cpus, sizeof(char));
+    if (cpu_list == NULL)
+        return -1;
+    cpu_list[work_cpu] = 1;
+    ibs_option_list_t opts[] =
+    {
+        {IBS_OP, (ibs_val_t)1},
+        {IBS_FETCH, (ibs_val_t)0},
+        {IBS_CPU_LIST, (ibs_val_t)cpu_list},
+        {IBS_MAX_CNT, (ibs_val_t)cfg->max_cnt},
+        {IBS_BUFFER_SIZE, (ibs_val_t)buf_bytes},
+        {IBS_POLL_NUM_SAMPLES, (ibs_val_t)cfg->poll_samples},
+        {IBS_POLL_TIMEOUT, (ibs_val_t)(long)poll_timeout},
+        {IBS_READ_ON_TIMEOUT, (ibs_val_t)1},
+    };
+    int status = ibs_initialize(opts, sizeof(opts) / sizeof(opts[0]), 0);
+    free(cpu_list);
+    if (status < 0)
+    {
+        fprintf(stderr, "Could not initialize IBS. %d\n", status);
+        return -1;
+    }
+    col->batch.ops = col->buf;
+    col->batch.max_ops = buf_bytes / sizeof(ibs_op_t);
+    ibs_get_lost(NULL, NULL);
+    if (ibs_enable_all() < 0)
+    {
+        fprintf(stderr, "Could not enable IBS on CPU %d\n", work_cpu);
+        ibs_finalize();
+        return -1;
+    }
+    return pthread_create(&col->thread, NULL, lib_collector, col);
+}
+
+static void collector_stop(struct collector *col)
+{
+    __atomic_store_n(&col->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(col->thread, NULL);
+    if (col->cfg->path == PATH_RAW)
+    {
+        long lost;
+        ioctl(col->fd, IBS_DISABLE);
+        lost = ioctl(col->fd, GET_LOST);
+        if (lost > 0)
+            col->lost += lost;
+        close(col->fd);
+    }
+    else
+    {
+        unsigned long lost = 0;
+        ibs_disable_all();
+        if (ibs_get_lost(&lost, NULL) == 0)
+            col->lost += lost;
+        ibs_finalize();
+    }
+    free(col->buf);
+}
+
+// Seconds that iters rounds of k take
+static double time_kernel(const struct kernel *k, uint64_t iters)
+{
+    static volatile uint64_t sink;
+    uint64_t start = now_ns();
+
+    sink = k->run(iters);
+    (void)sink;
+    return (now_ns() - start) / 1e9;
+}
+
+// Rounds of k that take about duration_ms
+static uint64_t calibrate(const struct kernel *k)
+{
+    uint64_t iters = 1;
+    double secs;
+
+    while ((secs = time_kernel(k, iters)) < duration_ms / 10000.0)
+        iters *= 2;
+    iters = iters * (duration_ms / 1000.0) / secs;
+    return iters ? iters : 1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double *vals, int n)
+{
+    qsort(vals, n, sizeof(*vals), cmp_double);
+    return (n % 2) ? vals[n / 2] : (vals[n / 2 - 1] + vals[n / 2]) / 2;
+}
+
+static double baseline_seconds(const struct kernel *k, uint64_t iters)
+{
+    double *secs = malloc(reps * sizeof(*secs));
+    double med;
+
+    for (int r = 0; r < reps; r++)
+        secs[r] = time_kernel(k, iters);
+    med = median(secs, reps);
+    free(secs);
+    return med;
+}
+
+static void run_config(const struct kernel *k, uint64_t iters,
+        double baseline, const struct bench_config *cfg)
+{
+    double *secs = malloc(reps * sizeof(*secs));
+    struct collector col;
+    uint64_t start, enabled_ns;
+    double run, drained;
+
+    memset(&col, 0, sizeof(col));
+    col.cfg = cfg;
+    if (secs == NULL || collector_start(&col))
+    {
+        fprintf(stderr, "Could not collect samples with this setup\n");
+        exit(EXIT_FAILURE);
+    }
+    start = now_ns();
+    for (int r = 0; r < reps; r++)
+        secs[r] = time_kernel(k, iters);
+    enabled_ns = now_ns() - start;
+    collector_stop(&col);
+    if (col.failed)
+        fprintf(stderr, "Warning, the collector stopped early\n");
+
+    run = median(secs, reps);
+    drained = col.samples + col.lost;
+    fprintf(out_fp, "%s,%s,0x%lx,%lu,%lu,%lu,%" PRIu64 ",%.3f,%.3f,%.2f,",
+            (cfg->path == PATH_RAW) ? "raw" : "lib", k->name, cfg->max_cnt,
+            cfg->buffer_kb, cfg->poll_pct, cfg->poll_samples, iters,
+            baseline * 1000, run * 1000, (run / baseline - 1) * 100);
+    fprintf(out_fp, "%" PRIu64 ",%.0f,%" PRIu64 ",%.3f,%.1f,%.1f\n",
+            col.samples, col.samples / (enabled_ns / 1e9), col.lost,
+            drained ? 100.0 * col.lost / drained : 0.0,
+            col.samples ? col.age_sum / col.samples / tsc_per_us : 0.0,
+            col.age_max / tsc_per_us);
+    fflush(out_fp);
+    free(secs);
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    pin_to_cpu(work_cpu);
+    measure_tsc();
+    kernels_init(mem_mb);
+
+    fprintf(out_fp, "path,kernel,max_cnt,buffer_kb,poll_pct,poll_samples,");
+    fprintf(out_fp, "iters,baseline_ms,run_ms,slowdown_pct,samples,");
+    fprintf(out_fp, "samples_per_s,lost,lost_pct,drain_lat_avg_us,");
+    fprintf(out_fp, "drain_lat_max_us\n");
+
+    for (int i = 0; i < num_kernels; i++)
+    {
+        const struct kernel *k = kernels_to_run[i];
+        uint64_t iters = calibrate(k);
+        double baseline = baseline_seconds(k, iters);
+
+        for (int path = PATH_RAW; path <= PATH_LIB; path <<= 1)
+        {
+            if (!(paths & path))
+                continue;
+            for (int c = 0; c < max_cnts.num; c++)
+            for (int b = 0; b < buffer_kbs.num; b++)
+            for (int p = 0; p < poll_pcts.num; p++)
+            {
+                struct bench_config cfg = {
+                    .path = path,
+                    .max_cnt = max_cnts.vals[c],
+                    .buffer_kb = buffer_kbs.vals[b],
+                    .poll_pct = poll_pcts.vals[p],
+                };
+                cfg.poll_samples = cfg.buffer_kb * 1024 / sizeof(ibs_op_t) *
+                    cfg.poll_pct / 100;
+                if (cfg.poll_samples == 0)
+                    cfg.poll_samples = 1;
+                run_config(k, iters, baseline, &cfg);
+            }
+        }
+    }
+
+    kernels_fini();
+    if (out_fp != stdout)
+        fclose(out_fp);
+    return 0;
+}
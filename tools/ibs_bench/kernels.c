@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ *
+ * The workloads that ibs_bench measures sampling overheads on.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+
+// Steps or bytes per round of each kernel
+#define CHASE_STEPS     (1 << 16)
+#define STREAM_BYTES    (1 << 24)
+#define BRANCH_BYTES    (1 << 16)
+
+static uint64_t *chase_buf = NULL;
+static size_t chase_len = 0;
+static uint64_t chase_pos = 0;
+static uint64_t *stream_buf = NULL;
+static size_t stream_len = 0;
+static size_t stream_pos = 0;
+static unsigned char *branch_buf = NULL;
+
+// xorshift64*, so the kernels' data is the same on every run
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+static uint64_t next_random(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void *alloc_or_die(size_t len)
+{
+    void *p = malloc(len);
+    if (p == NULL)
+    {
+        fprintf(stderr, "Could not allocate %zu bytes for the kernels\n", len);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void kernels_init(unsigned long mem_mb)
+{
+    size_t bytes = (size_t)mem_mb << 20;
+
+    // One cycle through every element (Sattolo's shuffle), one per line
+    chase_len = bytes / 2 / 64;
+    if (chase_len < 2)
+        chase_len = 2;
+    chase_buf = alloc_or_die(chase_len * 64);
+    uint64_t *order = alloc_or_die(chase_len * sizeof(*order));
+    for (size_t i = 0; i < chase_len; i++)
+        order[i] = i;
+    for (size_t i = chase_len - 1; i > 0; i--)
+    {
+        size_t j = next_random() % i;
+        uint64_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (size_t i = 0; i < chase_len; i++)
+        chase_buf[order[i] * 8] = order[(i + 1) % chase_len] * 8;
+    free(order);
+
+    stream_len = bytes / 2 / sizeof(*stream_buf);
+    if (stream_len < STREAM_BYTES / sizeof(*stream_buf))
+        stream_len = STREAM_BYTES / sizeof(*stream_buf);
+    stream_buf = alloc_or_die(stream_len * sizeof(*stream_buf));
+    for (size_t i = 0; i < stream_len; i++)
+        stream_buf[i] = i;
+
+    branch_buf = alloc_or_die(BRANCH_BYTES);
+    for (size_t i = 0; i < BRANCH_BYTES; i++)
+        branch_buf[i] = next_random() >> 56;
+}
+
+void kernels_fini(void)
+{
+    free(chase_buf);
+    free(stream_buf);
+    free(branch_buf);
+    chase_buf = stream_buf = NULL;
+    branch_buf = NULL;
+}
+
+static uint64_t run_chase(uint64_t iters)
+{
+    uint64_t pos = chase_pos;
+
+    for (uint64_t i = 0; i < iters; i++)
+        for (int j = 0; j < CHASE_STEPS; j++)
+            pos = chase_buf[pos];
+    // Carry on from here next time, rather than from cached lines
+    chase_pos = pos;
+    return pos;
+}
+
+static uint64_t run_stream(uint64_t iters)
+{
+    const size_t words = STREAM_BYTES / sizeof(*stream_buf);
+    uint64_t sum = 0;
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        uint64_t *p;
+        if (stream_pos + words > stream_len)
+            stream_pos = 0;
+        p = stream_buf + stream_pos;
+        for (size_t j = 0; j < words; j++)
+        {
+            sum += p[j];
+            p[j] = sum;
+        }
+        stream_pos += words;
+    }
+    return sum;
+}
+
+static uint64_t run_branch(uint64_t iters)
+{
+    uint64_t a = 0, b = 0;
+
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        for (int j = 0; j < BRANCH_BYTES; j++)
+        {
+            // Keep the compiler from turning these into cmovs
+            if (branch_buf[j] & 0x80)
+            {
+                a += branch_buf[j];
+                __asm__ volatile("" : "+r"(a));
+            }
+            else
+            {
+                b ^= a + j;
+                __asm__ volatile("" : "+r"(b));
+            }
+        }
+    }
+    return a + b;
+}
+
+static const struct kernel kernels[] = {
+    {"chase", run_chase},
+    {"stream", run_stream},
+    {"branch", run_branch},
+};
+
+const struct kernel *find_kernel(const char *name)
+{
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        if (!strcmp(kernels[i].name, name))
+            return &kernels[i];
+    return NULL;
+}
+
+const char *kernel_names(void)
+{
+    return "chase,stream,branch";
+}
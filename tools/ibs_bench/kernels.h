@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ */
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+
+// Workloads for ibs_bench to sample. Each stresses one part of the core, so
+// that the cost of sampling shows up where real programs would feel it:
+//   chase:  dependent loads around a random cycle much larger than the
+//           caches, so nearly every op sample is a DRAM miss
+//   stream: sequential loads and stores through a large array
+//   branch: data-dependent branches on random bytes, about half mispredicted
+struct kernel {
+    const char *name;
+    // Run iters rounds of the kernel; the result only defeats the optimizer
+    uint64_t (*run)(uint64_t iters);
+};
+
+// Allocate and fill the kernels' data, of about mem_mb MB
+void kernels_init(unsigned long mem_mb);
+void kernels_fini(void);
+
+// NULL if there is no kernel of that name
+const struct kernel *find_kernel(const char *name);
+
+// Comma-separated names of every kernel, for the help text
+const char *kernel_names(void);
+
+#endif  /* KERNELS_H */
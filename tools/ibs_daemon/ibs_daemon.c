@@ -38,6 +38,8 @@
 static int header_written = 0;
 static char *global_op_file = NULL;
 static char *global_work_dir = NULL;
+static ibs_readers_t global_readers = IBS_READERS_NONE;
+static int global_trace = 0;
 
 static void write_header(FILE * fp)
 {
@@ -130,12 +132,15 @@ static void parse_args(int argc, char *argv[])
     {
         {"op_file", required_argument, NULL, 'o'},
         {"working_dir", required_argument, NULL, 'w'},
+        {"readers", required_argument, NULL, 'r'},
+        {"compress", no_argument, NULL, 'z'},
+        {"columnar", no_argument, NULL, 'c'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
 
     char c;
-    while ((c = getopt_long(argc, argv, "+ho:w:", longopts, NULL)) != -1)
+    while ((c = getopt_long(argc, argv, "+ho:w:r:zc", longopts, NULL)) != -1)
     {
         switch (c) {
             case 'h':
@@ -146,7 +151,16 @@ static void parse_args(int argc, char *argv[])
                 fprintf(stderr, "       Sets the working direcotry for launching the program to monitor.\n");
                 fprintf(stderr, "--op_file (or -o):\n");
                 fprintf(stderr, "       File to which to save IBS op samples\n");
-                fprintf(stderr, "If you skip setting the file, IBS sampling will be disabled.\n\n");
+                fprintf(stderr, "If you skip setting the file, IBS sampling will be disabled.\n");
+                fprintf(stderr, "--readers (or -r) {node|l3}:\n");
+                fprintf(stderr, "       Read samples with one thread per NUMA node or per L3 cache,\n");
+                fprintf(stderr, "       each pinned there, instead of one thread for everything.\n");
+                fprintf(stderr, "--compress (or -z):\n");
+                fprintf(stderr, "       Save every field of each sample in the compressed trace format 2 that\n");
+                fprintf(stderr, "       ibs_decoder reads, instead of as CSV.\n");
+                fprintf(stderr, "--columnar (or -c):\n");
+                fprintf(stderr, "       Like --compress, but in trace format 3, which is stored a field at a\n");
+                fprintf(stderr, "       time and indexed so that readers can skip what they do not need.\n\n");
                 exit(EXIT_SUCCESS);
             case 'o':
                 global_op_file = optarg;
@@ -154,6 +168,24 @@ static void parse_args(int argc, char *argv[])
             case 'w':
                 global_work_dir = optarg;
                 break;
+            case 'r':
+                if (!strcmp(optarg, "node"))
+                    global_readers = IBS_READERS_PER_NODE;
+                else if (!strcmp(optarg, "l3"))
+                    global_readers = IBS_READERS_PER_L3;
+                else
+                {
+                    fprintf(stderr, "--readers takes node or l3, not %s\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'z':
+                global_trace = 2;
+                break;
+            case 'c':
+                global_trace = 3;
+                break;
             case '?':
             default:
                 fprintf(stderr, "Found this bad argument: %s\n", argv[optind]);
@@ -353,6 +385,10 @@ int main(int argc, char *argv[])
             {IBS_DAEMON_OP_FILE,        (ibs_val_t)global_op_file},
             // Function that will write out op traces.
             {IBS_DAEMON_OP_WRITE,       (ibs_val_t)func_ptr_cast.ptr},
+            // Whether to spread the reading over one thread per node or L3
+            {IBS_DAEMON_READERS,        (ibs_val_t)(long)global_readers},
+            // Whether to write a compressed trace rather than the CSV above
+            {IBS_DAEMON_TRACE,          (ibs_val_t)(long)global_trace},
         };
         num_opts = sizeof(opts) / sizeof(ibs_option_list_t);
 
@@ -0,0 +1,515 @@
+/*
+ * Copyright (C) 2019 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ *
+ * A small Arrow IPC file writer for the IBS decoder. Arrow's metadata is
+ * FlatBuffers, which are built here by hand rather than by pulling in the
+ * FlatBuffers and Arrow libraries. See Schema.fbs, Message.fbs and File.fbs
+ * in the Arrow format specification for the tables written below.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arrow_output.h"
+
+#define ARROW_MAGIC             "ARROW1"
+#define ARROW_CONTINUATION      0xFFFFFFFFU
+#define ARROW_METADATA_V5       4
+
+// Message.fbs MessageHeader and Schema.fbs Type union members
+#define ARROW_HEADER_SCHEMA     1
+#define ARROW_HEADER_DICTIONARY 2
+#define ARROW_HEADER_BATCH      3
+#define ARROW_TYPE_INT          2
+#define ARROW_TYPE_UTF8         5
+
+// Where a message is in the file, as File.fbs's Block struct
+struct arrow_block {
+    int64_t offset;
+    int32_t meta_len;
+    int32_t pad;
+    int64_t body_len;
+};
+
+struct arrow_file {
+    FILE *fp;
+    const struct arrow_field *fields;
+    size_t num_fields;
+    int64_t offset;
+    struct arrow_block *dicts;
+    size_t num_dicts;
+    struct arrow_block *batches;
+    size_t num_batches;
+    size_t max_batches;
+};
+
+// Body buffers of a message, and the FieldNode and Buffer structs that
+// describe them
+struct arrow_body {
+    const void *data[3 * 64];
+    int64_t buffers[2 * 3 * 64];    // Offset, length
+    size_t num_buffers;
+    int64_t nodes[2 * 64];          // Length, null count
+    size_t num_nodes;
+    int64_t len;
+};
+
+static void *xrealloc(void *p, size_t len)
+{
+    p = realloc(p, len);
+    if (p == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Out of memory writing an Arrow file.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static inline int64_t pad8(int64_t len)
+{
+    return (len + 7) & ~(int64_t)7;
+}
+
+/*
+ * FlatBuffers, built front to back. A table's fields are laid out first
+ * and the tables, vectors and strings they point to after it, as
+ * FlatBuffers offsets only point forwards. Each table's vtable goes just
+ * before it.
+ */
+struct fb {
+    unsigned char *buf;
+    size_t len;
+    size_t size;
+};
+
+// Append n zeroed bytes at the next multiple of align
+static size_t fb_alloc(struct fb *b, size_t n, size_t align)
+{
+    size_t pos = (b->len + align - 1) & ~(align - 1);
+
+    if (pos + n > b->size)
+    {
+        b->size = (pos + n) * 2 + 256;
+        b->buf = xrealloc(b->buf, b->size);
+    }
+    memset(b->buf + b->len, 0, pos + n - b->len);
+    b->len = pos + n;
+    return pos;
+}
+
+#define fb_scalar(b, pos, type, value) \
+do { \
+    type tmp_ = (value); \
+    memcpy((b)->buf + (pos), &tmp_, sizeof(tmp_)); \
+} while (0)
+
+// Point the offset at pos to target, which must come after it
+static void fb_ref(struct fb *b, size_t pos, size_t target)
+{
+    fb_scalar(b, pos, uint32_t, target - pos);
+}
+
+// Lay out a table whose field i is sizes[i] bytes, or absent if that is 0.
+// Each field's position goes in pos[i].
+static size_t fb_table(struct fb *b, size_t num_fields, const uint8_t *sizes,
+        size_t *pos)
+{
+    size_t vt = fb_alloc(b, 4 + 2 * num_fields, 2);
+    size_t t = fb_alloc(b, 4, 4);
+
+    for (size_t i = 0; i < num_fields; i++)
+    {
+        pos[i] = sizes[i] ? fb_alloc(b, sizes[i], sizes[i]) : t;
+        fb_scalar(b, vt + 4 + 2 * i, uint16_t, pos[i] - t);
+    }
+    fb_scalar(b, vt, uint16_t, 4 + 2 * num_fields);
+    fb_scalar(b, vt + 2, uint16_t, b->len - t);
+    fb_scalar(b, t, int32_t, t - vt);
+    return t;
+}
+
+// Start a vector of n elements of elem_size bytes. Returns where the
+// elements go; the vector itself, for fb_ref, starts 4 bytes before.
+static size_t fb_vector(struct fb *b, size_t n, size_t elem_size,
+        size_t align)
+{
+    size_t at;
+
+    if (align < 4)
+        align = 4;
+    // The length goes just before the first element
+    fb_alloc(b, (align - (b->len + 4) % align) % align, 1);
+    at = fb_alloc(b, 4, 4);
+    fb_scalar(b, at, uint32_t, n);
+    fb_alloc(b, n * elem_size, 1);
+    return at + 4;
+}
+
+static size_t fb_string(struct fb *b, const char *s)
+{
+    size_t len = strlen(s);
+    size_t at = fb_alloc(b, 4 + len + 1, 4);
+
+    fb_scalar(b, at, uint32_t, len);
+    memcpy(b->buf + at + 4, s, len);
+    return at;
+}
+
+// table Int { bitWidth: int; is_signed: bool; }
+static size_t fb_int(struct fb *b, int bit_width, int is_signed)
+{
+    static const uint8_t sizes[] = {4, 1};
+    size_t pos[2];
+    size_t t = fb_table(b, 2, sizes, pos);
+
+    fb_scalar(b, pos[0], int32_t, bit_width);
+    fb_scalar(b, pos[1], uint8_t, is_signed);
+    return t;
+}
+
+static size_t type_width(enum arrow_type type)
+{
+    switch (type) {
+        case ARROW_UINT8:
+        case ARROW_DICT:
+            return 1;
+        case ARROW_UINT16:
+            return 2;
+        case ARROW_UINT32:
+        case ARROW_INT32:
+            return 4;
+        default:
+            return 8;
+    }
+}
+
+// table Field { name, nullable, type_type, type, dictionary, children }
+// Dictionary ids are column numbers.
+static size_t fb_field(struct fb *b, const struct arrow_field *f, size_t id)
+{
+    static const uint8_t int_sizes[] = {4, 1, 1, 4, 0, 4};
+    static const uint8_t dict_sizes[] = {4, 1, 1, 4, 4, 4};
+    static const uint8_t encoding_sizes[] = {8, 4};
+    int is_dict = (f->type == ARROW_DICT);
+    size_t pos[6], epos[2];
+    size_t t = fb_table(b, 6, is_dict ? dict_sizes : int_sizes, pos);
+
+    fb_ref(b, pos[0], fb_string(b, f->name));
+    fb_scalar(b, pos[1], uint8_t, 1);
+    if (is_dict)
+    {
+        // The values are strings; the column holds int8 indices to them
+        fb_scalar(b, pos[2], uint8_t, ARROW_TYPE_UTF8);
+        fb_ref(b, pos[3], fb_table(b, 0, NULL, NULL));
+        size_t enc = fb_table(b, 2, encoding_sizes, epos);
+        fb_ref(b, pos[4], enc);
+        fb_scalar(b, epos[0], int64_t, id);
+        fb_ref(b, epos[1], fb_int(b, 8, 1));
+    }
+    else
+    {
+        fb_scalar(b, pos[2], uint8_t, ARROW_TYPE_INT);
+        fb_ref(b, pos[3], fb_int(b, 8 * type_width(f->type),
+                    f->type == ARROW_INT32));
+    }
+    // Readers insist on a children vector, even an empty one
+    fb_ref(b, pos[5], fb_vector(b, 0, 4, 4) - 4);
+    return t;
+}
+
+// table Schema { endianness, fields }
+static size_t fb_schema(struct fb *b, const struct arrow_field *fields,
+        size_t num_fields)
+{
+    static const uint8_t sizes[] = {2, 4};
+    size_t pos[2], vec;
+    size_t t = fb_table(b, 2, sizes, pos);
+
+    vec = fb_vector(b, num_fields, 4, 4);
+    fb_ref(b, pos[1], vec - 4);
+    for (size_t i = 0; i < num_fields; i++)
+        fb_ref(b, vec + 4 * i, fb_field(b, &fields[i], i));
+    return t;
+}
+
+// table RecordBatch { length, nodes, buffers }
+static size_t fb_record_batch(struct fb *b, int64_t length,
+        const struct arrow_body *body)
+{
+    static const uint8_t sizes[] = {8, 4, 4};
+    size_t pos[3], vec;
+    size_t t = fb_table(b, 3, sizes, pos);
+
+    fb_scalar(b, pos[0], int64_t, length);
+    vec = fb_vector(b, body->num_nodes, 16, 8);
+    memcpy(b->buf + vec, body->nodes, body->num_nodes * 16);
+    fb_ref(b, pos[1], vec - 4);
+    vec = fb_vector(b, body->num_buffers, 16, 8);
+    memcpy(b->buf + vec, body->buffers, body->num_buffers * 16);
+    fb_ref(b, pos[2], vec - 4);
+    return t;
+}
+
+// The root table Message { version, header_type, header, bodyLength }.
+// Returns where the offset to the header goes.
+static size_t fb_message(struct fb *b, uint8_t header_type, int64_t body_len)
+{
+    static const uint8_t sizes[] = {2, 1, 4, 8};
+    size_t pos[4];
+    size_t root = fb_alloc(b, 4, 4);
+    size_t t = fb_table(b, 4, sizes, pos);
+
+    fb_ref(b, root, t);
+    fb_scalar(b, pos[0], int16_t, ARROW_METADATA_V5);
+    fb_scalar(b, pos[1], uint8_t, header_type);
+    fb_scalar(b, pos[3], int64_t, body_len);
+    return pos[2];
+}
+
+static void body_add_node(struct arrow_body *body, int64_t length,
+        int64_t null_count)
+{
+    body->nodes[2 * body->num_nodes] = length;
+    body->nodes[2 * body->num_nodes + 1] = null_count;
+    body->num_nodes++;
+}
+
+// Every body buffer starts on an 8-byte boundary
+static void body_add_buffer(struct arrow_body *body, const void *data,
+        int64_t len)
+{
+    body->data[body->num_buffers] = data;
+    body->buffers[2 * body->num_buffers] = body->len;
+    body->buffers[2 * body->num_buffers + 1] = len;
+    body->num_buffers++;
+    body->len += pad8(len);
+}
+
+static void write_bytes(struct arrow_file *af, const void *data, size_t len)
+{
+    if (len && fwrite(data, 1, len, af->fp) != len)
+    {
+        fprintf(stderr, "\n\nERROR. Could not write the Arrow file.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    af->offset += len;
+}
+
+static void write_padding(struct arrow_file *af, size_t len)
+{
+    static const unsigned char zeros[8];
+    write_bytes(af, zeros, pad8(len) - len);
+}
+
+// Write an encapsulated message: its metadata, then its body. Returns its
+// place in the file for the footer.
+static struct arrow_block write_message(struct arrow_file *af,
+        const struct fb *meta, const struct arrow_body *body)
+{
+    struct arrow_block block = {af->offset, 0, 0, body ? body->len : 0};
+    uint32_t prefix[2] = {ARROW_CONTINUATION, pad8(meta->len)};
+
+    write_bytes(af, prefix, sizeof(prefix));
+    write_bytes(af, meta->buf, meta->len);
+    write_padding(af, meta->len);
+    block.meta_len = sizeof(prefix) + pad8(meta->len);
+
+    for (size_t i = 0; body && i < body->num_buffers; i++)
+    {
+        write_bytes(af, body->data[i], body->buffers[2 * i + 1]);
+        write_padding(af, body->buffers[2 * i + 1]);
+    }
+    return block;
+}
+
+// A DictionaryBatch holding a column's strings
+static void write_dictionary(struct arrow_file *af, size_t id)
+{
+    const struct arrow_field *f = &af->fields[id];
+    struct arrow_body body = {0};
+    struct fb meta = {0};
+    int32_t *offsets = xrealloc(NULL, (f->dict_len + 1) * sizeof(int32_t));
+    char *chars = NULL;
+    size_t len = 0;
+
+    offsets[0] = 0;
+    for (size_t i = 0; i < f->dict_len; i++)
+    {
+        size_t n = strlen(f->dict[i]);
+        chars = xrealloc(chars, len + n + 1);
+        memcpy(chars + len, f->dict[i], n);
+        len += n;
+        offsets[i + 1] = len;
+    }
+
+    body_add_node(&body, f->dict_len, 0);
+    body_add_buffer(&body, NULL, 0);
+    body_add_buffer(&body, offsets, (f->dict_len + 1) * sizeof(int32_t));
+    body_add_buffer(&body, chars, len);
+
+    // table DictionaryBatch { id, data }
+    static const uint8_t sizes[] = {8, 4};
+    size_t pos[2];
+    size_t header = fb_message(&meta, ARROW_HEADER_DICTIONARY, body.len);
+    size_t t = fb_table(&meta, 2, sizes, pos);
+    fb_ref(&meta, header, t);
+    fb_scalar(&meta, pos[0], int64_t, id);
+    fb_ref(&meta, pos[1], fb_record_batch(&meta, f->dict_len, &body));
+
+    af->dicts = xrealloc(af->dicts,
+            (af->num_dicts + 1) * sizeof(struct arrow_block));
+    af->dicts[af->num_dicts++] = write_message(af, &meta, &body);
+
+    free(meta.buf);
+    free(offsets);
+    free(chars);
+}
+
+struct arrow_file *arrow_file_open(FILE *fp, const struct arrow_field *fields,
+        size_t num_fields)
+{
+    struct arrow_file *af = xrealloc(NULL, sizeof(struct arrow_file));
+    struct fb meta = {0};
+
+    if (num_fields > 64)
+    {
+        fprintf(stderr, "\n\nERROR. Too many Arrow columns.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(af, 0, sizeof(*af));
+    af->fp = fp;
+    af->fields = fields;
+    af->num_fields = num_fields;
+
+    write_bytes(af, ARROW_MAGIC, sizeof(ARROW_MAGIC) - 1);
+    write_padding(af, sizeof(ARROW_MAGIC) - 1);
+
+    size_t header = fb_message(&meta, ARROW_HEADER_SCHEMA, 0);
+    fb_ref(&meta, header, fb_schema(&meta, fields, num_fields));
+    write_message(af, &meta, NULL);
+    free(meta.buf);
+
+    // The dictionaries never change, so they all go up front
+    for (size_t i = 0; i < num_fields; i++)
+        if (fields[i].type == ARROW_DICT)
+            write_dictionary(af, i);
+    return af;
+}
+
+void arrow_file_write(struct arrow_file *af, const struct arrow_batch *b)
+{
+    struct arrow_body body = {0};
+    struct fb meta = {0};
+
+    for (size_t i = 0; i < b->num_fields; i++)
+    {
+        const struct arrow_column *c = &b->columns[i];
+        body_add_node(&body, b->num_rows, c->null_count);
+        // Without nulls, the validity bitmap can be left out
+        body_add_buffer(&body, c->validity,
+                c->null_count ? (b->num_rows + 7) / 8 : 0);
+        body_add_buffer(&body, c->values, b->num_rows * c->width);
+    }
+
+    size_t header = fb_message(&meta, ARROW_HEADER_BATCH, body.len);
+    fb_ref(&meta, header, fb_record_batch(&meta, b->num_rows, &body));
+
+    if (af->num_batches == af->max_batches)
+    {
+        af->max_batches = af->max_batches * 2 + 64;
+        af->batches = xrealloc(af->batches,
+                af->max_batches * sizeof(struct arrow_block));
+    }
+    af->batches[af->num_batches++] = write_message(af, &meta, &body);
+    free(meta.buf);
+}
+
+static size_t fb_blocks(struct fb *b, const struct arrow_block *blocks,
+        size_t n)
+{
+    size_t vec = fb_vector(b, n, sizeof(struct arrow_block), 8);
+    memcpy(b->buf + vec, blocks, n * sizeof(struct arrow_block));
+    return vec - 4;
+}
+
+void arrow_file_close(struct arrow_file *af)
+{
+    // The end-of-stream marker, then table Footer { version, schema,
+    // dictionaries, recordBatches }, its length, and the magic again
+    static const uint32_t eos[2] = {ARROW_CONTINUATION, 0};
+    static const uint8_t sizes[] = {2, 4, 4, 4};
+    struct fb footer = {0};
+    size_t pos[4];
+    size_t root = fb_alloc(&footer, 4, 4);
+    size_t t = fb_table(&footer, 4, sizes, pos);
+    int32_t len;
+
+    write_bytes(af, eos, sizeof(eos));
+
+    fb_ref(&footer, root, t);
+    fb_scalar(&footer, pos[0], int16_t, ARROW_METADATA_V5);
+    fb_ref(&footer, pos[1], fb_schema(&footer, af->fields, af->num_fields));
+    fb_ref(&footer, pos[2], fb_blocks(&footer, af->dicts, af->num_dicts));
+    fb_ref(&footer, pos[3], fb_blocks(&footer, af->batches,
+                af->num_batches));
+
+    write_bytes(af, footer.buf, footer.len);
+    len = footer.len;
+    write_bytes(af, &len, sizeof(len));
+    write_bytes(af, ARROW_MAGIC, sizeof(ARROW_MAGIC) - 1);
+    if (fflush(af->fp))
+    {
+        fprintf(stderr, "\n\nERROR. Could not write the Arrow file.\n\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(footer.buf);
+    free(af->dicts);
+    free(af->batches);
+    free(af);
+}
+
+struct arrow_batch *arrow_batch_new(const struct arrow_field *fields,
+        size_t num_fields, size_t max_rows)
+{
+    struct arrow_batch *b = xrealloc(NULL, sizeof(struct arrow_batch));
+
+    b->fields = fields;
+    b->num_fields = num_fields;
+    b->max_rows = max_rows;
+    b->columns = xrealloc(NULL, num_fields * sizeof(struct arrow_column));
+    for (size_t i = 0; i < num_fields; i++)
+    {
+        struct arrow_column *c = &b->columns[i];
+        c->width = type_width(fields[i].type);
+        c->values = xrealloc(NULL, max_rows * c->width);
+        c->validity = xrealloc(NULL, (max_rows + 7) / 8);
+    }
+    arrow_batch_clear(b);
+    return b;
+}
+
+void arrow_batch_clear(struct arrow_batch *b)
+{
+    for (size_t i = 0; i < b->num_fields; i++)
+    {
+        struct arrow_column *c = &b->columns[i];
+        memset(c->validity, 0xff, (b->max_rows + 7) / 8);
+        c->null_count = 0;
+    }
+    b->num_rows = 0;
+}
+
+void arrow_batch_free(struct arrow_batch *b)
+{
+    for (size_t i = 0; i < b->num_fields; i++)
+    {
+        free(b->columns[i].values);
+        free(b->columns[i].validity);
+    }
+    free(b->columns);
+    free(b);
+}
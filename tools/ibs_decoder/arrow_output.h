@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2019 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ */
+#ifndef ARROW_OUTPUT_H
+#define ARROW_OUTPUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Writes Apache Arrow IPC files (also known as Feather V2), which pyarrow,
+// pandas (read_feather) and R's arrow package load without parsing.
+// Only what the decoder needs is supported: little-endian integer columns
+// and string columns dictionary-encoded against a fixed list of strings.
+// Every column is nullable.
+
+enum arrow_type {
+    ARROW_UINT8,
+    ARROW_UINT16,
+    ARROW_UINT32,
+    ARROW_UINT64,
+    ARROW_INT32,
+    ARROW_DICT,         // int8 indices into dict
+};
+
+struct arrow_field {
+    const char *name;
+    enum arrow_type type;
+    const char *const *dict;
+    size_t dict_len;
+};
+
+struct arrow_column {
+    unsigned char *values;
+    unsigned char *validity;    // One bit per row, set if it is not null
+    size_t width;
+    size_t null_count;
+};
+
+// Rows, stored column by column, on their way to becoming a record batch
+struct arrow_batch {
+    const struct arrow_field *fields;
+    size_t num_fields;
+    struct arrow_column *columns;
+    size_t num_rows;
+    size_t max_rows;
+};
+
+struct arrow_batch *arrow_batch_new(const struct arrow_field *fields,
+        size_t num_fields, size_t max_rows);
+void arrow_batch_clear(struct arrow_batch *b);
+void arrow_batch_free(struct arrow_batch *b);
+
+// Fill in a column of the row after the last one, then call
+// arrow_batch_next_row once every column is set.
+static inline void arrow_batch_set(struct arrow_batch *b, size_t col,
+        uint64_t value)
+{
+    struct arrow_column *c = &b->columns[col];
+    unsigned char *dst = c->values + b->num_rows * c->width;
+
+    switch (c->width) {
+        case 1:
+            *dst = value;
+            break;
+        case 2:
+            memcpy(dst, &(uint16_t){value}, 2);
+            break;
+        case 4:
+            memcpy(dst, &(uint32_t){value}, 4);
+            break;
+        default:
+            memcpy(dst, &value, 8);
+            break;
+    }
+}
+
+static inline void arrow_batch_set_null(struct arrow_batch *b, size_t col)
+{
+    struct arrow_column *c = &b->columns[col];
+
+    arrow_batch_set(b, col, 0);
+    c->validity[b->num_rows / 8] &= ~(1 << (b->num_rows % 8));
+    c->null_count++;
+}
+
+static inline void arrow_batch_next_row(struct arrow_batch *b)
+{
+    b->num_rows++;
+}
+
+struct arrow_file;
+
+// Start an Arrow file in fp with these columns. fields must stay valid
+// until arrow_file_close.
+struct arrow_file *arrow_file_open(FILE *fp, const struct arrow_field *fields,
+        size_t num_fields);
+// Write b's rows as one record batch. b must have the file's columns.
+void arrow_file_write(struct arrow_file *af, const struct arrow_batch *b);
+// Write the file's footer. fp is left open.
+void arrow_file_close(struct arrow_file *af);
+
+#endif  /* ARROW_OUTPUT_H */
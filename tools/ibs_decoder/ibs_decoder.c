@@ -12,36 +12,23 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ibs-uapi.h"
+#include "ibs-trace.h"
+#include "ibs-heatmap.h"
+#include "ibs-merge.h"
+#include "arrow_output.h"
 
 static int fam15h_model01h_err717 = 0;
 static int fam14h_err484 = 0;
 
-static inline void print_u8(FILE *outf, uint8_t input) {
-    fprintf(outf, "%" PRIu8 ",", input);
-}
-
-static inline void print_u16(FILE *outf, uint16_t input) {
-    fprintf(outf, "%" PRIu16 ",", input);
-}
-
-static inline void print_u32(FILE *outf, uint32_t input) {
-    fprintf(outf, "%" PRIu32 ",", input);
-}
-
-static inline void print_u64(FILE *outf, uint64_t input) {
-    fprintf(outf, "%" PRIu64 ",", input);
-}
-
-static inline void print_x64(FILE *outf, uint64_t input) {
-    fprintf(outf, "0x%" PRIx64 ",", input);
-}
-
 #define CHECK_ASPRINTF_RET(num_bytes) \
 { \
     if (num_bytes <= 0) \
@@ -63,6 +50,33 @@ FILE *op_in_fp = NULL;
 FILE *op_out_fp = NULL;
 FILE *fetch_in_fp = NULL;
 FILE *fetch_out_fp = NULL;
+// Worker threads for --threads
+static int num_threads = 1;
+// Write Arrow IPC files rather than CSV
+static int arrow_output = 0;
+// Comma-separated column names for --columns, or NULL for all of them
+static char *column_list = NULL;
+// With --heatmap, op samples are also counted per data page, and the
+// table is written here
+static FILE *heatmap_fp = NULL;
+static unsigned int heatmap_page_shift = IBS_HEATMAP_PAGE_4K;
+// With --merge, samples are written in TSC order, given that none is more
+// than merge_window cycles older than one read before it
+static int merge_samples = 0;
+static uint64_t merge_window = 0;
+
+// Samples to keep, from --pid, --tid, --cpu, --user, --kernel, --tsc_start
+// and --tsc_end. An empty list matches everything.
+#define MAX_FILTER_IDS  64
+struct id_list {
+    int ids[MAX_FILTER_IDS];
+    int num;
+};
+static struct sample_filter {
+    struct id_list pids, tids, cpus;
+    int kern_mode;                  // -1 for either mode
+    uint64_t tsc_start, tsc_end;    // Both inclusive
+} filter = { .kern_mode = -1, .tsc_end = UINT64_MAX };
 
 void set_op_in_file(char *opt)
 {
@@ -104,6 +118,72 @@ void set_fetch_out_file(char *opt)
     }
 }
 
+void set_heatmap_file(char *opt)
+{
+    heatmap_fp = fopen(opt, "w");
+    if (heatmap_fp == NULL) {
+        fprintf(stderr, "Cannot fopen Heatmap File: %s\n", opt);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void set_num_threads(char *opt)
+{
+    long n = strtol(opt, NULL, 0);
+    if (n == 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1 || n > 1024)
+    {
+        fprintf(stderr, "Bad number of threads: %s\n", opt);
+        exit(EXIT_FAILURE);
+    }
+    num_threads = n;
+}
+
+void set_id_list(char *opt, struct id_list *list, const char *what)
+{
+    char *tok, *save = NULL;
+    for (tok = strtok_r(opt, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save))
+    {
+        char *end;
+        long id = strtol(tok, &end, 0);
+        if (*end != '\0' || end == tok || id < 0 || id > INT32_MAX ||
+                list->num == MAX_FILTER_IDS)
+        {
+            fprintf(stderr, "Bad %s list: %s\n", what, opt);
+            exit(EXIT_FAILURE);
+        }
+        list->ids[list->num++] = id;
+    }
+}
+
+void set_tsc_bound(char *opt, uint64_t *bound)
+{
+    char *end;
+    errno = 0;
+    *bound = strtoull(opt, &end, 0);
+    if (*end != '\0' || end == opt || errno)
+    {
+        fprintf(stderr, "Bad TSC value: %s\n", opt);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void set_merge_window(char *opt)
+{
+    char *end;
+    errno = 0;
+    merge_window = strtoull(opt, &end, 0);
+    if (*end != '\0' || end == opt || errno)
+    {
+        fprintf(stderr, "Bad merge window: %s\n", opt);
+        exit(EXIT_FAILURE);
+    }
+    merge_samples = 1;
+}
+
 void parse_args(int argc, char *argv[])
 {
     static struct option longopts[] =
@@ -112,12 +192,26 @@ void parse_args(int argc, char *argv[])
         {"op_out_file", required_argument, NULL, 'o'},
         {"fetch_in_file", required_argument, NULL, 'f'},
         {"fetch_out_file", required_argument, NULL, 'g'},
+        {"threads", required_argument, NULL, 't'},
+        {"arrow", no_argument, NULL, 'a'},
+        {"columns", required_argument, NULL, 'C'},
+        {"pid", required_argument, NULL, 'p'},
+        {"tid", required_argument, NULL, 'T'},
+        {"cpu", required_argument, NULL, 'c'},
+        {"user", no_argument, NULL, 'u'},
+        {"kernel", no_argument, NULL, 'k'},
+        {"tsc_start", required_argument, NULL, 's'},
+        {"tsc_end", required_argument, NULL, 'e'},
+        {"heatmap", required_argument, NULL, 'N'},
+        {"heatmap_2m", no_argument, NULL, 'B'},
+        {"merge", required_argument, NULL, 'm'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
 
     char c;
-    while ((c = getopt_long(argc, argv, "+hi:o:f:g:", longopts, NULL)) != -1)
+    while ((c = getopt_long(argc, argv, "+hi:o:f:g:t:aC:p:T:c:uks:e:N:Bm:",
+                    longopts, NULL)) != -1)
     {
         switch (c) {
             case 'h':
@@ -135,6 +229,44 @@ void parse_args(int argc, char *argv[])
                 fprintf(stderr, "       File with IBS fetch samples from the monitor program.\n");
                 fprintf(stderr, "--fetch_out_file (or -g):\n");
                 fprintf(stderr, "       CSV file to output decoded IBS fetch trace.\n");
+                fprintf(stderr, "--threads (or -t):\n");
+                fprintf(stderr, "       Decode on this many threads, or 0 for one per CPU.\n");
+                fprintf(stderr, "       The output is the same as with one. Format 2 traces\n");
+                fprintf(stderr, "       (--compress) are always decoded on one thread.\n");
+                fprintf(stderr, "--arrow (or -a):\n");
+                fprintf(stderr, "       Write the *_out_file outputs as Arrow IPC (Feather V2)\n");
+                fprintf(stderr, "       files rather than CSV. Columns are named as in the CSV\n");
+                fprintf(stderr, "       header, integers are typed, \"-\" becomes null, and\n");
+                fprintf(stderr, "       string columns are dictionary-encoded.\n");
+                fprintf(stderr, "--columns (or -C):\n");
+                fprintf(stderr, "       Comma-separated names of the columns to write, in that\n");
+                fprintf(stderr, "       order, e.g. TSC,PID,IbsOpRip,IbsDcLinAd. Only the trace\n");
+                fprintf(stderr, "       fields those columns come from are decoded. Cells are\n");
+                fprintf(stderr, "       plain numbers (or the --arrow strings).\n");
+                fprintf(stderr, "--pid (or -p), --tid (or -T), --cpu (or -c):\n");
+                fprintf(stderr, "       Only write samples from these comma-separated PIDs,\n");
+                fprintf(stderr, "       TIDs or CPUs.\n");
+                fprintf(stderr, "--user (or -u), --kernel (or -k):\n");
+                fprintf(stderr, "       Only write samples taken in user or kernel mode.\n");
+                fprintf(stderr, "--tsc_start (or -s), --tsc_end (or -e):\n");
+                fprintf(stderr, "       Only write samples with TSCs from tsc_start through\n");
+                fprintf(stderr, "       tsc_end. Format 3 traces skip chunks that lie outside\n");
+                fprintf(stderr, "       the TSC range or the PID list without decoding them.\n");
+                fprintf(stderr, "--heatmap (or -N):\n");
+                fprintf(stderr, "       Also count the op samples' loads, stores, DC misses and\n");
+                fprintf(stderr, "       latencies per 4K data page, linear and physical, with\n");
+                fprintf(stderr, "       the NUMA nodes of the sampling CPUs and of the memory,\n");
+                fprintf(stderr, "       into this binary file of sorted tables (see\n");
+                fprintf(stderr, "       ibs-heatmap.h). Nodes come from this machine's sysfs.\n");
+                fprintf(stderr, "       The filters apply. With it, --op_out_file is optional.\n");
+                fprintf(stderr, "--heatmap_2m (or -B):\n");
+                fprintf(stderr, "       Count --heatmap samples per 2M page rather than 4K.\n");
+                fprintf(stderr, "--merge (or -m) {# cycles}:\n");
+                fprintf(stderr, "       Write samples in TSC order across CPUs, holding each until\n");
+                fprintf(stderr, "       one this many TSC cycles newer has been read. Samples that\n");
+                fprintf(stderr, "       are further out of order are written late and counted.\n");
+                fprintf(stderr, "       Twice ibs_monitor's poll_timeout is plenty. Decodes on\n");
+                fprintf(stderr, "       one thread.\n");
                 fprintf(stderr, "If you skip either of the input arguments, that IBS sample type will be ignored.\n");
                 fprintf(stderr, "You cannot skip the *_out_file argument when you have an input file.\n\n");
                 exit(EXIT_SUCCESS);
@@ -150,6 +282,45 @@ void parse_args(int argc, char *argv[])
             case 'g':
                 set_fetch_out_file(optarg);
                 break;
+            case 't':
+                set_num_threads(optarg);
+                break;
+            case 'a':
+                arrow_output = 1;
+                break;
+            case 'C':
+                column_list = optarg;
+                break;
+            case 'p':
+                set_id_list(optarg, &filter.pids, "PID");
+                break;
+            case 'T':
+                set_id_list(optarg, &filter.tids, "TID");
+                break;
+            case 'c':
+                set_id_list(optarg, &filter.cpus, "CPU");
+                break;
+            case 'u':
+                filter.kern_mode = 0;
+                break;
+            case 'k':
+                filter.kern_mode = 1;
+                break;
+            case 's':
+                set_tsc_bound(optarg, &filter.tsc_start);
+                break;
+            case 'e':
+                set_tsc_bound(optarg, &filter.tsc_end);
+                break;
+            case 'N':
+                set_heatmap_file(optarg);
+                break;
+            case 'B':
+                heatmap_page_shift = IBS_HEATMAP_PAGE_2M;
+                break;
+            case 'm':
+                set_merge_window(optarg);
+                break;
             default:
                 fprintf(stderr, "Found this bad argument: %s\n", argv[optind]);
                 break;
@@ -160,7 +331,7 @@ void parse_args(int argc, char *argv[])
     {
         fprintf(stderr, "\n\nWARNING. No input files given.\n\n");
     }
-    if (op_in_fp != NULL && op_out_fp == NULL)
+    if (op_in_fp != NULL && op_out_fp == NULL && heatmap_fp == NULL)
     {
         fprintf(stderr, "\n\nERROR. There is an Op input file, ");
         fprintf(stderr, "but no Op output file target.\n\n");
@@ -172,6 +343,12 @@ void parse_args(int argc, char *argv[])
         fprintf(stderr, "but no Fetch output file target.\n\n");
         exit(EXIT_FAILURE);
     }
+    // Blocks are decoded apart, but the merge has to see them in order
+    if (merge_samples && num_threads > 1)
+    {
+        fprintf(stderr, "WARNING. --merge decodes on one thread.\n");
+        num_threads = 1;
+    }
 }
 
 #define header_parse(string, target) \
@@ -189,7 +366,8 @@ void parse_op_in_header(uint32_t *family, uint32_t *model, int *brn_resync,
         int *rip_invalid_chk, int *op_brn_fuse, int *ibs_op_data_4,
         int *microcode, int *ibs_op_data2_4_5, int *dc_ld_bnk_con,
         int *dc_st_bnk_con, int *dc_st_to_ld_fwd, int *dc_st_to_ld_can,
-        int *ibs_data3_20_31_48_63)
+        int *ibs_data3_20_31_48_63, uint32_t *version, uint64_t *fields,
+        uint32_t *format)
 {
     char line[256];
     memset(line, 0, sizeof(line));
@@ -207,6 +385,9 @@ void parse_op_in_header(uint32_t *family, uint32_t *model, int *brn_resync,
         int done_checking = 0;
         header_parse("AMD Processor Family:", family);
         header_parse("AMD Processor Model:", model);
+        header_parse("IBS Op Structure Version:", version);
+        header_parse("IBS Op Field Mask:", fields);
+        header_parse("IBS Trace Format:", format);
         header_parse("IbsOpBrnResync:", brn_resync);
         header_parse("IbsOpMispReturn:", misp_return);
         header_parse("BrnTrgt:", brn_target);
@@ -231,7 +412,8 @@ void parse_op_in_header(uint32_t *family, uint32_t *model, int *brn_resync,
 }
 
 void parse_fetch_in_header(uint32_t *family, uint32_t *model,
-        int *fetch_ctl_ext)
+        int *fetch_ctl_ext, uint32_t *version, uint64_t *fields,
+        uint32_t *format)
 {
     char line[256];
     memset(line, 0, sizeof(line));
@@ -249,10 +431,102 @@ void parse_fetch_in_header(uint32_t *family, uint32_t *model,
         int done_checking = 0;
         header_parse("AMD Processor Family:", family);
         header_parse("AMD Processor Model:", model);
+        header_parse("IBS Fetch Structure Version:", version);
+        header_parse("IBS Fetch Field Mask:", fields);
+        header_parse("IBS Trace Format:", format);
         header_parse("IbsFetchCtlExtd:", fetch_ctl_ext);
     }
 }
 
+// Expand a packed record into a full struct. Fields that were not recorded
+// are left as zero.
+static void unpack_record(const char *record, uint64_t fields,
+        const uint64_t *order, size_t num_fields, void *out)
+{
+    char *dst = out;
+    for (size_t i = 0; i < num_fields; i++)
+    {
+        size_t len = (order[i] & IBS_FIELDS_NARROW) ? 4 : 8;
+        if (fields & order[i])
+        {
+            memcpy(dst, record, len);
+            record += len;
+        }
+        else
+            memset(dst, 0, len);
+        dst += len;
+    }
+}
+
+// Read the next sample, in whatever layout the trace header described, into
+// a full struct of full_size bytes. trace is set up for format 2 traces.
+static size_t read_record(FILE *in_fp, ibs_trace_reader_t *trace, void *out,
+        size_t full_size, uint64_t fields, uint64_t all_fields,
+        const uint64_t *order, size_t num_fields)
+{
+    char record[sizeof(ibs_op_t)];
+
+    if (trace != NULL)
+    {
+        int ret = ibs_trace_read(trace, in_fp, out);
+        if (ret < 0)
+        {
+            fprintf(stderr, "\n\nERROR. The trace is damaged after this ");
+            fprintf(stderr, "point; stopping here.\n\n");
+            return 0;
+        }
+        return ret;
+    }
+
+    if (fields == all_fields)
+        return fread(out, full_size, 1, in_fp);
+
+    if (fread(record, ibs_sample_entry_size(fields), 1, in_fp) != 1)
+        return 0;
+    unpack_record(record, fields, order, num_fields, out);
+    return 1;
+}
+
+static void check_record_format(uint32_t version, uint32_t max_version,
+        uint64_t fields, uint64_t all_fields, uint32_t format,
+        const char *flavor)
+{
+    if (format == 0 || format > IBS_TRACE_FORMAT)
+    {
+        fprintf(stderr, "\n\nERROR. %s trace uses trace format %u, ",
+                flavor, format);
+        fprintf(stderr, "but this decoder only understands up to %u.\n\n",
+                IBS_TRACE_FORMAT);
+        exit(EXIT_FAILURE);
+    }
+    if (version > max_version)
+    {
+        fprintf(stderr, "\n\nERROR. %s trace uses structure version %u, ",
+                flavor, version);
+        fprintf(stderr, "but this decoder only understands up to %u.\n\n",
+                max_version);
+        exit(EXIT_FAILURE);
+    }
+    if (fields == 0 || (fields & ~all_fields))
+    {
+        fprintf(stderr, "\n\nERROR. %s trace has a bad field mask: ", flavor);
+        fprintf(stderr, "0x%" PRIx64 "\n\n", fields);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Format 3 traces are read out of memory, starting just after the header
+static void map_trace(ibs_trace_reader_t *trace, FILE *in_fp, int is_op)
+{
+    off_t off = ftello(in_fp);
+    if (off < 0 || ibs_trace_reader_map(trace, fileno(in_fp), off, is_op))
+    {
+        fprintf(stderr, "\n\nERROR. Could not map the trace: %s\n\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
 static void output_common_header(FILE *outf)
 {
     print_hdr(outf, "%s,%s,%s,%s,%s,", "TSC", "CPU_Number",
@@ -409,274 +683,1591 @@ static void output_fetch_header(FILE *outf, uint32_t fam, uint32_t model,
     print_hdr(outf, "%s", "\n");
 }
 
-void output_op_entry(FILE *outf, ibs_op_t op, uint32_t family,
-        uint32_t model, int brn_resync, int misp_return, int brn_trgt,
-        int op_cnt_ext, int rip_invalid_chk, int op_brn_fuse,
-        int ibs_op_data_4, int microcode, int ibs_op_data2_4_5,
-        int dc_ld_bnk_con, int dc_st_bnk_con, int dc_st_to_ld_fwd,
-        int dc_st_to_ld_can, int ibs_data3_20_31_48_63)
+// The op header's feature flags
+struct op_format {
+    uint32_t family, model;
+    int brn_resync, misp_return, brn_trgt, op_cnt_ext;
+    int rip_invalid_chk, op_brn_fuse, ibs_op_data_4, microcode;
+    int ibs_op_data2_4_5, dc_ld_bnk_con, dc_st_bnk_con;
+    int dc_st_to_ld_fwd, dc_st_to_ld_can, ibs_data3_20_31_48_63;
+};
+
+// The fetch header's feature flags
+struct fetch_format {
+    uint32_t family, model;
+    int fetch_ctl_ext;
+};
+
+// Samples are turned into CSV by a list of column routines, picked once
+// per trace from its header, so the per-sample work does not look at the
+// feature flags again. Each routine writes one or more "value," cells.
+struct csv_format;
+typedef char *(*csv_column_fn)(char *p, const void *record,
+        const struct csv_format *f);
+
+#define CSV_MAX_COLUMNS 32
+// More than the longest line any op or fetch sample turns into
+#define CSV_MAX_LINE    2048
+// CSV text buffered up before each write to the output file
+#define CSV_BUF_SIZE    (1 << 20)
+
+struct csv_format {
+    csv_column_fn columns[CSV_MAX_COLUMNS];
+    size_t num_columns;
+    // For the few columns whose meaning depends on the family
+    uint32_t family;
+    int local_l3;               // NbIbsReqSrc 1 is the local L3
+    int l2_miss_valid;          // IbsOpData3 has IbsL2Miss
+    int op_data2_4_5;
+};
+
+static void add_column(struct csv_format *f, csv_column_fn fn)
+{
+    f->columns[f->num_columns++] = fn;
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+static const char hex_digits[] = "0123456789abcdef";
+
+static inline char *put_u64(char *p, uint64_t v)
 {
-    // Common stuff
-    print_u64(outf, op.tsc);
-    fprintf(outf, "%d,%d,%d,%d,", op.cpu, op.tid, op.pid,
-            op.kern_mode);
+    char tmp[20];
+    char *t = tmp + sizeof(tmp);
 
+    while (v >= 100)
+    {
+        t -= 2;
+        memcpy(t, &digit_pairs[(v % 100) * 2], 2);
+        v /= 100;
+    }
+    if (v >= 10)
+    {
+        t -= 2;
+        memcpy(t, &digit_pairs[v * 2], 2);
+    }
+    else
+        *--t = '0' + v;
+
+    memcpy(p, t, tmp + sizeof(tmp) - t);
+    p += tmp + sizeof(tmp) - t;
+    *p++ = ',';
+    return p;
+}
+
+static inline char *put_int(char *p, int v)
+{
+    if (v >= 0)
+        return put_u64(p, v);
+    *p++ = '-';
+    return put_u64(p, -(int64_t)v);
+}
+
+static inline char *put_x64(char *p, uint64_t v)
+{
+    int digits = v ? (67 - __builtin_clzll(v)) / 4 : 1;
+
+    *p++ = '0';
+    *p++ = 'x';
+    for (int i = digits - 1; i >= 0; i--)
+    {
+        p[i] = hex_digits[v & 0xf];
+        v >>= 4;
+    }
+    p += digits;
+    *p++ = ',';
+    return p;
+}
+
+#define put_str(p, s) (memcpy(p, s, sizeof(s) - 1), (p) + sizeof(s) - 1)
+
+static inline char *put_reserved(char *p, uint64_t v)
+{
+    p = put_str(p, "Reserved-");
+    return put_u64(p, v);
+}
+
+static inline char *put_common(char *p, uint64_t tsc, int cpu, int tid,
+        int pid, int kern_mode)
+{
+    p = put_u64(p, tsc);
+    p = put_int(p, cpu);
+    p = put_int(p, tid);
+    p = put_int(p, pid);
+    return put_int(p, kern_mode);
+}
+
+#define OP_COLUMN(name) \
+static char *name(char *p, const void *record, const struct csv_format *f) \
+{ \
+    const ibs_op_t *op = record; \
+    (void)f;
+#define FETCH_COLUMN(name) \
+static char *name(char *p, const void *record, const struct csv_format *f) \
+{ \
+    const ibs_fetch_t *fetch = record; \
+    (void)f;
+#define END_COLUMN \
+    return p; \
+}
+
+OP_COLUMN(op_common)
+    p = put_common(p, op->tsc, op->cpu, op->tid, op->pid, op->kern_mode);
     // IbsOpRip / IBS_OP_RIP
-    print_x64(outf, op.op_rip);
+    p = put_x64(p, op->op_rip);
+END_COLUMN
+
+// Data on sampling rate
+OP_COLUMN(op_max_cnt)
+    p = put_u64(p, (uint32_t)(op->op_ctl.reg.ibs_op_max_cnt << 4));
+END_COLUMN
+OP_COLUMN(op_max_cnt_ext)
+    p = put_u64(p, (uint32_t)((op->op_ctl.reg.ibs_op_max_cnt_upper << 20) +
+                (op->op_ctl.reg.ibs_op_max_cnt << 4)));
+END_COLUMN
+
+// IbsOpData / IBS_OP_DATA
+OP_COLUMN(op_data_ctrs)
+    p = put_u64(p, op->op_data.reg.ibs_comp_to_ret_ctr);
+    p = put_u64(p, op->op_data.reg.ibs_tag_to_ret_ctr);
+END_COLUMN
+OP_COLUMN(op_brn_resync)
+    p = put_u64(p, op->op_data.reg.ibs_op_brn_resync);
+END_COLUMN
+OP_COLUMN(op_misp_return)
+    p = put_u64(p, op->op_data.reg.ibs_op_misp_return);
+END_COLUMN
+OP_COLUMN(op_data_brn)
+    // The IbsOpReturn column has always held IbsOpBrnRet
+    p = put_u64(p, op->op_data.reg.ibs_op_brn_ret);
+    p = put_u64(p, op->op_data.reg.ibs_op_brn_taken);
+    p = put_u64(p, op->op_data.reg.ibs_op_brn_misp);
+    p = put_u64(p, op->op_data.reg.ibs_op_brn_ret);
+END_COLUMN
+OP_COLUMN(op_rip_invalid)
+    p = put_u64(p, op->op_data.reg.ibs_rip_invalid);
+END_COLUMN
+OP_COLUMN(op_brn_fuse)
+    p = put_u64(p, op->op_data.reg.ibs_op_brn_fuse);
+END_COLUMN
+OP_COLUMN(op_microcode)
+    p = put_u64(p, op->op_data.reg.ibs_op_microcode);
+END_COLUMN
+
+// IbsOpData2 / IBS_OP_DATA2
+// This register is only valid for load operations that miss in
+// both the L1 and L2. However, until KV+ and BT+, IBS could not
+// tell us if an access was an L2 miss.
+// The first case, we support checking L2, so check all the three things.
+// In the second case, we can't read L2, so go ahead if it's a load
+// L1 miss
+static inline char *put_op_data2(char *p, const ibs_op_t *op,
+        const struct csv_format *f, int err484)
+{
+    if (!op->op_data3.reg.ibs_ld_op || !op->op_data3.reg.ibs_dc_miss ||
+            (f->l2_miss_valid && !op->op_data3.reg.ibs_l2_miss) ||
+            (err484 && op->op_data3.reg.ibs_dc_wc_mem_acc))
+        return put_str(p, "-,-,-,");
+
+    switch (op->op_data2.reg.ibs_nb_req_src) {
+        case 0:
+            p = put_str(p, "-,");
+            break;
+        case 1:
+            if (f->local_l3)
+                p = put_str(p, "local_L3,");
+            else
+                p = put_reserved(p, op->op_data2.reg.ibs_nb_req_src);
+            break;
+        case 2:
+            p = put_str(p, "other_core_cache,");
+            break;
+        case 3:
+            p = put_str(p, "DRAM,");
+            break;
+        case 7:
+            p = put_str(p, "Other,");
+            break;
+        default:
+            p = put_reserved(p, op->op_data2.reg.ibs_nb_req_src);
+            break;
+    }
+    if (f->op_data2_4_5)
+    {
+        // This is only valid if the NbIbsReqSrc != 0
+        if (op->op_data2.reg.ibs_nb_req_src == 0)
+            p = put_str(p, "-,");
+        else if (op->op_data2.reg.ibs_nb_req_dst_node == 1)
+            p = put_str(p, "other_node,");
+        else
+            p = put_str(p, "same_node,");
 
-    // Data on sampling rate
-    uint32_t op_max_cnt = 0;
-    if (op_cnt_ext)
-        op_max_cnt = op.op_ctl.reg.ibs_op_max_cnt_upper << 20;
-    op_max_cnt += (op.op_ctl.reg.ibs_op_max_cnt << 4);
-    print_u32(outf, op_max_cnt);
+        // This is only valid when NbIbsReqSrc == 2
+        if (op->op_data2.reg.ibs_nb_req_src != 2)
+            p = put_str(p, "-,");
+        else if (op->op_data2.reg.ibs_nb_req_cache_hit_st == 1)
+            p = put_str(p, "O,");
+        else
+            p = put_str(p, "M,");
+    }
+    return p;
+}
+OP_COLUMN(op_data2)
+    p = put_op_data2(p, op, f, 0);
+END_COLUMN
+OP_COLUMN(op_data2_err484)
+    p = put_op_data2(p, op, f, 1);
+END_COLUMN
+
+// IbsOpData3 / IBS_OP_DATA3
+OP_COLUMN(op_data3_dc)
+    p = put_u64(p, op->op_data3.reg.ibs_ld_op);
+    p = put_u64(p, op->op_data3.reg.ibs_st_op);
+    p = put_u64(p, op->op_data3.reg.ibs_dc_l1_tlb_miss);
+    p = put_u64(p, op->op_data3.reg.ibs_dc_l2_tlb_miss);
+    p = put_u64(p, op->op_data3.reg.ibs_dc_l1_tlb_hit_2m);
+    p = put_u64(p, op->op_data3.reg.ibs_dc_l1_tlb_hit_1g);
+    p = put_u64(p, op->op_data3.reg.ibs_dc_l2_tlb_hit_2m);
+    p = put_u64(p, op->op_data3.reg.ibs_dc_miss);
+    p = put_u64(p, op->op_data3.reg.ibs_dc_miss_acc);
+END_COLUMN
+OP_COLUMN(op_ld_bnk_con)
+    p = put_u64(p, op->op_data3.reg.ibs_dc_ld_bank_con);
+END_COLUMN
+OP_COLUMN(op_st_bnk_con)
+    p = put_u64(p, op->op_data3.reg.ibs_dc_st_bank_con);
+END_COLUMN
+OP_COLUMN(op_st_to_ld_fwd)
+    p = put_u64(p, op->op_data3.reg.ibs_dc_st_to_ld_fwd);
+END_COLUMN
+OP_COLUMN(op_st_to_ld_can)
+    p = put_u64(p, op->op_data3.reg.ibs_dc_st_to_ld_can);
+END_COLUMN
+OP_COLUMN(op_data3_mem)
+    p = put_u64(p, op->op_data3.reg.ibs_dc_wc_mem_acc);
+    p = put_u64(p, op->op_data3.reg.ibs_dc_uc_mem_acc);
+    p = put_u64(p, op->op_data3.reg.ibs_dc_locked_op);
+END_COLUMN
+OP_COLUMN(op_no_mab_alloc)
+    p = put_u64(p, op->op_data3.reg.ibs_dc_no_mab_alloc);
+END_COLUMN
+OP_COLUMN(op_no_mab_alloc_err717)
+    if (op->op_data3.reg.ibs_dc_miss)
+        p = put_str(p, "0,");
+    else
+        p = put_u64(p, op->op_data3.reg.ibs_dc_no_mab_alloc);
+END_COLUMN
+OP_COLUMN(op_data3_valid)
+    p = put_u64(p, op->op_data3.reg.ibs_lin_addr_valid);
+    p = put_u64(p, op->op_data3.reg.ibs_phy_addr_valid);
+    p = put_u64(p, op->op_data3.reg.ibs_dc_l2_tlb_hit_1g);
+END_COLUMN
+OP_COLUMN(op_data3_ext)
+    p = put_u64(p, op->op_data3.reg.ibs_l2_miss);
+    p = put_u64(p, op->op_data3.reg.ibs_sw_pf);
+    switch(op->op_data3.reg.ibs_op_mem_width)
+    {
+        case 0:
+            p = put_str(p, "0,");
+            break;
+        case 1:
+            p = put_str(p, "1,");
+            break;
+        case 2:
+            p = put_str(p, "2,");
+            break;
+        case 3:
+            p = put_str(p, "4,");
+            break;
+        case 4:
+            p = put_str(p, "8,");
+            break;
+        case 5:
+            p = put_str(p, "16,");
+            break;
+        default:
+            p = put_reserved(p, op->op_data3.reg.ibs_op_mem_width);
+            break;
+    }
+    p = put_u64(p, op->op_data3.reg.ibs_op_dc_miss_open_mem_reqs);
+END_COLUMN
+OP_COLUMN(op_miss_lat)
+    p = put_u64(p, op->op_data3.reg.ibs_dc_miss_lat);
+END_COLUMN
+OP_COLUMN(op_tlb_refill_lat)
+    p = put_u64(p, op->op_data3.reg.ibs_tlb_refill_lat);
+END_COLUMN
+
+// IbsDcLinAd / IBS_DC_LINADDR and IbsDcPhsAd / IBS_DC_PHYSADDR
+OP_COLUMN(op_dc_addrs)
+    if (op->op_data3.reg.ibs_lin_addr_valid)
+        p = put_x64(p, op->dc_lin_ad);
+    else
+        p = put_str(p, "-,");
+    if (op->op_data3.reg.ibs_phy_addr_valid)
+        p = put_x64(p, op->dc_phys_ad.reg.ibs_dc_phys_addr);
+    else
+        p = put_str(p, "-,");
+END_COLUMN
+OP_COLUMN(op_brn_target)
+    if (op->op_data.reg.ibs_op_brn_ret)
+        p = put_x64(p, op->br_target);
+    else
+        p = put_str(p, "-,");
+END_COLUMN
+OP_COLUMN(op_ld_resync)
+    p = put_u64(p, op->op_data4.reg.ibs_op_ld_resync);
+END_COLUMN
+
+// The columns of output_op_header, for a trace with these features
+static void build_op_csv(struct csv_format *f, const struct op_format *h)
+{
+    memset(f, 0, sizeof(*f));
+    f->family = h->family;
+    f->local_l3 = h->family == 0x10 ||
+        (h->family == 0x15 && h->model < 0x10);
+    f->l2_miss_valid = h->ibs_data3_20_31_48_63;
+    f->op_data2_4_5 = h->ibs_op_data2_4_5;
+
+    add_column(f, op_common);
+    add_column(f, h->op_cnt_ext ? op_max_cnt_ext : op_max_cnt);
+    add_column(f, op_data_ctrs);
+    if (h->brn_resync)
+        add_column(f, op_brn_resync);
+    if (h->misp_return)
+        add_column(f, op_misp_return);
+    add_column(f, op_data_brn);
+    if (h->rip_invalid_chk)
+        add_column(f, op_rip_invalid);
+    if (h->op_brn_fuse)
+        add_column(f, op_brn_fuse);
+    if (h->microcode)
+        add_column(f, op_microcode);
+    add_column(f, fam14h_err484 ? op_data2_err484 : op_data2);
+    add_column(f, op_data3_dc);
+    if (h->dc_ld_bnk_con)
+        add_column(f, op_ld_bnk_con);
+    if (h->dc_st_bnk_con)
+        add_column(f, op_st_bnk_con);
+    if (h->dc_st_to_ld_fwd)
+        add_column(f, op_st_to_ld_fwd);
+    if (h->dc_st_to_ld_can)
+        add_column(f, op_st_to_ld_can);
+    add_column(f, op_data3_mem);
+    add_column(f, fam15h_model01h_err717 ? op_no_mab_alloc_err717 :
+            op_no_mab_alloc);
+    add_column(f, op_data3_valid);
+    if (h->ibs_data3_20_31_48_63)
+        add_column(f, op_data3_ext);
+    add_column(f, op_miss_lat);
+    if (h->ibs_data3_20_31_48_63)
+        add_column(f, op_tlb_refill_lat);
+    add_column(f, op_dc_addrs);
+    if (h->brn_trgt)
+        add_column(f, op_brn_target);
+    if (h->ibs_op_data_4)
+        add_column(f, op_ld_resync);
+}
 
-    // IbsOpData / IBS_OP_DATA
-    print_u16(outf, op.op_data.reg.ibs_comp_to_ret_ctr);
-    print_u16(outf, op.op_data.reg.ibs_tag_to_ret_ctr);
-    if (brn_resync)
-        print_u8(outf, op.op_data.reg.ibs_op_brn_resync);
-    if (misp_return)
-        print_u8(outf, op.op_data.reg.ibs_op_misp_return);
-    print_u8(outf, op.op_data.reg.ibs_op_brn_ret);
-    print_u8(outf, op.op_data.reg.ibs_op_brn_taken);
-    print_u8(outf, op.op_data.reg.ibs_op_brn_misp);
-    print_u8(outf, op.op_data.reg.ibs_op_brn_ret);
-    if (rip_invalid_chk)
-        print_u8(outf, op.op_data.reg.ibs_rip_invalid);
-    if (op_brn_fuse)
-        print_u8(outf, op.op_data.reg.ibs_op_brn_fuse);
-    if (microcode)
-        print_u8(outf, op.op_data.reg.ibs_op_microcode);
+FETCH_COLUMN(fetch_common)
+    p = put_common(p, fetch->tsc, fetch->cpu, fetch->tid, fetch->pid,
+            fetch->kern_mode);
 
-    // IbsOpData2 / IBS_OP_DATA2
-    // This register is only valid for load operations that miss in
-    // both the L1 and L2. However, until KV+ and BT+, IBS could not
-    // tell us if an access was an L2 miss.
-    // The first case, we support checking L2, so check all the three things.
-    // In the second case, we can't read L2, so go ahead if it's a load
-    // L1 miss
-    if ((ibs_data3_20_31_48_63 && op.op_data3.reg.ibs_ld_op &&
-            op.op_data3.reg.ibs_l2_miss && op.op_data3.reg.ibs_dc_miss)
-        ||
-        (!ibs_data3_20_31_48_63 && op.op_data3.reg.ibs_ld_op &&
-        op.op_data3.reg.ibs_dc_miss))
-    {
-        if (fam14h_err484 && op.op_data3.reg.ibs_dc_wc_mem_acc)
-            fprintf(outf, "-,-,-,");
+    // IBS_FETCH_CTL_PHYADDR_VALID, IBS_DC_LINADDR, and IBS_DC_PHYSADDR
+    p = put_u64(p, fetch->fetch_ctl.reg.ibs_phy_addr_valid);
+    p = put_x64(p, fetch->fetch_lin_ad);
+    if (fetch->fetch_ctl.reg.ibs_phy_addr_valid)
+        p = put_x64(p, fetch->fetch_phys_ad.reg.ibs_fetch_phy_addr);
+    else
+        p = put_str(p, "-,");
+
+    // IbsFetchCtl / IBS_FETCH_CTL
+    // Every generation of IBS Fetch has these columns.
+    p = put_u64(p, (uint32_t)(fetch->fetch_ctl.reg.ibs_fetch_max_cnt << 4));
+    p = put_u64(p, fetch->fetch_ctl.reg.ibs_fetch_lat);
+    p = put_u64(p, fetch->fetch_ctl.reg.ibs_fetch_comp);
+    p = put_u64(p, fetch->fetch_ctl.reg.ibs_ic_miss);
+
+    if (!fetch->fetch_ctl.reg.ibs_phy_addr_valid)
+        p = put_str(p, "-,");
+    else switch (fetch->fetch_ctl.reg.ibs_l1_tlb_pg_sz) {
+        case 0:
+            p = put_str(p, "4 KB,");
+            break;
+        case 1:
+            p = put_str(p, "2 MB,");
+            break;
+        case 2:
+            p = put_str(p, "1 GB,");
+            break;
+        case 3:
+            if (f->family == 0x17)
+            {
+                p = put_str(p, "16 KB,");
+                break;
+            }
+            /* Fallthrough */
+        default:
+            p = put_reserved(p, fetch->fetch_ctl.reg.ibs_l1_tlb_pg_sz);
+            break;
+    }
+
+    p = put_u64(p, fetch->fetch_ctl.reg.ibs_l1_tlb_miss);
+    p = put_u64(p, fetch->fetch_ctl.reg.ibs_l2_tlb_miss);
+END_COLUMN
+FETCH_COLUMN(fetch_l2_miss)
+    p = put_u64(p, fetch->fetch_ctl.reg.ibs_fetch_l2_miss);
+END_COLUMN
+// IBS_EXTD_CTL
+FETCH_COLUMN(fetch_itlb_refill_lat)
+    if (fetch->fetch_ctl.reg.ibs_fetch_comp)
+        p = put_u64(p, fetch->fetch_ctl_extd.reg.ibs_itlb_refill_lat);
+    else
+        p = put_str(p, "-,");
+END_COLUMN
+
+// The columns of output_fetch_header, for a trace with these features
+static void build_fetch_csv(struct csv_format *f,
+        const struct fetch_format *h)
+{
+    memset(f, 0, sizeof(*f));
+    f->family = h->family;
+
+    add_column(f, fetch_common);
+    // Only CZ, ST, and ZN have this field, but there is no CPUID for it.
+    if ((h->family == 0x15 && h->model >= 0x60) || h->family == 0x17)
+        add_column(f, fetch_l2_miss);
+    if (h->fetch_ctl_ext)
+        add_column(f, fetch_itlb_refill_lat);
+}
+
+// CSV text on its way to outf, or with outf NULL, held until the caller
+// writes it out (the buffer then grows as needed)
+struct csv_buf {
+    char *data;
+    size_t len;
+    size_t size;
+    FILE *outf;
+};
+
+static void csv_buf_init(struct csv_buf *b, FILE *outf)
+{
+    b->data = malloc(CSV_BUF_SIZE);
+    if (b->data == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Could not allocate an output buffer.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    b->len = 0;
+    b->size = CSV_BUF_SIZE;
+    b->outf = outf;
+}
+
+static void csv_buf_flush(struct csv_buf *b)
+{
+    if (b->len)
+        fwrite(b->data, 1, b->len, b->outf);
+    b->len = 0;
+}
+
+static void csv_buf_fini(struct csv_buf *b)
+{
+    if (b->outf != NULL)
+        csv_buf_flush(b);
+    free(b->data);
+    b->data = NULL;
+}
+
+// Format one sample as a line of CSV at the end of b
+// Make room in b for one more line
+static char *csv_buf_line(struct csv_buf *b)
+{
+    if (b->size - b->len < CSV_MAX_LINE)
+    {
+        if (b->outf != NULL)
+            csv_buf_flush(b);
         else
         {
-            switch (op.op_data2.reg.ibs_nb_req_src) {
-                case 0:
-                    fprintf(outf, "-,");
-                    break;
-                case 1:
-                    if (family == 0x10 || (family == 0x15 && model < 0x10))
-                        fprintf(outf, "local_L3,");
-                    else
-                    {
-                        fprintf(outf, "Reserved-%" PRIu8 ",",
-                                op.op_data2.reg.ibs_nb_req_src);
-                    }
-                    break;
-                case 2:
-                    fprintf(outf, "other_core_cache,");
-                    break;
-                case 3:
-                    fprintf(outf, "DRAM,");
-                    break;
-                case 7:
-                    fprintf(outf, "Other,");
-                    break;
-                default:
-                    fprintf(outf, "Reserved-%" PRIu8 ",",
-                            op.op_data2.reg.ibs_nb_req_src);
-                    break;
-            }
-            if (ibs_op_data2_4_5)
+            char *tmp = realloc(b->data, b->size * 2);
+            if (tmp == NULL)
             {
-                // This is only valid if the NbIbsReqSrc != 0
-                if (op.op_data2.reg.ibs_nb_req_src == 0)
-                    fprintf(outf, "-,");
-                else if (op.op_data2.reg.ibs_nb_req_dst_node == 1)
-                    fprintf(outf, "other_node,");
-                else
-                    fprintf(outf, "same_node,");
-
-                // This is only valid when NbIbsReqSrc == 2
-                if (op.op_data2.reg.ibs_nb_req_src != 2)
-                    fprintf(outf, "-,");
-                else if (op.op_data2.reg.ibs_nb_req_cache_hit_st == 1)
-                    fprintf(outf, "O,");
-                else
-                    fprintf(outf, "M,");
+                fprintf(stderr, "\n\nERROR. Could not grow an output ");
+                fprintf(stderr, "buffer.\n\n");
+                exit(EXIT_FAILURE);
             }
+            b->data = tmp;
+            b->size *= 2;
         }
     }
+    return b->data + b->len;
+}
+
+static void csv_put(struct csv_buf *b, const struct csv_format *f,
+        const void *record)
+{
+    char *p = csv_buf_line(b);
+
+    for (size_t i = 0; i < f->num_columns; i++)
+        p = f->columns[i](p, record, f);
+    *p++ = '\n';
+    b->len = p - b->data;
+}
+
+// With --threads, a trace is cut into blocks of this many records (or of
+// this many format 3 chunks). Each thread decodes one block at a time into
+// its own buffer, and the buffers are written out in block order.
+#define DECODE_BLOCK_RECORDS    (64 * IBS_TRACE_CHUNK_RECORDS)
+#define DECODE_BLOCK_CHUNKS (DECODE_BLOCK_RECORDS / IBS_TRACE_CHUNK_RECORDS)
+
+// For --arrow and --columns, each column is pulled out of a sample by one of
+// these. They return 0 where the CSV would hold "-", which in Arrow becomes
+// a null.
+typedef int (*arrow_get_fn)(const void *record, const struct csv_format *f,
+        uint64_t *value);
+
+struct arrow_format {
+    struct arrow_field fields[CSV_MAX_COLUMNS * 2];
+    arrow_get_fn get[CSV_MAX_COLUMNS * 2];
+    uint64_t need[CSV_MAX_COLUMNS * 2];     // IBS_*FIELD_* the getter reads
+    unsigned char hex[CSV_MAX_COLUMNS * 2]; // Printed as 0x... in CSV
+    size_t num_fields;
+    struct csv_format csv;      // The family's flags, for the getters
+};
+
+static void add_typed(struct arrow_format *a, const char *name,
+        enum arrow_type type, arrow_get_fn get, uint64_t need, int hex)
+{
+    a->fields[a->num_fields].name = name;
+    a->fields[a->num_fields].type = type;
+    a->need[a->num_fields] = need;
+    a->hex[a->num_fields] = hex;
+    a->get[a->num_fields++] = get;
+}
+
+static void add_typed_dict(struct arrow_format *a, const char *name,
+        const char *const *dict, size_t dict_len, arrow_get_fn get,
+        uint64_t need)
+{
+    a->fields[a->num_fields].dict = dict;
+    a->fields[a->num_fields].dict_len = dict_len;
+    add_typed(a, name, ARROW_DICT, get, need, 0);
+}
+
+// Each getter comes with get##_need, the fields it is computed from
+#define add_arrow(a, name, type, get) \
+    add_typed(a, name, type, get, get##_need, 0)
+#define add_arrow_addr(a, name, get) \
+    add_typed(a, name, ARROW_UINT64, get, get##_need, 1)
+#define add_arrow_dict(a, name, dict, get) \
+    add_typed_dict(a, name, dict, get, get##_need)
+
+#define OP_VALUE(name, need, valid, expr) \
+static const uint64_t name##_need = (need); \
+static int name(const void *record, const struct csv_format *f, \
+        uint64_t *value) \
+{ \
+    const ibs_op_t *op = record; \
+    (void)f; \
+    if (!(valid)) \
+        return 0; \
+    *value = (expr); \
+    return 1; \
+}
+#define FETCH_VALUE(name, need, valid, expr) \
+static const uint64_t name##_need = (need); \
+static int name(const void *record, const struct csv_format *f, \
+        uint64_t *value) \
+{ \
+    const ibs_fetch_t *fetch = record; \
+    (void)f; \
+    if (!(valid)) \
+        return 0; \
+    *value = (expr); \
+    return 1; \
+}
+
+// Dictionaries are indexed by the raw register field
+static const char *const data_src_names[] = {"Reserved-0", "Reserved-1",
+    "other_core_cache", "DRAM", "Reserved-4", "Reserved-5", "Reserved-6",
+    "Other"};
+static const char *const data_src_l3_names[] = {"Reserved-0", "local_L3",
+    "other_core_cache", "DRAM", "Reserved-4", "Reserved-5", "Reserved-6",
+    "Other"};
+static const char *const req_dst_node_names[] = {"same_node", "other_node"};
+static const char *const cache_hit_st_names[] = {"M", "O"};
+static const char *const page_size_names[] = {"4 KB", "2 MB", "1 GB",
+    "Reserved-3"};
+static const char *const page_size_17h_names[] = {"4 KB", "2 MB", "1 GB",
+    "16 KB"};
+#define DICT(names) names, sizeof(names) / sizeof(names[0])
+
+static int op_data2_valid(const ibs_op_t *op, const struct csv_format *f)
+{
+    return op->op_data3.reg.ibs_ld_op && op->op_data3.reg.ibs_dc_miss &&
+        (!f->l2_miss_valid || op->op_data3.reg.ibs_l2_miss) &&
+        !(fam14h_err484 && op->op_data3.reg.ibs_dc_wc_mem_acc);
+}
+
+OP_VALUE(op_get_tsc, IBS_FIELD_TSC, 1, op->tsc)
+OP_VALUE(op_get_cpu, IBS_FIELD_CPU, 1, (int64_t)op->cpu)
+OP_VALUE(op_get_tid, IBS_FIELD_TID, 1, (int64_t)op->tid)
+OP_VALUE(op_get_pid, IBS_FIELD_PID, 1, (int64_t)op->pid)
+OP_VALUE(op_get_kern_mode, IBS_FIELD_KERN_MODE, 1, (int64_t)op->kern_mode)
+OP_VALUE(op_get_rip, IBS_OP_FIELD_RIP, 1, op->op_rip)
+OP_VALUE(op_get_max_cnt, IBS_OP_FIELD_CTL, 1,
+        (uint32_t)(op->op_ctl.reg.ibs_op_max_cnt << 4))
+OP_VALUE(op_get_max_cnt_ext, IBS_OP_FIELD_CTL, 1,
+        (uint32_t)((op->op_ctl.reg.ibs_op_max_cnt_upper << 20) +
+        (op->op_ctl.reg.ibs_op_max_cnt << 4)))
+OP_VALUE(op_get_comp_to_ret, IBS_OP_FIELD_DATA, 1,
+        op->op_data.reg.ibs_comp_to_ret_ctr)
+OP_VALUE(op_get_tag_to_ret, IBS_OP_FIELD_DATA, 1,
+        op->op_data.reg.ibs_tag_to_ret_ctr)
+OP_VALUE(op_get_brn_resync, IBS_OP_FIELD_DATA, 1,
+        op->op_data.reg.ibs_op_brn_resync)
+OP_VALUE(op_get_misp_return, IBS_OP_FIELD_DATA, 1,
+        op->op_data.reg.ibs_op_misp_return)
+OP_VALUE(op_get_brn_taken, IBS_OP_FIELD_DATA, 1,
+        op->op_data.reg.ibs_op_brn_taken)
+OP_VALUE(op_get_brn_misp, IBS_OP_FIELD_DATA, 1,
+        op->op_data.reg.ibs_op_brn_misp)
+// Also what the CSV's IbsOpReturn column has always held
+OP_VALUE(op_get_brn_ret, IBS_OP_FIELD_DATA, 1, op->op_data.reg.ibs_op_brn_ret)
+OP_VALUE(op_get_rip_invalid, IBS_OP_FIELD_DATA, 1,
+        op->op_data.reg.ibs_rip_invalid)
+OP_VALUE(op_get_brn_fuse, IBS_OP_FIELD_DATA, 1,
+        op->op_data.reg.ibs_op_brn_fuse)
+OP_VALUE(op_get_microcode, IBS_OP_FIELD_DATA, 1,
+        op->op_data.reg.ibs_op_microcode)
+OP_VALUE(op_get_data_src, IBS_OP_FIELD_DATA2 | IBS_OP_FIELD_DATA3,
+        op_data2_valid(op, f) && op->op_data2.reg.ibs_nb_req_src != 0,
+        op->op_data2.reg.ibs_nb_req_src)
+OP_VALUE(op_get_req_dst_node, IBS_OP_FIELD_DATA2 | IBS_OP_FIELD_DATA3,
+        op_data2_valid(op, f) && op->op_data2.reg.ibs_nb_req_src != 0,
+        op->op_data2.reg.ibs_nb_req_dst_node == 1)
+OP_VALUE(op_get_cache_hit_st, IBS_OP_FIELD_DATA2 | IBS_OP_FIELD_DATA3,
+        op_data2_valid(op, f) && op->op_data2.reg.ibs_nb_req_src == 2,
+        op->op_data2.reg.ibs_nb_req_cache_hit_st == 1)
+OP_VALUE(op_get_ld_op, IBS_OP_FIELD_DATA3, 1, op->op_data3.reg.ibs_ld_op)
+OP_VALUE(op_get_st_op, IBS_OP_FIELD_DATA3, 1, op->op_data3.reg.ibs_st_op)
+OP_VALUE(op_get_l1_tlb_miss, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_l1_tlb_miss)
+OP_VALUE(op_get_l2_tlb_miss, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_l2_tlb_miss)
+OP_VALUE(op_get_l1_tlb_hit_2m, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_l1_tlb_hit_2m)
+OP_VALUE(op_get_l1_tlb_hit_1g, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_l1_tlb_hit_1g)
+OP_VALUE(op_get_l2_tlb_hit_2m, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_l2_tlb_hit_2m)
+OP_VALUE(op_get_dc_miss, IBS_OP_FIELD_DATA3, 1, op->op_data3.reg.ibs_dc_miss)
+OP_VALUE(op_get_dc_miss_acc, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_miss_acc)
+OP_VALUE(op_get_ld_bnk_con, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_ld_bank_con)
+OP_VALUE(op_get_st_bnk_con, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_st_bank_con)
+OP_VALUE(op_get_st_to_ld_fwd, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_st_to_ld_fwd)
+OP_VALUE(op_get_st_to_ld_can, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_st_to_ld_can)
+OP_VALUE(op_get_wc_mem_acc, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_wc_mem_acc)
+OP_VALUE(op_get_uc_mem_acc, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_uc_mem_acc)
+OP_VALUE(op_get_locked_op, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_locked_op)
+OP_VALUE(op_get_no_mab_alloc, IBS_OP_FIELD_DATA3, 1, (fam15h_model01h_err717 &&
+        op->op_data3.reg.ibs_dc_miss) ? 0 :
+        op->op_data3.reg.ibs_dc_no_mab_alloc)
+OP_VALUE(op_get_lin_addr_valid, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_lin_addr_valid)
+OP_VALUE(op_get_phy_addr_valid, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_phy_addr_valid)
+OP_VALUE(op_get_l2_tlb_hit_1g, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_l2_tlb_hit_1g)
+OP_VALUE(op_get_l2_miss, IBS_OP_FIELD_DATA3, 1, op->op_data3.reg.ibs_l2_miss)
+OP_VALUE(op_get_sw_pf, IBS_OP_FIELD_DATA3, 1, op->op_data3.reg.ibs_sw_pf)
+// Bytes; the reserved encodings are nulls
+OP_VALUE(op_get_mem_width, IBS_OP_FIELD_DATA3,
+        op->op_data3.reg.ibs_op_mem_width <= 5,
+        op->op_data3.reg.ibs_op_mem_width ? 1 <<
+        (op->op_data3.reg.ibs_op_mem_width - 1) : 0)
+OP_VALUE(op_get_open_mem_reqs, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_op_dc_miss_open_mem_reqs)
+OP_VALUE(op_get_miss_lat, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_dc_miss_lat)
+OP_VALUE(op_get_tlb_refill_lat, IBS_OP_FIELD_DATA3, 1,
+        op->op_data3.reg.ibs_tlb_refill_lat)
+OP_VALUE(op_get_dc_lin_ad, IBS_OP_FIELD_DATA3 | IBS_OP_FIELD_DC_LIN_AD,
+        op->op_data3.reg.ibs_lin_addr_valid, op->dc_lin_ad)
+OP_VALUE(op_get_dc_phys_ad, IBS_OP_FIELD_DATA3 | IBS_OP_FIELD_DC_PHYS_AD,
+        op->op_data3.reg.ibs_phy_addr_valid,
+        op->dc_phys_ad.reg.ibs_dc_phys_addr)
+OP_VALUE(op_get_brn_target, IBS_OP_FIELD_DATA | IBS_OP_FIELD_BR_TARGET,
+        op->op_data.reg.ibs_op_brn_ret, op->br_target)
+OP_VALUE(op_get_ld_resync, IBS_OP_FIELD_DATA4, 1,
+        op->op_data4.reg.ibs_op_ld_resync)
+
+// The columns of output_op_header, typed
+static void build_op_arrow(struct arrow_format *a, const struct op_format *h)
+{
+    uint32_t fam = h->family;
+
+    memset(a, 0, sizeof(*a));
+    build_op_csv(&a->csv, h);
+
+    add_arrow(a, "TSC", ARROW_UINT64, op_get_tsc);
+    add_arrow(a, "CPU_Number", ARROW_INT32, op_get_cpu);
+    add_arrow(a, "TID", ARROW_INT32, op_get_tid);
+    add_arrow(a, "PID", ARROW_INT32, op_get_pid);
+    add_arrow(a, "Kern_mode", ARROW_INT32, op_get_kern_mode);
+    add_arrow_addr(a, "IbsOpRip", op_get_rip);
+    if (h->op_cnt_ext)
+        add_arrow(a, "IbsOpMaxCnt[26:0]", ARROW_UINT32, op_get_max_cnt_ext);
+    else
+        add_arrow(a, "IbsOpMaxCnt[19:0]", ARROW_UINT32, op_get_max_cnt);
+
+    add_arrow(a, "IbsCompToRetCtr", ARROW_UINT16, op_get_comp_to_ret);
+    add_arrow(a, "IbsTagToRetCtr", ARROW_UINT16, op_get_tag_to_ret);
+    if (h->brn_resync)
+        add_arrow(a, "IbsOpBrnResync", ARROW_UINT8, op_get_brn_resync);
+    if (h->misp_return)
+        add_arrow(a, "IbsOpMispReturn", ARROW_UINT8, op_get_misp_return);
+    add_arrow(a, "IbsOpReturn", ARROW_UINT8, op_get_brn_ret);
+    add_arrow(a, "IbsOpBrnTaken", ARROW_UINT8, op_get_brn_taken);
+    add_arrow(a, "IbsOpBrnMisp", ARROW_UINT8, op_get_brn_misp);
+    add_arrow(a, "IbsOpBrnRet", ARROW_UINT8, op_get_brn_ret);
+    if (h->rip_invalid_chk)
+        add_arrow(a, "IbsRipInvalid", ARROW_UINT8, op_get_rip_invalid);
+    if (h->op_brn_fuse)
+        add_arrow(a, "IbsOpBrnFuse", ARROW_UINT8, op_get_brn_fuse);
+    if (h->microcode)
+        add_arrow(a, "IbsOpMicrocode", ARROW_UINT8, op_get_microcode);
+
+    if (a->csv.local_l3)
+        add_arrow_dict(a, (fam < 0x17) ? "NbIbsReqSrc" : "DataSrc",
+                DICT(data_src_l3_names), op_get_data_src);
     else
-        fprintf(outf, "-,-,-,");
+        add_arrow_dict(a, (fam < 0x17) ? "NbIbsReqSrc" : "DataSrc",
+                DICT(data_src_names), op_get_data_src);
+    if (h->ibs_op_data2_4_5)
+    {
+        add_arrow_dict(a, (fam < 0x17) ? "NbIbsReqDstNode" : "RmtNode",
+                DICT(req_dst_node_names), op_get_req_dst_node);
+        add_arrow_dict(a, (fam < 0x17) ? "NbIbsReqCacheHitSt" : "CacheHitSt",
+                DICT(cache_hit_st_names), op_get_cache_hit_st);
+    }
 
-    // IbsOpData3 / IBS_OP_DATA3
-    print_u8(outf, op.op_data3.reg.ibs_ld_op);
-    print_u8(outf, op.op_data3.reg.ibs_st_op);
-    print_u8(outf, op.op_data3.reg.ibs_dc_l1_tlb_miss);
-    print_u8(outf, op.op_data3.reg.ibs_dc_l2_tlb_miss);
-    print_u8(outf, op.op_data3.reg.ibs_dc_l1_tlb_hit_2m);
-    print_u8(outf, op.op_data3.reg.ibs_dc_l1_tlb_hit_1g);
-    print_u8(outf, op.op_data3.reg.ibs_dc_l2_tlb_hit_2m);
-    print_u8(outf, op.op_data3.reg.ibs_dc_miss);
-    print_u8(outf, op.op_data3.reg.ibs_dc_miss_acc);
-    if (dc_ld_bnk_con)
-        print_u8(outf, op.op_data3.reg.ibs_dc_ld_bank_con);
-    if (dc_st_bnk_con)
-        print_u8(outf, op.op_data3.reg.ibs_dc_st_bank_con);
-    if (dc_st_to_ld_fwd)
-        print_u8(outf, op.op_data3.reg.ibs_dc_st_to_ld_fwd);
-    if (dc_st_to_ld_can)
-        print_u8(outf, op.op_data3.reg.ibs_dc_st_to_ld_can);
-    print_u8(outf, op.op_data3.reg.ibs_dc_wc_mem_acc);
-    print_u8(outf, op.op_data3.reg.ibs_dc_uc_mem_acc);
-    print_u8(outf, op.op_data3.reg.ibs_dc_locked_op);
-    if (fam15h_model01h_err717 && (op.op_data3.reg.ibs_dc_miss -= 0))
-        print_u8(outf, 0);
+    add_arrow(a, "IbsLdOp", ARROW_UINT8, op_get_ld_op);
+    add_arrow(a, "IbsStOp", ARROW_UINT8, op_get_st_op);
+    add_arrow(a, "IbsDcL1tlbMiss", ARROW_UINT8, op_get_l1_tlb_miss);
+    add_arrow(a, "IbsDcL2TlbMiss", ARROW_UINT8, op_get_l2_tlb_miss);
+    add_arrow(a, "IbsDcL1TlbHit2M", ARROW_UINT8, op_get_l1_tlb_hit_2m);
+    add_arrow(a, "IbsDcL1TlbHit1G", ARROW_UINT8, op_get_l1_tlb_hit_1g);
+    add_arrow(a, "IbsDcL2tlbHit2M", ARROW_UINT8, op_get_l2_tlb_hit_2m);
+    add_arrow(a, "IbsDcMiss", ARROW_UINT8, op_get_dc_miss);
+    add_arrow(a, "IbsDcMissAcc", ARROW_UINT8, op_get_dc_miss_acc);
+    if (h->dc_ld_bnk_con)
+        add_arrow(a, "IbsDcLdBnkCon", ARROW_UINT8, op_get_ld_bnk_con);
+    if (h->dc_st_bnk_con)
+        add_arrow(a, "IbsDcStBnkCon", ARROW_UINT8, op_get_st_bnk_con);
+    if (h->dc_st_to_ld_fwd)
+        add_arrow(a, "IbsDcStToLdFwd", ARROW_UINT8, op_get_st_to_ld_fwd);
+    if (h->dc_st_to_ld_can)
+        add_arrow(a, "IbsDcStToLdCan", ARROW_UINT8, op_get_st_to_ld_can);
+    add_arrow(a, "IbsDcWcMemAcc", ARROW_UINT8, op_get_wc_mem_acc);
+    add_arrow(a, "IbsDcUcMemAcc", ARROW_UINT8, op_get_uc_mem_acc);
+    add_arrow(a, "IbsDcLockedOp", ARROW_UINT8, op_get_locked_op);
+    if (fam <= 0x12 || (fam == 0x15 && h->model < 0x20))
+        add_arrow(a, "IbsDcMabHit", ARROW_UINT8, op_get_no_mab_alloc);
     else
-        print_u8(outf, op.op_data3.reg.ibs_dc_no_mab_alloc);
-    print_u8(outf, op.op_data3.reg.ibs_lin_addr_valid);
-    print_u8(outf, op.op_data3.reg.ibs_phy_addr_valid);
-    print_u8(outf, op.op_data3.reg.ibs_dc_l2_tlb_hit_1g);
-    if (ibs_data3_20_31_48_63)
+        add_arrow(a, "DcMissNoMabAlloc", ARROW_UINT8, op_get_no_mab_alloc);
+    add_arrow(a, "IbsDcLinAddrValid", ARROW_UINT8, op_get_lin_addr_valid);
+    add_arrow(a, "IbsDcPhyAddrValid", ARROW_UINT8, op_get_phy_addr_valid);
+    add_arrow(a, "IbsDcL2tlbHit1G", ARROW_UINT8, op_get_l2_tlb_hit_1g);
+    if (h->ibs_data3_20_31_48_63)
     {
-        print_u8(outf, op.op_data3.reg.ibs_l2_miss);
-        print_u8(outf, op.op_data3.reg.ibs_sw_pf);
-        switch(op.op_data3.reg.ibs_op_mem_width)
-        {
-            case 0:
-                fprintf(outf, "0,");
-                break;
-            case 1:
-                fprintf(outf, "1,");
-                break;
-            case 2:
-                fprintf(outf, "2,");
-                break;
-            case 3:
-                fprintf(outf, "4,");
-                break;
-            case 4:
-                fprintf(outf, "8,");
-                break;
-            case 5:
-                fprintf(outf, "16,");
-                break;
-            default:
-                fprintf(outf, "Reserved-%" PRIu8 ",",
-                        op.op_data3.reg.ibs_op_mem_width);
+        add_arrow(a, "IbsL2Miss", ARROW_UINT8, op_get_l2_miss);
+        add_arrow(a, "IbsSwPf", ARROW_UINT8, op_get_sw_pf);
+        add_arrow(a, "IbsOpMemWidth", ARROW_UINT8, op_get_mem_width);
+        add_arrow(a, "IbsOpDcMissOpenMemReqs", ARROW_UINT8,
+                op_get_open_mem_reqs);
+    }
+    add_arrow(a, "IbsDcMissLat", ARROW_UINT16, op_get_miss_lat);
+    if (h->ibs_data3_20_31_48_63)
+        add_arrow(a, "IbstlbRefillLat", ARROW_UINT16, op_get_tlb_refill_lat);
+
+    add_arrow_addr(a, "IbsDcLinAd", op_get_dc_lin_ad);
+    add_arrow_addr(a, "IbsDcPhysAd", op_get_dc_phys_ad);
+    if (h->brn_trgt)
+        add_arrow_addr(a, "IbsBrnTarget", op_get_brn_target);
+    if (h->ibs_op_data_4)
+        add_arrow(a, "IbsOpLdResync", ARROW_UINT8, op_get_ld_resync);
+}
+
+FETCH_VALUE(fetch_get_tsc, IBS_FIELD_TSC, 1, fetch->tsc)
+FETCH_VALUE(fetch_get_cpu, IBS_FIELD_CPU, 1, (int64_t)fetch->cpu)
+FETCH_VALUE(fetch_get_tid, IBS_FIELD_TID, 1, (int64_t)fetch->tid)
+FETCH_VALUE(fetch_get_pid, IBS_FIELD_PID, 1, (int64_t)fetch->pid)
+FETCH_VALUE(fetch_get_kern_mode, IBS_FIELD_KERN_MODE, 1,
+        (int64_t)fetch->kern_mode)
+FETCH_VALUE(fetch_get_phy_addr_valid, IBS_FETCH_FIELD_CTL, 1,
+        fetch->fetch_ctl.reg.ibs_phy_addr_valid)
+FETCH_VALUE(fetch_get_lin_ad, IBS_FETCH_FIELD_LIN_AD, 1, fetch->fetch_lin_ad)
+FETCH_VALUE(fetch_get_phys_ad, IBS_FETCH_FIELD_CTL | IBS_FETCH_FIELD_PHYS_AD,
+        fetch->fetch_ctl.reg.ibs_phy_addr_valid,
+        fetch->fetch_phys_ad.reg.ibs_fetch_phy_addr)
+FETCH_VALUE(fetch_get_max_cnt, IBS_FETCH_FIELD_CTL, 1,
+        (uint32_t)(fetch->fetch_ctl.reg.ibs_fetch_max_cnt << 4))
+FETCH_VALUE(fetch_get_lat, IBS_FETCH_FIELD_CTL, 1,
+        fetch->fetch_ctl.reg.ibs_fetch_lat)
+FETCH_VALUE(fetch_get_comp, IBS_FETCH_FIELD_CTL, 1,
+        fetch->fetch_ctl.reg.ibs_fetch_comp)
+FETCH_VALUE(fetch_get_ic_miss, IBS_FETCH_FIELD_CTL, 1,
+        fetch->fetch_ctl.reg.ibs_ic_miss)
+FETCH_VALUE(fetch_get_pg_sz, IBS_FETCH_FIELD_CTL,
+        fetch->fetch_ctl.reg.ibs_phy_addr_valid,
+        fetch->fetch_ctl.reg.ibs_l1_tlb_pg_sz)
+FETCH_VALUE(fetch_get_l1_tlb_miss, IBS_FETCH_FIELD_CTL, 1,
+        fetch->fetch_ctl.reg.ibs_l1_tlb_miss)
+FETCH_VALUE(fetch_get_l2_tlb_miss, IBS_FETCH_FIELD_CTL, 1,
+        fetch->fetch_ctl.reg.ibs_l2_tlb_miss)
+FETCH_VALUE(fetch_get_l2_miss, IBS_FETCH_FIELD_CTL, 1,
+        fetch->fetch_ctl.reg.ibs_fetch_l2_miss)
+FETCH_VALUE(fetch_get_itlb_refill_lat, IBS_FETCH_FIELD_CTL |
+        IBS_FETCH_FIELD_CTL_EXTD, fetch->fetch_ctl.reg.ibs_fetch_comp,
+        fetch->fetch_ctl_extd.reg.ibs_itlb_refill_lat)
+
+// The columns of output_fetch_header, typed
+static void build_fetch_arrow(struct arrow_format *a,
+        const struct fetch_format *h)
+{
+    memset(a, 0, sizeof(*a));
+    build_fetch_csv(&a->csv, h);
+
+    add_arrow(a, "TSC", ARROW_UINT64, fetch_get_tsc);
+    add_arrow(a, "CPU_Number", ARROW_INT32, fetch_get_cpu);
+    add_arrow(a, "TID", ARROW_INT32, fetch_get_tid);
+    add_arrow(a, "PID", ARROW_INT32, fetch_get_pid);
+    add_arrow(a, "Kern_mode", ARROW_INT32, fetch_get_kern_mode);
+    add_arrow(a, "IbsPhyAddrValid", ARROW_UINT8, fetch_get_phy_addr_valid);
+    add_arrow_addr(a, "IbsFetchLinAd", fetch_get_lin_ad);
+    add_arrow_addr(a, "IbsFetchPhysAd", fetch_get_phys_ad);
+    add_arrow(a, "IbsFetchMaxCnt[19:0]", ARROW_UINT32, fetch_get_max_cnt);
+    add_arrow(a, "IbsFetchLat", ARROW_UINT16, fetch_get_lat);
+    add_arrow(a, "IbsFetchComp", ARROW_UINT8, fetch_get_comp);
+    add_arrow(a, "IbsIcMiss", ARROW_UINT8, fetch_get_ic_miss);
+    if (h->family == 0x17)
+        add_arrow_dict(a, "IbsL1TlbPgSz", DICT(page_size_17h_names),
+                fetch_get_pg_sz);
+    else
+        add_arrow_dict(a, "IbsL1TlbPgSz", DICT(page_size_names),
+                fetch_get_pg_sz);
+    add_arrow(a, "IbsL1TlbMiss", ARROW_UINT8, fetch_get_l1_tlb_miss);
+    add_arrow(a, "IbsL2TlbMiss", ARROW_UINT8, fetch_get_l2_tlb_miss);
+    if ((h->family == 0x15 && h->model >= 0x60) || h->family == 0x17)
+        add_arrow(a, "IbsFetchL2Miss", ARROW_UINT8, fetch_get_l2_miss);
+    if (h->fetch_ctl_ext)
+        add_arrow(a, "IbsItlbRefillLat", ARROW_UINT16,
+                fetch_get_itlb_refill_lat);
+}
+
+static void arrow_put(struct arrow_batch *b, const struct arrow_format *a,
+        const void *record)
+{
+    for (size_t i = 0; i < a->num_fields; i++)
+    {
+        uint64_t value;
+        if (a->get[i](record, &a->csv, &value))
+            arrow_batch_set(b, i, value);
+        else
+            arrow_batch_set_null(b, i);
+    }
+    arrow_batch_next_row(b);
+}
+
+// --columns: keep only the named columns of a, in the order given
+static void select_columns(struct arrow_format *a, const char *flavor)
+{
+    struct arrow_format all = *a;
+    char *list = strdup(column_list);
+    char *tok, *save = NULL;
+
+    if (list == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Out of memory for --columns.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    a->num_fields = 0;
+    for (tok = strtok_r(list, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save))
+    {
+        size_t i;
+        for (i = 0; i < all.num_fields; i++)
+            if (!strcmp(tok, all.fields[i].name))
                 break;
+        if (i == all.num_fields)
+        {
+            fprintf(stderr, "WARNING. %s trace has no column %s\n", flavor,
+                    tok);
+            continue;
         }
-        print_u8(outf, op.op_data3.reg.ibs_op_dc_miss_open_mem_reqs);
+        if (a->num_fields == CSV_MAX_COLUMNS * 2)
+            break;
+        a->fields[a->num_fields] = all.fields[i];
+        a->need[a->num_fields] = all.need[i];
+        a->hex[a->num_fields] = all.hex[i];
+        a->get[a->num_fields++] = all.get[i];
     }
-    print_u16(outf, op.op_data3.reg.ibs_dc_miss_lat);
-    if (ibs_data3_20_31_48_63)
-        print_u16(outf, op.op_data3.reg.ibs_tlb_refill_lat);
+    free(list);
+    if (a->num_fields == 0)
+    {
+        fprintf(stderr, "\n\nERROR. None of the --columns are in the %s ",
+                flavor);
+        fprintf(stderr, "trace.\n\n");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    // IbsDcLinAd / IBS_DC_LINADDR
-    if (op.op_data3.reg.ibs_lin_addr_valid)
-        print_x64(outf, op.dc_lin_ad);
+// How one trace's samples are written out
+struct output_format {
+    int is_op;
+    struct csv_format csv;          // Every column, as CSV
+    struct arrow_format columns;    // Typed columns, after --columns
+    int arrow;                      // Write columns to an Arrow file
+    int projected;                  // Write columns as CSV
+    int filtered;                   // Some filter is set
+    uint64_t want;                  // The trace fields all that reads
+    ibs_heatmap_t *heatmap;         // With --heatmap
+    int discard;                    // Only count samples into heatmap
+    int merge;                      // With --merge
+};
+
+// The fields the filters look at
+static uint64_t filter_fields(void)
+{
+    uint64_t fields = 0;
+
+    if (filter.tsc_start != 0 || filter.tsc_end != UINT64_MAX)
+        fields |= IBS_FIELD_TSC;
+    if (filter.cpus.num)
+        fields |= IBS_FIELD_CPU;
+    if (filter.tids.num)
+        fields |= IBS_FIELD_TID;
+    if (filter.pids.num)
+        fields |= IBS_FIELD_PID;
+    if (filter.kern_mode >= 0)
+        fields |= IBS_FIELD_KERN_MODE;
+    return fields;
+}
+
+// Fill in everything past of->csv and of->columns, given the fields the
+// trace holds
+static void finish_output(struct output_format *of, uint64_t fields,
+        const char *flavor)
+{
+    uint64_t filtered = filter_fields();
+
+    of->arrow = arrow_output;
+    of->filtered = (filtered != 0);
+    of->want = fields;
+    if (filtered & ~fields)
+    {
+        fprintf(stderr, "WARNING. %s trace does not hold every field the ",
+                flavor);
+        fprintf(stderr, "filters look at; those read as 0.\n");
+    }
+    if (column_list != NULL)
+    {
+        select_columns(&of->columns, flavor);
+        of->projected = !arrow_output;
+        of->want = filtered;
+        for (size_t i = 0; i < of->columns.num_fields; i++)
+            of->want |= of->columns.need[i];
+        of->want &= fields;
+    }
+    if (of->heatmap != NULL)
+        of->want |= IBS_HEATMAP_FIELDS & fields;
+    if (of->discard)
+        of->want = (filtered | IBS_HEATMAP_FIELDS) & fields;
+    of->merge = merge_samples && !of->discard;
+    if (of->merge)
+    {
+        if (!(fields & IBS_FIELD_TSC))
+        {
+            fprintf(stderr, "\n\nERROR. --merge needs TSCs, and the %s ",
+                    flavor);
+            fprintf(stderr, "trace does not hold them.\n\n");
+            exit(EXIT_FAILURE);
+        }
+        of->want |= (IBS_FIELD_TSC | IBS_FIELD_CPU) & fields;
+    }
+}
+
+static int in_id_list(const struct id_list *list, int id)
+{
+    if (list->num == 0)
+        return 1;
+    for (int i = 0; i < list->num; i++)
+        if (list->ids[i] == id)
+            return 1;
+    return 0;
+}
+
+// Check a decoded sample against the filters
+static int keep_sample(int is_op, const void *record)
+{
+    uint64_t tsc;
+    int cpu, tid, pid, kern_mode;
+
+    if (is_op)
+    {
+        const ibs_op_t *op = record;
+        tsc = op->tsc;
+        cpu = op->cpu;
+        tid = op->tid;
+        pid = op->pid;
+        kern_mode = op->kern_mode;
+    }
     else
-        fprintf(outf, "-,");
+    {
+        const ibs_fetch_t *fetch = record;
+        tsc = fetch->tsc;
+        cpu = fetch->cpu;
+        tid = fetch->tid;
+        pid = fetch->pid;
+        kern_mode = fetch->kern_mode;
+    }
+    if (tsc < filter.tsc_start || tsc > filter.tsc_end)
+        return 0;
+    if (filter.kern_mode >= 0 && kern_mode != filter.kern_mode)
+        return 0;
+    return in_id_list(&filter.cpus, cpu) && in_id_list(&filter.tids, tid) &&
+        in_id_list(&filter.pids, pid);
+}
 
-    // IbsDcPhsAd / IBS_DC_PHYSADDR
-    if (op.op_data3.reg.ibs_phy_addr_valid)
-        print_x64(outf, op.dc_phys_ad.reg.ibs_dc_phys_addr);
+// Whether a format 3 chunk might hold a sample the filters keep, from its
+// index entry alone. The entry's cpu is the one the writer was handed
+// rather than the samples', so only the TSCs and PIDs are trusted.
+static int chunk_may_match(const ibs_trace_index_t *ent)
+{
+    if (ent->max_tsc < filter.tsc_start || ent->min_tsc > filter.tsc_end)
+        return 0;
+    if (filter.pids.num && ent->num_pids != IBS_TRACE_PIDS_MANY)
+    {
+        for (uint32_t i = 0; i < ent->num_pids; i++)
+            if (in_id_list(&filter.pids, ent->pids[i]))
+                return 1;
+        return 0;
+    }
+    return 1;
+}
+
+// --columns without --arrow: each cell is the plain number behind the
+// typed column, or the dictionary string
+static void csv_put_typed(struct csv_buf *b, const struct arrow_format *a,
+        const void *record)
+{
+    char *p = csv_buf_line(b);
+
+    for (size_t i = 0; i < a->num_fields; i++)
+    {
+        uint64_t value;
+        if (!a->get[i](record, &a->csv, &value))
+            p = put_str(p, "-,");
+        else if (a->fields[i].type == ARROW_DICT)
+        {
+            size_t len = strlen(a->fields[i].dict[value]);
+            memcpy(p, a->fields[i].dict[value], len);
+            p += len;
+            *p++ = ',';
+        }
+        else if (a->fields[i].type == ARROW_INT32)
+            p = put_int(p, (int)value);
+        else if (a->hex[i])
+            p = put_x64(p, value);
+        else
+            p = put_u64(p, value);
+    }
+    *p++ = '\n';
+    b->len = p - b->data;
+}
+
+static void output_typed_header(FILE *outf, const struct arrow_format *a)
+{
+    for (size_t i = 0; i < a->num_fields; i++)
+        fprintf(outf, "%s,", a->fields[i].name);
+    fprintf(outf, "\n");
+}
+
+// Where one thread's decoded samples go: CSV text, or columns of a record
+// batch for --arrow. With a file to go to, the text or batch is written out
+// as it fills; otherwise it is held for sink_write. With --merge, samples
+// wait in merge (see ibs-merge.h) until they are in TSC order.
+struct sample_sink {
+    const struct output_format *of;
+    struct csv_buf out;
+    struct arrow_batch *batch;
+    struct arrow_file *af;
+    ibs_heatmap_t *heatmap;
+    ibs_merge_t *merge;
+    uint64_t max_tsc;               // Newest sample put in merge
+};
+
+static void sink_init(struct sample_sink *s, const struct output_format *of,
+        FILE *outf, struct arrow_file *af)
+{
+    memset(s, 0, sizeof(*s));
+    s->of = of;
+    s->af = af;
+    s->heatmap = of->heatmap;
+    if (of->arrow)
+        s->batch = arrow_batch_new(of->columns.fields, of->columns.num_fields,
+                DECODE_BLOCK_RECORDS);
     else
-        fprintf(outf, "-,");
+        csv_buf_init(&s->out, outf);
+    if (of->merge)
+    {
+        s->merge = malloc(sizeof(*s->merge));
+        if (s->merge == NULL)
+        {
+            fprintf(stderr, "\n\nERROR. Could not set up the merge.\n\n");
+            exit(EXIT_FAILURE);
+        }
+        ibs_merge_init(s->merge,
+                of->is_op ? sizeof(ibs_op_t) : sizeof(ibs_fetch_t), 0);
+    }
+}
 
-    if (brn_trgt)
+static void sink_emit(struct sample_sink *s, const void *record)
+{
+    const struct output_format *of = s->of;
+
+    if (!of->arrow)
     {
-        if (op.op_data.reg.ibs_op_brn_ret)
-            print_x64(outf, op.br_target);
+        if (of->projected)
+            csv_put_typed(&s->out, &of->columns, record);
         else
-            fprintf(outf, "-,");
+            csv_put(&s->out, &of->csv, record);
+        return;
+    }
+    arrow_put(s->batch, &of->columns, record);
+    if (s->af != NULL && s->batch->num_rows == s->batch->max_rows)
+    {
+        arrow_file_write(s->af, s->batch);
+        arrow_batch_clear(s->batch);
     }
+}
 
-    if (ibs_op_data_4)
-        print_u8(outf, op.op_data4.reg.ibs_op_ld_resync);
+// Emit the held samples that are more than merge_window older than the
+// newest, or all of them with a watermark of UINT64_MAX
+static void sink_release(struct sample_sink *s, uint64_t watermark)
+{
+    const void *record;
 
-    fprintf(outf, "\n");
+    while ((record = ibs_merge_pop(s->merge, watermark, NULL)) != NULL)
+        sink_emit(s, record);
 }
 
-static void output_fetch_entry(FILE *outf, ibs_fetch_t fetch,
-        uint32_t family, uint32_t model, int fetch_ctl_ext)
+static void sink_merge(struct sample_sink *s, const void *record)
 {
-    // Common stuff
-    print_u64(outf, fetch.tsc);
-    fprintf(outf, "%d,%d,%d,%d,", fetch.cpu, fetch.tid, fetch.pid,
-            fetch.kern_mode);
+    uint64_t tsc;
+    int cpu;
 
-    // IBS_FETCH_CTL_PHYADDR_VALID, IBS_DC_LINADDR, and IBS_DC_PHYSADDR
-    print_u8(outf, fetch.fetch_ctl.reg.ibs_phy_addr_valid);
-    print_x64(outf, fetch.fetch_lin_ad);
-    if (fetch.fetch_ctl.reg.ibs_phy_addr_valid)
-        print_x64(outf, fetch.fetch_phys_ad.reg.ibs_fetch_phy_addr);
+    if (s->of->is_op)
+    {
+        const ibs_op_t *op = record;
+        tsc = op->tsc;
+        cpu = op->cpu;
+    }
     else
-        fprintf(outf, "-,");
+    {
+        const ibs_fetch_t *fetch = record;
+        tsc = fetch->tsc;
+        cpu = fetch->cpu;
+    }
+    // A trace without CPUs lands in one queue, which still sorts
+    if (ibs_merge_put(s->merge, (cpu < 0) ? 0 : cpu, tsc, record))
+    {
+        fprintf(stderr, "\n\nERROR. Ran out of memory for the merge.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    if (tsc > s->max_tsc)
+        s->max_tsc = tsc;
+    if (s->max_tsc > merge_window)
+        sink_release(s, s->max_tsc - merge_window);
+    else
+        sink_release(s, 0);
+}
 
-    // IbsFetchCtl / IBS_FETCH_CTL
-    // Every generation of IBS Fetch has these columns.
-    uint32_t fetch_max_cnt = (fetch.fetch_ctl.reg.ibs_fetch_max_cnt << 4);
-    print_u32(outf, fetch_max_cnt);
+static void sink_put(struct sample_sink *s, const void *record)
+{
+    const struct output_format *of = s->of;
 
-    print_u16(outf, fetch.fetch_ctl.reg.ibs_fetch_lat);
-    print_u8(outf, fetch.fetch_ctl.reg.ibs_fetch_comp);
-    print_u8(outf, fetch.fetch_ctl.reg.ibs_ic_miss);
+    if (of->filtered && !keep_sample(of->is_op, record))
+        return;
+    if (s->heatmap != NULL && ibs_heatmap_add(s->heatmap, record))
+    {
+        fprintf(stderr, "\n\nERROR. Ran out of memory for the heatmap.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    if (of->discard)
+        return;
+    if (s->merge != NULL)
+        sink_merge(s, record);
+    else
+        sink_emit(s, record);
+}
 
-    if (fetch.fetch_ctl.reg.ibs_phy_addr_valid)
+// With --merge, emit whatever is still held, since no more samples are
+// coming
+static void sink_drain(struct sample_sink *s)
+{
+    if (s->merge == NULL)
+        return;
+    sink_release(s, UINT64_MAX);
+    if (s->merge->late)
     {
-        switch (fetch.fetch_ctl.reg.ibs_l1_tlb_pg_sz) {
-            case 0:
-                fprintf(outf, "4 KB,");
-                break;
-            case 1:
-                fprintf(outf, "2 MB,");
-                break;
-            case 2:
-                fprintf(outf, "1 GB,");
-                break;
-            case 3:
-                if (family == 0x17)
-                {
-                    fprintf(outf, "16 KB,");
-                    break;
-                }
-                /* Fallthrough */
-            default:
-                fprintf(outf, "Reserved-%" PRIu8 ",",
-                        fetch.fetch_ctl.reg.ibs_l1_tlb_pg_sz);
-                    break;
+        fprintf(stderr, "WARNING. %" PRIu64 " samples were more than ",
+                s->merge->late);
+        fprintf(stderr, "--merge cycles out of order.\n");
+    }
+}
+
+// Write what s holds to outf or af, and empty it
+static void sink_write(struct sample_sink *s, FILE *outf,
+        struct arrow_file *af)
+{
+    if (!s->of->arrow)
+    {
+        if (s->out.len)
+            fwrite(s->out.data, 1, s->out.len, outf);
+        s->out.len = 0;
+        return;
+    }
+    if (s->batch->num_rows)
+        arrow_file_write(af, s->batch);
+    arrow_batch_clear(s->batch);
+}
+
+static void sink_fini(struct sample_sink *s)
+{
+    if (s->merge != NULL)
+    {
+        ibs_merge_fini(s->merge);
+        free(s->merge);
+    }
+    if (!s->of->arrow)
+    {
+        csv_buf_fini(&s->out);
+        return;
+    }
+    if (s->af != NULL && s->batch->num_rows)
+        arrow_file_write(s->af, s->batch);
+    arrow_batch_free(s->batch);
+}
+
+
+struct decode_job {
+    // Format 1: fixed-size records straight out of the mapped file
+    const unsigned char *records;
+    uint64_t num_records;
+    size_t entry_size;
+    uint64_t fields;
+    uint64_t all_fields;
+    const uint64_t *order;
+    size_t num_fields;
+    void *mapped;
+    size_t mapped_len;
+    // Format 3: chunks of a mapped trace
+    const ibs_trace_map_t *map;
+
+    size_t full_size;
+    uint64_t num_blocks;
+    const struct output_format *of;
+    struct arrow_file *af;              // With --arrow
+    int num_threads;
+    int stop;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+};
+
+struct decode_worker {
+    pthread_t thread;
+    int id;
+    struct decode_job *job;
+    unsigned char *recs;        // One decoded format 3 chunk
+    unsigned char *scratch;     // One format 3 column
+    struct sample_sink out;     // This round's block
+    ibs_heatmap_t heatmap;      // With --heatmap, merged at the end
+    uint64_t num_records;       // Records in buf
+    int damaged;
+};
+
+static void decode_block(struct decode_worker *w, uint64_t block)
+{
+    const struct decode_job *job = w->job;
+    union {
+        ibs_op_t op;
+        ibs_fetch_t fetch;
+    } record;
+
+    if (job->map == NULL)
+    {
+        uint64_t first = block * DECODE_BLOCK_RECORDS;
+        uint64_t last = first + DECODE_BLOCK_RECORDS;
+        if (last > job->num_records)
+            last = job->num_records;
+
+        for (uint64_t i = first; i < last; i++)
+        {
+            const unsigned char *src = job->records + i * job->entry_size;
+            // Records are not aligned in the mapping, so always copy
+            if (job->fields == job->all_fields)
+                memcpy(&record, src, job->full_size);
+            else
+                unpack_record((const char *)src, job->fields, job->order,
+                        job->num_fields, &record);
+            sink_put(&w->out, &record);
         }
+        w->num_records += last - first;
+        return;
     }
-    else
-        fprintf(outf, "-,");
 
-    print_u8(outf, fetch.fetch_ctl.reg.ibs_l1_tlb_miss);
-    print_u8(outf, fetch.fetch_ctl.reg.ibs_l2_tlb_miss);
+    uint64_t first = block * DECODE_BLOCK_CHUNKS;
+    uint64_t last = first + DECODE_BLOCK_CHUNKS;
+    if (last > job->map->num_chunks)
+        last = job->map->num_chunks;
 
-    // Only CZ, ST, and ZN have this field, but there is no CPUID for it.
-    if ((family == 0x15 && model >= 0x60) || family == 0x17)
+    for (uint64_t i = first; i < last; i++)
     {
-        print_u8(outf, fetch.fetch_ctl.reg.ibs_fetch_l2_miss);
+        long n;
+
+        if (job->of->filtered && !chunk_may_match(&job->map->index[i]))
+            continue;
+        n = ibs_trace_map_chunk(job->map, i, job->of->want, w->recs,
+                w->scratch);
+        if (n < 0)
+        {
+            w->damaged = 1;
+            return;
+        }
+        for (long j = 0; j < n; j++)
+            sink_put(&w->out, w->recs + j * job->full_size);
+        w->num_records += n;
     }
+}
 
-    // IBS_EXTD_CTL
-    if (fetch_ctl_ext)
+static void *decode_worker_main(void *arg)
+{
+    struct decode_worker *w = arg;
+    struct decode_job *job = w->job;
+
+    for (uint64_t round = 0; ; round++)
     {
-        if (fetch.fetch_ctl.reg.ibs_fetch_comp)
-            print_u16(outf, fetch.fetch_ctl_extd.reg.ibs_itlb_refill_lat);
+        uint64_t block = round * job->num_threads + w->id;
+
+        pthread_barrier_wait(&job->start);
+        if (job->stop)
+            break;
+
+        w->num_records = 0;
+        if (block < job->num_blocks)
+            decode_block(w, block);
+        pthread_barrier_wait(&job->done);
+    }
+    return NULL;
+}
+
+// Decode every block of job on job->num_threads threads into outf
+static uint64_t decode_parallel(struct decode_job *job, FILE *outf,
+        const char *flavor)
+{
+    struct decode_worker *workers;
+    uint64_t num_samples_seen = 0;
+    int damaged = 0;
+
+    workers = calloc(job->num_threads, sizeof(struct decode_worker));
+    if (workers == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Could not allocate the workers.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&job->start, NULL, job->num_threads + 1);
+    pthread_barrier_init(&job->done, NULL, job->num_threads + 1);
+
+    for (int i = 0; i < job->num_threads; i++)
+    {
+        struct decode_worker *w = &workers[i];
+        w->id = i;
+        w->job = job;
+        // A merge can let out more than a block at once, so its one worker
+        // writes as it goes, between the rounds
+        if (job->of->merge)
+            sink_init(&w->out, job->of, outf, job->af);
         else
-            fprintf(outf, "-,");
+            sink_init(&w->out, job->of, NULL, NULL);
+        if (job->of->heatmap != NULL)
+        {
+            if (ibs_heatmap_init(&w->heatmap, job->of->heatmap->page_shift))
+            {
+                fprintf(stderr, "\n\nERROR. Could not set up the ");
+                fprintf(stderr, "heatmaps.\n\n");
+                exit(EXIT_FAILURE);
+            }
+            w->out.heatmap = &w->heatmap;
+        }
+        if (job->map != NULL)
+        {
+            w->recs = malloc(IBS_TRACE_CHUNK_RECORDS * job->full_size);
+            w->scratch = malloc(IBS_TRACE_MAX_COLUMN);
+            if (w->recs == NULL || w->scratch == NULL)
+            {
+                fprintf(stderr, "\n\nERROR. Could not allocate the ");
+                fprintf(stderr, "workers.\n\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (pthread_create(&w->thread, NULL, decode_worker_main, w))
+        {
+            fprintf(stderr, "\n\nERROR. Could not start worker %d.\n\n", i);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    print_hdr(outf, "%s", "\n");
+    for (uint64_t block = 0; block < job->num_blocks && !damaged;
+            block += job->num_threads)
+    {
+        pthread_barrier_wait(&job->start);
+        pthread_barrier_wait(&job->done);
+
+        for (int i = 0; i < job->num_threads && !damaged; i++)
+        {
+            struct decode_worker *w = &workers[i];
+            sink_write(&w->out, outf, job->af);
+            num_samples_seen += w->num_records;
+            damaged = w->damaged;
+        }
+        printf("Working on %s sample number %" PRIu64 "...\n", flavor,
+                num_samples_seen);
+    }
+    if (damaged)
+    {
+        fprintf(stderr, "\n\nERROR. The trace is damaged after this ");
+        fprintf(stderr, "point; stopping here.\n\n");
+    }
+    // --merge runs one worker, which may still hold the last samples
+    if (job->of->merge)
+    {
+        sink_drain(&workers[0].out);
+        sink_write(&workers[0].out, outf, job->af);
+    }
+
+    job->stop = 1;
+    pthread_barrier_wait(&job->start);
+    for (int i = 0; i < job->num_threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        free(workers[i].recs);
+        free(workers[i].scratch);
+        sink_fini(&workers[i].out);
+        if (job->of->heatmap != NULL)
+        {
+            if (ibs_heatmap_merge(job->of->heatmap, &workers[i].heatmap))
+            {
+                fprintf(stderr, "\n\nERROR. Ran out of memory for the ");
+                fprintf(stderr, "heatmap.\n\n");
+                exit(EXIT_FAILURE);
+            }
+            ibs_heatmap_fini(&workers[i].heatmap);
+        }
+    }
+    pthread_barrier_destroy(&job->start);
+    pthread_barrier_destroy(&job->done);
+    free(workers);
+    return num_samples_seen;
+}
+
+// Set up job to decode the records after in_fp's header. Format 1 traces
+// are mapped here; format 3 traces were already mapped by map_trace.
+static void setup_decode_job(struct decode_job *job, FILE *in_fp,
+        const ibs_trace_reader_t *trace, uint32_t format, size_t full_size,
+        uint64_t fields, uint64_t all_fields, const uint64_t *order,
+        size_t num_fields)
+{
+    memset(job, 0, sizeof(*job));
+    job->full_size = full_size;
+    job->fields = fields;
+    job->all_fields = all_fields;
+    job->order = order;
+    job->num_fields = num_fields;
+    job->num_threads = num_threads;
+
+    if (format >= IBS_TRACE_FORMAT_COLUMNS)
+    {
+        job->map = &trace->map;
+        job->num_blocks = (trace->map.num_chunks + DECODE_BLOCK_CHUNKS - 1) /
+            DECODE_BLOCK_CHUNKS;
+        return;
+    }
+
+    off_t off = ftello(in_fp);
+    struct stat st;
+    if (off < 0 || fstat(fileno(in_fp), &st))
+    {
+        fprintf(stderr, "\n\nERROR. Could not map the trace: %s\n\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    job->entry_size = ibs_sample_entry_size(fields);
+    if (st.st_size <= off)
+        return;
+
+    // mmap offsets must be page aligned; the header rarely ends on one
+    off_t page_off = off & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    void *base = mmap(NULL, st.st_size - page_off, PROT_READ, MAP_PRIVATE,
+            fileno(in_fp), page_off);
+    if (base == MAP_FAILED)
+    {
+        fprintf(stderr, "\n\nERROR. Could not map the trace: %s\n\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    madvise(base, st.st_size - page_off, MADV_SEQUENTIAL);
+    job->records = (const unsigned char *)base + (off - page_off);
+    // A torn record at the end is dropped, as fread would
+    job->num_records = (st.st_size - off) / job->entry_size;
+    job->num_blocks = (job->num_records + DECODE_BLOCK_RECORDS - 1) /
+        DECODE_BLOCK_RECORDS;
+    job->mapped = base;
+    job->mapped_len = st.st_size - page_off;
+}
+
+static void teardown_decode_job(struct decode_job *job)
+{
+    if (job->mapped != NULL)
+        munmap(job->mapped, job->mapped_len);
+}
+
+static void write_heatmap(ibs_heatmap_t *heatmap)
+{
+    int err = ibs_heatmap_write(heatmap, heatmap_fp);
+
+    if (fclose(heatmap_fp))
+        err = -1;
+    heatmap_fp = NULL;
+    if (err)
+    {
+        fprintf(stderr, "\n\nERROR. Could not write the heatmap.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Heatmap: %" PRIu64 " memory ops on %zu linear and %zu physical "
+            "pages.\n", heatmap->num_samples, heatmap->lin.num,
+            heatmap->phys.num);
+    ibs_heatmap_fini(heatmap);
 }
 
 void do_op_work(void)
@@ -686,36 +2277,111 @@ void do_op_work(void)
     int rip_invalid_chk = 0, op_brn_fuse = 0, ibs_op_data_4 = 0, microcode = 0;
     int ibs_op_data2_4_5 = 0, dc_ld_bnk_con = 0, dc_st_bnk_con = 0;
     int dc_st_to_ld_fwd = 0, dc_st_to_ld_can = 0, ibs_data3_20_31_48_63 = 0;
+    // Traces from before version 2 have no field mask line
+    uint32_t version = 1;
+    uint64_t fields = IBS_OP_FIELDS_ALL;
+    // Raw records unless the header says otherwise
+    uint32_t format = 1;
+    ibs_trace_reader_t trace;
 
     printf("Beginning decode of IBS Op Trace header...");
     parse_op_in_header(&family, &model, &brn_resync, &misp_return, &brn_trgt,
             &op_cnt_ext, &rip_invalid_chk, &op_brn_fuse, &ibs_op_data_4,
             &microcode, &ibs_op_data2_4_5, &dc_ld_bnk_con, &dc_st_bnk_con,
-            &dc_st_to_ld_fwd, &dc_st_to_ld_can, &ibs_data3_20_31_48_63);
+            &dc_st_to_ld_fwd, &dc_st_to_ld_can, &ibs_data3_20_31_48_63,
+            &version, &fields, &format);
+    check_record_format(version, IBS_OP_STRUCT_VERSION, fields,
+            IBS_OP_FIELDS_ALL, format, "Op");
+    ibs_trace_reader_init(&trace, 1, fields);
+    if (format >= IBS_TRACE_FORMAT_COLUMNS)
+        map_trace(&trace, op_in_fp, 1);
     printf("Done!\n");
 
-    output_op_header(op_out_fp, family, model, brn_resync, misp_return,
-            brn_trgt, op_cnt_ext, rip_invalid_chk, op_brn_fuse, ibs_op_data_4,
-            microcode, ibs_op_data2_4_5, dc_ld_bnk_con, dc_st_bnk_con,
-            dc_st_to_ld_fwd, dc_st_to_ld_can, ibs_data3_20_31_48_63);
-
-    ibs_op_t op;
-    uint64_t num_samples_seen = 0;
-    printf("Starting to decode op trace. This may take a while...\n");
-    while (fread((char *)&op, sizeof(op), 1, op_in_fp) > 0) {
-        num_samples_seen++;
-        if (num_samples_seen % 100000 == 0)
+    struct op_format h = {family, model, brn_resync, misp_return,
+        brn_trgt, op_cnt_ext, rip_invalid_chk, op_brn_fuse, ibs_op_data_4,
+        microcode, ibs_op_data2_4_5, dc_ld_bnk_con, dc_st_bnk_con,
+        dc_st_to_ld_fwd, dc_st_to_ld_can, ibs_data3_20_31_48_63};
+    struct output_format of = {.is_op = 1};
+    struct arrow_file *af = NULL;
+    ibs_heatmap_t heatmap;
+    if (heatmap_fp != NULL)
+    {
+        if (ibs_heatmap_init(&heatmap, heatmap_page_shift))
         {
-            printf("Working on op sample number %" PRIu64 "...\n",
-                    num_samples_seen);
+            fprintf(stderr, "\n\nERROR. Could not set up the heatmap.\n\n");
+            exit(EXIT_FAILURE);
         }
-
-        output_op_entry(op_out_fp, op, family, model, brn_resync, misp_return,
+        if (!(fields & IBS_OP_FIELD_DATA3))
+        {
+            fprintf(stderr, "WARNING. Op trace has no IbsOpData3, so the ");
+            fprintf(stderr, "heatmap will be empty.\n");
+        }
+        of.heatmap = &heatmap;
+        of.discard = (op_out_fp == NULL);
+    }
+    build_op_csv(&of.csv, &h);
+    build_op_arrow(&of.columns, &h);
+    finish_output(&of, fields, "Op");
+    // With only --heatmap there is nothing to write a header to
+    if (of.discard)
+        of.arrow = of.projected = 0;
+    else if (of.arrow)
+        af = arrow_file_open(op_out_fp, of.columns.fields,
+                of.columns.num_fields);
+    else if (of.projected)
+        output_typed_header(op_out_fp, &of.columns);
+    else
+    {
+        output_op_header(op_out_fp, family, model, brn_resync, misp_return,
                 brn_trgt, op_cnt_ext, rip_invalid_chk, op_brn_fuse,
                 ibs_op_data_4, microcode, ibs_op_data2_4_5, dc_ld_bnk_con,
                 dc_st_bnk_con, dc_st_to_ld_fwd, dc_st_to_ld_can,
                 ibs_data3_20_31_48_63);
     }
+
+    ibs_op_t op;
+    uint64_t num_samples_seen = 0;
+    printf("Starting to decode op trace. This may take a while...\n");
+    // Format 2 chunks can only be found by reading through the ones before.
+    // Format 3 goes through the blocks even on one thread, so that chunks
+    // the filters rule out and unwanted columns are never decoded.
+    if (format >= IBS_TRACE_FORMAT_COLUMNS ||
+            (num_threads > 1 && format != IBS_TRACE_FORMAT_DELTA))
+    {
+        struct decode_job job;
+
+        setup_decode_job(&job, op_in_fp, &trace, format, sizeof(op), fields,
+                IBS_OP_FIELDS_ALL, ibs_op_field_order, IBS_OP_NUM_FIELDS);
+        job.of = &of;
+        job.af = af;
+        decode_parallel(&job, op_out_fp, "op");
+        teardown_decode_job(&job);
+    }
+    else
+    {
+        struct sample_sink out;
+
+        sink_init(&out, &of, op_out_fp, af);
+        while (read_record(op_in_fp, (format >= 2) ? &trace : NULL, &op,
+                    sizeof(op), fields, IBS_OP_FIELDS_ALL, ibs_op_field_order,
+                    IBS_OP_NUM_FIELDS) > 0) {
+            num_samples_seen++;
+            if (num_samples_seen % 100000 == 0)
+            {
+                printf("Working on op sample number %" PRIu64 "...\n",
+                        num_samples_seen);
+            }
+
+            sink_put(&out, &op);
+        }
+        sink_drain(&out);
+        sink_fini(&out);
+    }
+    if (af != NULL)
+        arrow_file_close(af);
+    ibs_trace_reader_fini(&trace);
+    if (of.heatmap != NULL)
+        write_heatmap(&heatmap);
     printf("Done with op samples!\n");
 }
 
@@ -723,26 +2389,74 @@ void do_fetch_work(void)
 {
     uint32_t family = 0, model = 0;
     int fetch_ctl_ext = 0;
+    uint32_t version = 1;
+    uint64_t fields = IBS_FETCH_FIELDS_ALL;
+    uint32_t format = 1;
+    ibs_trace_reader_t trace;
 
     printf("Beginning decode of IBS Fetch Trace header...");
-    parse_fetch_in_header(&family, &model, &fetch_ctl_ext);
+    parse_fetch_in_header(&family, &model, &fetch_ctl_ext, &version, &fields,
+            &format);
+    check_record_format(version, IBS_FETCH_STRUCT_VERSION, fields,
+            IBS_FETCH_FIELDS_ALL, format, "Fetch");
+    ibs_trace_reader_init(&trace, 0, fields);
+    if (format >= IBS_TRACE_FORMAT_COLUMNS)
+        map_trace(&trace, fetch_in_fp, 0);
     printf("Done!\n");
 
-    output_fetch_header(fetch_out_fp, family, model, fetch_ctl_ext);
+    struct fetch_format h = {family, model, fetch_ctl_ext};
+    struct output_format of = {.is_op = 0};
+    struct arrow_file *af = NULL;
+    build_fetch_csv(&of.csv, &h);
+    build_fetch_arrow(&of.columns, &h);
+    finish_output(&of, fields, "Fetch");
+    if (of.arrow)
+        af = arrow_file_open(fetch_out_fp, of.columns.fields,
+                of.columns.num_fields);
+    else if (of.projected)
+        output_typed_header(fetch_out_fp, &of.columns);
+    else
+        output_fetch_header(fetch_out_fp, family, model, fetch_ctl_ext);
 
     ibs_fetch_t fetch;
     uint64_t num_samples_seen = 0;
     printf("Starting to decode fetch trace. This may take a while...\n");
-    while (fread((char *)&fetch, sizeof(fetch), 1, fetch_in_fp) > 0) {
-        num_samples_seen++;
-        if (num_samples_seen % 100000 == 0)
-        {
-            printf("Working on fetch sample number %" PRIu64 "...\n",
-                    num_samples_seen);
-        }
+    if (format >= IBS_TRACE_FORMAT_COLUMNS ||
+            (num_threads > 1 && format != IBS_TRACE_FORMAT_DELTA))
+    {
+        struct decode_job job;
+
+        setup_decode_job(&job, fetch_in_fp, &trace, format, sizeof(fetch),
+                fields, IBS_FETCH_FIELDS_ALL, ibs_fetch_field_order,
+                IBS_FETCH_NUM_FIELDS);
+        job.of = &of;
+        job.af = af;
+        decode_parallel(&job, fetch_out_fp, "fetch");
+        teardown_decode_job(&job);
+    }
+    else
+    {
+        struct sample_sink out;
+
+        sink_init(&out, &of, fetch_out_fp, af);
+        while (read_record(fetch_in_fp, (format >= 2) ? &trace : NULL,
+                    &fetch, sizeof(fetch), fields, IBS_FETCH_FIELDS_ALL,
+                    ibs_fetch_field_order, IBS_FETCH_NUM_FIELDS) > 0) {
+            num_samples_seen++;
+            if (num_samples_seen % 100000 == 0)
+            {
+                printf("Working on fetch sample number %" PRIu64 "...\n",
+                        num_samples_seen);
+            }
 
-        output_fetch_entry(fetch_out_fp, fetch, family, model, fetch_ctl_ext);
+            sink_put(&out, &fetch);
+        }
+        sink_drain(&out);
+        sink_fini(&out);
     }
+    if (af != NULL)
+        arrow_file_close(af);
+    ibs_trace_reader_fini(&trace);
     printf("Done with fetch samples!\n");
 }
 
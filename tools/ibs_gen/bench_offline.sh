@@ -0,0 +1,92 @@
+#!/bin/bash
+# Copyright (c) 2015-2017 Advanced Micro Devices, Inc. All rights reserved.
+#
+# This file is made available under a 3-clause BSD license.
+# See tools/LICENSE for licensing details.
+#
+# Measures how many samples per second the IBS decoder and annotator get
+# through, on synthetic traces from ibs_gen, so that the speed of the
+# offline tools can be tracked on machines without IBS.
+#
+# Usage: ./bench_offline.sh [# samples] [# threads] [processor]
+#   # samples:  in each trace. Defaults to 2000000
+#   # threads:  for the multi-threaded runs, 0 for one per CPU. Defaults to 0
+#   processor:  passed to ibs_gen --processor. Defaults to zen2
+# Any other arguments go to ibs_gen, e.g. --miss_pct 20.
+#
+# Prints one CSV line per benchmark: its name, trace format, threads,
+# samples read, seconds, and samples per second.
+BASE_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)
+
+SAMPLES=${1:-2000000}
+THREADS=${2:-0}
+PROCESSOR=${3:-zen2}
+shift 3 2>/dev/null || shift $#
+
+GEN=${BASE_DIR}/ibs_gen
+DECODER=${BASE_DIR}/../ibs_decoder/ibs_decoder
+ANNOTATE=${BASE_DIR}/../ibs_annotate/ibs_annotate
+
+for tool in ${GEN} ${DECODER} ${ANNOTATE}; do
+    if [ ! -f ${tool} ]; then
+        echo -e "${tool} does not exist. Build the tools first. Exiting."
+        exit -1
+    fi
+done
+
+WORK_DIR=$(mktemp -d)
+trap "rm -rf ${WORK_DIR}" EXIT
+
+# The decoder stands in for the sampled program, since it has debug info
+for format in 1 2 3; do
+    case ${format} in
+        1) flag="" ;;
+        2) flag="--compress" ;;
+        3) flag="--columnar" ;;
+    esac
+    ${GEN} -o ${WORK_DIR}/op${format}.trace -f ${WORK_DIR}/fetch${format}.trace \
+        -n ${SAMPLES} -P ${PROCESSOR} -b ${DECODER} \
+        -M ${WORK_DIR}/module_map ${flag} "$@" > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+        echo -e "Failed to generate the format ${format} traces. Exiting."
+        exit -1
+    fi
+done
+
+# run_bench {name} {format} {threads} {command...}
+run_bench()
+{
+    local name=$1 format=$2 threads=$3
+    shift 3
+    local start=$(date +%s%N)
+    "$@" > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+        echo -e "${name} failed: $*" 1>&2
+        return
+    fi
+    local end=$(date +%s%N)
+    awk -v n="${name}" -v f="${format}" -v t="${threads}" -v s="${SAMPLES}" \
+        -v ns="$((end - start))" \
+        'BEGIN { sec = ns / 1e9; printf "%s,%s,%s,%d,%.3f,%.0f\n", n, f, t, s, sec, s / sec }'
+}
+
+echo "benchmark,format,threads,samples,seconds,samples_per_s"
+for format in 1 2 3; do
+    OP=${WORK_DIR}/op${format}.trace
+    FETCH=${WORK_DIR}/fetch${format}.trace
+    run_bench decode_op ${format} 1 ${DECODER} -i ${OP} -o ${WORK_DIR}/op.csv
+    run_bench decode_fetch ${format} 1 ${DECODER} -f ${FETCH} -g ${WORK_DIR}/fetch.csv
+    if [ ${format} -ne 2 ]; then
+        run_bench decode_op ${format} ${THREADS} ${DECODER} -t ${THREADS} -i ${OP} -o ${WORK_DIR}/op.csv
+    fi
+    run_bench decode_op_arrow ${format} ${THREADS} ${DECODER} -t ${THREADS} -a -i ${OP} -o ${WORK_DIR}/op.arrow
+    run_bench project_op ${format} ${THREADS} ${DECODER} -t ${THREADS} -C TSC,PID,IbsOpRip,IbsDcLinAd -i ${OP} -o ${WORK_DIR}/op_cols.csv
+    run_bench filter_op_pid ${format} ${THREADS} ${DECODER} -t ${THREADS} -p 1000 -i ${OP} -o ${WORK_DIR}/op_pid.csv
+    run_bench filter_op_user ${format} ${THREADS} ${DECODER} -t ${THREADS} -u -i ${OP} -o ${WORK_DIR}/op_user.csv
+    run_bench heatmap_op ${format} ${THREADS} ${DECODER} -t ${THREADS} -N ${WORK_DIR}/op.heatmap -i ${OP}
+done
+
+# Annotate the last full CSVs, which hold every format's samples alike
+run_bench annotate_op - 1 ${ANNOTATE} -i ${WORK_DIR}/op.csv -o ${WORK_DIR}/op_ann.csv -m ${WORK_DIR}/module_map -p 1000
+run_bench annotate_op - ${THREADS} ${ANNOTATE} -t ${THREADS} -i ${WORK_DIR}/op.csv -o ${WORK_DIR}/op_ann.csv -m ${WORK_DIR}/module_map -p 1000
+run_bench annotate_fetch - ${THREADS} ${ANNOTATE} -t ${THREADS} -i ${WORK_DIR}/fetch.csv -o ${WORK_DIR}/fetch_ann.csv -m ${WORK_DIR}/module_map -p 1000
@@ -0,0 +1,887 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ *
+ * Writes synthetic IBS traces, so that ibs_decoder and ibs_annotate can be
+ * run and benchmarked on machines without IBS. The traces have the headers
+ * that ibs_monitor would write on the chosen processor (see ibs-header.h),
+ * in any of its trace formats and field masks, and hold samples from a
+ * made-up set of processes whose code addresses, data addresses, miss rates
+ * and branch behavior follow the distributions given on the command line.
+ *
+ * With --binary, the code addresses fall in that program's executable
+ * segments, and --module_map writes where it was mapped in each process, so
+ * that the samples can be annotated.
+ */
+#define _GNU_SOURCE
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ibs-uapi.h"
+#include "ibs-header.h"
+#include "ibs-trace.h"
+#include "ibs-modmap.h"
+
+// The processors a trace can claim to come from. ibs_id is what CPUID
+// Fn8000_001B_EAX says about their IBS.
+struct processor {
+    const char *name;
+    uint32_t family;
+    uint32_t model;
+    uint32_t stepping;
+    uint32_t ibs_id;
+    const char *brand;
+};
+
+static const struct processor processors[] = {
+    {"k10", 0x10, 0x02, 0x3, 0x01F, "AMD Phenom(tm) 9850 Quad-Core Processor"},
+    {"bulldozer", 0x15, 0x01, 0x2, 0x0FF, "AMD FX(tm)-8150 Eight-Core Processor"},
+    {"steamroller", 0x15, 0x30, 0x1, 0x1FF, "AMD A10-7850K Radeon R7, 12 Compute Cores 4C+8G"},
+    {"excavator", 0x15, 0x60, 0x1, 0x7FF, "AMD A12-9800 RADEON R7, 12 COMPUTE CORES 4C+8G"},
+    {"jaguar", 0x16, 0x00, 0x1, 0x1FF, "AMD Athlon(tm) 5350 APU with Radeon(tm) R3"},
+    {"zen", 0x17, 0x01, 0x1, 0x3FF, "AMD Ryzen 7 1800X Eight-Core Processor"},
+    {"zen2", 0x17, 0x31, 0x0, 0x3FF, "AMD EPYC 7742 64-Core Processor"},
+    {"zen3", 0x19, 0x01, 0x1, 0x3FF, "AMD EPYC 7763 64-Core Processor"},
+    {NULL, 0, 0, 0, 0, NULL}
+};
+
+#define DEFAULT_PROCESSOR   6   // zen2
+
+// Where the made-up processes keep things
+#define FIRST_PID           1000
+#define CODE_BASE           0x400000ULL
+#define CODE_SIZE           (16ULL << 20)
+#define PIE_BASE            0x555555554000ULL
+#define KERNEL_BASE         0xffffffff81000000ULL
+#define HEAP_BASE           0x7f0000000000ULL
+#define PHYS_FRAMES         (16ULL << 20)   // 64 GB of 4K frames
+
+struct segment {
+    uint64_t vaddr;
+    uint64_t size;
+    uint64_t offset;
+};
+
+FILE *op_fp = NULL;
+FILE *fetch_fp = NULL;
+FILE *module_map_fp = NULL;
+char *binary_file = NULL;
+static uint64_t num_samples = 1000000;
+static const struct processor *proc = &processors[DEFAULT_PROCESSOR];
+static uint32_t family, model;
+static uint64_t op_fields = IBS_OP_FIELDS_ALL;
+static uint64_t fetch_fields = IBS_FETCH_FIELDS_ALL;
+static uint32_t trace_format = 0;
+static unsigned long op_max_cnt = 0x4000;
+static unsigned long fetch_max_cnt = 0x1000;
+static int num_pids = 4;
+static int threads_per_pid = 4;
+static int num_cpus = 8;
+static uint64_t seed = 1;
+
+// The distributions, all in percent but the sizes
+static unsigned kernel_pct = 10;
+static unsigned mem_pct = 40;
+static unsigned store_pct = 30;
+static unsigned miss_pct = 5;
+static unsigned remote_pct = 20;
+static unsigned branch_pct = 15;
+static unsigned ic_miss_pct = 3;
+static unsigned hot_pct = 80;
+static unsigned long num_rips = 8192;
+static unsigned long data_mb = 1024;
+
+// The code addresses every process runs, and the binary they are in
+static uint64_t *rips = NULL;
+static uint64_t load_base = CODE_BASE;
+static struct segment *segments = NULL;
+static int num_segments = 0;
+
+static uint64_t rng_state;
+
+static inline uint64_t rnd(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline int chance(unsigned pct)
+{
+    return rnd() % 100 < pct;
+}
+
+// An index below n that favors the low ones, as hot code does
+static inline uint64_t skewed(uint64_t n)
+{
+    double r = (rnd() >> 11) * (1.0 / 9007199254740992.0);
+    return (uint64_t)(r * r * r * n);
+}
+
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// The same linear page of the same process always gets the same frame
+static inline uint64_t phys_addr(int pid, uint64_t lin)
+{
+    uint64_t frame = mix64(((uint64_t)pid << 48) ^ (lin >> 12)) % PHYS_FRAMES;
+    return ((frame + 0x100000) << 12) | (lin & 0xfff);
+}
+
+static unsigned long parse_num(const char *opt, const char *what,
+        unsigned long max)
+{
+    char *end;
+    unsigned long val;
+
+    errno = 0;
+    val = strtoul(opt, &end, 0);
+    if (*end != '\0' || end == opt || errno || val > max)
+    {
+        fprintf(stderr, "Bad %s: %s\n", what, opt);
+        exit(EXIT_FAILURE);
+    }
+    return val;
+}
+
+static FILE *open_out_file(const char *opt, const char *what)
+{
+    FILE *fp = fopen(opt, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Cannot fopen %s: %s\n", what, opt);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+static void set_processor(const char *opt)
+{
+    for (int i = 0; processors[i].name != NULL; i++)
+    {
+        if (!strcmp(opt, processors[i].name))
+        {
+            proc = &processors[i];
+            return;
+        }
+    }
+    fprintf(stderr, "Unknown processor: %s. Choose from", opt);
+    for (int i = 0; processors[i].name != NULL; i++)
+        fprintf(stderr, " %s", processors[i].name);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t set_fields(const char *opt, uint64_t all, const char *what)
+{
+    uint64_t fields = parse_num(opt, what, ULONG_MAX);
+    if (fields == 0 || (fields & ~all))
+    {
+        fprintf(stderr, "Invalid IBS %s - 0x%" PRIx64 "\n", what, fields);
+        fprintf(stderr, "It must be a non-zero subset of 0x%" PRIx64 "\n",
+                all);
+        exit(EXIT_FAILURE);
+    }
+    return fields;
+}
+
+void parse_args(int argc, char *argv[])
+{
+    static struct option longopts[] =
+    {
+        {"op_file", required_argument, NULL, 'o'},
+        {"fetch_file", required_argument, NULL, 'f'},
+        {"module_map", required_argument, NULL, 'M'},
+        {"binary", required_argument, NULL, 'b'},
+        {"samples", required_argument, NULL, 'n'},
+        {"processor", required_argument, NULL, 'P'},
+        {"family", required_argument, NULL, 'Y'},
+        {"model", required_argument, NULL, 'm'},
+        {"op_fields", required_argument, NULL, 'O'},
+        {"fetch_fields", required_argument, NULL, 'F'},
+        {"compress", no_argument, NULL, 'z'},
+        {"columnar", no_argument, NULL, 'c'},
+        {"op_sample_rate", required_argument, NULL, 'r'},
+        {"fetch_sample_rate", required_argument, NULL, 's'},
+        {"pids", required_argument, NULL, 'p'},
+        {"threads", required_argument, NULL, 'T'},
+        {"cpus", required_argument, NULL, 'C'},
+        {"kernel_pct", required_argument, NULL, 'k'},
+        {"mem_pct", required_argument, NULL, 'e'},
+        {"store_pct", required_argument, NULL, 'S'},
+        {"miss_pct", required_argument, NULL, 'd'},
+        {"remote_pct", required_argument, NULL, 'R'},
+        {"branch_pct", required_argument, NULL, 'j'},
+        {"ic_miss_pct", required_argument, NULL, 'i'},
+        {"hot_pct", required_argument, NULL, 'H'},
+        {"rips", required_argument, NULL, 'x'},
+        {"data_mb", required_argument, NULL, 'D'},
+        {"seed", required_argument, NULL, 'X'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv,
+                    "ho:f:M:b:n:P:Y:m:O:F:zcr:s:p:T:C:k:e:S:d:R:j:i:H:x:D:X:",
+                    longopts, NULL)) != -1)
+    {
+        switch (c) {
+            case 'h':
+            case '?':
+                fprintf(stderr, "This program writes synthetic IBS traces like the ones from the IBS monitor,\n");
+                fprintf(stderr, "so that the decoder and annotator can be tested and benchmarked without IBS.\n");
+                fprintf(stderr, "Usage: ./ibs_gen [-o op_output] [-f fetch_output] [other options below]\n");
+                fprintf(stderr, "--op_file (or -o) {filename}:\n");
+                fprintf(stderr, "       File to which to save op samples\n");
+                fprintf(stderr, "--fetch_file (or -f) {filename}:\n");
+                fprintf(stderr, "       File to which to save fetch samples\n");
+                fprintf(stderr, "--binary (or -b) {filename}:\n");
+                fprintf(stderr, "       Put the code addresses in this ELF program's executable segments\n");
+                fprintf(stderr, "--module_map (or -M) {filename}:\n");
+                fprintf(stderr, "       Save where --binary was mapped in each process, as a module map for ibs_annotate\n");
+                fprintf(stderr, "--samples (or -n) {# samples}:\n");
+                fprintf(stderr, "       Samples to write to each file. Defaults to 1000000\n");
+                fprintf(stderr, "--processor (or -P) {name}:\n");
+                fprintf(stderr, "       Write the headers and model-specific bits of this processor: k10, bulldozer,\n");
+                fprintf(stderr, "       steamroller, excavator, jaguar, zen, zen2, or zen3. Defaults to zen2\n");
+                fprintf(stderr, "--family (or -Y) {family}, --model (or -m) {model}:\n");
+                fprintf(stderr, "       Claim another family or model, with the --processor's CPUID flags\n");
+                fprintf(stderr, "--op_fields (or -O) {mask}, --fetch_fields (or -F) {mask}:\n");
+                fprintf(stderr, "       Only record these fields of each sample, as masks from ibs-uapi.h.\n");
+                fprintf(stderr, "       Defaults to all\n");
+                fprintf(stderr, "--compress (or -z), --columnar (or -c):\n");
+                fprintf(stderr, "       Write trace format 2 or 3, as the monitor does with the same options\n");
+                fprintf(stderr, "--op_sample_rate (or -r) {max count}, --fetch_sample_rate (or -s) {max count}:\n");
+                fprintf(stderr, "       The MaxCnt the samples were taken with, as given to the monitor. This sets\n");
+                fprintf(stderr, "       the time between samples. Default to 0x4000 and 0x1000\n");
+                fprintf(stderr, "--pids (or -p), --threads (or -T), --cpus (or -C) {#}:\n");
+                fprintf(stderr, "       Processes, threads per process, and CPUs the samples come from.\n");
+                fprintf(stderr, "       Default to 4, 4 and 8. PIDs start at %d\n", FIRST_PID);
+                fprintf(stderr, "--kernel_pct (or -k) {%%}:\n");
+                fprintf(stderr, "       Samples taken in the kernel. Defaults to 10\n");
+                fprintf(stderr, "--mem_pct (or -e) {%%}, --store_pct (or -S) {%%}:\n");
+                fprintf(stderr, "       Op samples that are loads or stores, and how many of those are stores.\n");
+                fprintf(stderr, "       Default to 40 and 30\n");
+                fprintf(stderr, "--miss_pct (or -d) {%%}, --remote_pct (or -R) {%%}:\n");
+                fprintf(stderr, "       Loads and stores that miss in the data cache, and misses served by another\n");
+                fprintf(stderr, "       node. Default to 5 and 20\n");
+                fprintf(stderr, "--branch_pct (or -j) {%%}:\n");
+                fprintf(stderr, "       Op samples that are branches. Defaults to 15\n");
+                fprintf(stderr, "--ic_miss_pct (or -i) {%%}:\n");
+                fprintf(stderr, "       Fetch samples that miss in the instruction cache. Defaults to 3\n");
+                fprintf(stderr, "--hot_pct (or -H) {%%}:\n");
+                fprintf(stderr, "       Data accesses to the hottest sixteenth of the data. Defaults to 80\n");
+                fprintf(stderr, "--rips (or -x) {#}:\n");
+                fprintf(stderr, "       Distinct code addresses, some much hotter than others. Defaults to 8192\n");
+                fprintf(stderr, "--data_mb (or -D) {# MB}:\n");
+                fprintf(stderr, "       Data each process touches. Defaults to 1024\n");
+                fprintf(stderr, "--seed (or -X) {#}:\n");
+                fprintf(stderr, "       The same seed and options always give the same samples. Defaults to 1\n");
+                exit(EXIT_SUCCESS);
+            case 'o':
+                op_fp = open_out_file(optarg, "Op File");
+                break;
+            case 'f':
+                fetch_fp = open_out_file(optarg, "Fetch File");
+                break;
+            case 'M':
+                module_map_fp = open_out_file(optarg, "Module Map File");
+                break;
+            case 'b':
+                binary_file = optarg;
+                break;
+            case 'n':
+                num_samples = parse_num(optarg, "number of samples", ULONG_MAX);
+                break;
+            case 'P':
+                set_processor(optarg);
+                break;
+            case 'Y':
+                family = parse_num(optarg, "family", 0xff);
+                break;
+            case 'm':
+                model = parse_num(optarg, "model", 0xff);
+                break;
+            case 'O':
+                op_fields = set_fields(optarg, IBS_OP_FIELDS_ALL, "op field mask");
+                break;
+            case 'F':
+                fetch_fields = set_fields(optarg, IBS_FETCH_FIELDS_ALL,
+                        "fetch field mask");
+                break;
+            case 'z':
+                trace_format = IBS_TRACE_FORMAT_DELTA;
+                break;
+            case 'c':
+                trace_format = IBS_TRACE_FORMAT_COLUMNS;
+                break;
+            case 'r':
+                op_max_cnt = parse_num(optarg, "op sample rate", 0x7fffff);
+                break;
+            case 's':
+                fetch_max_cnt = parse_num(optarg, "fetch sample rate", 0xffff);
+                break;
+            case 'p':
+                num_pids = parse_num(optarg, "number of processes", 100000);
+                break;
+            case 'T':
+                threads_per_pid = parse_num(optarg, "number of threads", 99);
+                break;
+            case 'C':
+                num_cpus = parse_num(optarg, "number of CPUs", 4096);
+                break;
+            case 'k':
+                kernel_pct = parse_num(optarg, "percent", 100);
+                break;
+            case 'e':
+                mem_pct = parse_num(optarg, "percent", 100);
+                break;
+            case 'S':
+                store_pct = parse_num(optarg, "percent", 100);
+                break;
+            case 'd':
+                miss_pct = parse_num(optarg, "percent", 100);
+                break;
+            case 'R':
+                remote_pct = parse_num(optarg, "percent", 100);
+                break;
+            case 'j':
+                branch_pct = parse_num(optarg, "percent", 100);
+                break;
+            case 'i':
+                ic_miss_pct = parse_num(optarg, "percent", 100);
+                break;
+            case 'H':
+                hot_pct = parse_num(optarg, "percent", 100);
+                break;
+            case 'x':
+                num_rips = parse_num(optarg, "number of code addresses",
+                        1UL << 24);
+                break;
+            case 'D':
+                data_mb = parse_num(optarg, "data size", 1UL << 20);
+                break;
+            case 'X':
+                seed = parse_num(optarg, "seed", ULONG_MAX);
+                break;
+        }
+    }
+
+    if (op_fp == NULL && fetch_fp == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. Give an op file, a fetch file, or both.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    if (module_map_fp != NULL && binary_file == NULL)
+    {
+        fprintf(stderr, "\n\nERROR. --module_map needs a --binary.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    if (num_pids < 1 || threads_per_pid < 1 || num_cpus < 1 ||
+            num_rips < 1 || data_mb < 1 || mem_pct + branch_pct > 100)
+    {
+        fprintf(stderr, "\n\nERROR. There must be at least one process, ");
+        fprintf(stderr, "thread, CPU, code address and MB of data, and\n");
+        fprintf(stderr, "--mem_pct and --branch_pct cannot add up to more ");
+        fprintf(stderr, "than 100.\n\n");
+        exit(EXIT_FAILURE);
+    }
+    if (family == 0)
+        family = proc->family;
+    if (model == 0 && family == proc->family)
+        model = proc->model;
+}
+
+// The executable segments of binary_file, which every process maps at
+// load_base
+static void read_binary(void)
+{
+    Elf64_Ehdr ehdr;
+    int fd = open(binary_file, O_RDONLY);
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "Cannot open Binary File: %s\n", binary_file);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+            memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+            ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+            ehdr.e_phentsize != sizeof(Elf64_Phdr))
+    {
+        fprintf(stderr, "\n\nERROR. %s is not a 64-bit ELF file.\n\n",
+                binary_file);
+        exit(EXIT_FAILURE);
+    }
+    load_base = (ehdr.e_type == ET_DYN) ? PIE_BASE : 0;
+
+    segments = calloc(ehdr.e_phnum, sizeof(*segments));
+    if (segments == NULL)
+    {
+        fprintf(stderr, "Out of memory for %s\n", binary_file);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ehdr.e_phnum; i++)
+    {
+        Elf64_Phdr phdr;
+        if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff + i * sizeof(phdr)) !=
+                sizeof(phdr))
+            break;
+        if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X) ||
+                phdr.p_filesz == 0)
+            continue;
+        segments[num_segments].vaddr = phdr.p_vaddr;
+        segments[num_segments].size = phdr.p_filesz;
+        segments[num_segments].offset = phdr.p_offset;
+        num_segments++;
+    }
+    close(fd);
+    if (num_segments == 0)
+    {
+        fprintf(stderr, "\n\nERROR. %s has no code.\n\n", binary_file);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void make_rips(void)
+{
+    uint64_t code_size = 0;
+
+    rips = malloc(num_rips * sizeof(*rips));
+    if (rips == NULL)
+    {
+        fprintf(stderr, "Out of memory for the code addresses\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_segments; i++)
+        code_size += segments[i].size;
+    for (unsigned long i = 0; i < num_rips; i++)
+    {
+        if (num_segments == 0)
+        {
+            rips[i] = CODE_BASE + rnd() % CODE_SIZE;
+            continue;
+        }
+        uint64_t off = rnd() % code_size;
+        int s = 0;
+        while (off >= segments[s].size)
+            off -= segments[s++].size;
+        rips[i] = load_base + segments[s].vaddr + off;
+    }
+}
+
+static void write_module_map(uint64_t start_tsc)
+{
+    char *path = realpath(binary_file, NULL);
+
+    if (path == NULL || ibs_modmap_write_header(module_map_fp, FIRST_PID,
+                start_tsc))
+    {
+        fprintf(stderr, "Failed to write the module map header\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int p = 0; p < num_pids; p++)
+    {
+        for (int i = 0; i < num_segments; i++)
+        {
+            uint64_t start = segments[i].vaddr & ~0xfffULL;
+            uint64_t end = (segments[i].vaddr + segments[i].size + 0xfff) &
+                ~0xfffULL;
+            if (ibs_modmap_write(module_map_fp, IBS_MODMAP_MAP,
+                        FIRST_PID + p, start_tsc, load_base + start,
+                        load_base + end, segments[i].offset & ~0xfffULL,
+                        path))
+            {
+                fprintf(stderr, "Failed to write the module map\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    free(path);
+    if (fclose(module_map_fp))
+        fprintf(stderr, "Failed to close the module map\n");
+}
+
+static void write_machine_setup(FILE *fp, char *argv[])
+{
+    char timestamp[512];
+    time_t cur_time;
+    char *cwd = getcwd(NULL, 0);
+
+    fprintf(fp, "AMD Processor Family: 0x%x\n", family);
+    fprintf(fp, "AMD Processor Model: 0x%x\n", model);
+    fprintf(fp, "AMD Processor Stepping: 0x%x\n", proc->stepping);
+    fprintf(fp, "AMD Processor Name: %s\n", proc->brand);
+    fprintf(fp, "Memory Size: %.1f GB\n", (double)(PHYS_FRAMES >> 18));
+    fprintf(fp, "System name: ibs_gen\n");
+    fprintf(fp, "OS: synthetic\n");
+    time(&cur_time);
+    strftime(timestamp, sizeof(timestamp), "%c", localtime(&cur_time));
+    fprintf(fp, "Timestamp: %s\n", timestamp);
+    fprintf(fp, "Working directory: %s\n", cwd ? cwd : "/");
+    free(cwd);
+    fprintf(fp, "Command line: ");
+    for (int i = 0; argv[i] != NULL; i++)
+        fprintf(fp, "%s ", argv[i]);
+    fprintf(fp, "\n");
+}
+
+static void write_op_header(FILE *fp, char *argv[])
+{
+    fprintf(fp, "IBS Op Sample File\n");
+    write_machine_setup(fp, argv);
+    fprintf(fp, "IBS Op Structure Version: %u\n", IBS_OP_STRUCT_VERSION);
+    fprintf(fp, "IBS Op Field Mask: 0x%" PRIx64 "\n", op_fields);
+    if (trace_format)
+        fprintf(fp, "IBS Trace Format: %u\n", trace_format);
+    ibs_header_op_support(fp, family, model, proc->ibs_id);
+}
+
+static void write_fetch_header(FILE *fp, char *argv[])
+{
+    fprintf(fp, "IBS Fetch Sample File\n");
+    write_machine_setup(fp, argv);
+    fprintf(fp, "IBS Fetch Structure Version: %u\n",
+            IBS_FETCH_STRUCT_VERSION);
+    fprintf(fp, "IBS Fetch Field Mask: 0x%" PRIx64 "\n", fetch_fields);
+    if (trace_format)
+        fprintf(fp, "IBS Trace Format: %u\n", trace_format);
+    ibs_header_fetch_support(fp, proc->ibs_id);
+}
+
+// One of the files being written, and how its records are packed
+struct output {
+    FILE *fp;
+    const char *name;
+    uint64_t fields;
+    size_t entry_size;
+    const uint64_t *order;
+    size_t num_fields;
+    long full_offsets[IBS_OP_NUM_FIELDS];
+    ibs_trace_writer_t trace;
+    unsigned char record[sizeof(ibs_op_t)];
+    uint64_t num_records;
+};
+
+static void emit_trace_chunk(void *arg, const void *data, size_t len)
+{
+    struct output *out = arg;
+    if (fwrite(data, 1, len, out->fp) != len)
+    {
+        fprintf(stderr, "Failed to write %s\n", out->name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void output_init(struct output *out, FILE *fp, const char *name,
+        int is_op, uint64_t fields)
+{
+    uint64_t all = is_op ? IBS_OP_FIELDS_ALL : IBS_FETCH_FIELDS_ALL;
+
+    memset(out, 0, sizeof(*out));
+    out->fp = fp;
+    out->name = name;
+    out->fields = fields;
+    out->entry_size = ibs_sample_entry_size(fields);
+    out->order = is_op ? ibs_op_field_order : ibs_fetch_field_order;
+    out->num_fields = is_op ? IBS_OP_NUM_FIELDS : IBS_FETCH_NUM_FIELDS;
+    for (size_t i = 0; i < out->num_fields; i++)
+        out->full_offsets[i] = ibs_trace_field_offset(out->order,
+                out->num_fields, all, out->order[i]);
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+    if (trace_format)
+        ibs_trace_writer_init(&out->trace, trace_format, is_op, fields,
+                ftell(fp), emit_trace_chunk, out);
+}
+
+// Pack a full ibs_op_t or ibs_fetch_t as the driver would for out's fields
+static void output_put(struct output *out, const void *sample, int cpu)
+{
+    const unsigned char *src = sample;
+    unsigned char *p = out->record;
+
+    for (size_t i = 0; i < out->num_fields; i++)
+    {
+        size_t len = ibs_trace_field_len(out->order[i]);
+        if (!(out->fields & out->order[i]))
+            continue;
+        memcpy(p, src + out->full_offsets[i], len);
+        p += len;
+    }
+    if (trace_format)
+    {
+        if (ibs_trace_put(&out->trace, cpu, out->record))
+        {
+            fprintf(stderr, "Out of memory for %s\n", out->name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (fwrite(out->record, out->entry_size, 1, out->fp) != 1)
+    {
+        fprintf(stderr, "Failed to write %s\n", out->name);
+        exit(EXIT_FAILURE);
+    }
+    out->num_records++;
+}
+
+static void output_fini(struct output *out)
+{
+    if (out->fp == NULL)
+        return;
+    if (trace_format && ibs_trace_writer_fini(&out->trace))
+    {
+        fprintf(stderr, "Out of memory for %s\n", out->name);
+        exit(EXIT_FAILURE);
+    }
+    if (fclose(out->fp))
+    {
+        fprintf(stderr, "Failed to write %s\n", out->name);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Wrote %" PRIu64 " %s samples\n", out->num_records,
+            out->name);
+}
+
+// Who a sample was taken from
+struct context {
+    uint64_t tsc;
+    uint64_t cr3;
+    int pid;
+    int tid;
+    int cpu;
+    int kern_mode;
+};
+
+static void pick_context(struct context *ctx)
+{
+    int p = rnd() % num_pids;
+    int t = rnd() % threads_per_pid;
+
+    ctx->pid = FIRST_PID + p * 100;
+    ctx->tid = ctx->pid + t;
+    ctx->cr3 = (mix64(ctx->pid) & 0xffffffff000ULL);
+    // Threads mostly stay on one CPU
+    ctx->cpu = chance(90) ? mix64(ctx->tid) % num_cpus : rnd() % num_cpus;
+    ctx->kern_mode = chance(kernel_pct);
+}
+
+static uint64_t pick_rip(const struct context *ctx)
+{
+    if (ctx->kern_mode)
+        return KERNEL_BASE + skewed(CODE_SIZE);
+    return rips[skewed(num_rips)];
+}
+
+static uint64_t pick_data(const struct context *ctx)
+{
+    uint64_t pages = data_mb << 8;
+    uint64_t page = chance(hot_pct) ? rnd() % ((pages + 15) / 16) :
+        rnd() % pages;
+    uint64_t base = ctx->kern_mode ? 0xffff888000000000ULL :
+        HEAP_BASE + ((uint64_t)(ctx->pid - FIRST_PID) << 32);
+
+    return base + (page << 12) + (rnd() & 0xff8);
+}
+
+static void make_op(ibs_op_t *op, const struct context *ctx)
+{
+    uint32_t id = proc->ibs_id;
+    unsigned kind = rnd() % 100;
+    int is_mem = kind < mem_pct;
+    int is_branch = !is_mem && kind < mem_pct + branch_pct;
+    int missed = 0;
+
+    memset(op, 0, sizeof(*op));
+    op->op_ctl.reg.ibs_op_max_cnt = op_max_cnt & 0xffff;
+    if (id & IBS_CPUID_OP_CNT_EXT)
+        op->op_ctl.reg.ibs_op_max_cnt_upper = (op_max_cnt >> 16) & 0x7f;
+    op->op_ctl.reg.ibs_op_en = 1;
+    op->op_ctl.reg.ibs_op_val = 1;
+    op->op_ctl.reg.ibs_op_cur_cnt = rnd() & 0x3f;
+    op->op_rip = pick_rip(ctx);
+
+    op->op_data.reg.ibs_comp_to_ret_ctr = 1 + (rnd() & 0x1f);
+    if (is_branch)
+    {
+        op->op_data.reg.ibs_op_brn_ret = 1;
+        op->op_data.reg.ibs_op_brn_taken = chance(60);
+        op->op_data.reg.ibs_op_brn_misp = chance(4);
+        op->op_data.reg.ibs_op_return = chance(8);
+        if (id & IBS_CPUID_OP_BRN_FUSE)
+            op->op_data.reg.ibs_op_brn_fuse = chance(10);
+        if ((id & IBS_CPUID_BRN_TRGT) && op->op_data.reg.ibs_op_brn_taken)
+            op->br_target = pick_rip(ctx);
+    }
+    else if (!is_mem && (family == 0x17 ||
+                (family == 0x15 && model >= 0x60)))
+        op->op_data.reg.ibs_op_microcode = chance(1);
+
+    if (is_mem)
+    {
+        ibs_op_data3_t *d3 = &op->op_data3;
+        int store = chance(store_pct);
+
+        d3->reg.ibs_ld_op = !store;
+        d3->reg.ibs_st_op = store;
+        d3->reg.ibs_op_mem_width = 4;
+        op->dc_lin_ad = pick_data(ctx);
+        d3->reg.ibs_lin_addr_valid = 1;
+        if (chance(95))
+        {
+            op->dc_phys_ad.reg.ibs_dc_phys_addr =
+                phys_addr(ctx->pid, op->dc_lin_ad);
+            d3->reg.ibs_phy_addr_valid = 1;
+        }
+        if (chance(2))
+        {
+            d3->reg.ibs_dc_l1_tlb_miss = 1;
+            d3->reg.ibs_dc_l2_tlb_miss = chance(30);
+            d3->reg.ibs_tlb_refill_lat = 20 + skewed(400);
+        }
+        if (chance(miss_pct))
+        {
+            missed = 1;
+            d3->reg.ibs_dc_miss = 1;
+            d3->reg.ibs_dc_miss_lat = 30 + skewed(800);
+            d3->reg.ibs_l2_miss = chance(50);
+            d3->reg.ibs_op_dc_miss_open_mem_reqs = 1 + (rnd() & 0xf);
+            // Served by DRAM or by another cache, locally or not
+            op->op_data2.reg.ibs_nb_req_src = chance(60) ? 3 : 2;
+            op->op_data2.reg.ibs_nb_req_dst_node = chance(remote_pct);
+        }
+    }
+    op->op_data.reg.ibs_tag_to_ret_ctr = op->op_data.reg.ibs_comp_to_ret_ctr +
+        (rnd() & 0x3f) + (missed ? op->op_data3.reg.ibs_dc_miss_lat : 0);
+
+    op->tsc = ctx->tsc;
+    op->cr3 = ctx->cr3;
+    op->tid = ctx->tid;
+    op->pid = ctx->pid;
+    op->cpu = ctx->cpu;
+    op->kern_mode = ctx->kern_mode;
+}
+
+static void make_fetch(ibs_fetch_t *fetch, const struct context *ctx)
+{
+    ibs_fetch_ctl_t *ctl = &fetch->fetch_ctl;
+
+    memset(fetch, 0, sizeof(*fetch));
+    ctl->reg.ibs_fetch_max_cnt = fetch_max_cnt;
+    ctl->reg.ibs_fetch_cnt = fetch_max_cnt;
+    ctl->reg.ibs_fetch_en = 1;
+    ctl->reg.ibs_fetch_val = 1;
+    ctl->reg.ibs_fetch_comp = chance(95);
+    ctl->reg.ibs_fetch_lat = 4 + (rnd() & 0xf);
+    if (chance(ic_miss_pct))
+    {
+        ctl->reg.ibs_ic_miss = 1;
+        ctl->reg.ibs_fetch_lat += 20 + skewed(300);
+        if (proc->ibs_id & IBS_CPUID_FETCH_CTL_EXTD)
+            ctl->reg.ibs_fetch_l2_miss = chance(30);
+    }
+    if (chance(1))
+    {
+        ctl->reg.ibs_l1_tlb_miss = 1;
+        ctl->reg.ibs_l2_tlb_miss = chance(20);
+        if (proc->ibs_id & IBS_CPUID_FETCH_CTL_EXTD)
+            fetch->fetch_ctl_extd.reg.ibs_itlb_refill_lat = 20 + skewed(300);
+    }
+    fetch->fetch_lin_ad = pick_rip(ctx);
+    if (ctl->reg.ibs_fetch_comp)
+    {
+        ctl->reg.ibs_phy_addr_valid = 1;
+        fetch->fetch_phys_ad.reg.ibs_fetch_phy_addr =
+            phys_addr(ctx->pid, fetch->fetch_lin_ad);
+    }
+
+    fetch->tsc = ctx->tsc;
+    fetch->cr3 = ctx->cr3;
+    fetch->tid = ctx->tid;
+    fetch->pid = ctx->pid;
+    fetch->cpu = ctx->cpu;
+    fetch->kern_mode = ctx->kern_mode;
+}
+
+int main(int argc, char *argv[])
+{
+    struct output op_out, fetch_out;
+    struct context ctx;
+    uint64_t start_tsc = 0x100000000ULL;
+    uint64_t op_tsc = start_tsc, fetch_tsc = start_tsc;
+    uint64_t op_step, fetch_step;
+
+    parse_args(argc, argv);
+    rng_state = mix64(seed) | 1;
+    // About one op per cycle on each CPU, so that the machine as a whole
+    // takes a sample every MaxCnt * 16 / CPUs cycles
+    op_step = (op_max_cnt * 16) / num_cpus + 1;
+    fetch_step = (fetch_max_cnt * 16) / num_cpus + 1;
+    if (binary_file != NULL)
+        read_binary();
+    make_rips();
+    if (module_map_fp != NULL)
+        write_module_map(start_tsc);
+
+    if (op_fp != NULL)
+    {
+        write_op_header(op_fp, argv);
+        output_init(&op_out, op_fp, "op", 1, op_fields);
+    }
+    if (fetch_fp != NULL)
+    {
+        write_fetch_header(fetch_fp, argv);
+        output_init(&fetch_out, fetch_fp, "fetch", 0, fetch_fields);
+    }
+
+    for (uint64_t i = 0; i < num_samples; i++)
+    {
+        if (op_fp != NULL)
+        {
+            ibs_op_t op;
+            op_tsc += op_step / 2 + rnd() % op_step;
+            ctx.tsc = op_tsc;
+            pick_context(&ctx);
+            make_op(&op, &ctx);
+            output_put(&op_out, &op, ctx.cpu);
+        }
+        if (fetch_fp != NULL)
+        {
+            ibs_fetch_t fetch;
+            fetch_tsc += fetch_step / 2 + rnd() % fetch_step;
+            ctx.tsc = fetch_tsc;
+            pick_context(&ctx);
+            make_fetch(&fetch, &ctx);
+            output_put(&fetch_out, &fetch, ctx.cpu);
+        }
+    }
+
+    if (op_fp != NULL)
+        output_fini(&op_out);
+    if (fetch_fp != NULL)
+        output_fini(&fetch_out);
+    free(rips);
+    free(segments);
+    return 0;
+}
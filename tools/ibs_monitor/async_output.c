@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ *
+ * Background writes for the AMD Research IBS monitoring utility, so that the
+ * thread draining the driver's buffers never waits on storage.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "async_output.h"
+
+struct async_buf {
+    char *data;
+    size_t len;
+    off_t off;                  // Where data[0] goes in the file
+    struct async_file *af;
+    struct async_buf *next;
+};
+
+struct async_file {
+    FILE *fp;
+    int fd;                     // fp's file, reopened with O_DIRECT if asked
+    int direct;
+    int stream;                 // fp has no file; write through it in order
+    struct async_buf *cur;      // Being filled by the caller
+    off_t end;                  // File size once everything is written
+    int inflight;               // Buffers queued or being written
+};
+
+// Everything below is protected by lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t free_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cv = PTHREAD_COND_INITIALIZER;
+static struct async_buf *free_bufs = NULL;
+static struct async_buf *queue_head = NULL;
+static struct async_buf *queue_tail = NULL;
+static int stopping = 0;
+static unsigned long stalls = 0;
+
+static struct async_buf *all_bufs = NULL;
+static size_t num_bufs = 0;
+static size_t buf_len = 0;
+static size_t page_size = 0;
+static int use_direct = 0;
+static pthread_t writer;
+
+static struct async_buf *get_buf(struct async_file *af, off_t off)
+{
+    struct async_buf *b;
+
+    pthread_mutex_lock(&lock);
+    if (free_bufs == NULL)
+        stalls++;
+    while (free_bufs == NULL)
+        pthread_cond_wait(&free_cv, &lock);
+    b = free_bufs;
+    free_bufs = b->next;
+    pthread_mutex_unlock(&lock);
+
+    b->len = 0;
+    b->off = off;
+    b->af = af;
+    b->next = NULL;
+    return b;
+}
+
+static void submit_buf(struct async_buf *b)
+{
+    pthread_mutex_lock(&lock);
+    b->af->inflight++;
+    if (queue_tail != NULL)
+        queue_tail->next = b;
+    else
+        queue_head = b;
+    queue_tail = b;
+    pthread_cond_signal(&work_cv);
+    pthread_mutex_unlock(&lock);
+}
+
+static void write_buf(struct async_buf *b)
+{
+    size_t len = b->len;
+    size_t done = 0;
+
+    // O_DIRECT only takes whole pages; the file is truncated on close
+    if (b->af->direct && len % page_size)
+    {
+        size_t padded = (len + page_size - 1) & ~(page_size - 1);
+        memset(b->data + len, 0, padded - len);
+        len = padded;
+    }
+
+    // There is one writer thread, so a stream's buffers go out in order
+    if (b->af->stream)
+    {
+        if (fwrite(b->data, 1, len, b->af->fp) < len || fflush(b->af->fp))
+        {
+            fprintf(stderr, "Failed to stream %zu bytes of samples\n", len);
+            fprintf(stderr, "    %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    while (done < len)
+    {
+        ssize_t tmp = pwrite(b->af->fd, b->data + done, len - done,
+                b->off + done);
+        if (tmp < 0 && errno == EINTR)
+            continue;
+        if (tmp <= 0)
+        {
+            fprintf(stderr, "Failed to write %zu bytes of samples\n",
+                    len - done);
+            fprintf(stderr, "    %s\n", strerror(errno));
+            return;
+        }
+        done += tmp;
+    }
+}
+
+static void *writer_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for (;;)
+    {
+        struct async_buf *b;
+
+        while (queue_head == NULL && !stopping)
+            pthread_cond_wait(&work_cv, &lock);
+        if (queue_head == NULL)
+            break;
+        b = queue_head;
+        queue_head = b->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        write_buf(b);
+
+        pthread_mutex_lock(&lock);
+        b->af->inflight--;
+        b->next = free_bufs;
+        free_bufs = b;
+        pthread_cond_signal(&free_cv);
+        pthread_cond_broadcast(&done_cv);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void async_output_init(size_t nbufs, size_t buf_size, int direct)
+{
+    page_size = sysconf(_SC_PAGESIZE);
+    buf_len = (buf_size + page_size - 1) & ~(page_size - 1);
+    use_direct = direct;
+    num_bufs = (nbufs < 2) ? 2 : nbufs;
+
+    all_bufs = calloc(num_bufs, sizeof(struct async_buf));
+    if (all_bufs == NULL)
+    {
+        fprintf(stderr, "Could not allocate the output buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < num_bufs; i++)
+    {
+        if (posix_memalign((void **)&all_bufs[i].data, page_size, buf_len))
+        {
+            fprintf(stderr, "Could not allocate the output buffers\n");
+            exit(EXIT_FAILURE);
+        }
+        all_bufs[i].next = free_bufs;
+        free_bufs = &all_bufs[i];
+    }
+
+    if (pthread_create(&writer, NULL, writer_main, NULL))
+    {
+        fprintf(stderr, "Could not start the output thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+struct async_file *async_output_adopt(FILE *fp)
+{
+    struct async_file *af = calloc(1, sizeof(struct async_file));
+    off_t off;
+
+    if (af == NULL || fflush(fp) || (off = ftello(fp)) < 0)
+    {
+        fprintf(stderr, "Could not hand an output file to the writer\n");
+        exit(EXIT_FAILURE);
+    }
+    af->fp = fp;
+    af->fd = fileno(fp);
+    af->end = off;
+    af->stream = (af->fd < 0);
+
+    if (use_direct && !af->stream)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", af->fd);
+        af->fd = open(path, O_RDWR | O_DIRECT);
+        if (af->fd < 0)
+        {
+            fprintf(stderr, "Could not reopen an output file with O_DIRECT; ");
+            fprintf(stderr, "writing it through the page cache\n");
+            af->fd = fileno(fp);
+        }
+        else
+            af->direct = 1;
+    }
+
+    if (!af->direct)
+    {
+        af->cur = get_buf(af, off);
+        return af;
+    }
+
+    // Start on a page boundary, carrying over the page the header ends in
+    af->cur = get_buf(af, off & ~(off_t)(page_size - 1));
+    af->cur->len = off - af->cur->off;
+    if (af->cur->len &&
+            pread(af->fd, af->cur->data, page_size, af->cur->off) <
+            (ssize_t)af->cur->len)
+    {
+        fprintf(stderr, "Could not read back an output file's header\n");
+        exit(EXIT_FAILURE);
+    }
+    return af;
+}
+
+void async_output_write(struct async_file *af, const void *data, size_t len)
+{
+    const char *src = data;
+
+    af->end += len;
+    while (len > 0)
+    {
+        size_t room = buf_len - af->cur->len;
+        size_t n = (len < room) ? len : room;
+
+        memcpy(af->cur->data + af->cur->len, src, n);
+        af->cur->len += n;
+        src += n;
+        len -= n;
+
+        if (af->cur->len == buf_len)
+        {
+            off_t next = af->cur->off + buf_len;
+            submit_buf(af->cur);
+            af->cur = get_buf(af, next);
+        }
+    }
+}
+
+void async_output_close(struct async_file *af)
+{
+    if (af->cur->len)
+        submit_buf(af->cur);
+    else
+    {
+        pthread_mutex_lock(&lock);
+        af->cur->next = free_bufs;
+        free_bufs = af->cur;
+        pthread_cond_signal(&free_cv);
+        pthread_mutex_unlock(&lock);
+    }
+
+    pthread_mutex_lock(&lock);
+    while (af->inflight)
+        pthread_cond_wait(&done_cv, &lock);
+    pthread_mutex_unlock(&lock);
+
+    if (af->direct)
+    {
+        if (ftruncate(af->fd, af->end))
+            fprintf(stderr, "Could not trim an output file: %s\n",
+                    strerror(errno));
+        close(af->fd);
+    }
+    if (fclose(af->fp))
+        fprintf(stderr, "Could not close an output file: %s\n",
+                strerror(errno));
+    free(af);
+}
+
+unsigned long async_output_fini(void)
+{
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&work_cv);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+
+    for (size_t i = 0; i < num_bufs; i++)
+        free(all_bufs[i].data);
+    free(all_bufs);
+    all_bufs = NULL;
+    free_bufs = NULL;
+    return stalls;
+}
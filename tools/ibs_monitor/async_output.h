@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ */
+#ifndef ASYNC_OUTPUT_H
+#define ASYNC_OUTPUT_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Writes to a file that has been handed to a background writer thread.
+// Data is copied into one of a pool of page-aligned buffers, and a buffer is
+// written out once it is full, so the caller only waits on storage when
+// every buffer in the pool is queued.
+struct async_file;
+
+// Start the writer thread with nbufs buffers of buf_size bytes each, rounded
+// up to a multiple of the page size. With direct, files are written with
+// O_DIRECT so that large captures do not fill the page cache.
+void async_output_init(size_t nbufs, size_t buf_size, int direct);
+
+// Take over fp, which may already hold a header. Later writes go after what
+// it holds. Do not use fp directly again. fp may also be a stream with no
+// file descriptor (see ibs-stream.h), which is written through in order and
+// never with O_DIRECT.
+struct async_file *async_output_adopt(FILE *fp);
+
+void async_output_write(struct async_file *af, const void *data, size_t len);
+
+// Write out what is left, wait for it to reach the file, and close it
+void async_output_close(struct async_file *af);
+
+// Stop the writer thread once every file is closed. Returns the number of
+// times a caller had to wait for a free buffer.
+unsigned long async_output_fini(void);
+
+#endif  /* ASYNC_OUTPUT_H */
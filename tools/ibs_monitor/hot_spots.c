@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ *
+ * Live hot-spot tables for the AMD Research IBS monitoring utility.
+ *
+ * Each table is a space-saving summary (Metwally et al., "Efficient
+ * Computation of Frequent and Top-k Elements in Data Streams"): a min-heap
+ * of HOT_SPOT_SLOTS counters plus a hash table to find them. A key that is
+ * not in the heap takes over the smallest counter, inheriting its count as
+ * the bound on how far its own count may be over. Any key with more than
+ * 1/HOT_SPOT_SLOTS of the misses is always in the heap.
+ *
+ * The attributes of a key's misses (latency, where they were served from)
+ * are only known for the misses since it entered the heap, so they are
+ * shown as averages and fractions of those. Memory ops, most of which do
+ * not miss, go into a count-min sketch instead, which never undercounts.
+ */
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "ibs-uapi.h"
+#include "ibs-trace.h"
+#include "hot_spots.h"
+
+// Counters in each table. A key with more than 1/HOT_SPOT_SLOTS of the
+// (decayed) misses is never evicted.
+#define HOT_SPOT_SLOTS      1024
+#define HOT_SPOT_HASH_BITS  11
+#define HOT_SPOT_HASH_SLOTS (1 << HOT_SPOT_HASH_BITS)
+// Count-min sketch rows and columns. Over-counts are at most about
+// e/HOT_SPOT_CM_WIDTH of all memory ops, with probability 1 - e^-depth.
+#define HOT_SPOT_CM_DEPTH   4
+#define HOT_SPOT_CM_BITS    12
+#define HOT_SPOT_CM_WIDTH   (1 << HOT_SPOT_CM_BITS)
+// Northbridge request source for DRAM in IbsOpData2
+#define NB_REQ_SRC_DRAM     3
+
+struct hot_key {
+    uint64_t key;
+    uint64_t misses;        // Space-saving count
+    uint64_t error;         // Most that misses may be over by
+    uint64_t tracked;       // Misses seen since the key entered the heap
+    uint64_t lat_sum;       // Of the tracked misses' IbsDcMissLat
+    uint64_t dram;          // Tracked misses served from DRAM
+    uint64_t remote;        // Tracked misses served by another node
+    int slot;               // In the hash table
+};
+
+struct hot_table {
+    const char *name;
+    struct hot_key heap[HOT_SPOT_SLOTS];
+    int num_keys;
+    int hash[HOT_SPOT_HASH_SLOTS];     // Heap index, or -1
+    uint32_t cm[HOT_SPOT_CM_DEPTH][HOT_SPOT_CM_WIDTH];
+    uint64_t total_misses;
+    uint64_t total_ops;
+};
+
+static struct hot_table *rip_table = NULL;
+static struct hot_table *page_table = NULL;
+static int show_top = 0;
+static FILE *export = NULL;
+static unsigned long interval = 0;
+static struct timespec last_show;
+// Where the fields are in each record, or -1
+static long rip_off = -1, data2_off = -1, data3_off = -1, lin_ad_off = -1;
+
+// Odd multipliers for the hash functions
+static const uint64_t hash_mult[HOT_SPOT_CM_DEPTH + 1] = {
+    0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+    0xD6E8FEB86659FD93ULL, 0xFF51AFD7ED558CCDULL
+};
+
+static inline unsigned hash_bits(uint64_t key, int fn, int bits)
+{
+    return (key * hash_mult[fn]) >> (64 - bits);
+}
+
+static struct hot_table *new_table(const char *name)
+{
+    struct hot_table *t = calloc(1, sizeof(*t));
+
+    if (t == NULL)
+    {
+        fprintf(stderr, "Out of memory for the --live tables\n");
+        exit(EXIT_FAILURE);
+    }
+    t->name = name;
+    for (int i = 0; i < HOT_SPOT_HASH_SLOTS; i++)
+        t->hash[i] = -1;
+    return t;
+}
+
+static void heap_swap(struct hot_table *t, int a, int b)
+{
+    struct hot_key tmp = t->heap[a];
+    t->heap[a] = t->heap[b];
+    t->heap[b] = tmp;
+    t->hash[t->heap[a].slot] = a;
+    t->hash[t->heap[b].slot] = b;
+}
+
+// heap[i]'s count has grown
+static void sift_down(struct hot_table *t, int i)
+{
+    for (;;)
+    {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < t->num_keys && t->heap[l].misses < t->heap[min].misses)
+            min = l;
+        if (r < t->num_keys && t->heap[r].misses < t->heap[min].misses)
+            min = r;
+        if (min == i)
+            return;
+        heap_swap(t, i, min);
+        i = min;
+    }
+}
+
+static void sift_up(struct hot_table *t, int i)
+{
+    while (i > 0 && t->heap[(i - 1) / 2].misses > t->heap[i].misses)
+    {
+        heap_swap(t, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+// The hash slot holding key, or the empty one where it would go
+static int find_slot(const struct hot_table *t, uint64_t key)
+{
+    int s = hash_bits(key, HOT_SPOT_CM_DEPTH, HOT_SPOT_HASH_BITS);
+
+    while (t->hash[s] >= 0 && t->heap[t->hash[s]].key != key)
+        s = (s + 1) & (HOT_SPOT_HASH_SLOTS - 1);
+    return s;
+}
+
+// Linear probing can not just empty a slot: later keys that probed past it
+// have to move back into it.
+static void remove_slot(struct hot_table *t, int s)
+{
+    int next = s;
+
+    t->hash[s] = -1;
+    for (;;)
+    {
+        int home;
+        next = (next + 1) & (HOT_SPOT_HASH_SLOTS - 1);
+        if (t->hash[next] < 0)
+            return;
+        home = hash_bits(t->heap[t->hash[next]].key, HOT_SPOT_CM_DEPTH,
+                HOT_SPOT_HASH_BITS);
+        // Leave it if its home is cyclically in (s, next]
+        if ((next > s) ? (home > s && home <= next) :
+                (home > s || home <= next))
+            continue;
+        t->hash[s] = t->hash[next];
+        t->heap[t->hash[s]].slot = s;
+        t->hash[next] = -1;
+        s = next;
+    }
+}
+
+static void count_op(struct hot_table *t, uint64_t key)
+{
+    uint32_t *min = NULL;
+
+    // Conservative update: only raise the smallest counters
+    for (int d = 0; d < HOT_SPOT_CM_DEPTH; d++)
+    {
+        uint32_t *c = &t->cm[d][hash_bits(key, d, HOT_SPOT_CM_BITS)];
+        if (min == NULL || *c < *min)
+            min = c;
+    }
+    for (int d = 0; d < HOT_SPOT_CM_DEPTH; d++)
+    {
+        uint32_t *c = &t->cm[d][hash_bits(key, d, HOT_SPOT_CM_BITS)];
+        if (*c == *min && *c != UINT32_MAX)
+            (*c)++;
+    }
+    t->total_ops++;
+}
+
+static uint64_t op_estimate(const struct hot_table *t, uint64_t key)
+{
+    uint32_t min = UINT32_MAX;
+
+    for (int d = 0; d < HOT_SPOT_CM_DEPTH; d++)
+    {
+        uint32_t c = t->cm[d][hash_bits(key, d, HOT_SPOT_CM_BITS)];
+        if (c < min)
+            min = c;
+    }
+    return min;
+}
+
+static void count_miss(struct hot_table *t, uint64_t key, unsigned lat,
+        int dram, int remote)
+{
+    int s = find_slot(t, key);
+    int i = t->hash[s];
+    int is_new = 0;
+    struct hot_key *k;
+
+    if (i < 0 && t->num_keys < HOT_SPOT_SLOTS)
+    {
+        i = t->num_keys++;
+        k = &t->heap[i];
+        memset(k, 0, sizeof(*k));
+        is_new = 1;
+    }
+    else if (i < 0)
+    {
+        // Take over the smallest counter
+        i = 0;
+        k = &t->heap[0];
+        remove_slot(t, k->slot);
+        s = find_slot(t, key);
+        k->error = k->misses;
+        k->tracked = k->lat_sum = k->dram = k->remote = 0;
+    }
+    k = &t->heap[i];
+    if (t->hash[s] < 0)
+    {
+        k->key = key;
+        k->slot = s;
+        t->hash[s] = i;
+    }
+    k->misses++;
+    k->tracked++;
+    k->lat_sum += lat;
+    k->dram += dram;
+    k->remote += remote;
+    t->total_misses++;
+    // A new key starts as a leaf; any other only grew
+    if (is_new)
+        sift_up(t, i);
+    else
+        sift_down(t, i);
+}
+
+void hot_spots_init(int top_n, uint64_t fields, FILE *export_fp)
+{
+    rip_off = ibs_trace_field_offset(ibs_op_field_order, IBS_OP_NUM_FIELDS,
+            fields, IBS_OP_FIELD_RIP);
+    data2_off = ibs_trace_field_offset(ibs_op_field_order, IBS_OP_NUM_FIELDS,
+            fields, IBS_OP_FIELD_DATA2);
+    data3_off = ibs_trace_field_offset(ibs_op_field_order, IBS_OP_NUM_FIELDS,
+            fields, IBS_OP_FIELD_DATA3);
+    lin_ad_off = ibs_trace_field_offset(ibs_op_field_order, IBS_OP_NUM_FIELDS,
+            fields, IBS_OP_FIELD_DC_LIN_AD);
+    if (data3_off < 0 || (rip_off < 0 && lin_ad_off < 0))
+    {
+        fprintf(stderr, "Error, --live needs the op_data3 field and op_rip ");
+        fprintf(stderr, "or dc_lin_ad\n");
+        exit(EXIT_FAILURE);
+    }
+    if (rip_off >= 0)
+        rip_table = new_table("RIP");
+    if (lin_ad_off >= 0)
+        page_table = new_table("Page");
+    show_top = top_n;
+    export = export_fp;
+    if (export != NULL)
+        fprintf(export, "interval,tsc,table,rank,key,misses,misses_error,"
+                "mem_ops,avg_miss_lat,dram_misses,remote_misses\n");
+    clock_gettime(CLOCK_MONOTONIC, &last_show);
+}
+
+void hot_spots_add(const void *data, size_t entry_size, size_t n)
+{
+    const unsigned char *rec = data;
+
+    for (size_t i = 0; i < n; i++, rec += entry_size)
+    {
+        ibs_op_data2_t data2;
+        ibs_op_data3_t data3;
+        uint64_t rip = 0, page = 0;
+        int dram = 0, remote = 0;
+
+        data3.val = ibs_trace_load(rec + data3_off, 8);
+        if (!data3.reg.ibs_ld_op && !data3.reg.ibs_st_op)
+            continue;
+        if (rip_off >= 0)
+            rip = ibs_trace_load(rec + rip_off, 8);
+        if (lin_ad_off >= 0 && data3.reg.ibs_lin_addr_valid)
+            page = ibs_trace_load(rec + lin_ad_off, 8) >> 12;
+        if (rip_table != NULL)
+            count_op(rip_table, rip);
+        if (page_table != NULL && data3.reg.ibs_lin_addr_valid)
+            count_op(page_table, page);
+
+        if (!data3.reg.ibs_dc_miss)
+            continue;
+        if (data2_off >= 0)
+        {
+            data2.val = ibs_trace_load(rec + data2_off, 8);
+            dram = data2.reg.ibs_nb_req_src == NB_REQ_SRC_DRAM;
+            remote = data2.reg.ibs_nb_req_dst_node;
+        }
+        if (rip_table != NULL)
+            count_miss(rip_table, rip, data3.reg.ibs_dc_miss_lat, dram,
+                    remote);
+        if (page_table != NULL && data3.reg.ibs_lin_addr_valid)
+            count_miss(page_table, page, data3.reg.ibs_dc_miss_lat, dram,
+                    remote);
+    }
+}
+
+static int by_misses(const void *a, const void *b)
+{
+    const struct hot_key *x = *(const struct hot_key * const *)a;
+    const struct hot_key *y = *(const struct hot_key * const *)b;
+    if (x->misses != y->misses)
+        return (x->misses > y->misses) ? -1 : 1;
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+static void show_table(const struct hot_table *t, uint64_t tsc)
+{
+    const struct hot_key *sorted[HOT_SPOT_SLOTS];
+    int n = t->num_keys < show_top ? t->num_keys : show_top;
+
+    for (int i = 0; i < t->num_keys; i++)
+        sorted[i] = &t->heap[i];
+    qsort(sorted, t->num_keys, sizeof(sorted[0]), by_misses);
+
+    if (export == NULL)
+    {
+        fprintf(stderr, "\n%-4s %-18s %10s %8s %10s %7s %8s %6s %6s\n",
+                "#", t->name, "misses", "+/-", "mem_ops", "miss%",
+                "avg_lat", "dram%", "node%");
+    }
+    for (int i = 0; i < n; i++)
+    {
+        const struct hot_key *k = sorted[i];
+        uint64_t ops = op_estimate(t, k->key);
+        uint64_t key = (t == page_table) ? k->key << 12 : k->key;
+        double tracked = k->tracked ? k->tracked : 1;
+
+        if (ops < k->misses)
+            ops = k->misses;
+        if (export != NULL)
+        {
+            fprintf(export, "%lu,%" PRIu64 ",%s,%d,0x%" PRIx64 ",%" PRIu64
+                    ",%" PRIu64 ",%" PRIu64 ",%.1f,%" PRIu64 ",%" PRIu64 "\n",
+                    interval, tsc, t->name, i + 1, key, k->misses, k->error,
+                    ops, k->lat_sum / tracked, k->dram, k->remote);
+            continue;
+        }
+        fprintf(stderr, "%-4d 0x%-16" PRIx64 " %10" PRIu64 " %8" PRIu64
+                " %10" PRIu64 " %6.1f%% %8.1f %5.1f%% %5.1f%%\n", i + 1, key,
+                k->misses, k->error, ops, 100.0 * k->misses / ops,
+                k->lat_sum / tracked, 100.0 * k->dram / tracked,
+                100.0 * k->remote / tracked);
+    }
+}
+
+// Halve every count, so that old misses fade out. Halving keeps the heap
+// in order, and keeps every ratio that is shown.
+static void decay_table(struct hot_table *t)
+{
+    for (int i = 0; i < t->num_keys; i++)
+    {
+        struct hot_key *k = &t->heap[i];
+        k->misses >>= 1;
+        k->error >>= 1;
+        k->tracked >>= 1;
+        k->lat_sum >>= 1;
+        k->dram >>= 1;
+        k->remote >>= 1;
+    }
+    for (int d = 0; d < HOT_SPOT_CM_DEPTH; d++)
+        for (int i = 0; i < HOT_SPOT_CM_WIDTH; i++)
+            t->cm[d][i] >>= 1;
+    t->total_misses >>= 1;
+    t->total_ops >>= 1;
+}
+
+static void show_tables(void)
+{
+    uint64_t tsc = __rdtsc();
+    const struct hot_table *t = rip_table ? rip_table : page_table;
+
+    if (export == NULL)
+    {
+        // Redraw in place on a terminal
+        if (isatty(STDERR_FILENO))
+            fprintf(stderr, "\033[H\033[2J");
+        fprintf(stderr, "IBS op DC misses, interval %lu: %" PRIu64 " of %"
+                PRIu64 " memory ops (counts halve every interval)\n",
+                interval, t->total_misses, t->total_ops);
+    }
+    if (rip_table != NULL)
+        show_table(rip_table, tsc);
+    if (page_table != NULL)
+        show_table(page_table, tsc);
+    if (export != NULL)
+        fflush(export);
+    interval++;
+}
+
+void hot_spots_poll(int interval_ms)
+{
+    struct timespec now;
+
+    if (show_top == 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - last_show.tv_sec) * 1000 +
+            (now.tv_nsec - last_show.tv_nsec) / 1000000 < interval_ms)
+        return;
+    last_show = now;
+    show_tables();
+    if (rip_table != NULL)
+        decay_table(rip_table);
+    if (page_table != NULL)
+        decay_table(page_table);
+}
+
+void hot_spots_fini(void)
+{
+    if (show_top == 0)
+        return;
+    show_tables();
+    if (export != NULL && fclose(export))
+        perror("fclose");
+    free(rip_table);
+    free(page_table);
+    rip_table = page_table = NULL;
+    show_top = 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ */
+#ifndef HOT_SPOTS_H
+#define HOT_SPOTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A live view of the op samples that missed in the data cache, without
+// writing them anywhere. Misses are counted per RIP and per data page in
+// space-saving summaries of HOT_SPOT_SLOTS keys each, which always hold the
+// heaviest keys, and the memory ops behind the miss rates are counted in
+// count-min sketches. Memory use is fixed however long the run is.
+//
+// Every interval the top keys are printed as a table or appended to a CSV
+// file, and then every count is halved, so the view follows the program as
+// its hot spots move.
+
+// Show the top_n keys of each table. fields is the op field mask that the
+// driver records; without IBS_OP_FIELD_DATA3 there is nothing to count.
+// With export_fp, the tables go there as CSV rather than to the terminal.
+void hot_spots_init(int top_n, uint64_t fields, FILE *export_fp);
+
+// n op samples of entry_size bytes each
+void hot_spots_add(const void *data, size_t entry_size, size_t n);
+
+// Show the tables if interval_ms have passed since the last time
+void hot_spots_poll(int interval_ms);
+
+// Show the final tables and free everything
+void hot_spots_fini(void);
+
+#endif  /* HOT_SPOTS_H */
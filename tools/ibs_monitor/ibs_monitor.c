@@ -26,18 +26,29 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <time.h>
+#include <sys/mman.h>
 #include <sys/sysinfo.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
+#include <x86intrin.h>
 
 #include "ibs-uapi.h"
+#include "ibs-header.h"
+#include "ibs-trace.h"
+#include "ibs-heatmap.h"
+#include "ibs-merge.h"
+#include "ibs-stream.h"
 #include "ibs_monitor.h"
 #include "cpu_check.h"
+#include "async_output.h"
+#include "module_map.h"
+#include "hot_spots.h"
 
 // Note that this program does not use libIBS. This is an example of a program
 // that directly talks to the AMD Research IBS driver using the ioctl()
@@ -55,6 +66,21 @@ unsigned long n_fetch_samples = 0;
 unsigned long n_lost_op_samples = 0;
 unsigned long n_lost_fetch_samples = 0;
 
+// Samples that the driver dropped because of the filters set with
+// --target_only, --cgroup, --user_only or --kernel_only.
+unsigned long n_filtered_op_samples = 0;
+unsigned long n_filtered_fetch_samples = 0;
+
+// What sampling cost, summed over the driver's devices (GET_STATS) just
+// before they are closed. high_water and nmi_cycles_max are the largest of
+// any device. have_*_stats stays 0 for drivers without GET_STATS.
+ibs_stats_t op_stats;
+ibs_stats_t fetch_stats;
+int have_op_stats = 0;
+int have_fetch_stats = 0;
+unsigned long long ibs_start_tsc = 0;
+unsigned long long ibs_stats_tsc = 0;
+
 // Global variables for IBS driver settings
 int op_cnt_max_to_set = 0;
 int fetch_cnt_max_to_set = 0;
@@ -65,6 +91,176 @@ int poll_size = 0;
 int poll_timeout = 0;
 char *global_work_dir = NULL;
 char *ld_debug_out = NULL;
+// With --module_map, the program's executable mappings are written here
+// (see ibs-modmap.h) instead of having ld.so log them.
+FILE *module_map_fp = NULL;
+
+// With --live, op samples are counted into hot-spot tables (see
+// hot_spots.h), which are shown every LIVE_INTERVAL ms, or appended to
+// live_fp as CSV.
+int live_top = 0;
+FILE *live_fp = NULL;
+
+// With --heatmap, op samples are counted per data page (see ibs-heatmap.h)
+// and the table is written to heatmap_fp when the program ends.
+FILE *heatmap_fp = NULL;
+unsigned int heatmap_page_shift = IBS_HEATMAP_PAGE_4K;
+ibs_heatmap_t heatmap;
+
+// When set, the driver's buffers are mmap()ed and written out in place
+// instead of being read() into global_buffer first. ring_maps[i] is the
+// mapping for fds[i], or NULL.
+int use_mmap = 0;
+// Ask for physically contiguous, large-page-backed driver buffers
+int huge_buffers = 0;
+ibs_ring_header_t **ring_maps = NULL;
+size_t *ring_map_lens = NULL;
+
+// Which fields of each sample the driver should record. See the
+// "IBS sample field masks" documentation in ibs-uapi.h.
+uint64_t op_fields = IBS_OP_FIELDS_ALL;
+uint64_t fetch_fields = IBS_FETCH_FIELDS_ALL;
+size_t op_entry_size = sizeof(ibs_op_t);
+size_t fetch_entry_size = sizeof(ibs_fetch_t);
+
+// In-driver sample filters. See "IBS sample filters" in ibs-uapi.h.
+int target_only = 0;
+int filter_mode = IBS_FILTER_MODE_ALL;
+int filter_cgroup_fd = -1;
+
+// Only let IBS count while a target task runs. See "IBS scheduler gating" in
+// ibs-uapi.h.
+int sched_gate = 0;
+
+// Keep only the most recent samples in the driver, and write them out when
+// we get SIGUSR2 and when the program ends. See "IBS ring modes" in
+// ibs-uapi.h.
+int flight_recorder = 0;
+static volatile sig_atomic_t snapshot_requested = 0;
+
+// Poll and read every CPU's samples through /dev/ibs/all instead of one fd
+// per device. See "IBS all-CPU device" in ibs-uapi.h.
+int use_all_device = 0;
+int all_fd = -1;
+
+// Have each op device take in its CPU's fetch samples too, so there is one
+// fd and one buffer per CPU, and split the records it returns between the op
+// and fetch outputs. See "IBS combined rings" in ibs-uapi.h.
+int combined_ring = 0;
+
+// Have the op devices count samples per RIP (and optionally per data page)
+// in the driver, and write the per-interval tables to histf as CSV instead
+// of storing raw op samples. See "IBS op histograms" in ibs-uapi.h.
+FILE *histf = NULL;
+int hist_key_page = 0;
+ibs_hist_entry_t *hist_buffer = NULL;
+unsigned long hist_interval = 0;
+struct timespec hist_last_read;
+
+// With --adaptive_rate, each device's max count is retuned every
+// ADAPT_INTERVAL ms so that it produces about adaptive_rate samples per
+// second. rates[i] tracks fds[i]; changes are logged to ratef.
+struct rate_state {
+    int cpu;
+    int is_op;
+    unsigned long max_cnt;  // in driver units, i.e. sample period >> 4
+    unsigned long samples;  // read since the last adjustment
+    unsigned long lost;     // lost since the last adjustment
+    long buffered;          // FIONREAD at the last adjustment
+};
+unsigned long adaptive_rate = 0;
+unsigned long op_max_cnt_limit = 0;
+FILE *ratef = NULL;
+struct rate_state *rates = NULL;
+int num_rates = 0;
+struct timespec rate_last_adapt;
+
+// CPUs whose op and fetch devices were set up, as the CPU bitmaps that
+// SESSION_CONFIG and SESSION_DISABLE take. See "IBS sessions" in ibs-uapi.h.
+unsigned char *session_op_cpus = NULL;
+unsigned char *session_fetch_cpus = NULL;
+size_t session_cpus_len = 0;
+int session_nopfds = 0;
+
+// With --async_output, sample files are written by a background thread out
+// of async_buffers buffers, so the polling loop does not wait on storage.
+// --direct_io has it use O_DIRECT. With --per_cpu_files, samples from CPU n
+// go to <file>.cpu<n>, each with its own header, and <file> keeps only the
+// header. With --compress or --columnar, samples are written in trace
+// format 2 or 3 (see ibs-trace.h) by a trace writer per output.
+// op_outs/fetch_outs hold num_outs outputs (1 or one per CPU).
+// With --stream, every sample file goes to the ibs_receiver at stream_addr
+// (see ibs-stream.h) instead of the local file system, through the
+// background thread, so a slow network only holds up the polling loop once
+// all of the output buffers are queued.
+int async_buffers = 0;
+int direct_io = 0;
+int per_cpu_files = 0;
+uint32_t trace_format = 0;
+char *op_file_name = NULL;
+char *fetch_file_name = NULL;
+char *stream_addr = NULL;
+uint32_t stream_flags = 0;
+struct sample_out {
+    FILE *fp;
+    struct async_file *af;
+    ibs_trace_writer_t *trace;
+};
+struct sample_out *op_outs = NULL;
+struct sample_out *fetch_outs = NULL;
+int num_outs = 0;
+// fd_cpus[i] is the CPU of fds[i]
+int *fd_cpus = NULL;
+
+// With --tsc_order, samples wait in op_merge/fetch_merge (see ibs-merge.h)
+// until every device has been read past them, and are then written out in
+// TSC order instead of one CPU's batch after another. Every device is read
+// each time around the polling loop, so a sample older than the start of a
+// round, less merge_window cycles of slack, is safe to write after it.
+int tsc_order = 0;
+ibs_merge_t op_merge;
+ibs_merge_t fetch_merge;
+FILE *op_merge_fp = NULL;
+FILE *fetch_merge_fp = NULL;
+long op_merge_tsc = -1;
+long fetch_merge_tsc = -1;
+uint64_t merge_window = 0;
+
+struct field_name {
+    const char *name;
+    uint64_t bit;
+};
+
+static const struct field_name op_field_names[] = {
+    {"op_ctl", IBS_OP_FIELD_CTL},
+    {"op_rip", IBS_OP_FIELD_RIP},
+    {"op_data", IBS_OP_FIELD_DATA},
+    {"op_data2", IBS_OP_FIELD_DATA2},
+    {"op_data3", IBS_OP_FIELD_DATA3},
+    {"op_data4", IBS_OP_FIELD_DATA4},
+    {"dc_lin_ad", IBS_OP_FIELD_DC_LIN_AD},
+    {"dc_phys_ad", IBS_OP_FIELD_DC_PHYS_AD},
+    {"br_target", IBS_OP_FIELD_BR_TARGET},
+    {NULL, 0}
+};
+
+static const struct field_name fetch_field_names[] = {
+    {"fetch_ctl", IBS_FETCH_FIELD_CTL},
+    {"fetch_ctl_extd", IBS_FETCH_FIELD_CTL_EXTD},
+    {"fetch_lin_ad", IBS_FETCH_FIELD_LIN_AD},
+    {"fetch_phys_ad", IBS_FETCH_FIELD_PHYS_AD},
+    {NULL, 0}
+};
+
+static const struct field_name common_field_names[] = {
+    {"tsc", IBS_FIELD_TSC},
+    {"cr3", IBS_FIELD_CR3},
+    {"tid", IBS_FIELD_TID},
+    {"pid", IBS_FIELD_PID},
+    {"cpu", IBS_FIELD_CPU},
+    {"kern_mode", IBS_FIELD_KERN_MODE},
+    {NULL, 0}
+};
 
 void set_global_defaults(void)
 {
@@ -74,6 +270,47 @@ void set_global_defaults(void)
     poll_percent = POLL_SIZE_PERCENT;
     poll_size = buffer_size * ((float)poll_percent / 100.);;
     poll_timeout = POLL_TIMEOUT;
+    op_fields = IBS_OP_FIELDS_ALL;
+    fetch_fields = IBS_FETCH_FIELDS_ALL;
+    op_entry_size = sizeof(ibs_op_t);
+    fetch_entry_size = sizeof(ibs_fetch_t);
+    target_only = 0;
+    filter_mode = IBS_FILTER_MODE_ALL;
+    filter_cgroup_fd = -1;
+    sched_gate = 0;
+    flight_recorder = 0;
+    use_all_device = 0;
+    combined_ring = 0;
+    hist_key_page = 0;
+    adaptive_rate = 0;
+    stream_addr = NULL;
+    stream_flags = 0;
+}
+
+// A sample file, or a stream standing in for it with --stream
+static FILE *open_sample_file(const char *name)
+{
+    FILE *fp;
+
+    if (stream_addr == NULL)
+    {
+        fp = fopen(name, "w");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "Could not open %s\n", name);
+            fprintf(stderr, "    %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        return fp;
+    }
+    fp = ibs_stream_open(stream_addr, name, stream_flags);
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not stream %s to %s\n", name, stream_addr);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fp;
 }
 
 void set_op_file(char *opt, FILE **opf, int *flavors)
@@ -83,11 +320,8 @@ void set_op_file(char *opt, FILE **opf, int *flavors)
         perror("Null value in set_op_file\n");
         exit(EXIT_FAILURE);
     }
-    *opf = fopen(opt, "w");
-    if (*opf == NULL) {
-        perror("fopen");
-        exit(EXIT_FAILURE);
-    }
+    // Opened once all the options are in, since --stream may come later
+    op_file_name = opt;
     *flavors |= IBS_OP;
 }
 
@@ -98,12 +332,23 @@ void set_fetch_file(char *opt, FILE **fetchf, int *flavors)
         perror("Null value in set_fetch_file\n");
         exit(EXIT_FAILURE);
     }
-    *fetchf = fopen(opt, "w");
-    if (*fetchf == NULL) {
+    fetch_file_name = opt;
+    *flavors |= IBS_FETCH;
+}
+
+void set_histogram_file(char *opt, int *flavors)
+{
+    if (flavors == NULL)
+    {
+        perror("Null value in set_histogram_file\n");
+        exit(EXIT_FAILURE);
+    }
+    histf = fopen(opt, "w");
+    if (histf == NULL) {
         perror("fopen");
         exit(EXIT_FAILURE);
     }
-    *flavors |= IBS_FETCH;
+    *flavors |= IBS_OP;
 }
 
 void set_working_dir(char *opt)
@@ -116,6 +361,52 @@ void set_ld_debug_name(char *opt)
     ld_debug_out = opt;
 }
 
+void set_module_map_file(char *opt)
+{
+    module_map_fp = fopen(opt, "w");
+    if (module_map_fp == NULL) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    module_map_init(module_map_fp, MODULE_MAP_INTERVAL);
+}
+
+void set_global_live_top(int top_n, int *flavors)
+{
+    if (top_n < 1)
+    {
+        fprintf(stderr, "Error, --live needs at least 1 row - tried %d\n",
+                top_n);
+        exit(EXIT_FAILURE);
+    }
+    live_top = top_n;
+    *flavors |= IBS_OP;
+}
+
+void set_live_file(char *opt)
+{
+    live_fp = fopen(opt, "w");
+    if (live_fp == NULL) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void set_heatmap_file(char *opt, int *flavors)
+{
+    heatmap_fp = fopen(opt, "w");
+    if (heatmap_fp == NULL) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    *flavors |= IBS_OP;
+}
+
+void set_global_heatmap_huge_pages(void)
+{
+    heatmap_page_shift = IBS_HEATMAP_PAGE_2M;
+}
+
 void set_global_op_sample_rate(int sample_rate)
 {
     int max_sample_rate = 0;
@@ -185,6 +476,211 @@ void set_global_poll_percent(int in_poll_percent)
     poll_percent = in_poll_percent;
 }
 
+void set_global_use_mmap(void)
+{
+    use_mmap = 1;
+}
+
+void set_global_huge_buffers(void)
+{
+    huge_buffers = 1;
+}
+
+void set_global_flight_recorder(void)
+{
+    flight_recorder = 1;
+}
+
+void set_global_use_all_device(void)
+{
+    use_all_device = 1;
+}
+
+void set_global_combined_ring(void)
+{
+    combined_ring = 1;
+}
+
+void set_global_histogram_pages(void)
+{
+    hist_key_page = 1;
+}
+
+void set_global_adaptive_rate(int in_rate)
+{
+    if (in_rate <= 0)
+    {
+        fprintf(stderr, "Adaptive sample rate must be positive - %d\n", in_rate);
+        exit(EXIT_FAILURE);
+    }
+    adaptive_rate = in_rate;
+
+    // Same limits as set_global_op_sample_rate(), in driver units
+    check_amd_processor();
+    check_basic_ibs_support();
+    uint32_t ibs_id = get_deep_ibs_info();
+    if (ibs_id & (1 << 6))
+        op_max_cnt_limit = ((1 << 27) - 1) >> 4;
+    else
+        op_max_cnt_limit = ((1 << 20) - 1) >> 4;
+}
+
+void set_global_async_buffers(int in_buffers)
+{
+    if (in_buffers < 2)
+    {
+        fprintf(stderr, "--async_output needs at least 2 buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    async_buffers = in_buffers;
+}
+
+void set_global_direct_io(void)
+{
+    direct_io = 1;
+    if (async_buffers == 0)
+        async_buffers = ASYNC_BUFFERS;
+}
+
+void set_global_stream(char *addr)
+{
+    stream_addr = addr;
+    if (async_buffers == 0)
+        async_buffers = ASYNC_BUFFERS;
+}
+
+void set_global_stream_deflate(void)
+{
+    stream_flags |= IBS_STREAM_DEFLATE;
+}
+
+void set_global_per_cpu_files(void)
+{
+    per_cpu_files = 1;
+}
+
+void set_global_trace_format(uint32_t format)
+{
+    trace_format = format;
+}
+
+void set_global_tsc_order(void)
+{
+    tsc_order = 1;
+}
+
+void set_rate_log_file(char *opt)
+{
+    ratef = fopen(opt, "w");
+    if (ratef == NULL) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(ratef, "tsc,cpu,flavor,old_max_cnt,new_max_cnt\n");
+}
+
+static uint64_t lookup_field_name(const char *name,
+        const struct field_name *flavor_names)
+{
+    const struct field_name *tables[] = {flavor_names, common_field_names};
+    for (size_t t = 0; t < sizeof(tables) / sizeof(tables[0]); t++)
+    {
+        for (int i = 0; tables[t][i].name != NULL; i++)
+        {
+            if (!strcmp(name, tables[t][i].name))
+                return tables[t][i].bit;
+        }
+    }
+    return 0;
+}
+
+// Turn either a numeric mask or a comma-separated list of field names
+// (e.g. "op_rip,op_data3,dc_lin_ad,tsc") into a field mask.
+static uint64_t parse_field_list(char *opt, const struct field_name *names,
+        uint64_t all_fields, const char *flavor)
+{
+    uint64_t fields = 0;
+    char *end;
+
+    if (isdigit(opt[0]))
+    {
+        fields = strtoull(opt, &end, 0);
+        if (*end != '\0')
+            fields = 0;
+    }
+    else
+    {
+        char *saveptr = NULL;
+        char *name = strtok_r(opt, ",", &saveptr);
+        while (name != NULL)
+        {
+            uint64_t bit = lookup_field_name(name, names);
+            if (!bit)
+            {
+                fprintf(stderr, "Unknown IBS %s field: %s\n", flavor, name);
+                exit(EXIT_FAILURE);
+            }
+            fields |= bit;
+            name = strtok_r(NULL, ",", &saveptr);
+        }
+    }
+
+    if (fields == 0 || (fields & ~all_fields))
+    {
+        fprintf(stderr, "Invalid IBS %s field mask - 0x%" PRIx64 "\n",
+                flavor, fields);
+        fprintf(stderr, "It must be a non-zero subset of 0x%" PRIx64 "\n",
+                all_fields);
+        exit(EXIT_FAILURE);
+    }
+    return fields;
+}
+
+void set_global_op_fields(char *opt)
+{
+    op_fields = parse_field_list(opt, op_field_names, IBS_OP_FIELDS_ALL,
+            "op");
+    op_entry_size = ibs_sample_entry_size(op_fields);
+}
+
+void set_global_fetch_fields(char *opt)
+{
+    fetch_fields = parse_field_list(opt, fetch_field_names,
+            IBS_FETCH_FIELDS_ALL, "fetch");
+    fetch_entry_size = ibs_sample_entry_size(fetch_fields);
+}
+
+void set_global_target_only(void)
+{
+    target_only = 1;
+}
+
+void set_global_filter_cgroup(char *dir)
+{
+    filter_cgroup_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (filter_cgroup_fd < 0)
+    {
+        fprintf(stderr, "Unable to open cgroup directory: %s\n", dir);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void set_global_sched_gate(void)
+{
+    sched_gate = 1;
+}
+
+void set_global_filter_mode(int in_filter_mode)
+{
+    if (filter_mode != IBS_FILTER_MODE_ALL && filter_mode != in_filter_mode)
+    {
+        fprintf(stderr, "Error, cannot combine --user_only and --kernel_only\n");
+        exit(EXIT_FAILURE);
+    }
+    filter_mode = in_filter_mode;
+}
+
 void set_global_poll_timeout(int in_poll_timeout)
 {
     if (in_poll_timeout < 1)
@@ -202,12 +698,41 @@ void parse_args(int argc, char *argv[], FILE **opf, FILE **fetchf, int *flavors)
         {"op_file", required_argument, NULL, 'o'},
         {"fetch_file", required_argument, NULL, 'f'},
         {"library_map", required_argument, NULL, 'l'},
+        {"module_map", required_argument, NULL, 'M'},
+        {"live", required_argument, NULL, 'T'},
+        {"live_file", required_argument, NULL, 'E'},
+        {"heatmap", required_argument, NULL, 'N'},
+        {"heatmap_2m", no_argument, NULL, 'B'},
         {"op_sample_rate", required_argument, NULL, 'r'},
         {"fetch_sample_rate", required_argument, NULL, 's'},
         {"buffer_size", required_argument, NULL, 'b'},
         {"poll_percent", required_argument, NULL, 'p'},
         {"poll_timeout", required_argument, NULL, 't'},
         {"working_dir", required_argument, NULL, 'w'},
+        {"mmap", no_argument, NULL, 'm'},
+        {"op_fields", required_argument, NULL, 'O'},
+        {"fetch_fields", required_argument, NULL, 'F'},
+        {"target_only", no_argument, NULL, 'P'},
+        {"user_only", no_argument, NULL, 'u'},
+        {"kernel_only", no_argument, NULL, 'k'},
+        {"cgroup", required_argument, NULL, 'J'},
+        {"sched_gate", no_argument, NULL, 'Y'},
+        {"huge_buffers", no_argument, NULL, 'H'},
+        {"flight_recorder", no_argument, NULL, 'R'},
+        {"all_device", no_argument, NULL, 'A'},
+        {"combined", no_argument, NULL, 'U'},
+        {"histogram", required_argument, NULL, 'g'},
+        {"histogram_pages", no_argument, NULL, 'G'},
+        {"adaptive_rate", required_argument, NULL, 'a'},
+        {"rate_log", required_argument, NULL, 'L'},
+        {"async_output", required_argument, NULL, 'W'},
+        {"direct_io", no_argument, NULL, 'D'},
+        {"per_cpu_files", no_argument, NULL, 'C'},
+        {"compress", no_argument, NULL, 'z'},
+        {"columnar", no_argument, NULL, 'c'},
+        {"tsc_order", no_argument, NULL, 'S'},
+        {"stream", required_argument, NULL, 'n'},
+        {"stream_deflate", no_argument, NULL, 'Z'},
         {"help", no_argument, NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
@@ -219,7 +744,7 @@ void parse_args(int argc, char *argv[], FILE **opf, FILE **fetchf, int *flavors)
     }
 
     char c;
-    while ((c = getopt_long(argc, argv, "+ho:f:l:r:s:b:p:t:w:", longopts, NULL)) != -1)
+    while ((c = getopt_long(argc, argv, "+hmo:f:g:l:M:T:E:N:r:s:a:L:W:b:p:t:w:O:F:J:n:PukYHRAUGDCzcBSZ", longopts, NULL)) != -1)
     {
         switch (c) {
             case 'h':
@@ -233,21 +758,116 @@ void parse_args(int argc, char *argv[], FILE **opf, FILE **fetchf, int *flavors)
                 fprintf(stderr, "--fetch_file (or -f) {filename}:\n");
                 fprintf(stderr, "       File to which to save fetch samples\n");
                 fprintf(stderr, "If you skip either of the file arguments, that type of IBS sampling will be disabled.\n");
+                fprintf(stderr, "--histogram (or -g) {filename}:\n");
+                fprintf(stderr, "       Count op samples per RIP in the driver instead of saving each one, and write\n");
+                fprintf(stderr, "       the counts to this CSV file every poll_timeout. Cannot be combined with --op_file\n");
+                fprintf(stderr, "--histogram_pages (or -G):\n");
+                fprintf(stderr, "       Count --histogram samples per RIP and data page rather than per RIP\n");
+                fprintf(stderr, "--live (or -T) {# rows}:\n");
+                fprintf(stderr, "       Show the RIPs and data pages with the most DC misses, with their miss rates,\n");
+                fprintf(stderr, "       latencies and DRAM/other-node shares, every %d ms while the program runs.\n",
+                        LIVE_INTERVAL);
+                fprintf(stderr, "       Counts are kept in fixed-size sketches and halve every interval. Op samples\n");
+                fprintf(stderr, "       are only written out if --op_file is also given\n");
+                fprintf(stderr, "--live_file (or -E) {filename}:\n");
+                fprintf(stderr, "       Append the --live tables to this CSV file instead of showing them\n");
+                fprintf(stderr, "--heatmap (or -N) {filename}:\n");
+                fprintf(stderr, "       Count loads, stores, DC misses and their latencies per 4K data page, both linear\n");
+                fprintf(stderr, "       and physical, along with the NUMA nodes of the sampling CPUs and of the memory,\n");
+                fprintf(stderr, "       and write the counts to this file as sorted binary tables (see ibs-heatmap.h)\n");
+                fprintf(stderr, "       when the program ends. Op samples are only written out if --op_file is also given\n");
+                fprintf(stderr, "--heatmap_2m (or -B):\n");
+                fprintf(stderr, "       Count --heatmap samples per 2M page rather than per 4K page\n");
                 fprintf(stderr, "\n");
                 fprintf(stderr, "--library_map (or -l) {filename}:\n");
                 fprintf(stderr, "       Save LD_DEBUG information about dynamic library mappings.. Off by default.\n");
+                fprintf(stderr, "--module_map (or -M) {filename}:\n");
+                fprintf(stderr, "       Save the program's executable mappings, read from /proc/<pid>/maps when it starts\n");
+                fprintf(stderr, "       and every %d ms after, as a binary module map for ibs_annotate. Unlike\n",
+                        MODULE_MAP_INTERVAL);
+                fprintf(stderr, "       --library_map, this does not slow the program down and also sees JIT code.\n");
+                fprintf(stderr, "       The processes the program starts are mapped too.\n");
                 fprintf(stderr, "\n");
                 fprintf(stderr, "IBS configuration parameters:\n");
                 fprintf(stderr, "--op_sample_rate (or -r) {# ops}:\n");
                 fprintf(stderr, "       The number of ops between each IBS op sample. Defaults to 256K\n");
                 fprintf(stderr, "--fetch_sample_rate (or -s) {# instructions}:\n");
                 fprintf(stderr, "       The number if instructions between each IBS fetch sample. Defaults to 64K\n");
+                fprintf(stderr, "--adaptive_rate (or -a) {# samples}:\n");
+                fprintf(stderr, "       Retune each core's sample rates once a second so that each flavor produces about\n");
+                fprintf(stderr, "       this many samples per second, backing off while samples are lost. The sample rates\n");
+                fprintf(stderr, "       above are the starting points. Off by default\n");
+                fprintf(stderr, "--rate_log (or -L) {filename}:\n");
+                fprintf(stderr, "       Record every --adaptive_rate change here as CSV, for reweighting samples that\n");
+                fprintf(stderr, "       do not keep op_ctl or fetch_ctl\n");
                 fprintf(stderr, "--buffer_size (or -b) {# kB}:\n");
                 fprintf(stderr, "       The size of the per-core in-kernel IBS storage buffer, in kB. Defaults to 1024 kB\n");
                 fprintf(stderr, "--poll_percent (or -p) {%%age}:\n");
                 fprintf(stderr, "       How full the in-kernel buffer should be before reading it, in %%. Defaults to 75%%\n");
                 fprintf(stderr, "--poll_timeout (or -t) {# ms}:\n");
                 fprintf(stderr, "       How long to wait on the driver before reading a non-full buffer, in ms. Defaults to 1000 ms\n");
+                fprintf(stderr, "--mmap (or -m):\n");
+                fprintf(stderr, "       Map the in-kernel buffers and write samples out of them in place instead of read()ing them. Off by default\n");
+                fprintf(stderr, "--huge_buffers (or -H):\n");
+                fprintf(stderr, "       Ask the driver for physically contiguous buffers (at most ~4 MB) to cut its TLB misses.\n");
+                fprintf(stderr, "       Falls back to normal buffers if one cannot be allocated. Off by default\n");
+                fprintf(stderr, "--flight_recorder (or -R):\n");
+                fprintf(stderr, "       Only keep the most recent buffer's worth of samples. They are written out when\n");
+                fprintf(stderr, "       ibs_monitor gets SIGUSR2 and when the program ends. Off by default\n");
+                fprintf(stderr, "--all_device (or -A):\n");
+                fprintf(stderr, "       Poll and read all CPUs' samples through /dev/ibs/all rather than two fds per CPU.\n");
+                fprintf(stderr, "       Cannot be combined with --mmap. Off by default\n");
+                fprintf(stderr, "--combined (or -U):\n");
+                fprintf(stderr, "       Have each CPU's op device take its fetch samples too, so both are read as one\n");
+                fprintf(stderr, "       stream of records from one fd per CPU. Needs --op_file and --fetch_file, and\n");
+                fprintf(stderr, "       cannot be combined with --mmap, --all_device or --adaptive_rate. Off by default\n");
+                fprintf(stderr, "--async_output (or -W) {# buffers}:\n");
+                fprintf(stderr, "       Write sample files from a background thread through this many buffers of\n");
+                fprintf(stderr, "       buffer_size each, so reading the driver never waits on storage. Off by default\n");
+                fprintf(stderr, "--direct_io (or -D):\n");
+                fprintf(stderr, "       Write sample files with O_DIRECT, bypassing the page cache. Implies --async_output %d\n",
+                        ASYNC_BUFFERS);
+                fprintf(stderr, "--per_cpu_files (or -C):\n");
+                fprintf(stderr, "       Write each CPU's samples to {file}.cpu{n}, each with its own header. The files\n");
+                fprintf(stderr, "       named by --op_file and --fetch_file then only hold the header\n");
+                fprintf(stderr, "--compress (or -z):\n");
+                fprintf(stderr, "       Write samples in the compressed, delta-encoded trace format 2 that\n");
+                fprintf(stderr, "       ibs_decoder reads. Off by default\n");
+                fprintf(stderr, "--columnar (or -c):\n");
+                fprintf(stderr, "       Write samples in trace format 3: compressed like --compress, but stored a\n");
+                fprintf(stderr, "       field at a time, with an index of the chunks at the end. Off by default\n");
+                fprintf(stderr, "--tsc_order (or -S):\n");
+                fprintf(stderr, "       Write samples in TSC order across all CPUs rather than one CPU's batch after\n");
+                fprintf(stderr, "       another. Samples are held for up to two poll_timeouts, every device is read each\n");
+                fprintf(stderr, "       time around, and tsc must be in --op_fields and --fetch_fields. Off by default\n");
+                fprintf(stderr, "--stream (or -n) {host:port or unix:path}:\n");
+                fprintf(stderr, "       Send the sample files to an ibs_receiver there instead of writing them here.\n");
+                fprintf(stderr, "       The receiver keeps them under the names given to --op_file and --fetch_file.\n");
+                fprintf(stderr, "       Cannot be combined with --direct_io. Implies --async_output %d\n",
+                        ASYNC_BUFFERS);
+                fprintf(stderr, "--stream_deflate (or -Z):\n");
+                fprintf(stderr, "       Also compress what --stream sends, which mostly helps uncompressed traces\n");
+                fprintf(stderr, "--op_fields (or -O) {field,...}:\n");
+                fprintf(stderr, "       Only record these fields of each op sample, to shrink the trace. A comma-separated\n");
+                fprintf(stderr, "       list of op_ctl, op_rip, op_data, op_data2, op_data3, op_data4, dc_lin_ad, dc_phys_ad,\n");
+                fprintf(stderr, "       br_target, tsc, cr3, tid, pid, cpu, kern_mode, or a mask from ibs-uapi.h. Defaults to all\n");
+                fprintf(stderr, "--fetch_fields (or -F) {field,...}:\n");
+                fprintf(stderr, "       Only record these fields of each fetch sample. A comma-separated list of fetch_ctl,\n");
+                fprintf(stderr, "       fetch_ctl_extd, fetch_lin_ad, fetch_phys_ad, tsc, cr3, tid, pid, cpu, kern_mode,\n");
+                fprintf(stderr, "       or a mask from ibs-uapi.h. Defaults to all\n");
+                fprintf(stderr, "\n");
+                fprintf(stderr, "Sample filters (applied in the driver, before samples are buffered):\n");
+                fprintf(stderr, "--target_only (or -P):\n");
+                fprintf(stderr, "       Only record samples from the monitored program itself (not its children)\n");
+                fprintf(stderr, "--user_only (or -u):\n");
+                fprintf(stderr, "       Only record samples taken in user mode\n");
+                fprintf(stderr, "--kernel_only (or -k):\n");
+                fprintf(stderr, "       Only record samples taken in kernel mode\n");
+                fprintf(stderr, "--cgroup (or -J) {dir}:\n");
+                fprintf(stderr, "       Only record samples from tasks in this cgroup v2 directory or below it\n");
+                fprintf(stderr, "--sched_gate (or -Y):\n");
+                fprintf(stderr, "       Only let IBS count while a --target_only or --cgroup task runs, pausing it\n");
+                fprintf(stderr, "       at every context switch, so other tasks take no IBS interrupts at all\n");
                 exit(EXIT_SUCCESS);
             case 'o':
                 set_op_file(optarg, opf, flavors);
@@ -255,9 +875,60 @@ void parse_args(int argc, char *argv[], FILE **opf, FILE **fetchf, int *flavors)
             case 'f':
                 set_fetch_file(optarg, fetchf, flavors);
                 break;
+            case 'g':
+                set_histogram_file(optarg, flavors);
+                break;
+            case 'G':
+                set_global_histogram_pages();
+                break;
+            case 'a':
+                set_global_adaptive_rate(atoi(optarg));
+                break;
+            case 'L':
+                set_rate_log_file(optarg);
+                break;
+            case 'W':
+                set_global_async_buffers(atoi(optarg));
+                break;
+            case 'D':
+                set_global_direct_io();
+                break;
+            case 'C':
+                set_global_per_cpu_files();
+                break;
+            case 'z':
+                set_global_trace_format(IBS_TRACE_FORMAT_DELTA);
+                break;
+            case 'c':
+                set_global_trace_format(IBS_TRACE_FORMAT_COLUMNS);
+                break;
+            case 'S':
+                set_global_tsc_order();
+                break;
+            case 'n':
+                set_global_stream(optarg);
+                break;
+            case 'Z':
+                set_global_stream_deflate();
+                break;
             case 'l':
                 set_ld_debug_name(optarg);
                 break;
+            case 'M':
+                set_module_map_file(optarg);
+                break;
+            case 'T':
+                set_global_live_top(atoi(optarg), flavors);
+                break;
+            case 'E':
+                set_live_file(optarg);
+                break;
+            case 'N':
+                set_heatmap_file(optarg, flavors);
+                break;
+            case 'B':
+                set_global_heatmap_huge_pages();
+                break;
             case 'r':
                 set_global_op_sample_rate(atoi(optarg));
                 break;
@@ -276,12 +947,120 @@ void parse_args(int argc, char *argv[], FILE **opf, FILE **fetchf, int *flavors)
             case 'w':
                 set_working_dir(optarg);
                 break;
+            case 'm':
+                set_global_use_mmap();
+                break;
+            case 'O':
+                set_global_op_fields(optarg);
+                break;
+            case 'F':
+                set_global_fetch_fields(optarg);
+                break;
+            case 'P':
+                set_global_target_only();
+                break;
+            case 'H':
+                set_global_huge_buffers();
+                break;
+            case 'R':
+                set_global_flight_recorder();
+                break;
+            case 'A':
+                set_global_use_all_device();
+                break;
+            case 'U':
+                set_global_combined_ring();
+                break;
+            case 'u':
+                set_global_filter_mode(IBS_FILTER_MODE_USER);
+                break;
+            case 'k':
+                set_global_filter_mode(IBS_FILTER_MODE_KERNEL);
+                break;
+            case 'J':
+                set_global_filter_cgroup(optarg);
+                break;
+            case 'Y':
+                set_global_sched_gate();
+                break;
             case '?':
             default:
                 fprintf(stderr, "Found this bad argument: %s\n", argv[optind]);
                 break;
         }
     }
+
+    if (op_file_name != NULL)
+        *opf = open_sample_file(op_file_name);
+    if (fetch_file_name != NULL)
+        *fetchf = open_sample_file(fetch_file_name);
+
+    if (use_all_device && use_mmap)
+    {
+        fprintf(stderr, "Error, cannot combine --all_device and --mmap\n");
+        exit(EXIT_FAILURE);
+    }
+    if (combined_ring && (*opf == NULL || *fetchf == NULL))
+    {
+        fprintf(stderr, "Error, --combined needs --op_file and --fetch_file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (combined_ring && (use_mmap || use_all_device || adaptive_rate))
+    {
+        fprintf(stderr, "Error, cannot combine --combined with --mmap, --all_device or --adaptive_rate\n");
+        exit(EXIT_FAILURE);
+    }
+    if (histf != NULL && *opf != NULL)
+    {
+        fprintf(stderr, "Error, cannot combine --histogram and --op_file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (histf != NULL && live_top)
+    {
+        fprintf(stderr, "Error, cannot combine --histogram and --live\n");
+        exit(EXIT_FAILURE);
+    }
+    if (histf != NULL && heatmap_fp != NULL)
+    {
+        fprintf(stderr, "Error, cannot combine --histogram and --heatmap\n");
+        exit(EXIT_FAILURE);
+    }
+    if (live_fp != NULL && !live_top)
+    {
+        fprintf(stderr, "Error, --live_file needs --live\n");
+        exit(EXIT_FAILURE);
+    }
+    if (histf != NULL && adaptive_rate)
+    {
+        fprintf(stderr, "Error, cannot combine --histogram and --adaptive_rate\n");
+        exit(EXIT_FAILURE);
+    }
+    if (tsc_order && per_cpu_files)
+    {
+        fprintf(stderr, "Error, cannot combine --tsc_order and --per_cpu_files\n");
+        exit(EXIT_FAILURE);
+    }
+    if (tsc_order && (!(op_fields & IBS_FIELD_TSC) ||
+                !(fetch_fields & IBS_FIELD_TSC)))
+    {
+        fprintf(stderr, "Error, --tsc_order needs tsc in --op_fields and --fetch_fields\n");
+        exit(EXIT_FAILURE);
+    }
+    if (sched_gate && !target_only && filter_cgroup_fd < 0)
+    {
+        fprintf(stderr, "Error, --sched_gate needs --target_only or --cgroup\n");
+        exit(EXIT_FAILURE);
+    }
+    if (stream_addr != NULL && direct_io)
+    {
+        fprintf(stderr, "Error, cannot combine --stream and --direct_io\n");
+        exit(EXIT_FAILURE);
+    }
+    if (stream_flags && stream_addr == NULL)
+    {
+        fprintf(stderr, "Error, --stream_deflate needs --stream\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
 #define print_hdr(opf, fmt, ...) \
@@ -385,79 +1164,14 @@ static void output_op_header(FILE *opf, char *argv[])
     // will be dumping to disk. This way, old traces can later be read by
     // new versions of the decoder.
     print_hdr(opf, "IBS Op Structure Version: %u\n", IBS_OP_STRUCT_VERSION);
-
-    // The following bits were only available on Family 10h, Family 12h,
-    // Family 14h, and Family 15h Models 00h-0Fh
-    uint32_t brn_resync = 0, misp_return = 0;
-    if (fam == 0x10 || fam == 0x12 || fam == 0x14 ||
-            (fam == 0x15 && model < 0x10))
-    {
-        brn_resync = 1;
-        misp_return = 1;
-    }
-
-    print_hdr(opf, "IbsOpBrnResync: %u\n", brn_resync);
-    print_hdr(opf, "IbsOpMispReturn: %u\n", misp_return);
-
-    uint32_t ibs_id = get_deep_ibs_info();
-    uint32_t branch_target = (ibs_id & (1 << 5)) >> 5;
-    uint32_t op_cnt_ext = (ibs_id & (1 << 6)) >> 6;
-    uint32_t rip_invalid_check = (ibs_id & (1 << 7)) >> 7;
-    uint32_t branch_fuse = (ibs_id & (1 << 8)) >> 8;
-    uint32_t op_data_4 = (ibs_id & (1 << 10)) >> 10;
-    print_hdr(opf, "BrnTrgt: %u\n", branch_target);
-    print_hdr(opf, "OpCntExt: %u\n", op_cnt_ext);
-    print_hdr(opf, "RipInvalidChk: %u\n", rip_invalid_check);
-    print_hdr(opf, "OpBrnFuse: %u\n", branch_fuse);
-    print_hdr(opf, "IbsOpData4: %u\n", op_data_4);
-
-    // Unfortunately, this is based on family/model, not CPUID check.
-    // This tells us about IBS_OP_DATA[40]
-    uint32_t microcode = 0;
-    if ((fam == 0x15 && model >= 0x60) ||
-        fam == 0x17)
-        microcode = 1;
-    print_hdr(opf, "Microcode: %u\n", microcode);
-
-    // Family 16h does not have these 2 bits defined.
-    uint32_t ibs_op_data2_4_5 = 1;
-    if (fam == 0x14 || fam == 0x16)
-        ibs_op_data2_4_5 = 0;
-    print_hdr(opf, "IBSOpData2_4_5: %u\n", ibs_op_data2_4_5);
-
-    // The following are available on Fam 10h, 12h, and 15h Model 00h-0Fh
-    uint32_t ld_bnk_con = 0, st_to_ld_can = 0;
-    if (fam <= 0x12 || (fam == 0x15 && model < 0x10))
-    {
-        ld_bnk_con = 1;
-        st_to_ld_can = 1;
-    }
-    // Available on Fam 10h and 12h
-    uint32_t st_bnk_con = 0;
-    if (fam <= 0x12)
-        st_bnk_con = 1;
-    // Available on Fam 10h, 12h, 15h Model 00h-0Fh, and 16h
-    uint32_t st_to_ld_fw = 0;
-    if (fam <= 0x12 || fam == 0x14 || fam == 0x16 ||
-            (fam == 0x15 && model < 0x10))
-    {
-        st_to_ld_fw = 1;
-    }
-    print_hdr(opf, "IbsDcLdBnkCon: %u\n", ld_bnk_con);
-    print_hdr(opf, "IbsDcStBnkCon: %u\n", st_bnk_con);
-    print_hdr(opf, "IbsDcStToLdFwd: %u\n", st_to_ld_fw);
-    print_hdr(opf, "IbsDcStToLdCan: %u\n", st_to_ld_can);
-
-    // Available on Fam 15h Models >= 30h, Fam 16h, Fam 17h
-    uint32_t ibs_data_3_20_31_48_63 = 0;
-    if (fam >= 0x16 || (fam == 0x15 && model >= 0x30))
-        ibs_data_3_20_31_48_63 = 1;
-    print_hdr(opf, "IbsData3_20_31_48_63: %u\n", ibs_data_3_20_31_48_63);
-
-    // Last line of every header before the binary dump of IBS samples starts
-    // is 45 equal signs.
-    print_hdr(opf, "%s\n", "");
-    print_hdr(opf, "=============================================%s", "\n");
+    // Version 2 records only hold the fields in this mask
+    print_hdr(opf, "IBS Op Field Mask: 0x%" PRIx64 "\n", op_fields);
+    if (trace_format)
+        print_hdr(opf, "IBS Trace Format: %u\n", trace_format);
+    if (tsc_order)
+        print_hdr(opf, "IBS TSC Ordered: %u\n", 1);
+
+    ibs_header_op_support(opf, fam, model, get_deep_ibs_info());
     return;
 }
 
@@ -479,15 +1193,13 @@ static void output_fetch_header(FILE *fetchf, char *argv[])
     // new versions of the decoder.
     print_hdr(fetchf, "IBS Fetch Structure Version: %u\n",
             IBS_FETCH_STRUCT_VERSION);
+    print_hdr(fetchf, "IBS Fetch Field Mask: 0x%" PRIx64 "\n", fetch_fields);
+    if (trace_format)
+        print_hdr(fetchf, "IBS Trace Format: %u\n", trace_format);
+    if (tsc_order)
+        print_hdr(fetchf, "IBS TSC Ordered: %u\n", 1);
 
-    uint32_t ibs_id = get_deep_ibs_info();
-    uint32_t ibs_fetch_ctl_extd = (ibs_id & (1 << 9)) >> 9;
-    print_hdr(fetchf, "IbsFetchCtlExtd: %u\n", ibs_fetch_ctl_extd);
-
-    // Last line of every header before the binary dump of IBS samples starts
-    // is 45 equal signs.
-    print_hdr(fetchf, "%s\n", "");
-    print_hdr(fetchf, "=============================================%s", "\n");
+    ibs_header_fetch_support(fetchf, get_deep_ibs_info());
     return;
 }
 
@@ -550,6 +1262,12 @@ char **update_environment(void)
     return new_environ;
 }
 
+static void request_snapshot(int sig)
+{
+    (void)sig;
+    snapshot_requested = 1;
+}
+
 int main(int argc, char *argv[])
 {
     struct pollfd *fds;
@@ -560,6 +1278,8 @@ int main(int argc, char *argv[])
     FILE *fetchf = NULL;
     int i;
     pid_t cpid;
+    int sync_pipe[2];
+    int exec_pipe[2];
 
     set_global_defaults();
 
@@ -568,14 +1288,56 @@ int main(int argc, char *argv[])
     argv = &(argv[optind]);
 
     output_headers(opf, fetchf, flavors, argv);
+    open_sample_outputs(opf, fetchf, argv);
+    open_tsc_order(opf, fetchf);
+    if (live_top)
+        hot_spots_init(live_top, op_fields, live_fp);
+    if (heatmap_fp != NULL)
+    {
+        if (ibs_heatmap_init(&heatmap, heatmap_page_shift))
+        {
+            fprintf(stderr, "Could not set up the heatmap\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!(op_fields & IBS_OP_FIELD_DATA3))
+            fprintf(stderr, "Warning, --heatmap needs op_data3 in --op_fields\n");
+    }
 
     poll_size = buffer_size * ((float)poll_percent/100.);
     global_buffer = malloc(buffer_size);
+    if (histf != NULL)
+    {
+        hist_buffer = calloc(HIST_SLOTS, sizeof(ibs_hist_entry_t));
+        fprintf(histf, "interval,rip,page,count,dc_miss,dc_miss_lat\n");
+        clock_gettime(CLOCK_MONOTONIC, &hist_last_read);
+    }
 
     int num_cpus = get_nprocs_conf();
     // Add enough space for fetch and op FDs for every core.
     fds = calloc(num_cpus*2, sizeof(struct pollfd));
+    ring_maps = calloc(num_cpus*2, sizeof(ibs_ring_header_t *));
+    ring_map_lens = calloc(num_cpus*2, sizeof(size_t));
+    fd_cpus = calloc(num_cpus*2, sizeof(int));
+    if (adaptive_rate)
+        rates = calloc(num_cpus*2, sizeof(struct rate_state));
     enable_ibs_flavors(fds, &nopfds, &nfetchfds, flavors);
+    if (use_all_device)
+        open_ibs_all_device();
+    ibs_start_tsc = __rdtsc();
+
+    // With --target_only, the child must not start the program until the
+    // driver's filters know its pid.
+    if (target_only && pipe(sync_pipe) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    // With --module_map, the parent waits for the child's exec() to close
+    // this pipe, so that it does not read its own mappings from the child.
+    if (module_map_fp != NULL && pipe2(exec_pipe, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        exit(EXIT_FAILURE);
+    }
 
     cpid = fork();
     if (cpid == -1) {
@@ -583,6 +1345,20 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
     if (cpid == 0) {    /* Child process */
+        if (module_map_fp != NULL)
+            close(exec_pipe[0]);
+        if (target_only)
+        {
+            char go;
+            close(sync_pipe[1]);
+            // Returns once the parent closes its end of the pipe
+            if (read(sync_pipe[0], &go, 1) == -1)
+            {
+                perror("read");
+                exit(EXIT_FAILURE);
+            }
+            close(sync_pipe[0]);
+        }
         if (global_work_dir != NULL)
         {
             int err_chk = chdir(global_work_dir);
@@ -617,13 +1393,56 @@ int main(int argc, char *argv[])
         exit(EXIT_SUCCESS);
     }
 
+    if (target_only)
+    {
+        close(sync_pipe[0]);
+        filter_ibs_target(fds, nopfds + nfetchfds, cpid);
+        close(sync_pipe[1]);
+    }
+
+    if (module_map_fp != NULL)
+    {
+        char go;
+        close(exec_pipe[1]);
+        // Returns once the child has exec()ed (or died trying)
+        while (read(exec_pipe[0], &go, 1) == -1 && errno == EINTR)
+            ;
+        close(exec_pipe[0]);
+        module_map_start(cpid, ibs_start_tsc);
+    }
+
     reset_ibs_buffers(fds, nopfds + nfetchfds);
+    clock_gettime(CLOCK_MONOTONIC, &rate_last_adapt);
+
+    if (flight_recorder)
+        signal(SIGUSR2, request_snapshot);
 
     while (!waitpid(cpid, &i, WNOHANG))
+    {
         poll_ibs(fds, nopfds, nfetchfds, opf, fetchf);
+        if (histf != NULL)
+            poll_histograms(fds, nopfds);
+        if (rates != NULL)
+            adapt_sample_rates(fds, nopfds + nfetchfds);
+        module_map_poll();
+        hot_spots_poll(LIVE_INTERVAL);
+        if (snapshot_requested)
+        {
+            snapshot_requested = 0;
+            snapshot_ibs_buffers(fds, nopfds, nfetchfds, opf, fetchf);
+        }
+    }
 
-    flush_ibs_buffers(fds, nopfds, nfetchfds, opf, fetchf);
+    if (flight_recorder)
+        snapshot_ibs_buffers(fds, nopfds, nfetchfds, opf, fetchf);
+    else
+        flush_ibs_buffers(fds, nopfds, nfetchfds, opf, fetchf);
 
+    close_sample_outputs();
+    module_map_close();
+    hot_spots_fini();
+    write_heatmap();
+    collect_ibs_stats(fds, nopfds, nfetchfds);
     disable_ibs(fds, nopfds + nfetchfds);
 
     // LD_DEBUG_OUTPUT appends the child's PID to the name by default.
@@ -642,15 +1461,46 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (opf != NULL || fetchf != NULL)
+    if (opf != NULL || fetchf != NULL || histf != NULL || live_top ||
+            heatmap_fp != NULL)
     {
         printf("\nIBS sampling statistics:\n");
-        printf("op_samples,op_samples_lost,fetch_samples,fetch_samples_lost\n");
-        printf("%lu,%lu,%lu,%lu\n", n_op_samples, n_lost_op_samples,
-                n_fetch_samples, n_lost_fetch_samples);
+        printf("op_samples,op_samples_lost,fetch_samples,fetch_samples_lost,");
+        printf("op_samples_filtered,fetch_samples_filtered\n");
+        printf("%lu,%lu,%lu,%lu,%lu,%lu\n", n_op_samples, n_lost_op_samples,
+                n_fetch_samples, n_lost_fetch_samples, n_filtered_op_samples,
+                n_filtered_fetch_samples);
+    }
+    if (tsc_order)
+    {
+        printf("\nIBS samples written out of TSC order:\n");
+        printf("op_samples_late,fetch_samples_late\n");
+        printf("%" PRIu64 ",%" PRIu64 "\n", op_merge.late, fetch_merge.late);
+        ibs_merge_fini(&op_merge);
+        ibs_merge_fini(&fetch_merge);
+    }
+    if (have_op_stats || have_fetch_stats)
+    {
+        printf("\nIBS overhead statistics:\n");
+        printf("flavor,nmis,nmi_cycles,nmi_cycles_avg,nmi_cycles_max,");
+        printf("nmi_overhead_pct,wakeups,read_bytes,high_water\n");
+        if (have_op_stats)
+            print_ibs_stats("op", &op_stats, nopfds);
+        if (have_fetch_stats)
+            print_ibs_stats("fetch", &fetch_stats,
+                    combined_ring ? nopfds : nfetchfds);
+        if (have_op_stats)
+            print_nmi_histogram("op", &op_stats);
+        if (have_fetch_stats)
+            print_nmi_histogram("fetch", &fetch_stats);
     }
 
     free(fds);
+    free(hist_buffer);
+    free(rates);
+    free(ring_maps);
+    free(ring_map_lens);
+    free(fd_cpus);
     exit(EXIT_SUCCESS);
 }
 
@@ -729,6 +1579,396 @@ static int fill_out_online_cores(int num_cpus, int num_online_cpus,
     return previous_cpu;
 }
 
+static FILE *open_cpu_file(const char *name, int cpu, int is_op, char *argv[])
+{
+    char *cpu_name;
+    FILE *fp;
+
+    int num_bytes = asprintf(&cpu_name, "%s.cpu%d", name, cpu);
+    CHECK_ASPRINTF_RET(num_bytes);
+    fp = open_sample_file(cpu_name);
+    free(cpu_name);
+
+    if (is_op)
+        output_op_header(fp, argv);
+    else
+        output_fetch_header(fp, argv);
+    return fp;
+}
+
+// Write straight to where out goes, past any trace writer
+static void write_sample_out(struct sample_out *out, const void *data,
+        size_t len)
+{
+    if (out->af != NULL)
+        async_output_write(out->af, data, len);
+    else if (fwrite(data, 1, len, out->fp) < len)
+        fprintf(stderr, "Failed to write %zu bytes of samples\n", len);
+}
+
+static void emit_trace_chunk(void *arg, const void *data, size_t len)
+{
+    write_sample_out(arg, data, len);
+}
+
+// Call before out->fp is handed to the writer thread
+static void open_sample_trace(struct sample_out *out, int is_op)
+{
+    off_t off;
+
+    if (out->fp == NULL)
+        return;
+    out->trace = malloc(sizeof(ibs_trace_writer_t));
+    if (out->trace == NULL)
+    {
+        fprintf(stderr, "Could not allocate a trace writer\n");
+        exit(EXIT_FAILURE);
+    }
+    // Format 3 indexes chunks by where they are in the file
+    off = ftello(out->fp);
+    if (off < 0)
+    {
+        perror("ftello");
+        exit(EXIT_FAILURE);
+    }
+    ibs_trace_writer_init(out->trace, trace_format, is_op,
+            is_op ? op_fields : fetch_fields, off, emit_trace_chunk, out);
+}
+
+/**
+ * open_sample_outputs - set up --per_cpu_files, --async_output and --compress
+ * @opf:    op sample file, with its header written, or NULL
+ * @fetchf: fetch sample file, with its header written, or NULL
+ * @argv:   the monitored command line, for the per-CPU headers
+ */
+void open_sample_outputs(FILE *opf, FILE *fetchf, char *argv[])
+{
+    int num_cpus = get_nprocs_conf();
+    char *cpu_list;
+
+    if (!per_cpu_files && !async_buffers && !trace_format)
+        return;
+    if (async_buffers)
+        async_output_init(async_buffers, buffer_size, direct_io);
+
+    num_outs = per_cpu_files ? num_cpus : 1;
+    op_outs = calloc(num_outs, sizeof(struct sample_out));
+    fetch_outs = calloc(num_outs, sizeof(struct sample_out));
+    cpu_list = calloc(num_cpus, sizeof(char));
+    if (op_outs == NULL || fetch_outs == NULL || cpu_list == NULL)
+    {
+        fprintf(stderr, "Could not allocate the sample outputs\n");
+        exit(EXIT_FAILURE);
+    }
+    if (per_cpu_files)
+        fill_out_online_cores(num_cpus, get_nprocs(), cpu_list);
+    else
+        cpu_list[0] = 1;
+
+    for (int i = 0; i < num_outs; i++)
+    {
+        if (!cpu_list[i])
+            continue;
+        if (opf != NULL)
+            op_outs[i].fp = per_cpu_files ?
+                open_cpu_file(op_file_name, i, 1, argv) : opf;
+        if (fetchf != NULL)
+            fetch_outs[i].fp = per_cpu_files ?
+                open_cpu_file(fetch_file_name, i, 0, argv) : fetchf;
+        if (trace_format)
+        {
+            open_sample_trace(&op_outs[i], 1);
+            open_sample_trace(&fetch_outs[i], 0);
+        }
+        if (async_buffers && op_outs[i].fp != NULL)
+            op_outs[i].af = async_output_adopt(op_outs[i].fp);
+        if (async_buffers && fetch_outs[i].fp != NULL)
+            fetch_outs[i].af = async_output_adopt(fetch_outs[i].fp);
+    }
+    free(cpu_list);
+}
+
+// Returns -1 if a trace writer ran out of memory
+static int flush_sample_traces(void)
+{
+    int ret = 0;
+    for (int i = 0; i < num_outs; i++)
+    {
+        if (op_outs[i].trace != NULL && ibs_trace_flush(op_outs[i].trace))
+            ret = -1;
+        if (fetch_outs[i].trace != NULL &&
+                ibs_trace_flush(fetch_outs[i].trace))
+            ret = -1;
+    }
+    return ret;
+}
+
+static void close_sample_out(struct sample_out *out, uint64_t *raw_bytes,
+        uint64_t *out_bytes)
+{
+    if (out->trace != NULL)
+    {
+        if (ibs_trace_writer_fini(out->trace))
+            fprintf(stderr, "Ran out of memory compressing samples\n");
+        *raw_bytes += out->trace->raw_bytes;
+        *out_bytes += out->trace->out_bytes;
+        free(out->trace);
+        out->trace = NULL;
+    }
+    if (out->af != NULL)
+        async_output_close(out->af);
+    else if (per_cpu_files && out->fp != NULL)
+        fclose(out->fp);
+    out->af = NULL;
+    out->fp = NULL;
+}
+
+/**
+ * close_sample_outputs - finish writing what open_sample_outputs set up
+ *
+ * An --async_output file is closed here, so its FILE * is no longer valid.
+ */
+void close_sample_outputs(void)
+{
+    uint64_t raw_bytes = 0, out_bytes = 0;
+
+    for (int i = 0; i < num_outs; i++)
+    {
+        close_sample_out(&op_outs[i], &raw_bytes, &out_bytes);
+        close_sample_out(&fetch_outs[i], &raw_bytes, &out_bytes);
+    }
+    if (trace_format && out_bytes)
+        fprintf(stderr, "Compressed %" PRIu64 " bytes of samples to %"
+                PRIu64 " (%.1fx)\n", raw_bytes, out_bytes,
+                (double)raw_bytes / out_bytes);
+    if (async_buffers)
+    {
+        unsigned long waits = async_output_fini();
+        if (waits)
+            fprintf(stderr, "The sample readers waited on storage %lu times; "
+                    "try more --async_output buffers\n", waits);
+    }
+    free(op_outs);
+    free(fetch_outs);
+    op_outs = NULL;
+    fetch_outs = NULL;
+    num_outs = 0;
+}
+
+// Write the --heatmap tables out. heatmap_fp is closed but left set.
+void write_heatmap(void)
+{
+    int err;
+
+    if (heatmap_fp == NULL)
+        return;
+    err = ibs_heatmap_write(&heatmap, heatmap_fp);
+    if (fclose(heatmap_fp))
+        err = -1;
+    if (err)
+        fprintf(stderr, "Failed to write the heatmap\n");
+    else
+        fprintf(stderr, "Heatmap: %" PRIu64 " memory ops on %zu linear and "
+                "%zu physical pages\n", heatmap.num_samples, heatmap.lin.num,
+                heatmap.phys.num);
+    ibs_heatmap_fini(&heatmap);
+}
+
+// Map the in-kernel buffer behind fd so its samples can be written to disk
+// without first copying them into global_buffer.
+static void map_ibs_buffer(int fd, int idx)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    // Ask the driver, in case it could not give us the size we asked for
+    long real_size = ioctl(fd, GET_BUFFER_SIZE);
+    size_t len = page_size +
+        ((real_size + page_size - 1) / page_size) * page_size;
+    void *ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    ring_maps[idx] = (ibs_ring_header_t *)ring;
+    ring_map_lens[idx] = len;
+}
+
+static void set_buffer_size(int fd, int cpu)
+{
+    if (huge_buffers)
+    {
+        if (!ioctl(fd, SET_BUFFER_SIZE,
+                    (unsigned long)buffer_size | IBS_BUFFER_HUGE))
+            return;
+        fprintf(stderr, "Could not get a huge IBS buffer on cpu %d; ", cpu);
+        fprintf(stderr, "using a normal one\n");
+    }
+    ioctl(fd, SET_BUFFER_SIZE, buffer_size);
+}
+
+static void set_ring_mode(int fd, int cpu)
+{
+    if (!flight_recorder)
+        return;
+    if (ioctl(fd, SET_RING_MODE, IBS_RING_MODE_OVERWRITE))
+    {
+        fprintf(stderr, "Could not set the IBS ring mode on cpu %d\n", cpu);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void set_histogram(int fd, int cpu)
+{
+    unsigned long arg = HIST_SLOTS;
+
+    if (histf == NULL)
+        return;
+    if (hist_key_page)
+        arg |= IBS_HIST_KEY_PAGE;
+    if (ioctl(fd, SET_HISTOGRAM, arg))
+    {
+        fprintf(stderr, "Could not set up the IBS histogram on cpu %d\n", cpu);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// half is IBS_CMD_FETCH for the fetch half of a combined op device, else 0
+static void set_filter_mode(int fd, unsigned int half, int cpu)
+{
+    if (filter_mode != IBS_FILTER_MODE_ALL &&
+            ioctl(fd, SET_FILTER_MODE | half, filter_mode))
+    {
+        fprintf(stderr, "Could not set the IBS filter mode on cpu %d\n", cpu);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (filter_cgroup_fd >= 0 &&
+            ioctl(fd, SET_FILTER_CGROUP | half, filter_cgroup_fd))
+    {
+        fprintf(stderr, "Could not set the IBS cgroup filter on cpu %d\n", cpu);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (sched_gate && ioctl(fd, SET_SCHED_GATE | half, 1))
+    {
+        fprintf(stderr, "Could not gate IBS on context switches on cpu %d\n",
+                cpu);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Have the op device behind fd take in its CPU's fetch samples as well, and
+// set up that fetch half the way a fetch device would be set up below
+static void combine_fetch_half(int fd, int cpu)
+{
+    if (ioctl(fd, SET_COMBINED, 1))
+    {
+        fprintf(stderr, "Could not combine the IBS buffers on cpu %d\n", cpu);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (fetch_fields != IBS_FETCH_FIELDS_ALL &&
+            ioctl(fd, SET_SAMPLE_FIELDS | IBS_CMD_FETCH, fetch_fields))
+    {
+        fprintf(stderr, "Could not set IBS fetch fields on cpu %d\n", cpu);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    ioctl(fd, SET_MAX_CNT | IBS_CMD_FETCH, fetch_cnt_max_to_set);
+    set_filter_mode(fd, IBS_CMD_FETCH, cpu);
+}
+
+/**
+ * filter_ibs_target - only keep samples from one process
+ * @fds:    file descriptors returned by enable_ibs_flavors
+ * @nfds:   number of file descriptors
+ * @pid:    the process to keep samples from
+ */
+void filter_ibs_target(const struct pollfd *fds, int nfds, pid_t pid)
+{
+    for (int i = 0; i < nfds; i++)
+    {
+        if (ioctl(fds[i].fd, ADD_FILTER_TGID, pid) || (combined_ring &&
+                    ioctl(fds[i].fd, ADD_FILTER_TGID | IBS_CMD_FETCH, pid)))
+        {
+            fprintf(stderr, "Could not set the IBS target filter\n");
+            fprintf(stderr, "    %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// Send SESSION_CONFIG or SESSION_DISABLE for one flavor's devices (or both
+// flavors' when their CPUs match). Returns nonzero if the driver could not,
+// e.g. because it predates sessions, and the caller should go fd by fd.
+static int ibs_session_ioctl(int fd, unsigned long cmd, uint64_t flags,
+        const unsigned char *cpus)
+{
+    ibs_session_t session;
+
+    memset(&session, 0xff, sizeof(session));
+    session.cpus = (uint64_t)(uintptr_t)cpus;
+    session.cpus_len = session_cpus_len;
+    session.flags = flags;
+    return ioctl(fd, cmd, &session);
+}
+
+// Turn fds[first] to fds[first + n - 1] on or off with one broadcast if
+// possible, else with one IBS_ENABLE or IBS_DISABLE each
+static void switch_ibs_fds(const struct pollfd *fds, int first, int n,
+        uint64_t flags, const unsigned char *cpus, int enable)
+{
+    if (n == 0)
+        return;
+    if (enable && !ibs_session_ioctl(fds[first].fd, SESSION_CONFIG,
+                flags | IBS_SESSION_ENABLE, cpus))
+        return;
+    if (!enable && !ibs_session_ioctl(fds[first].fd, SESSION_DISABLE,
+                flags, cpus))
+        return;
+
+    for (int i = first; i < first + n; i++)
+    {
+        unsigned int cmd = enable ? IBS_ENABLE : IBS_DISABLE;
+        // The fetch halves of combined op devices
+        if (combined_ring && (flags & IBS_SESSION_FETCH))
+            cmd |= IBS_CMD_FETCH;
+        if (ioctl(fds[i].fd, cmd))
+        {
+            fprintf(stderr, "IBS %s %s failed on fd %d\n",
+                    (flags & IBS_SESSION_OP) ? "op" : "fetch",
+                    enable ? "enable" : "disable", fds[i].fd);
+            fprintf(stderr, "    %s\n", strerror(errno));
+        }
+    }
+}
+
+// Turn every device on or off; fds holds nopfds op devices, then nfetchfds
+// fetch devices, or with --combined, nopfds combined op devices
+static void switch_ibs(const struct pollfd *fds, int nopfds, int nfetchfds,
+        int enable)
+{
+    uint64_t both = IBS_SESSION_OP | IBS_SESSION_FETCH;
+
+    if (nopfds && (nfetchfds || combined_ring) &&
+            !memcmp(session_op_cpus, session_fetch_cpus, session_cpus_len) &&
+            !ibs_session_ioctl(fds[0].fd,
+                enable ? SESSION_CONFIG : SESSION_DISABLE,
+                enable ? both | IBS_SESSION_ENABLE : both, session_op_cpus))
+        return;
+
+    switch_ibs_fds(fds, 0, nopfds, IBS_SESSION_OP, session_op_cpus, enable);
+    if (combined_ring)
+        switch_ibs_fds(fds, 0, nopfds, IBS_SESSION_FETCH, session_fetch_cpus,
+                enable);
+    else
+        switch_ibs_fds(fds, nopfds, nfetchfds, IBS_SESSION_FETCH,
+                session_fetch_cpus, enable);
+}
+
 /**
  * enable_ibs_flavors - turn on IBS where possible
  * @fds:    (output) file descriptors and events of interest for poll
@@ -753,6 +1993,15 @@ void enable_ibs_flavors(struct pollfd *fds, int *nopfds, int *nfetchfds,
     int num_online_cpus = get_nprocs();
     fill_out_online_cores(num_cpus, num_online_cpus, cpu_list);
 
+    session_cpus_len = (num_cpus + 7) / 8;
+    session_op_cpus = calloc(session_cpus_len, 1);
+    session_fetch_cpus = calloc(session_cpus_len, 1);
+    if (session_op_cpus == NULL || session_fetch_cpus == NULL)
+    {
+        fprintf(stderr, "Could not allocate the session CPU bitmaps\n");
+        exit(EXIT_FAILURE);
+    }
+
     *nopfds = 0;
     if (flavors & IBS_OP) {
         for (cpu = 0; cpu < num_cpus; cpu++) {
@@ -766,24 +2015,45 @@ void enable_ibs_flavors(struct pollfd *fds, int *nopfds, int *nfetchfds,
                 continue;
             }
 
-            ioctl(fds[count].fd, SET_BUFFER_SIZE, buffer_size);
-            ioctl(fds[count].fd, SET_POLL_SIZE,
-                  poll_size / sizeof(ibs_op_t));
-            ioctl(fds[count].fd, SET_MAX_CNT, op_cnt_max_to_set);
-            if (ioctl(fds[count].fd, IBS_ENABLE)) {
-                fprintf(stderr, "IBS op enable failed on cpu %d\n",
+            set_buffer_size(fds[count].fd, cpu);
+            if (op_fields != IBS_OP_FIELDS_ALL &&
+                    ioctl(fds[count].fd, SET_SAMPLE_FIELDS, op_fields)) {
+                fprintf(stderr, "Could not set IBS op fields on cpu %d\n",
                         cpu);
-                continue;
+                fprintf(stderr, "    %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            if (combined_ring)
+            {
+                combine_fetch_half(fds[count].fd, cpu);
+                session_fetch_cpus[cpu / 8] |= 1 << (cpu % 8);
             }
+            // A combined buffer counts in IBS_RECORD_ALIGN-byte units
+            ioctl(fds[count].fd, SET_POLL_SIZE, poll_size /
+                    (combined_ring ? IBS_RECORD_ALIGN : op_entry_size));
+            ioctl(fds[count].fd, SET_MAX_CNT, op_cnt_max_to_set);
+            set_filter_mode(fds[count].fd, 0, cpu);
+            set_ring_mode(fds[count].fd, cpu);
+            set_histogram(fds[count].fd, cpu);
+            if (use_mmap)
+                map_ibs_buffer(fds[count].fd, count);
+            session_op_cpus[cpu / 8] |= 1 << (cpu % 8);
 
             fds[count].events = POLLIN | POLLRDNORM;
+            fd_cpus[count] = cpu;
+            if (rates != NULL)
+            {
+                rates[count].cpu = cpu;
+                rates[count].is_op = 1;
+                rates[count].max_cnt = op_cnt_max_to_set;
+            }
             (*nopfds)++;
             count++;
         }
     }
 
     *nfetchfds = 0;
-    if (flavors & IBS_FETCH) {
+    if ((flavors & IBS_FETCH) && !combined_ring) {
         for (cpu = 0; cpu < num_cpus; cpu++) {
             if (!cpu_list[cpu])
                 continue;
@@ -795,26 +2065,60 @@ void enable_ibs_flavors(struct pollfd *fds, int *nopfds, int *nfetchfds,
                 continue;
             }
 
-            ioctl(fds[count].fd, SET_BUFFER_SIZE, buffer_size);
-            ioctl(fds[count].fd, SET_POLL_SIZE,
-                  poll_size / sizeof(ibs_fetch_t));
-            ioctl(fds[count].fd, SET_MAX_CNT, fetch_cnt_max_to_set);
-            if (ioctl(fds[count].fd, IBS_ENABLE)) {
-                fprintf(stderr, "IBS fetch enable failed on cpu %d\n",
+            set_buffer_size(fds[count].fd, cpu);
+            if (fetch_fields != IBS_FETCH_FIELDS_ALL &&
+                    ioctl(fds[count].fd, SET_SAMPLE_FIELDS, fetch_fields)) {
+                fprintf(stderr, "Could not set IBS fetch fields on cpu %d\n",
                         cpu);
-                continue;
+                fprintf(stderr, "    %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
             }
+            ioctl(fds[count].fd, SET_POLL_SIZE,
+                  poll_size / fetch_entry_size);
+            ioctl(fds[count].fd, SET_MAX_CNT, fetch_cnt_max_to_set);
+            set_filter_mode(fds[count].fd, 0, cpu);
+            set_ring_mode(fds[count].fd, cpu);
+            if (use_mmap)
+                map_ibs_buffer(fds[count].fd, count);
+            session_fetch_cpus[cpu / 8] |= 1 << (cpu % 8);
 
             fds[count].events = POLLIN | POLLRDNORM;
+            fd_cpus[count] = cpu;
+            if (rates != NULL)
+            {
+                rates[count].cpu = cpu;
+                rates[count].is_op = 0;
+                rates[count].max_cnt = fetch_cnt_max_to_set;
+            }
             (*nfetchfds)++;
             count++;
         }
     }
 
+    num_rates = count;
+
+    // Everything is set up, so start sampling on every CPU at once
+    session_nopfds = *nopfds;
+    switch_ibs(fds, *nopfds, *nfetchfds, 1);
+
     if (cpu_list)
         free(cpu_list);
 }
 
+/**
+ * open_ibs_all_device - open /dev/ibs/all once the buffers are set up
+ */
+void open_ibs_all_device(void)
+{
+    all_fd = open("/dev/ibs/all", O_RDONLY | O_NONBLOCK);
+    if (all_fd < 0)
+    {
+        fprintf(stderr, "Could not open /dev/ibs/all\n");
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
 /**
  * reset_ibs_buffers
  */
@@ -824,48 +2128,467 @@ void reset_ibs_buffers(const struct pollfd *fds, int nfds)
         ioctl(fds[i].fd, RESET_BUFFER);
 }
 
-static inline void read_and_write_op_data(int fd, FILE *fp)
+// Write n samples from cpu to fp, or to where --per_cpu_files,
+// --async_output and --compress send them instead
+static void write_samples_now(FILE *fp, int is_op, int cpu,
+        const void *data, size_t entry_size, size_t n)
+{
+    struct sample_out *out = NULL;
+    size_t tmp;
+
+    if (num_outs > 0)
+    {
+        out = is_op ? op_outs : fetch_outs;
+        if (per_cpu_files && cpu >= 0 && cpu < num_outs)
+            out = &out[cpu];
+        if (out->trace != NULL)
+        {
+            const char *record = data;
+            for (size_t i = 0; i < n; i++, record += entry_size)
+            {
+                if (ibs_trace_put(out->trace, cpu, record))
+                {
+                    fprintf(stderr, "Ran out of memory compressing samples\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            return;
+        }
+        if (out->af != NULL)
+        {
+            async_output_write(out->af, data, entry_size * n);
+            return;
+        }
+        if (out->fp != NULL)
+            fp = out->fp;
+    }
+
+    tmp = fwrite(data, entry_size, n, fp);
+    if (tmp < n)
+        fprintf(stderr, "Failed to write %zu samples\n", n - tmp);
+}
+
+// TSC cycles per ms, measured against CLOCK_MONOTONIC
+static uint64_t tsc_per_ms(void)
+{
+    struct timespec start, now;
+    uint64_t start_tsc;
+    long ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_tsc = __rdtsc();
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ns = (now.tv_sec - start.tv_sec) * 1000000000L +
+            (now.tv_nsec - start.tv_nsec);
+    } while (ns < 10000000L);
+    return (__rdtsc() - start_tsc) * 1000000 / ns;
+}
+
+/**
+ * open_tsc_order - set up the --tsc_order merges
+ *
+ * Samples are held until one poll_timeout after the round that read them
+ * started, which leaves room for TSC skew between CPUs and for samples that
+ * were still being written into a buffer as it was read.
+ */
+void open_tsc_order(FILE *opf, FILE *fetchf)
+{
+    if (!tsc_order)
+        return;
+    ibs_merge_init(&op_merge, op_entry_size, 0);
+    ibs_merge_init(&fetch_merge, fetch_entry_size, 0);
+    op_merge_fp = opf;
+    fetch_merge_fp = fetchf;
+    op_merge_tsc = ibs_trace_field_offset(ibs_op_field_order,
+            IBS_OP_NUM_FIELDS, op_fields, IBS_FIELD_TSC);
+    fetch_merge_tsc = ibs_trace_field_offset(ibs_fetch_field_order,
+            IBS_FETCH_NUM_FIELDS, fetch_fields, IBS_FIELD_TSC);
+    merge_window = tsc_per_ms() * poll_timeout;
+}
+
+// Write out the held samples that are older than watermark
+static void release_merged(uint64_t watermark)
+{
+    const void *rec;
+    int cpu;
+
+    while ((rec = ibs_merge_pop(&op_merge, watermark, &cpu)) != NULL)
+        write_samples_now(op_merge_fp, 1, cpu, rec, op_entry_size, 1);
+    while ((rec = ibs_merge_pop(&fetch_merge, watermark, &cpu)) != NULL)
+        write_samples_now(fetch_merge_fp, 0, cpu, rec, fetch_entry_size, 1);
+}
+
+static void merge_samples(int is_op, int cpu, const void *data,
+        size_t entry_size, size_t n)
+{
+    ibs_merge_t *m = is_op ? &op_merge : &fetch_merge;
+    long tsc_off = is_op ? op_merge_tsc : fetch_merge_tsc;
+    const unsigned char *record = data;
+
+    for (size_t i = 0; i < n; i++, record += entry_size)
+    {
+        uint64_t tsc = ibs_trace_load(record + tsc_off, sizeof(uint64_t));
+        if (ibs_merge_put(m, (cpu < 0) ? 0 : cpu, tsc, record))
+        {
+            fprintf(stderr, "Ran out of memory ordering samples\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Past max_held, the oldest samples go out now rather than wait
+    release_merged(0);
+}
+
+// Count n samples from cpu for --live and --heatmap, and write them out
+// either now or, with --tsc_order, once they are in order
+static void write_samples(FILE *fp, int is_op, int cpu, const void *data,
+        size_t entry_size, size_t n)
+{
+    if (is_op && live_top)
+        hot_spots_add(data, entry_size, n);
+    if (is_op && heatmap_fp != NULL &&
+            ibs_heatmap_add_records(&heatmap, data, entry_size, n, op_fields))
+    {
+        fprintf(stderr, "Ran out of memory for the heatmap\n");
+        exit(EXIT_FAILURE);
+    }
+    if (fp == NULL || n == 0)
+        return;
+    if (tsc_order)
+        merge_samples(is_op, cpu, data, entry_size, n);
+    else
+        write_samples_now(fp, is_op, cpu, data, entry_size, n);
+}
+
+// Write out everything between rd and wr of a mapped buffer, then hand the
+// slots back to the driver. This takes at most two fwrite()s and no syscalls
+// to the driver.
+static void drain_mapped_buffer(ibs_ring_header_t *ring, FILE *fp,
+        int is_op, int cpu, unsigned long *n_samples, unsigned long *n_lost)
+{
+    uint64_t rd = ring->rd;
+    uint64_t wr = __atomic_load_n(&ring->wr, __ATOMIC_ACQUIRE);
+    char *data = (char *)ring + ring->data_offset;
+
+    while (rd != wr)
+    {
+        uint64_t end = (wr > rd) ? wr : ring->capacity;
+        size_t num_items = end - rd;
+        write_samples(fp, is_op, cpu, data + rd * ring->entry_size,
+                ring->entry_size, num_items);
+        *n_samples += num_items;
+        rd = (end == ring->capacity) ? 0 : end;
+    }
+
+    __atomic_store_n(&ring->rd, rd, __ATOMIC_RELEASE);
+    *n_lost += __atomic_exchange_n(&ring->lost, 0, __ATOMIC_RELAXED);
+}
+
+static inline void read_and_write_op_data(int fd, ibs_ring_header_t *ring,
+        FILE *fp, int cpu)
 {
     int tmp = 0;
     int num_items = 0;
 
+    if (ring != NULL)
+    {
+        drain_mapped_buffer(ring, fp, 1, cpu, &n_op_samples,
+                &n_lost_op_samples);
+        return;
+    }
+
     tmp = read(fd, global_buffer, buffer_size);
     if (tmp <= 0)
         return;
-    num_items = tmp / sizeof(ibs_op_t);
-
-    if (fp != NULL)
-    {
-        tmp = fwrite(global_buffer, sizeof(ibs_op_t), num_items, fp);
-        if (tmp < num_items)
-            fprintf(stderr, "Failed to write %d samples\n",
-                    num_items - tmp);
-    }
+    num_items = tmp / op_entry_size;
+    write_samples(fp, 1, cpu, global_buffer, op_entry_size, num_items);
 
     n_op_samples += num_items;
     n_lost_op_samples += ioctl(fd, GET_LOST);
 }
 
-static inline void read_and_write_fetch_data(int fd, FILE *fp)
+static inline void read_and_write_fetch_data(int fd, ibs_ring_header_t *ring,
+        FILE *fp, int cpu)
 {
     int tmp;
     int num_items = 0;
 
+    if (ring != NULL)
+    {
+        drain_mapped_buffer(ring, fp, 0, cpu, &n_fetch_samples,
+                &n_lost_fetch_samples);
+        return;
+    }
+
     tmp = read(fd, global_buffer, buffer_size);
     if (tmp <= 0)
         return;
-    num_items = tmp / sizeof(ibs_fetch_t);
+    num_items = tmp / fetch_entry_size;
+    write_samples(fp, 0, cpu, global_buffer, fetch_entry_size, num_items);
+
+    n_fetch_samples += num_items;
+    n_lost_fetch_samples += ioctl(fd, GET_LOST);
+}
+
+// Split the records read from a combined op device between the op and fetch
+// outputs. Its GET_LOST covers both flavors, and is counted as op losses.
+static void read_and_write_records(int fd, FILE *opf, FILE *fetchf, int cpu)
+{
+    int tmp = read(fd, global_buffer, buffer_size);
+    int off = 0;
 
-    if (fp != NULL)
+    if (tmp <= 0)
+        return;
+    while (off + (int)sizeof(ibs_record_header_t) <= tmp)
     {
-        tmp = fwrite(global_buffer, sizeof(ibs_fetch_t), num_items, fp);
-        if (tmp < num_items)
-            fprintf(stderr, "Failed to write %d samples\n",
-                    num_items - tmp);
+        ibs_record_header_t *rec = (ibs_record_header_t *)(global_buffer + off);
+        const char *sample = global_buffer + off + sizeof(*rec);
+
+        if (rec->size < sizeof(*rec) || rec->size > (uint32_t)(tmp - off))
+            break;
+        if (rec->type == IBS_RECORD_OP)
+        {
+            write_samples(opf, 1, cpu, sample, op_entry_size, 1);
+            n_op_samples++;
+        }
+        else if (rec->type == IBS_RECORD_FETCH)
+        {
+            write_samples(fetchf, 0, cpu, sample, fetch_entry_size, 1);
+            n_fetch_samples++;
+        }
+        off += rec->size;
     }
+    n_lost_op_samples += ioctl(fd, GET_LOST);
+}
 
-    n_fetch_samples += num_items;
-    n_lost_fetch_samples += ioctl(fd, GET_LOST);
+static void read_and_write_histogram(int fd)
+{
+    int tmp = read(fd, hist_buffer, HIST_SLOTS * sizeof(ibs_hist_entry_t));
+    int num_items;
+
+    if (tmp <= 0)
+        return;
+    num_items = tmp / sizeof(ibs_hist_entry_t);
+
+    for (int i = 0; i < num_items; i++)
+    {
+        ibs_hist_entry_t *e = &hist_buffer[i];
+        fprintf(histf, "%lu,0x%" PRIx64 ",0x%" PRIx64 ",%" PRIu64 ",%" PRIu64
+                ",%" PRIu64 "\n", hist_interval, e->rip, e->page, e->count,
+                e->dc_miss, e->dc_miss_lat);
+        n_op_samples += e->count;
+    }
+    n_lost_op_samples += ioctl(fd, GET_LOST);
+}
+
+// Each read() of a histogram device covers the samples since the last one,
+// so every op device is read once per interval.
+static void read_histograms(const struct pollfd *fds, int nopfds)
+{
+    for (int i = 0; i < nopfds; i++)
+        read_and_write_histogram(fds[i].fd);
+    hist_interval++;
+}
+
+// Milliseconds from then until now
+static long ms_between(const struct timespec *then, const struct timespec *now)
+{
+    return (now->tv_sec - then->tv_sec) * 1000 +
+        (now->tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/**
+ * poll_histograms - write out the histograms once every poll_timeout
+ */
+void poll_histograms(const struct pollfd *fds, int nopfds)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (ms_between(&hist_last_read, &now) < poll_timeout)
+        return;
+    read_histograms(fds, nopfds);
+    hist_last_read = now;
+}
+
+// Scale max_cnt so that the samples the device generated over elapsed_ms
+// would have come in at adaptive_rate per second. Lost samples always make
+// it back off. Steps are at most 2x, and errors under 10% are left alone so
+// that the rate does not hunt.
+static unsigned long next_max_cnt(const struct rate_state *r, long generated,
+        long elapsed_ms)
+{
+    unsigned long limit = r->is_op ? op_max_cnt_limit : 0xffff;
+    unsigned long min = r->is_op ? 0x9 : 0x1;
+    double scale;
+    unsigned long new_cnt;
+
+    // An idle core tells us nothing about its next busy phase
+    if (generated <= 0 || elapsed_ms <= 0)
+        return r->max_cnt;
+
+    scale = (generated * 1000.0 / elapsed_ms) / adaptive_rate;
+    if (r->lost && scale < 1.25)
+        scale = 1.25;
+    if (scale > 0.9 && scale < 1.1)
+        return r->max_cnt;
+    if (scale > 2.0)
+        scale = 2.0;
+    if (scale < 0.5)
+        scale = 0.5;
+
+    new_cnt = r->max_cnt * scale;
+    if (new_cnt > limit)
+        new_cnt = limit;
+    if (new_cnt < min)
+        new_cnt = min;
+    return new_cnt;
+}
+
+/**
+ * adapt_sample_rates - retune every device's max count once per interval
+ *
+ * The samples a device generated are those read out, plus those lost, plus
+ * the change in what is sitting in its buffer.
+ */
+void adapt_sample_rates(const struct pollfd *fds, int nfds)
+{
+    struct timespec now;
+    long elapsed_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ms = ms_between(&rate_last_adapt, &now);
+    if (elapsed_ms < ADAPT_INTERVAL)
+        return;
+
+    for (int i = 0; i < nfds; i++)
+    {
+        struct rate_state *r = &rates[i];
+        long buffered = ioctl(fds[i].fd, FIONREAD);
+        long generated;
+        unsigned long new_cnt;
+
+        if (buffered < 0)
+            buffered = r->buffered;
+        generated = r->samples + r->lost + (buffered - r->buffered);
+        new_cnt = next_max_cnt(r, generated, elapsed_ms);
+        if (new_cnt != r->max_cnt && !ioctl(fds[i].fd, SET_MAX_CNT, new_cnt))
+        {
+            // Periods in the units ibs_decoder uses for IbsOpMaxCnt
+            if (ratef != NULL)
+                fprintf(ratef, "%llu,%d,%s,%lu,%lu\n", __rdtsc(), r->cpu,
+                        r->is_op ? "op" : "fetch", r->max_cnt << 4,
+                        new_cnt << 4);
+            r->max_cnt = new_cnt;
+        }
+        r->samples = 0;
+        r->lost = 0;
+        r->buffered = buffered;
+    }
+    rate_last_adapt = now;
+}
+
+// Credit what one read of a device produced to its rate_state
+static void count_rate(int is_op, int cpu, unsigned long samples,
+        unsigned long lost)
+{
+    // /dev/ibs/all batches only say which cpu they came from
+    for (int i = 0; i < num_rates; i++)
+    {
+        if (rates[i].is_op == is_op && rates[i].cpu == cpu)
+        {
+            rates[i].samples += samples;
+            rates[i].lost += lost;
+            return;
+        }
+    }
+}
+
+static void read_and_write_dev(const struct pollfd *fds, int i, int nopfds,
+        FILE *opf, FILE *fetchf)
+{
+    unsigned long old_samples = n_op_samples + n_fetch_samples;
+    unsigned long old_lost = n_lost_op_samples + n_lost_fetch_samples;
+
+    if (i < nopfds && combined_ring)
+        read_and_write_records(fds[i].fd, opf, fetchf, fd_cpus[i]);
+    else if (i < nopfds)
+        read_and_write_op_data(fds[i].fd, ring_maps[i], opf, fd_cpus[i]);
+    else
+        read_and_write_fetch_data(fds[i].fd, ring_maps[i], fetchf,
+                fd_cpus[i]);
+
+    if (rates != NULL)
+    {
+        rates[i].samples += n_op_samples + n_fetch_samples - old_samples;
+        rates[i].lost += n_lost_op_samples + n_lost_fetch_samples - old_lost;
+    }
+}
+
+// Write out the batches returned by one read() of /dev/ibs/all. Returns
+// the number of bytes read, or <= 0 if nothing was.
+static int read_and_write_all_data(FILE *opf, FILE *fetchf)
+{
+    int bytes = read(all_fd, global_buffer, buffer_size);
+    int off = 0;
+
+    while (off + (int)sizeof(ibs_batch_header_t) <= bytes)
+    {
+        ibs_batch_header_t *hdr = (ibs_batch_header_t *)(global_buffer + off);
+        char *entries = global_buffer + off + sizeof(*hdr);
+        int is_op = (hdr->flavor == IBS_BATCH_OP);
+        FILE *fp = is_op ? opf : fetchf;
+
+        write_samples(fp, is_op, hdr->cpu, entries, hdr->entry_size,
+                hdr->num_entries);
+        if (rates != NULL)
+            count_rate(is_op, hdr->cpu, hdr->num_entries, hdr->lost);
+        if (is_op)
+        {
+            n_op_samples += hdr->num_entries;
+            n_lost_op_samples += hdr->lost;
+        }
+        else
+        {
+            n_fetch_samples += hdr->num_entries;
+            n_lost_fetch_samples += hdr->lost;
+        }
+        off += sizeof(*hdr) + (size_t)hdr->entry_size * hdr->num_entries;
+    }
+    return bytes;
+}
+
+// Keep reading while each read() fills most of global_buffer, since the
+// driver may have had more to give.
+static void drain_all_device(FILE *opf, FILE *fetchf)
+{
+    int slack = sizeof(ibs_batch_header_t) + sizeof(ibs_op_t);
+
+    while (read_and_write_all_data(opf, fetchf) > buffer_size - slack)
+        ;
+}
+
+// For --tsc_order: read every device, ready or not, then write out what
+// no device can still undercut. In flight recorder mode, the buffers are
+// left alone until the snapshot.
+static void read_all_ordered(const struct pollfd *fds, int nopfds,
+        int nfetchfds, FILE *opf, FILE *fetchf)
+{
+    uint64_t start = __rdtsc();
+
+    if (flight_recorder)
+        return;
+    if (all_fd >= 0)
+        drain_all_device(opf, fetchf);
+    else
+    {
+        for (int i = 0; i < nopfds + nfetchfds; i++)
+        {
+            if (i >= nopfds || histf == NULL)
+                read_and_write_dev(fds, i, nopfds, opf, fetchf);
+        }
+    }
+    release_merged((start > merge_window) ? start - merge_window : 0);
 }
 
 /**
@@ -876,27 +2599,63 @@ void poll_ibs(struct pollfd *fds, int nopfds, int nfetchfds, FILE *opf,
 {
     int tmp;
     int i;
+    int timeout = poll_timeout;
+
+    // --module_map and --live have work to do between polls
+    if (module_map_fp != NULL && timeout > MODULE_MAP_INTERVAL)
+        timeout = MODULE_MAP_INTERVAL;
+    if (live_top && timeout > LIVE_INTERVAL)
+        timeout = LIVE_INTERVAL;
+
+    if (all_fd >= 0)
+    {
+        struct pollfd all_pfd = { all_fd, POLLIN | POLLRDNORM, 0 };
+
+        tmp = poll(&all_pfd, 1, timeout);
+        if (tmp == -1 && errno != EINTR) {
+            perror("poll()");
+            exit(EXIT_FAILURE);
+        }
+        if (tsc_order)
+            read_all_ordered(fds, nopfds, nfetchfds, opf, fetchf);
+        else if (tmp > 0)
+            drain_all_device(opf, fetchf);
+        return;
+    }
 
     /* Wait up to POLL_TIMEOUT if nothing is ready */
-    tmp = poll(fds, nopfds + nfetchfds, poll_timeout);
+    tmp = poll(fds, nopfds + nfetchfds, timeout);
     if (tmp == -1) {
+        if (errno == EINTR)   // e.g. SIGUSR2 for a snapshot
+            return;
         perror("poll()");
         exit(EXIT_FAILURE);
+    } else if (tsc_order) {
+        read_all_ordered(fds, nopfds, nfetchfds, opf, fetchf);
+        return;
     } else if (tmp == 0) {
         return;
     }
 
-    /* Something is ready */
+    /* Something is ready. Histogram devices are read on a timer instead. */
     for (i = 0; i < nopfds; i++) {
-        if (fds[i].revents)
-            read_and_write_op_data(fds[i].fd, opf);
+        if (fds[i].revents && histf == NULL)
+            read_and_write_dev(fds, i, nopfds, opf, fetchf);
     }
     for (i = nopfds; i < (nopfds + nfetchfds); i++) {
         if (fds[i].revents)
-            read_and_write_fetch_data(fds[i].fd, fetchf);
+            read_and_write_dev(fds, i, nopfds, opf, fetchf);
     }
 }
 
+// Drivers without sample filters fail GET_FILTERED; count that as zero.
+// half is IBS_CMD_FETCH for the fetch half of a combined op device, else 0.
+static unsigned long get_filtered(int fd, unsigned int half)
+{
+    int filtered = ioctl(fd, GET_FILTERED | half);
+    return (filtered > 0) ? filtered : 0;
+}
+
 /**
  * flush_ibs_buffers - read all data from all fds
  */
@@ -905,10 +2664,146 @@ void flush_ibs_buffers(const struct pollfd *fds, int nopfds, int nfetchfds,
 {
     int i;
 
+    if (all_fd >= 0)
+        drain_all_device(opf, fetchf);
+    if (histf != NULL)
+        read_histograms(fds, nopfds);
+
     for (i = 0; i < nopfds; i++)
-        read_and_write_op_data(fds[i].fd, opf);
+    {
+        if (all_fd < 0 && histf == NULL)
+            read_and_write_dev(fds, i, nopfds, opf, fetchf);
+        n_filtered_op_samples += get_filtered(fds[i].fd, 0);
+        if (combined_ring)
+            n_filtered_fetch_samples += get_filtered(fds[i].fd,
+                    IBS_CMD_FETCH);
+    }
     for (i = nopfds; i < (nopfds + nfetchfds); i++)
-        read_and_write_fetch_data(fds[i].fd, fetchf);
+    {
+        if (all_fd < 0)
+            read_and_write_dev(fds, i, nopfds, opf, fetchf);
+        n_filtered_fetch_samples += get_filtered(fds[i].fd, 0);
+    }
+    // Everything has been read, so nothing held can be undercut
+    if (tsc_order)
+        release_merged(UINT64_MAX);
+}
+
+static void snapshot_ibs_ioctl(const struct pollfd *fds, int nfds,
+        unsigned long arg)
+{
+    for (int i = 0; i < nfds; i++)
+    {
+        if (ioctl(fds[i].fd, SNAPSHOT, arg))
+        {
+            fprintf(stderr, "IBS snapshot ioctl failed\n");
+            fprintf(stderr, "    %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * snapshot_ibs_buffers - write out the samples held by the frozen buffers
+ *
+ * The buffers take no new samples until this returns.
+ */
+void snapshot_ibs_buffers(const struct pollfd *fds, int nopfds, int nfetchfds,
+                          FILE *opf, FILE *fetchf)
+{
+    unsigned long old_op_samples = n_op_samples;
+    unsigned long old_fetch_samples = n_fetch_samples;
+
+    snapshot_ibs_ioctl(fds, nopfds + nfetchfds, IBS_SNAPSHOT_FREEZE);
+    flush_ibs_buffers(fds, nopfds, nfetchfds, opf, fetchf);
+    snapshot_ibs_ioctl(fds, nopfds + nfetchfds, IBS_SNAPSHOT_THAW);
+    // Do not leave part of the snapshot sitting in a trace writer
+    if (flush_sample_traces())
+        fprintf(stderr, "Ran out of memory compressing samples\n");
+
+    fprintf(stderr, "IBS snapshot: %lu op samples, %lu fetch samples\n",
+            n_op_samples - old_op_samples,
+            n_fetch_samples - old_fetch_samples);
+}
+
+// Returns 0 if no device could report its statistics
+static int sum_ibs_stats(const struct pollfd *fds, int first, int last,
+        unsigned int half, ibs_stats_t *sum)
+{
+    int found = 0;
+
+    memset(sum, 0, sizeof(*sum));
+    for (int i = first; i < last; i++)
+    {
+        ibs_stats_t st;
+        if (ioctl(fds[i].fd, GET_STATS | half, &st))
+            continue;
+        found = 1;
+        sum->nmis += st.nmis;
+        sum->nmi_cycles += st.nmi_cycles;
+        if (st.nmi_cycles_max > sum->nmi_cycles_max)
+            sum->nmi_cycles_max = st.nmi_cycles_max;
+        for (int b = 0; b < IBS_STATS_HIST_BUCKETS; b++)
+            sum->nmi_hist[b] += st.nmi_hist[b];
+        sum->wakeups += st.wakeups;
+        sum->read_bytes += st.read_bytes;
+        if (st.high_water > sum->high_water)
+            sum->high_water = st.high_water;
+    }
+    return found;
+}
+
+/**
+ * collect_ibs_stats - gather the driver's overhead statistics
+ *
+ * Call this while the devices are still open; closing them resets the
+ * counters.
+ */
+void collect_ibs_stats(const struct pollfd *fds, int nopfds, int nfetchfds)
+{
+    ibs_stats_tsc = __rdtsc();
+    have_op_stats = sum_ibs_stats(fds, 0, nopfds, 0, &op_stats);
+    // The fetch halves of combined op devices keep their own interrupt
+    // counts, but the buffer's wakeups and high water are the op side's
+    if (combined_ring)
+        have_fetch_stats = sum_ibs_stats(fds, 0, nopfds, IBS_CMD_FETCH,
+                &fetch_stats);
+    else
+        have_fetch_stats = sum_ibs_stats(fds, nopfds, nopfds + nfetchfds, 0,
+                &fetch_stats);
+}
+
+/**
+ * print_ibs_stats - print one CSV line of overhead statistics
+ * @ndevs:  number of devices summed in st, one per core
+ *
+ * The overhead is the share of the sampled cores' TSC cycles, since IBS was
+ * enabled, that went into the interrupt handler.
+ */
+void print_ibs_stats(const char *flavor, const ibs_stats_t *st, int ndevs)
+{
+    double elapsed = (double)(ibs_stats_tsc - ibs_start_tsc) * ndevs;
+    double pct = (elapsed > 0) ? (100.0 * st->nmi_cycles / elapsed) : 0;
+    uint64_t avg = st->nmis ? (st->nmi_cycles / st->nmis) : 0;
+
+    printf("%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.4f,%" PRIu64
+            ",%" PRIu64 ",%" PRIu64 "\n", flavor, st->nmis, st->nmi_cycles,
+            avg, st->nmi_cycles_max, pct, st->wakeups, st->read_bytes,
+            st->high_water);
+}
+
+void print_nmi_histogram(const char *flavor, const ibs_stats_t *st)
+{
+    printf("\n%s interrupt handler cycles:\n", flavor);
+    for (int b = 0; b < IBS_STATS_HIST_BUCKETS; b++)
+    {
+        if (!st->nmi_hist[b])
+            continue;
+        if (b == IBS_STATS_HIST_BUCKETS - 1)
+            printf(">= 2^%d,%" PRIu64 "\n", b - 1, st->nmi_hist[b]);
+        else
+            printf("< 2^%d,%" PRIu64 "\n", b, st->nmi_hist[b]);
+    }
 }
 
 /**
@@ -916,8 +2811,17 @@ void flush_ibs_buffers(const struct pollfd *fds, int nopfds, int nfetchfds,
  */
 void disable_ibs(const struct pollfd *fds, int nfds)
 {
+    // Let go of the buffers first, so the devices can be reset on close
+    if (all_fd >= 0)
+    {
+        close(all_fd);
+        all_fd = -1;
+    }
+    if (session_op_cpus != NULL)
+        switch_ibs(fds, session_nopfds, nfds - session_nopfds, 0);
     for (int i = 0; i < nfds; i++) {
-        ioctl(fds[i].fd, IBS_DISABLE);
+        if (ring_maps[i] != NULL)
+            munmap(ring_maps[i], ring_map_lens[i]);
         close(fds[i].fd);
     }
 }
@@ -48,6 +48,26 @@
 // on the read() command.
 #define POLL_TIMEOUT    1000
 
+// Slots in each of the driver's per-core histogram tables with --histogram.
+// Each slot holds one RIP (or RIP and page); once the table is too crowded to
+// place a new one, its samples are counted as lost.
+#define HIST_SLOTS      4096
+
+// How often (in ms) --adaptive_rate retunes the sample rates
+#define ADAPT_INTERVAL  1000
+
+// How often (in ms) --module_map looks for new or removed code mappings.
+// Polls wait at most this long while it is on.
+#define MODULE_MAP_INTERVAL 10
+
+// How often (in ms) --live shows its tables
+#define LIVE_INTERVAL   1000
+
+// Output buffers for --direct_io or --stream without --async_output. Each is
+// as large as the driver's buffer, so this many reads can be in flight to
+// storage or the network.
+#define ASYNC_BUFFERS   16
+
 // The IBS Monitor application uses a number of global variables to hold things
 // like the file handler outputs, the op and fetch sample rates, and the size
 // of the kernel buffer that it will request from the IBS driver.
@@ -59,11 +79,13 @@ void set_global_defaults(void);
 // limit and error checking.
 
 // Arg 1: Input -   Filename string.
-// Arg 2: Output -  Pointer to the FILE* to initialize with this function.
+// Arg 2: Output -  Pointer to the FILE* that parse_args() will open.
 // Arg 3: Output -  Pointer to the variable that will have IBS_OP/FETCH
 //                  Added to it.
 void set_op_file(char *opt, FILE **opf, int *flavors);
 void set_fetch_file(char *opt, FILE **fetchf, int *flavors);
+// Count op samples per RIP in the driver and write the counts here as CSV
+void set_histogram_file(char *opt, int *flavors);
 // The sample rates here are the actual sample rates you want. However, the
 // bottom 4 bits of what you put in will be randomized in the driver.
 void set_global_op_sample_rate(int sample_rate);
@@ -73,6 +95,57 @@ void set_global_buffer_size(int in_buffer_size);
 void set_global_poll_percent(int in_poll_percent);
 // Timeout in ms
 void set_global_poll_timeout(int in_poll_timeout);
+// Consume the driver's buffers through mmap() rather than read()
+void set_global_use_mmap(void);
+// Physically contiguous driver buffers; see IBS_BUFFER_HUGE in ibs-uapi.h
+void set_global_huge_buffers(void);
+// Comma-separated field names or a numeric IBS_*FIELD* mask
+void set_global_op_fields(char *opt);
+void set_global_fetch_fields(char *opt);
+// Keep the most recent samples and write them out on SIGUSR2
+void set_global_flight_recorder(void);
+// Read every CPU's samples through /dev/ibs/all
+void set_global_use_all_device(void);
+// Put each CPU's op and fetch samples into one driver buffer
+void set_global_combined_ring(void);
+// Key --histogram counts on the data page as well as the RIP
+void set_global_histogram_pages(void);
+// Target samples per second per device for the sample rate controller
+void set_global_adaptive_rate(int in_rate);
+// Log each sample rate change there as CSV
+void set_rate_log_file(char *opt);
+// Write the program's executable mappings there (see ibs-modmap.h)
+void set_module_map_file(char *opt);
+// Show the top_n DC-missing RIPs and pages as the program runs
+void set_global_live_top(int top_n, int *flavors);
+// Append the --live tables there as CSV
+void set_live_file(char *opt);
+// Write a per-page NUMA heatmap of the op samples there (see ibs-heatmap.h)
+void set_heatmap_file(char *opt, int *flavors);
+// Count the heatmap per 2M page
+void set_global_heatmap_huge_pages(void);
+// Write sample files from a background thread through this many buffers
+void set_global_async_buffers(int in_buffers);
+// Write sample files with O_DIRECT
+void set_global_direct_io(void);
+// Send the sample files to an ibs_receiver at addr (see ibs-stream.h)
+void set_global_stream(char *addr);
+// Also deflate each block sent with --stream
+void set_global_stream_deflate(void);
+// One sample file per CPU
+void set_global_per_cpu_files(void);
+// Write sample files in this trace format (see ibs-trace.h)
+void set_global_trace_format(uint32_t format);
+// Write samples in TSC order across CPUs (see ibs-merge.h)
+void set_global_tsc_order(void);
+// Only keep samples from the monitored program
+void set_global_target_only(void);
+// IBS_FILTER_MODE_USER or IBS_FILTER_MODE_KERNEL
+void set_global_filter_mode(int in_filter_mode);
+// Only keep samples from tasks under this cgroup v2 directory
+void set_global_filter_cgroup(char *dir);
+// Only let IBS count while a target task runs
+void set_global_sched_gate(void);
 
 
 // Call this early in the application in order to parse the command line
@@ -87,13 +160,27 @@ void parse_args(int argc, char *argv[], FILE **opf, FILE **fetchf,
  * @nfetchfds:  (output) number of fetch file descriptors successfully set up
  * @flavors:    IBS_OP, IBS_FETCH, or IBS_BOTH
  */
+void open_sample_outputs(FILE *opf, FILE *fetchf, char *argv[]);
+void close_sample_outputs(void);
+void open_tsc_order(FILE *opf, FILE *fetchf);
+void write_heatmap(void);
 void enable_ibs_flavors(struct pollfd *fds, int *nopfds, int *nfetchfds,
                         int flavors);
+void filter_ibs_target(const struct pollfd *fds, int nfds, pid_t pid);
+void open_ibs_all_device(void);
 void reset_ibs_buffers(const struct pollfd *fds, int nfds);
 void poll_ibs(struct pollfd *fds, int nopfds, int nfetchfds, FILE *opf,
               FILE *fetchf);
+void poll_histograms(const struct pollfd *fds, int nopfds);
+void adapt_sample_rates(const struct pollfd *fds, int nfds);
 void flush_ibs_buffers(const struct pollfd *fds, int nopfds, int nfetchfds,
                        FILE *opf, FILE *fetchf);
+void snapshot_ibs_buffers(const struct pollfd *fds, int nopfds, int nfetchfds,
+                          FILE *opf, FILE *fetchf);
+void collect_ibs_stats(const struct pollfd *fds, int nopfds, int nfetchfds);
+// ndevs is the number of devices (cores) that st was summed over
+void print_ibs_stats(const char *flavor, const ibs_stats_t *st, int ndevs);
+void print_nmi_histogram(const char *flavor, const ibs_stats_t *st);
 void disable_ibs(const struct pollfd *fds, int nfds);
 
 #endif        /* IBS_MONITOR_H */
@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ *
+ * Module map capture for the AMD Research IBS monitoring utility. Instead of
+ * having ld.so log every library it loads (LD_DEBUG), this reads the
+ * program's /proc/<pid>/maps from the outside, which also catches code that
+ * was mapped by hand or written by a JIT. The program itself is never
+ * slowed down; each look costs the monitor an open() and a read() per
+ * process.
+ *
+ * LD_DEBUG is inherited, so the processes that the program starts (a shell
+ * wrapper's or make's workload, say) are followed as well. Every look goes
+ * through /proc/<pid>/task/<tid>/children of each process it knows. Kernels
+ * built without CONFIG_PROC_CHILDREN lack those files, and there the parent
+ * of every process in /proc is checked instead, though less often.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "ibs-modmap.h"
+#include "module_map.h"
+
+struct mapping {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    char *name;                 // NULL for anonymous code
+};
+
+struct mapping_list {
+    struct mapping *maps;
+    size_t num, max;
+};
+
+// One of the monitored program's processes
+struct process {
+    pid_t pid;
+    char maps_path[64];
+    // What /proc/<pid>/maps held at the last look, and the mappings in it
+    char *last_text;
+    size_t last_len;
+    struct mapping_list current;
+    // When the last look was
+    uint64_t last_tsc;
+};
+
+static FILE *map_fp = NULL;
+static int scan_interval_ms = 0;
+static pid_t map_pid = -1;
+static struct process *procs = NULL;
+static size_t num_procs = 0, max_procs = 0;
+// Scratch space for one look
+static char *text = NULL;
+static size_t text_max = 0;
+static struct mapping_list next;
+// When the last look at all of them was
+static uint64_t last_tsc = 0;
+static struct timespec last_scan;
+static unsigned long num_records = 0;
+// Without children files: how often to go through all of /proc, and when
+// that was last done
+#define PROC_WALK_INTERVAL_MS 100
+static int have_children_files = -1;
+static uint64_t last_walk_tsc = 0;
+static struct timespec last_walk;
+
+void module_map_init(FILE *fp, int interval_ms)
+{
+    map_fp = fp;
+    scan_interval_ms = interval_ms;
+}
+
+// The whole of /proc/<pid>/maps into text, or -1 once pid is gone
+static ssize_t read_maps(const char *maps_path)
+{
+    int fd = open(maps_path, O_RDONLY);
+    size_t len = 0;
+
+    if (fd < 0)
+        return -1;
+    for (;;)
+    {
+        ssize_t n;
+        if (text_max - len < 4096)
+        {
+            text_max = text_max ? 2 * text_max : 16384;
+            text = realloc(text, text_max);
+            if (text == NULL)
+            {
+                fprintf(stderr, "Out of memory reading %s\n", maps_path);
+                exit(EXIT_FAILURE);
+            }
+        }
+        n = read(fd, text + len, text_max - len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    close(fd);
+    text[len] = '\0';
+    return len;
+}
+
+static void add_mapping(struct mapping_list *l, const struct mapping *m)
+{
+    if (l->num == l->max)
+    {
+        l->max = l->max ? 2 * l->max : 64;
+        l->maps = realloc(l->maps, l->max * sizeof(*l->maps));
+        if (l->maps == NULL)
+        {
+            fprintf(stderr, "Out of memory for the module map\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    l->maps[l->num++] = *m;
+}
+
+static void clear_mappings(struct mapping_list *l)
+{
+    for (size_t i = 0; i < l->num; i++)
+        free(l->maps[i].name);
+    l->num = 0;
+}
+
+// Pull the executable mappings out of lines like
+// "00400000-00452000 r-xp 00000000 08:02 173521      /usr/bin/dbus-daemon"
+static void parse_maps(struct mapping_list *l)
+{
+    char *line = text;
+
+    clear_mappings(l);
+    while (*line != '\0')
+    {
+        char *eol = strchr(line, '\n');
+        char *p, *perms;
+        struct mapping m;
+
+        if (eol != NULL)
+            *eol = '\0';
+        m.start = strtoull(line, &p, 16);
+        m.end = strtoull(p + 1, &p, 16);
+        perms = p + 1;
+        if (strlen(perms) > 5 && perms[2] == 'x')
+        {
+            m.offset = strtoull(perms + 5, &p, 16);
+            // Skip the device and inode to get to the name, if any
+            for (int field = 0; field < 2; field++)
+            {
+                p += strspn(p, " ");
+                p += strcspn(p, " ");
+            }
+            p += strspn(p, " ");
+            m.name = (*p != '\0') ? strdup(p) : NULL;
+            add_mapping(l, &m);
+        }
+        if (eol == NULL)
+            break;
+        *eol = '\n';
+        line = eol + 1;
+    }
+}
+
+static int same_mapping(const struct mapping *a, const struct mapping *b)
+{
+    return a->start == b->start && a->end == b->end &&
+        a->offset == b->offset &&
+        (a->name == NULL ? b->name == NULL :
+         (b->name != NULL && !strcmp(a->name, b->name)));
+}
+
+static void write_record(uint16_t type, pid_t pid, uint64_t tsc,
+        const struct mapping *m)
+{
+    if (ibs_modmap_write(map_fp, type, pid, tsc, m->start, m->end,
+                m->offset, m->name))
+    {
+        fprintf(stderr, "Failed to write the module map\n");
+        exit(EXIT_FAILURE);
+    }
+    num_records++;
+}
+
+// Both lists are sorted by address, as /proc/<pid>/maps is
+static void write_changes(const struct process *proc, uint64_t now)
+{
+    const struct mapping_list *cur = &proc->current;
+    size_t i = 0, j = 0;
+
+    while (i < cur->num || j < next.num)
+    {
+        const struct mapping *old = (i < cur->num) ? &cur->maps[i] : NULL;
+        const struct mapping *new = (j < next.num) ? &next.maps[j] : NULL;
+
+        if (old != NULL && new != NULL && same_mapping(old, new))
+        {
+            i++;
+            j++;
+        }
+        else if (new == NULL || (old != NULL && old->start <= new->start))
+        {
+            write_record(IBS_MODMAP_UNMAP, proc->pid, now, old);
+            i++;
+        }
+        else
+        {
+            write_record(IBS_MODMAP_MAP, proc->pid, proc->last_tsc, new);
+            j++;
+        }
+    }
+}
+
+static int following(pid_t pid)
+{
+    for (size_t i = 0; i < num_procs; i++)
+        if (procs[i].pid == pid)
+            return 1;
+    return 0;
+}
+
+// Start following pid, which was not around at the last look at tsc.
+// Returns 1 if it was new.
+static int add_process(pid_t pid, uint64_t tsc)
+{
+    struct process *proc;
+
+    if (following(pid))
+        return 0;
+    if (num_procs == max_procs)
+    {
+        max_procs = max_procs ? 2 * max_procs : 16;
+        procs = realloc(procs, max_procs * sizeof(*procs));
+        if (procs == NULL)
+        {
+            fprintf(stderr, "Out of memory for the module map\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    proc = &procs[num_procs++];
+    memset(proc, 0, sizeof(*proc));
+    proc->pid = pid;
+    snprintf(proc->maps_path, sizeof(proc->maps_path), "/proc/%d/maps",
+            (int)pid);
+    proc->last_tsc = tsc;
+    return 1;
+}
+
+static void free_process(struct process *proc)
+{
+    clear_mappings(&proc->current);
+    free(proc->current.maps);
+    free(proc->last_text);
+}
+
+// Add the children of each of pid's threads, in lines like "1234 1240 "
+static void add_children(pid_t pid)
+{
+    char path[64];
+    DIR *dir;
+    struct dirent *d;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    dir = opendir(path);
+    if (dir == NULL)
+        return;
+    while ((d = readdir(dir)) != NULL)
+    {
+        char children_path[sizeof(path) + sizeof(d->d_name) + 16];
+        char buf[4096];
+        ssize_t n;
+        int fd;
+
+        if (d->d_name[0] == '.')
+            continue;
+        snprintf(children_path, sizeof(children_path), "%s/%s/children",
+                path, d->d_name);
+        fd = open(children_path, O_RDONLY);
+        if (fd < 0)
+            continue;
+        // Only this many bytes' worth of a thread's children are followed
+        n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0)
+            continue;
+        buf[n] = '\0';
+        for (char *p = buf, *end; ; p = end)
+        {
+            long child = strtol(p, &end, 10);
+            if (end == p)
+                break;
+            if (child > 0)
+                add_process(child, last_tsc);
+        }
+    }
+    closedir(dir);
+}
+
+// The parent in /proc/<pid>/stat, "pid (comm) state ppid ...", or -1
+static pid_t read_ppid(const char *pid)
+{
+    char path[300];
+    char buf[512];
+    char *p;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%s/stat", pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    // comm may hold spaces and parentheses of its own
+    p = strrchr(buf, ')');
+    if (p == NULL || p[1] == '\0' || p[2] == '\0')
+        return -1;
+    return strtol(p + 3, NULL, 10);
+}
+
+// Add every process in /proc whose parent is followed, until no more turn up
+static void walk_proc(uint64_t now)
+{
+    int added;
+
+    do {
+        DIR *dir = opendir("/proc");
+        struct dirent *d;
+
+        added = 0;
+        if (dir == NULL)
+            return;
+        while ((d = readdir(dir)) != NULL)
+        {
+            char *end;
+            long pid = strtol(d->d_name, &end, 10);
+            pid_t ppid;
+
+            if (*end != '\0' || pid <= 0 || following(pid))
+                continue;
+            ppid = read_ppid(d->d_name);
+            if (ppid > 0 && following(ppid))
+                added += add_process(pid, last_walk_tsc);
+        }
+        closedir(dir);
+    } while (added);
+    last_walk_tsc = now;
+    clock_gettime(CLOCK_MONOTONIC, &last_walk);
+}
+
+static void add_descendants(uint64_t now)
+{
+    if (have_children_files < 0)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/children",
+                (int)getpid(), (int)getpid());
+        have_children_files = !access(path, R_OK);
+    }
+    if (have_children_files)
+    {
+        // This also goes through the children added on the way
+        for (size_t i = 0; i < num_procs; i++)
+            add_children(procs[i].pid);
+    }
+    else if ((last_scan.tv_sec - last_walk.tv_sec) * 1000 +
+            (last_scan.tv_nsec - last_walk.tv_nsec) / 1000000 >=
+            PROC_WALK_INTERVAL_MS)
+    {
+        walk_proc(now);
+    }
+}
+
+// Look at one process. Returns -1 if it is gone.
+static int scan_process(struct process *proc, uint64_t now)
+{
+    ssize_t len = read_maps(proc->maps_path);
+    struct mapping_list tmp;
+
+    if (len < 0)
+        return -1;
+    // A zombie shows no mappings; keep the last ones until it is reaped
+    if (len == 0)
+        return 0;
+    if ((size_t)len == proc->last_len && !memcmp(text, proc->last_text, len))
+    {
+        proc->last_tsc = now;
+        return 0;
+    }
+
+    parse_maps(&next);
+    write_changes(proc, now);
+    tmp = proc->current;
+    proc->current = next;
+    next = tmp;
+    proc->last_tsc = now;
+
+    proc->last_text = realloc(proc->last_text, len);
+    if (proc->last_text == NULL)
+    {
+        fprintf(stderr, "Out of memory for the module map\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(proc->last_text, text, len);
+    proc->last_len = len;
+    return 0;
+}
+
+static void scan(void)
+{
+    uint64_t now = __rdtsc();
+    size_t kept = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &last_scan);
+    add_descendants(now);
+    for (size_t i = 0; i < num_procs; i++)
+    {
+        if (scan_process(&procs[i], now))
+            free_process(&procs[i]);
+        else
+            procs[kept++] = procs[i];
+    }
+    num_procs = kept;
+    last_tsc = now;
+}
+
+void module_map_start(pid_t pid, uint64_t start_tsc)
+{
+    if (map_fp == NULL)
+        return;
+    map_pid = pid;
+    if (ibs_modmap_write_header(map_fp, pid, start_tsc))
+    {
+        fprintf(stderr, "Failed to write the module map header\n");
+        exit(EXIT_FAILURE);
+    }
+    last_tsc = start_tsc;
+    last_walk_tsc = start_tsc;
+    add_process(pid, start_tsc);
+    scan();
+}
+
+void module_map_poll(void)
+{
+    struct timespec now;
+
+    if (map_fp == NULL || map_pid < 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - last_scan.tv_sec) * 1000 +
+            (now.tv_nsec - last_scan.tv_nsec) / 1000000 < scan_interval_ms)
+        return;
+    scan();
+}
+
+void module_map_close(void)
+{
+    if (map_fp == NULL)
+        return;
+    if (map_pid >= 0)
+        scan();
+    if (fclose(map_fp))
+        fprintf(stderr, "Failed to close the module map\n");
+    map_fp = NULL;
+    for (size_t i = 0; i < num_procs; i++)
+        free_process(&procs[i]);
+    free(procs);
+    clear_mappings(&next);
+    free(next.maps);
+    free(text);
+}
+
+unsigned long module_map_records(void)
+{
+    return num_records;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ */
+#ifndef MODULE_MAP_H
+#define MODULE_MAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Records the executable mappings of the monitored program, and of the
+// processes it starts, into a module map (see ibs-modmap.h) by reading
+// /proc/<pid>/maps when it has exec()ed and then whenever module_map_poll()
+// finds that interval_ms have passed. Only the lines that changed since the
+// last look are written.
+
+// Write the map to fp, looking at most every interval_ms
+void module_map_init(FILE *fp, int interval_ms);
+
+// pid has just exec()ed the program; monitoring began at start_tsc
+void module_map_start(pid_t pid, uint64_t start_tsc);
+
+// Look again if it is time to
+void module_map_poll(void);
+
+// Take a last look at the processes still around, and close the file
+void module_map_close(void);
+
+// Number of map and unmap records written
+unsigned long module_map_records(void);
+
+#endif  /* MODULE_MAP_H */
@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2017 Advanced Micro Devices, Inc.
+ *
+ * This file is distributed under the BSD license described in tools/LICENSE
+ *
+ * Receives the sample files that ibs_monitor --stream and the libIBS daemon
+ * send over the network (see ibs-stream.h), so that one machine can collect
+ * the samples of a whole fleet. Each stream is written to
+ * {dir}/{sender's host name}/{file name}, byte for byte what the sender
+ * would have written locally, so ibs_decoder reads it as usual.
+ *
+ * Each connection gets its own thread, and a thread only reads as fast as it
+ * can write, so a receiver that falls behind slows its senders down rather
+ * than buffering without bound.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "ibs-stream.h"
+
+char *listen_addr = NULL;
+char *out_dir = ".";
+// Streams to take before exiting, or 0 to run until killed
+unsigned long max_streams = 0;
+
+// Connections still being read; protected by conn_lock
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_cv = PTHREAD_COND_INITIALIZER;
+static unsigned long active = 0;
+
+struct conn {
+    int fd;
+    unsigned long id;
+};
+
+void parse_args(int argc, char *argv[])
+{
+    static struct option longopts[] =
+    {
+        {"listen", required_argument, NULL, 'l'},
+        {"dir", required_argument, NULL, 'd'},
+        {"count", required_argument, NULL, 'n'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "hl:d:n:", longopts, NULL)) != -1)
+    {
+        switch (c) {
+            case 'h':
+            case '?':
+                fprintf(stderr, "This program receives the sample files that ibs_monitor --stream and the\n");
+                fprintf(stderr, "IBS daemon's IBS_DAEMON_STREAM send, and writes them under a directory.\n");
+                fprintf(stderr, "Usage: ./ibs_receiver -l {address} [other options below]\n");
+                fprintf(stderr, "--listen (or -l) {host:port, :port or unix:path}:\n");
+                fprintf(stderr, "       Where to listen for senders. Required\n");
+                fprintf(stderr, "--dir (or -d) {dir}:\n");
+                fprintf(stderr, "       Write each stream to {dir}/{sender's host name}/{file name}. Defaults to .\n");
+                fprintf(stderr, "--count (or -n) {# streams}:\n");
+                fprintf(stderr, "       Exit once this many streams have ended. Defaults to running until killed\n");
+                exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+            case 'l':
+                listen_addr = optarg;
+                break;
+            case 'd':
+                out_dir = optarg;
+                break;
+            case 'n':
+                max_streams = strtoul(optarg, NULL, 0);
+                break;
+        }
+    }
+
+    if (listen_addr == NULL)
+    {
+        fprintf(stderr, "Error, --listen is required\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// A host or file name from a sender must stay in its own directory
+static int safe_name(const char *name)
+{
+    return name[0] != '\0' && strchr(name, '/') == NULL &&
+        strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// Open {out_dir}/{host}/{name}, or return NULL after saying why
+static FILE *open_stream_file(unsigned long id, const char *host,
+        const char *name, char **path)
+{
+    char *host_dir;
+    FILE *fp;
+
+    if (!safe_name(host) || !safe_name(name))
+    {
+        fprintf(stderr, "Stream %lu: refusing the name %s/%s\n", id, host,
+                name);
+        return NULL;
+    }
+    int num_bytes = asprintf(&host_dir, "%s/%s", out_dir, host);
+    if (num_bytes <= 0)
+        return NULL;
+    if (mkdir(host_dir, 0755) && errno != EEXIST)
+    {
+        fprintf(stderr, "Stream %lu: could not make %s\n", id, host_dir);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        free(host_dir);
+        return NULL;
+    }
+    num_bytes = asprintf(path, "%s/%s", host_dir, name);
+    free(host_dir);
+    if (num_bytes <= 0)
+        return NULL;
+    fp = fopen(*path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Stream %lu: could not open %s\n", id, *path);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        free(*path);
+    }
+    return fp;
+}
+
+// Read blocks into fp until the sender closes. Returns 0 if it ended cleanly.
+static int receive_blocks(struct conn *c, uint32_t flags, FILE *fp,
+        uint64_t *raw_bytes, uint64_t *wire_bytes)
+{
+    unsigned char *buf = NULL, *raw = NULL;
+    size_t buf_len = 0, raw_len = 0;
+    int ret = -1;
+
+    for (;;)
+    {
+        ibs_stream_block_t block;
+        int got = ibs_stream_recv(c->fd, &block, sizeof(block));
+        if (got == 1)
+        {
+            ret = 0;
+            break;
+        }
+        if (got < 0)
+        {
+            fprintf(stderr, "Stream %lu ended part way through a block\n",
+                    c->id);
+            fprintf(stderr, "    %s\n", strerror(errno));
+            break;
+        }
+        if (block.raw_len > IBS_STREAM_MAX_BLOCK || block.len > block.raw_len ||
+                (block.len < block.raw_len && !(flags & IBS_STREAM_DEFLATE)))
+        {
+            fprintf(stderr, "Stream %lu sent a bad block of %u bytes for %u\n",
+                    c->id, block.len, block.raw_len);
+            break;
+        }
+        if (block.len > buf_len)
+        {
+            unsigned char *tmp = realloc(buf, block.len);
+            if (tmp == NULL)
+                break;
+            buf = tmp;
+            buf_len = block.len;
+        }
+        if (ibs_stream_recv(c->fd, buf, block.len))
+        {
+            fprintf(stderr, "Stream %lu ended part way through a block\n",
+                    c->id);
+            break;
+        }
+
+        const unsigned char *data = buf;
+        if (block.len < block.raw_len)
+        {
+            uLongf out_len = block.raw_len;
+            if (block.raw_len > raw_len)
+            {
+                unsigned char *tmp = realloc(raw, block.raw_len);
+                if (tmp == NULL)
+                    break;
+                raw = tmp;
+                raw_len = block.raw_len;
+            }
+            if (uncompress(raw, &out_len, buf, block.len) != Z_OK ||
+                    out_len != block.raw_len)
+            {
+                fprintf(stderr, "Stream %lu sent a corrupt block\n", c->id);
+                break;
+            }
+            data = raw;
+        }
+        if (fwrite(data, 1, block.raw_len, fp) < block.raw_len)
+        {
+            fprintf(stderr, "Stream %lu: failed to write %u bytes\n", c->id,
+                    block.raw_len);
+            fprintf(stderr, "    %s\n", strerror(errno));
+            break;
+        }
+        *raw_bytes += block.raw_len;
+        *wire_bytes += sizeof(block) + block.len;
+    }
+    free(buf);
+    free(raw);
+    return ret;
+}
+
+static void receive_stream(struct conn *c)
+{
+    ibs_stream_hello_t hello;
+    char names[IBS_STREAM_MAX_NAME];
+    uint64_t raw_bytes = 0, wire_bytes = 0;
+    char *host, *name, *path;
+    FILE *fp;
+    int ret;
+
+    if (ibs_stream_recv(c->fd, &hello, sizeof(hello)) ||
+            memcmp(hello.magic, IBS_STREAM_MAGIC, sizeof(hello.magic)) ||
+            hello.name_len < 4 || hello.name_len > sizeof(names) ||
+            ibs_stream_recv(c->fd, names, hello.name_len) ||
+            names[hello.name_len - 1] != '\0')
+    {
+        fprintf(stderr, "Stream %lu did not start like an IBS stream\n",
+                c->id);
+        return;
+    }
+    host = names;
+    name = host + strlen(host) + 1;
+    if (name >= names + hello.name_len)
+    {
+        fprintf(stderr, "Stream %lu did not name its file\n", c->id);
+        return;
+    }
+
+    fp = open_stream_file(c->id, host, name, &path);
+    if (fp == NULL)
+        return;
+    ret = receive_blocks(c, hello.flags, fp, &raw_bytes, &wire_bytes);
+    if (fclose(fp) && ret == 0)
+    {
+        fprintf(stderr, "Stream %lu: failed to write %s\n", c->id, path);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        ret = -1;
+    }
+    printf("%s,%s,%" PRIu64 ",%" PRIu64 "\n", path,
+            (ret == 0) ? "complete" : "incomplete", raw_bytes, wire_bytes);
+    fflush(stdout);
+    free(path);
+}
+
+static void *conn_main(void *arg)
+{
+    struct conn *c = arg;
+
+    receive_stream(c);
+    close(c->fd);
+    free(c);
+
+    pthread_mutex_lock(&conn_lock);
+    active--;
+    pthread_cond_signal(&conn_cv);
+    pthread_mutex_unlock(&conn_lock);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long accepted = 0;
+    pthread_attr_t attr;
+    int listen_fd;
+
+    parse_args(argc, argv);
+    listen_fd = ibs_stream_listen(listen_addr);
+    if (listen_fd < 0)
+    {
+        fprintf(stderr, "Could not listen on %s\n", listen_addr);
+        fprintf(stderr, "    %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    printf("file,status,bytes,wire_bytes\n");
+    fflush(stdout);
+    while (max_streams == 0 || accepted < max_streams)
+    {
+        struct conn *c;
+        pthread_t thread;
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "Could not accept a sender\n");
+            fprintf(stderr, "    %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        c = malloc(sizeof(struct conn));
+        if (c == NULL)
+        {
+            fprintf(stderr, "Could not allocate a connection\n");
+            exit(EXIT_FAILURE);
+        }
+        c->fd = fd;
+        c->id = accepted++;
+
+        pthread_mutex_lock(&conn_lock);
+        active++;
+        pthread_mutex_unlock(&conn_lock);
+        if (pthread_create(&thread, &attr, conn_main, c))
+        {
+            fprintf(stderr, "Could not start a thread for a sender\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // With --count, let the last streams finish
+    pthread_mutex_lock(&conn_lock);
+    while (active)
+        pthread_cond_wait(&conn_cv, &conn_lock);
+    pthread_mutex_unlock(&conn_lock);
+    pthread_attr_destroy(&attr);
+    close(listen_fd);
+    return EXIT_SUCCESS;
+}